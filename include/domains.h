@@ -40,6 +40,7 @@ typedef enum {
    START_STOP,        // 17  (associated with starting and exiting an app)
    HTTP,              // 18  (HTTP verb events)
    THREADS,           // 19
+   LISTENER,          // 20  (records made by mq_listener about its producers)
    END_DOMAINS        // keep this one as last
 } DOMAIN_TYPE;
 
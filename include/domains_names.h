@@ -0,0 +1,29 @@
+//
+// Copyright (c) 2017 Intel Corporation
+//
+// THIS FILE IS GENERATED — DO NOT EDIT!!  CHANGES WILL NOT BE PRESERVED!
+//
+
+
+static const char* domains_names[] = {
+"LINKS",
+"XATTRS",
+"DIRS",
+"FILE_SYSTEMS",
+"FILE_DESCRIPTORS",
+"SYNCS",
+"SOCKETS",
+"SEEKS",
+"FILE_SPACE",
+"PROCESSES",
+"FILE_METADATA",
+"FILE_WRITE",
+"FILE_READ",
+"FILE_OPEN_CLOSE",
+"MISC",
+"DIR_METADATA",
+"START_STOP",
+"HTTP",
+"THREADS",
+"LISTENER",
+};
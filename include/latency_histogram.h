@@ -0,0 +1,107 @@
+//
+// Copyright (c) 2017 Intel Corporation
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+// implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef __LATENCY_HISTOGRAM_H
+#define __LATENCY_HISTOGRAM_H
+
+#include <stdint.h>
+
+// log-linear histogram of latencies in microseconds, used by plugins
+// reporting percentiles. Each power of 2 is split into 16 buckets, so a
+// percentile is off by at most 1/16 of its value, whatever the range.
+// Values below 16 us have bucket of their own; values beyond 2^36 us
+// (19 hours) share the last bucket. Histograms of the same layout are
+// merged by adding up their buckets.
+#define LATENCY_SUB_BITS 4
+#define LATENCY_SUB (1 << LATENCY_SUB_BITS)
+#define LATENCY_MAX_EXP 36
+#define LATENCY_BUCKETS ((LATENCY_MAX_EXP - LATENCY_SUB_BITS + 2) * LATENCY_SUB)
+
+struct latency_histogram {
+  uint64_t count;
+  uint64_t max_us;
+  uint32_t buckets[LATENCY_BUCKETS];
+};
+
+static inline unsigned int latency_bucket(uint64_t us)
+{
+  unsigned int e;
+
+  if (us < LATENCY_SUB)
+    return us;
+  if (us >> (LATENCY_MAX_EXP + 1))
+    return LATENCY_BUCKETS - 1;
+  e = 63 - __builtin_clzll(us);
+  return (e - LATENCY_SUB_BITS + 1) * LATENCY_SUB
+    + (unsigned int)(us >> (e - LATENCY_SUB_BITS)) - LATENCY_SUB;
+}
+
+// smallest value falling into bucket
+static inline uint64_t latency_bucket_low(unsigned int bucket)
+{
+  unsigned int e;
+
+  if (bucket < LATENCY_SUB)
+    return bucket;
+  e = bucket / LATENCY_SUB + LATENCY_SUB_BITS - 1;
+  return (uint64_t)(LATENCY_SUB + bucket % LATENCY_SUB)
+    << (e - LATENCY_SUB_BITS);
+}
+
+static inline void latency_add(struct latency_histogram* h, uint64_t us)
+{
+  h->count++;
+  h->buckets[latency_bucket(us)]++;
+  if (us > h->max_us)
+    h->max_us = us;
+}
+
+static inline void latency_merge(struct latency_histogram* to,
+                                 const struct latency_histogram* from)
+{
+  unsigned int i;
+
+  if (!from->count)
+    return;
+  to->count += from->count;
+  if (from->max_us > to->max_us)
+    to->max_us = from->max_us;
+  for (i = 0; i != LATENCY_BUCKETS; ++i)
+    to->buckets[i] += from->buckets[i];
+}
+
+// value below which given fraction of latencies lie: middle of the
+// bucket holding it, but never above the largest value seen
+static inline double latency_percentile(const struct latency_histogram* h,
+                                        double fraction)
+{
+  const double rank = fraction * h->count;
+  uint64_t seen = 0;
+  unsigned int i;
+
+  if (!h->count)
+    return 0.0;
+  for (i = 0; i != LATENCY_BUCKETS - 1; ++i) {
+    seen += h->buckets[i];
+    if (seen >= rank && seen) {
+      double mid = (latency_bucket_low(i) + latency_bucket_low(i + 1)) / 2.0;
+      return mid < h->max_us ? mid : (double)h->max_us;
+    }
+  }
+  return h->max_us;
+}
+
+#endif
@@ -0,0 +1,64 @@
+//
+// Copyright (c) 2017 Intel Corporation
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+// implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef __MONITOR_CONTROL_H
+#define __MONITOR_CONTROL_H
+
+#include "ops.h"
+
+// control block is a SysV shared memory segment keyed by the same file
+// as the message queue (MESSAGE_QUEUE_PATH), but with its own project id
+#define CONTROL_PROJECT_ID 'c'
+#define CONTROL_MAGIC 0x434d4f49   // "IOMC"
+#define CONTROL_VERSION 2
+#define CONTROL_OP_MASK_WORDS ((END_OPS + 31) / 32)
+
+// flags telling which settings of the block override environment
+// variables of monitored process
+#define CONTROL_DOMAINS   0x1   // domain_mask replaces MONITOR_DOMAINS
+#define CONTROL_SAMPLING  0x2   // sampling fields replace *_SAMPLE_* variables
+
+// control block written by mq_listener and polled by io_monitor.so.
+// listener bumps generation to an odd value before changing the block
+// and to an even value afterwards; monitored processes only compare
+// generation on each intercept and copy the block when it changed.
+struct monitor_control_t {
+  unsigned int magic;
+  unsigned int version;
+  unsigned int generation;
+  unsigned int flags;
+
+  unsigned int domain_mask;     // valid with CONTROL_DOMAINS
+
+  // what the plugin chain of the listener can actually use; records
+  // outside of these masks are never generated
+  unsigned int capture_domain_mask;
+  unsigned int capture_op_mask[CONTROL_OP_MASK_WORDS];
+  int wants_strings;            // s1/s2 are sent for ops other than OPEN
+
+  int paused;                   // stop generating records altogether
+
+  unsigned int count_sample_frequency;  // valid with CONTROL_SAMPLING; 0 = off
+  unsigned int time_sample_frequency;   // valid with CONTROL_SAMPLING; 0 = off
+  unsigned int time_sample_duration;
+
+  // message queue as seen by listener, so that producers can tell how
+  // long a burst may wait for room instead of guessing
+  unsigned int queue_capacity;  // full records queue holds; 0 = unknown
+  unsigned int retry_wait_us;   // first wait after queue was full; 0 = default
+};
+
+#endif
@@ -22,17 +22,18 @@
 #else
 #include <linux/limits.h>
 #endif
+#include <stddef.h>
+
 #define STR_LEN 256
 #define HOSTNAME_LEN 64
 #define DEVICE_LEN 10
 #define DOMAIN_UNSPECIFIED -1
 #define FD_NONE -1
+#define OFFSET_NONE -1
 
 
 struct monitor_record_t {
   char facility[STR_LEN];
-  char hostname[HOSTNAME_LEN];
-  char device[DEVICE_LEN];
   int timestamp;
   float elapsed_time;
   int pid;
@@ -43,8 +44,23 @@ struct monitor_record_t {
   int error_code;
   int fd;
   size_t bytes_transferred;
+  unsigned long long timestamp_ns;  // CLOCK_REALTIME when record was made
+  int tid;
+  unsigned int seq;                 // per-thread; gaps mean lost records
+  long long offset;                 // file position given to positioned
+                                    // read/write, or resulting from seek;
+                                    // descriptor duplicated by DUP;
+                                    // OFFSET_NONE otherwise
   char s1[PATH_MAX];
   char s2[STR_LEN];
+
+  // fields below are populated by mq_listener and are never sent by
+  // io_monitor; keep them last so that they stay out of the message
+  char hostname[HOSTNAME_LEN];
+  char device[DEVICE_LEN];
 };
 
+// number of bytes of record actually transferred over IPC
+#define MONITOR_RECORD_WIRE_SIZE offsetof(struct monitor_record_t, hostname)
+
 #endif
@@ -0,0 +1,204 @@
+//
+// Copyright (c) 2017 Intel Corporation
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+// implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef __MONITOR_RING_H
+#define __MONITOR_RING_H
+
+#include <string.h>
+#include "monitor_record.h"
+
+// per-process channel: a file <MONITOR_RING_DIR>/<pid>.ring mapped by the
+// monitored process (many threads write) and by mq_listener (single
+// reader). it is a bounded queue where each slot carries a sequence
+// number telling whose turn it is, so that writers only need one CAS
+// and never wait for each other or for the reader.
+#define RING_MAGIC 0x474e4952   // "RING"
+#define RING_VERSION 2
+#define RING_DEFAULT_SLOTS 64
+#define RING_SUFFIX ".ring"
+
+struct monitor_ring_slot_t {
+  unsigned long long sequence;
+  unsigned int length;             // bytes of record written
+  struct monitor_record_t record;
+};
+
+struct monitor_ring_t {
+  unsigned int magic;
+  unsigned int version;
+  unsigned int num_slots;          // power of 2
+  int pid;
+
+  // writers and reader touch different cache lines
+  unsigned long long head __attribute__((aligned(64)));  // next slot to write
+  unsigned long long drops;        // records lost because ring was full
+  unsigned long long tail __attribute__((aligned(64)));  // next slot to read
+
+  struct monitor_ring_slot_t slots[] __attribute__((aligned(64)));
+};
+
+#define RING_SIZE(num_slots) (sizeof(struct monitor_ring_t) + \
+  (num_slots) * sizeof(struct monitor_ring_slot_t))
+
+// sets up freshly mapped (zero-filled) ring; magic is written last so
+// that mq_listener ignores ring until it is ready
+static inline void ring_init(struct monitor_ring_t* ring,
+                             unsigned int num_slots, int pid)
+{
+  unsigned int i;
+  ring->version = RING_VERSION;
+  ring->num_slots = num_slots;
+  ring->pid = pid;
+  for (i = 0; i != num_slots; ++i) {
+    ring->slots[i].sequence = i;
+  }
+  __atomic_store_n(&ring->magic, RING_MAGIC, __ATOMIC_RELEASE);
+}
+
+// slot sequence of a writer copying its record: RING_WRITING | pos. the
+// listener marks it RING_STALE when it gives up on the writer, who then
+// hands slot back once it is done copying (see ring_commit), so slot is
+// never written by two writers at once
+#define RING_WRITING (1ULL << 63)
+#define RING_STALE (1ULL << 62)
+
+// reserves next slot and claims it for copying; returns NULL if ring is
+// full (record is counted as dropped). *reserved is passed to ring_commit()
+static inline struct monitor_ring_slot_t*
+ring_reserve(struct monitor_ring_t* ring, unsigned long long* reserved)
+{
+  const unsigned long long mask = ring->num_slots - 1;
+  unsigned long long pos = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+  struct monitor_ring_slot_t* slot;
+
+  for (;;) {
+    slot = &ring->slots[pos & mask];
+    const unsigned long long sequence =
+      __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+    const long long diff = (long long)(sequence - pos);
+    if (sequence & RING_WRITING) {
+      // skipped writer is still copying into slot
+      __atomic_fetch_add(&ring->drops, 1, __ATOMIC_RELAXED);
+      return NULL;
+    } else if (diff == 0) {
+      if (__atomic_compare_exchange_n(&ring->head, &pos, pos + 1, 0,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        break;
+      }
+    } else if (diff < 0) {
+      __atomic_fetch_add(&ring->drops, 1, __ATOMIC_RELAXED);
+      return NULL;
+    } else {
+      pos = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+    }
+  }
+
+  // listener may have skipped slot before it was claimed; record is then
+  // lost and already counted
+  const unsigned long long expected = pos;
+  if (!__atomic_compare_exchange_n(&slot->sequence, &pos, expected | RING_WRITING,
+                                   0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+    return NULL;
+  }
+  *reserved = expected;
+  return slot;
+}
+
+// publishes slot filled after ring_reserve(); returns 0 on success, -1 if
+// listener skipped slot meanwhile (record is lost and already counted)
+static inline int ring_commit(struct monitor_ring_t* ring,
+                              struct monitor_ring_slot_t* slot,
+                              unsigned long long reserved)
+{
+  unsigned long long expected = reserved | RING_WRITING;
+  if (!__atomic_compare_exchange_n(&slot->sequence, &expected, reserved + 1, 0,
+                                   __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+    // stale: listener moved on, slot is free for next round of writers
+    __atomic_store_n(&slot->sequence, reserved + ring->num_slots,
+                     __ATOMIC_RELEASE);
+    return -1;
+  }
+  return 0;
+}
+
+// returns 0 on success, -1 if record was dropped
+static inline int ring_push(struct monitor_ring_t* ring,
+                            const struct monitor_record_t* record,
+                            unsigned int length)
+{
+  unsigned long long reserved;
+  struct monitor_ring_slot_t* slot = ring_reserve(ring, &reserved);
+  if (!slot) {
+    return -1;
+  }
+  memcpy(&slot->record, record, length);
+  slot->length = length;
+  return ring_commit(ring, slot, reserved);
+}
+
+// returns slot holding oldest record or NULL if there is none; slot is
+// given back to writers by ring_consume()
+static inline struct monitor_ring_slot_t* ring_peek(struct monitor_ring_t* ring)
+{
+  const unsigned long long pos = ring->tail;
+  struct monitor_ring_slot_t* slot = &ring->slots[pos & (ring->num_slots - 1)];
+  if (__atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) != pos + 1) {
+    return NULL;
+  }
+  return slot;
+}
+
+static inline void ring_consume(struct monitor_ring_t* ring,
+                                struct monitor_ring_slot_t* slot)
+{
+  const unsigned long long pos = ring->tail;
+  __atomic_store_n(&slot->sequence, pos + ring->num_slots, __ATOMIC_RELEASE);
+  __atomic_store_n(&ring->tail, pos + 1, __ATOMIC_RELEASE);
+}
+
+// gives slot at tail back to writers unread and counts it as dropped. used
+// when writer reserved slot but never completed it (it died or stalls in
+// between), which would otherwise stall ring forever. slot of a writer
+// still copying is only marked stale; writer frees it when done
+static inline void ring_skip(struct monitor_ring_t* ring)
+{
+  const unsigned long long pos = ring->tail;
+  struct monitor_ring_slot_t* slot = &ring->slots[pos & (ring->num_slots - 1)];
+  unsigned long long expected = pos;
+
+  // writer may have completed slot meanwhile; then it is read normally
+  if (!__atomic_compare_exchange_n(&slot->sequence, &expected,
+                                   pos + ring->num_slots, 0,
+                                   __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+    expected = pos | RING_WRITING;
+    if (!__atomic_compare_exchange_n(&slot->sequence, &expected,
+                                     expected | RING_STALE, 0,
+                                     __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+      return;
+    }
+  }
+  __atomic_fetch_add(&ring->drops, 1, __ATOMIC_RELAXED);
+  __atomic_store_n(&ring->tail, pos + 1, __ATOMIC_RELEASE);
+}
+
+// number of records waiting in ring (approximate while writers run)
+static inline unsigned long long ring_backlog(struct monitor_ring_t* ring)
+{
+  return __atomic_load_n(&ring->head, __ATOMIC_RELAXED) -
+    __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+}
+
+#endif
@@ -89,6 +89,9 @@ typedef enum {
    COND_WAIT,
    COND_SIGNAL,
    COND_BROADCAST,
+
+   PRODUCER_STATS, // Delivery counters of one producer, made by mq_listener
+   LISTENER_STATS, // Timing of one stage or plugin of mq_listener
    
    END_OPS         // keep this one as last
 } OP_TYPE;
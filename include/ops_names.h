@@ -0,0 +1,74 @@
+//
+// Copyright (c) 2017 Intel Corporation
+//
+// THIS FILE IS GENERATED — DO NOT EDIT!!  CHANGES WILL NOT BE PRESERVED!
+//
+
+
+static const char* ops_names[] = {
+"OPEN",
+"CLOSE",
+"WRITE",
+"READ",
+"SYNC",
+"SEEK",
+"RENAME",
+"LINK",
+"UNLINK",
+"FCNTL",
+"DUP",
+"STAT",
+"ACCESS",
+"CHMOD",
+"CHOWN",
+"FLOCK",
+"READLINK",
+"UTIME",
+"GETXATTR",
+"SETXATTR",
+"LISTXATTR",
+"REMOVEXATTR",
+"MOUNT",
+"UMOUNT",
+"FORK",
+"MKNOD",
+"MKDIR",
+"RMDIR",
+"CHDIR",
+"CHROOT",
+"SOCKET",
+"FLUSH",
+"ALLOCATE",
+"TRUNCATE",
+"OPENDIR",
+"CLOSEDIR",
+"READDIR",
+"SEEKDIR",
+"TELLDIR",
+"REWINDDIR",
+"SCANDIR",
+"CONNECT",
+"ACCEPT",
+"LISTEN",
+"BIND",
+"EXEC",
+"KILL",
+"START",
+"STOP",
+"HTTP_REQ_SEND",
+"HTTP_REQ_RECV",
+"HTTP_RESP_SEND",
+"HTTP_RESP_RECV",
+"HTTP_RESP_FINI_SEND",
+"HTTP_RESP_FINI_RECV",
+"MUTEX_LOCK",
+"MUTEX_UNLOCK",
+"MUTEX_INIT",
+"MUTEX_DESTROY",
+"THREAD_CREATE",
+"COND_WAIT",
+"COND_SIGNAL",
+"COND_BROADCAST",
+"PRODUCER_STATS",
+"LISTENER_STATS",
+};
@@ -0,0 +1,285 @@
+//
+// Copyright (c) 2017 Intel Corporation
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+// implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef __PATH_MATCHER_H
+#define __PATH_MATCHER_H
+
+#include <stdlib.h>
+#include <string.h>
+#include "domains.h"
+
+// include and exclude path patterns, compiled together into one
+// Aho-Corasick automaton whose every state has transitions for every
+// character. Path is matched in a single pass, with one table lookup per
+// character, however many patterns there are. Patterns are
+//   /some/dir     paths starting with it (same as /some/dir*)
+//   *text*        paths containing text
+//   *.log         paths ending with text
+// and apply to paths as the application passed them, relative or not.
+// Characters not used by any pattern share one column of transitions.
+#define PATH_MATCH_INCLUDE 1
+#define PATH_MATCH_EXCLUDE 2
+
+// domains whose records carry path as s1
+#define PATH_MATCH_DOMAINS ((1U << FILE_OPEN_CLOSE) | (1U << FILE_METADATA) | \
+                            (1U << DIR_METADATA) | (1U << DIRS) | \
+                            (1U << LINKS) | (1U << XATTRS) | \
+                            (1U << FILE_SPACE))
+
+#define PATH_ANCHOR_START 1
+#define PATH_ANCHOR_END 2
+
+struct path_pattern {
+  unsigned int len;
+  unsigned char anchors;
+  unsigned char exclude;
+  int next;                     /* next pattern ending in same state, or -1 */
+};
+
+struct path_matcher {
+  unsigned char classes[256];   /* character to column of transitions */
+  unsigned int num_classes;
+  unsigned int num_states;
+  unsigned int* next;           /* num_states rows of num_classes */
+  int* first;                   /* first pattern ending in state, or -1 */
+  unsigned int* output;         /* nearest state down failure links where
+                                 * patterns end, 0 if none */
+  struct path_pattern* patterns;
+  unsigned int num_patterns;
+  unsigned int num_includes;
+  unsigned int max_prefix;      /* longest pattern anchored at start */
+  int floating;                 /* some pattern isn't anchored at start */
+};
+
+static inline void path_matcher_free(struct path_matcher* m)
+{
+  if (m) {
+    free(m->next);
+    free(m->first);
+    free(m->output);
+    free(m->patterns);
+    free(m);
+  }
+}
+
+// calls fn for each pattern of separator separated list; returns -1 if
+// fn does
+static inline int path_matcher_each(const char* list, char separator,
+                                    int exclude,
+                                    int (*fn)(void* arg, const char* pattern,
+                                              size_t len, int exclude),
+                                    void* arg)
+{
+  const char* end;
+
+  while (list && *list) {
+    end = strchr(list, separator);
+    if (!end)
+      end = list + strlen(list);
+    if (end != list && fn(arg, list, end - list, exclude))
+      return -1;
+    list = *end ? end + 1 : end;
+  }
+  return 0;
+}
+
+// strips wildcards of pattern; -1 if it has them elsewhere or nothing
+// else
+static inline int path_pattern_parse(const char** text, size_t* len,
+                                     unsigned char* anchors)
+{
+  *anchors = PATH_ANCHOR_START;
+  if (*len && **text == '*') {
+    *anchors = PATH_ANCHOR_END;
+    ++*text;
+    --*len;
+  }
+  if (*len && (*text)[*len - 1] == '*') {
+    *anchors &= ~PATH_ANCHOR_END;
+    --*len;
+  }
+  return (!*len || memchr(*text, '*', *len)) ? -1 : 0;
+}
+
+static inline int path_matcher_count(void* arg, const char* pattern,
+                                     size_t len, int exclude)
+{
+  struct path_matcher* m = arg;
+  unsigned char anchors;
+  size_t i;
+
+  if (path_pattern_parse(&pattern, &len, &anchors))
+    return -1;
+  for (i = 0; i != len; ++i) {
+    if (!m->classes[(unsigned char)pattern[i]])
+      m->classes[(unsigned char)pattern[i]] = m->num_classes++;
+  }
+  m->num_states += len;
+  ++m->num_patterns;
+  return 0;
+}
+
+static inline int path_matcher_insert(void* arg, const char* pattern,
+                                      size_t len, int exclude)
+{
+  struct path_matcher* m = arg;
+  struct path_pattern* p = &m->patterns[m->num_patterns];
+  unsigned int state = 0;
+  unsigned int* next;
+  size_t i;
+
+  path_pattern_parse(&pattern, &len, &p->anchors);
+  for (i = 0; i != len; ++i) {
+    next = &m->next[state * m->num_classes +
+                    m->classes[(unsigned char)pattern[i]]];
+    if (!*next)
+      *next = m->num_states++;
+    state = *next;
+  }
+  p->len = len;
+  p->exclude = exclude;
+  p->next = m->first[state];
+  m->first[state] = m->num_patterns++;
+  if (p->anchors & PATH_ANCHOR_START) {
+    if (len > m->max_prefix)
+      m->max_prefix = len;
+  } else {
+    m->floating = 1;
+  }
+  if (!exclude)
+    ++m->num_includes;
+  return 0;
+}
+
+// builds matcher of separator separated lists; NULL if a pattern is
+// invalid or out of memory
+static inline struct path_matcher* path_matcher_compile(const char* includes,
+                                                        const char* excludes,
+                                                        char separator)
+{
+  struct path_matcher* m = calloc(1, sizeof(struct path_matcher));
+  unsigned int* fail = NULL;
+  unsigned int* queue = NULL;
+  unsigned int head = 0, tail = 0;
+  unsigned int state, child, c, max_states;
+
+  if (!m)
+    return NULL;
+  // first pass sizes tables; class 0 is for characters of no pattern
+  m->num_classes = 1;
+  m->num_states = 1;
+  if (path_matcher_each(includes, separator, 0, path_matcher_count, m) ||
+      path_matcher_each(excludes, separator, 1, path_matcher_count, m))
+    goto fail;
+  max_states = m->num_states;
+  m->next = calloc((size_t)max_states * m->num_classes, sizeof(unsigned int));
+  m->first = malloc(max_states * sizeof(int));
+  m->output = calloc(max_states, sizeof(unsigned int));
+  m->patterns = calloc(m->num_patterns + 1, sizeof(struct path_pattern));
+  fail = calloc(max_states, sizeof(unsigned int));
+  queue = malloc(max_states * sizeof(unsigned int));
+  if (!m->next || !m->first || !m->output || !m->patterns || !fail || !queue)
+    goto fail;
+  memset(m->first, 0xff, max_states * sizeof(int));
+
+  // trie, where 0 marks missing child (root is nobody's child)
+  m->num_states = 1;
+  m->num_patterns = 0;
+  path_matcher_each(includes, separator, 0, path_matcher_insert, m);
+  path_matcher_each(excludes, separator, 1, path_matcher_insert, m);
+
+  // breadth first, so that row of failure state is complete when a
+  // state's missing transitions are copied from it
+  queue[tail++] = 0;
+  while (head != tail) {
+    state = queue[head++];
+    for (c = 0; c != m->num_classes; ++c) {
+      unsigned int* next = &m->next[state * m->num_classes + c];
+      const unsigned int via_fail = m->next[fail[state] * m->num_classes + c];
+      child = *next;
+      if (!child) {
+        *next = state ? via_fail : 0;
+        continue;
+      }
+      fail[child] = state ? via_fail : 0;
+      m->output[child] = m->first[fail[child]] >= 0 ? fail[child] :
+        m->output[fail[child]];
+      queue[tail++] = child;
+    }
+  }
+  free(fail);
+  free(queue);
+  return m;
+
+fail:
+  free(fail);
+  free(queue);
+  path_matcher_free(m);
+  return NULL;
+}
+
+// PATH_MATCH_INCLUDE and/or PATH_MATCH_EXCLUDE, as patterns of path are;
+// stops at first exclude pattern
+static inline int path_matcher_match(const struct path_matcher* m,
+                                     const char* path)
+{
+  const unsigned char* p = (const unsigned char*)path;
+  const struct path_pattern* pattern;
+  unsigned int state = 0, s, pos = 0;
+  int result = 0, i;
+
+  for (; *p; ++p) {
+    state = m->next[state * m->num_classes + m->classes[*p]];
+    ++pos;
+    for (s = m->first[state] >= 0 ? state : m->output[state]; s;
+         s = m->output[s]) {
+      for (i = m->first[s]; i >= 0; i = pattern->next) {
+        pattern = &m->patterns[i];
+        if (!(pattern->anchors & PATH_ANCHOR_END) &&
+            (!(pattern->anchors & PATH_ANCHOR_START) || pattern->len == pos))
+          result |= pattern->exclude ? PATH_MATCH_EXCLUDE : PATH_MATCH_INCLUDE;
+      }
+    }
+    if (result & PATH_MATCH_EXCLUDE)
+      return result;
+    // past longest prefix, only patterns elsewhere in path can match
+    if (!m->floating && pos >= m->max_prefix)
+      return result;
+  }
+
+  // patterns anchored at end only match at end of path
+  for (s = m->first[state] >= 0 ? state : m->output[state]; s;
+       s = m->output[s]) {
+    for (i = m->first[s]; i >= 0; i = pattern->next) {
+      pattern = &m->patterns[i];
+      if (pattern->anchors & PATH_ANCHOR_END)
+        result |= pattern->exclude ? PATH_MATCH_EXCLUDE : PATH_MATCH_INCLUDE;
+    }
+  }
+  return result;
+}
+
+// path matches no exclude pattern, and one of include patterns if any
+static inline int path_matcher_allows(const struct path_matcher* m,
+                                      const char* path)
+{
+  const int result = path_matcher_match(m, path);
+
+  return !(result & PATH_MATCH_EXCLUDE) &&
+    (!m->num_includes || (result & PATH_MATCH_INCLUDE));
+}
+
+#endif
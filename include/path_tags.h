@@ -0,0 +1,70 @@
+//
+// Copyright (c) 2017 Intel Corporation
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+// implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef __PATH_TAGS_H
+#define __PATH_TAGS_H
+
+#include "ops.h"
+#include "path_matcher.h"
+
+// which records a path filter drops; shared by io_monitor
+// (MONITOR_PATHS_INCLUDE/EXCLUDE) and the filter_paths plugin. Descriptors
+// opened on left out paths are tagged, so that records of their later use
+// are dropped without matching path again. Caller keeps the tags: io_monitor
+// in a bitmap of its own descriptors, filter_paths by pid and descriptor
+typedef int (*path_tags_get_fn)(void* tags, int fd);
+typedef void (*path_tags_set_fn)(void* tags, int fd, int tagged);
+
+// whether record is about path left out, or about descriptor opened on
+// one. s1 is NULL or empty if record has no path. old_fd is descriptor
+// which DUP duplicated, -1 if not known
+static inline int path_tags_skip(const struct path_matcher* matcher,
+                                 void* tags, path_tags_get_fn get,
+                                 path_tags_set_fn set, int dom_type,
+                                 int op_type, int fd, int old_fd,
+                                 const char* s1)
+{
+  const int has_path = (s1 != NULL) && s1[0];
+  int skipped;
+
+  // fdopendir has no path; its descriptor keeps the tag it has
+  if ((op_type == OPEN) || (op_type == SOCKET) ||
+      ((op_type == OPENDIR) && has_path)) {
+    skipped = has_path && !path_matcher_allows(matcher, s1);
+    if (fd >= 0) {
+      set(tags, fd, skipped);
+    }
+    return skipped;
+  }
+  if (op_type == DUP) {
+    // new descriptor refers to what old one was opened on
+    skipped = (old_fd >= 0) && get(tags, old_fd);
+    if (fd >= 0) {
+      set(tags, fd, skipped);
+    }
+    return skipped;
+  }
+  if ((fd >= 0) && get(tags, fd)) {
+    if ((op_type == CLOSE) || (op_type == CLOSEDIR)) {
+      set(tags, fd, 0);
+    }
+    return 1;
+  }
+  return has_path && (PATH_MATCH_DOMAINS & (1U << dom_type)) &&
+    !path_matcher_allows(matcher, s1);
+}
+
+#endif
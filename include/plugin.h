@@ -24,11 +24,48 @@
 #define PLUGIN_DROP_DATA   -1
 
 #include "monitor_record.h"
+#include "domains.h"
+#include "ops.h"
+
+/* number of words needed to hold one bit per operation type */
+#define OP_MASK_WORDS ((END_OPS + 31) / 32)
+
+/* structure filled by (optional) get_interest function - describes
+ * which records plugin wants to receive. mq_listener builds dispatch
+ * tables from it, so plugin is not called at all for other records */
+struct plugin_interest {
+  unsigned int domain_mask;             /* bit per DOMAIN_TYPE */
+  unsigned int op_mask[OP_MASK_WORDS];  /* bit per OP_TYPE */
+  int wants_strings;                    /* plugin reads s1/s2 */
+  int drop_uninteresting;               /* records outside of interest are
+                                         * dropped from the chain, as if
+                                         * plugin returned PLUGIN_DROP_DATA
+                                         * (typical for filter plugins) */
+};
+
 /* structure passed to open function - passes parameters
  * containing state of mq_listener program, including
  * handles allowing interaction with it */
 struct listener {
   int (*command_function)(const char* buf);
+  /* plugin calls this after its interest changed at runtime
+   * (i.e. from plugin_command); must not be called from process_data */
+  void (*interest_changed)();
+  /* record passed to process_data is valid only until process_data
+   * returns. Plugin which wants to keep it (i.e. for batching or output
+   * from another thread) retains it, and releases it when done; both
+   * may be called from any thread */
+  void (*retain_record)(struct monitor_record_t* rec);
+  void (*release_record)(struct monitor_record_t* rec);
+  /* new record for plugin to fill in (hostname already is), holding one
+   * reference; NULL if out of memory */
+  struct monitor_record_t* (*alloc_record)();
+  /* passes record made by plugin to plugins loaded after it, once
+   * process_data or flush_plugin emitting it returns. Takes over the
+   * reference of caller. Only plugins running in the chain itself (not
+   * branched ones) may emit, and only from those two functions; other
+   * records are released without being passed on */
+  void (*emit_record)(struct monitor_record_t* rec);
 };
 /* plugin needs to expose at least following four functions */
 
@@ -65,6 +102,21 @@ typedef int (*PFN_PLUGIN_COMMAND)(const char* name, const char** args, void* sta
 /* function returning list of commands supported by plugin */
 typedef char** (*PFN_LIST_COMMANDS)(void* state);
 
+/* function get_interest adhering to prototype below:
+ * called after plugin is opened and every time plugin reports change
+ * via listener->interest_changed. Structure is pre-filled with "all
+ * records, with strings"; plugin narrows it down. Plugins not exposing
+ * this function receive all records */
+typedef void (*PFN_GET_INTEREST)(struct plugin_interest* interest, void* state);
+
+/* function flush_plugin adhering to prototype below:
+ * called when listener has no more records for plugin at the moment,
+ * and then about once a second while it stays idle, from the same
+ * thread which calls process_data. Plugins buffering their output
+ * write it out here, so that buffered records don't wait for next
+ * burst of data */
+typedef void (*PFN_FLUSH_PLUGIN)(void* state);
+
 /* note, it is advisable that if plugin supports commands,
  * one of commands supported is help, giving brief description of plugin and
  * its available commands. Even if plugin doesn't expose any commands that
@@ -80,6 +132,8 @@ typedef char** (*PFN_LIST_COMMANDS)(void* state);
   int process_data(struct monitor_record_t* data);
   char **list_commands();
   int plugin_command(const char* name, const char** args);
+  void get_interest(struct plugin_interest* interest);
+  void flush_plugin();
 */
 
 #endif
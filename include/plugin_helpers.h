@@ -0,0 +1,109 @@
+//
+// Copyright (c) 2017 Intel Corporation
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+// implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef __PLUGIN_HELPERS_H
+#define __PLUGIN_HELPERS_H
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <time.h>
+
+// FNV-1a hash, used by plugins keeping hash tables of records. Fields are
+// hashed one after another by passing previous result as hash, starting
+// with FNV_OFFSET (FNV64_OFFSET for 64 bit variant).
+#define FNV_OFFSET 2166136261U
+#define FNV_PRIME 16777619U
+#define FNV64_OFFSET 14695981039346656037ULL
+#define FNV64_PRIME 1099511628211ULL
+
+static inline unsigned int fnv_hash(unsigned int hash, const void* data,
+                                    size_t size)
+{
+  const unsigned char* p = data;
+
+  while (size--)
+    hash = (hash ^ *p++) * FNV_PRIME;
+  return hash;
+}
+
+static inline unsigned long long fnv_hash64(unsigned long long hash,
+                                            const void* data, size_t size)
+{
+  const unsigned char* p = data;
+
+  while (size--)
+    hash = (hash ^ *p++) * FNV64_PRIME;
+  return hash;
+}
+
+// wall clock in nanoseconds, the clock record timestamps are taken with
+static inline unsigned long long now_ns(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// time of records, for plugins whose windows end by it rather than by
+// clock of listener, so that replayed traces come out as captured. While
+// no records come, it is estimated from time passed since the last one
+struct event_clock {
+  unsigned long long last_event_ns;       // newest record seen
+  unsigned long long last_event_seen_ns;  // when it was seen
+};
+
+static inline void event_clock_see(struct event_clock* c,
+                                   unsigned long long timestamp_ns)
+{
+  if (timestamp_ns > c->last_event_ns) {
+    c->last_event_ns = timestamp_ns;
+    c->last_event_seen_ns = now_ns();
+  }
+}
+
+static inline unsigned long long event_clock_now(const struct event_clock* c)
+{
+  return c->last_event_ns + (now_ns() - c->last_event_seen_ns);
+}
+
+// doubles buckets of chained hash table; size is a power of 2 and entries
+// are linked through their next member. entry names each entry for
+// hash_expr, which gives hash it is placed by. Table stays as it is if
+// memory runs out; chains then just get longer
+#define GROW_CHAINED_TABLE(table, size, entry, hash_expr)                  \
+  do {                                                                     \
+    const unsigned int new_size_ = 2 * (size);                             \
+    __typeof__(table) new_table_ = calloc(new_size_, sizeof(*(table)));    \
+    unsigned int i_;                                                       \
+    if (new_table_) {                                                      \
+      for (i_ = 0; i_ != (size); ++i_) {                                   \
+        __typeof__(*(table)) entry = (table)[i_];                          \
+        while (entry) {                                                    \
+          __typeof__(entry) next_ = entry->next;                           \
+          const unsigned int bucket_ = (hash_expr) & (new_size_ - 1);      \
+          entry->next = new_table_[bucket_];                               \
+          new_table_[bucket_] = entry;                                     \
+          entry = next_;                                                   \
+        }                                                                  \
+      }                                                                    \
+      free(table);                                                         \
+      (table) = new_table_;                                                \
+      (size) = new_size_;                                                  \
+    }                                                                      \
+  } while (0)
+
+#endif
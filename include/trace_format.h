@@ -0,0 +1,229 @@
+//
+// Copyright (c) 2017 Intel Corporation
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+// implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#ifndef __TRACE_FORMAT_H
+#define __TRACE_FORMAT_H
+
+#include <stdint.h>
+#include <string.h>
+#include "monitor_record.h"
+
+// binary trace file written by output_trace plugin and replayed by
+// mq_listener (--replay). File is a header followed by self-contained
+// blocks; each block carries its own string dictionary (facility, host,
+// device, s1, s2) and records encoded against previous record of the
+// block. Index of blocks with their time and pid ranges follows the last
+// block, so that reader may skip blocks; a file without index (writer
+// was killed) is still read by walking the blocks.
+//
+//   trace_file_header
+//   trace_block_header, dictionary, records    (repeated)
+//   trace_index_entry[num_blocks], trace_footer
+//
+// Integers in records are varints, which don't depend on byte order.
+// Headers, index, footer and elapsed_time are stored as in memory, in
+// host byte order; a trace is read back only on hosts of the same byte
+// order (magic numbers of blocks don't match on others).
+#define TRACE_MAGIC "IOMTRACE"
+#define TRACE_VERSION 2
+#define TRACE_BLOCK_MAGIC 0x4b4c4254     // "TBLK"
+#define TRACE_FOOTER_MAGIC 0x58444954    // "TIDX"
+
+// upper bound of bytes one encoded record takes (strings excluded)
+#define TRACE_MAX_RECORD_SIZE 144
+
+struct trace_file_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t header_size;
+  uint64_t created_ns;
+};
+
+struct trace_block_header {
+  uint32_t magic;
+  uint32_t num_records;
+  uint32_t num_strings;    // NUL terminated strings, ids in order
+  uint32_t strings_size;   // bytes of dictionary
+  uint32_t records_size;   // bytes of encoded records
+  uint32_t reserved;
+  uint64_t first_ns;       // smallest timestamp_ns in block
+  uint64_t last_ns;        // largest timestamp_ns in block
+  int32_t min_pid;
+  int32_t max_pid;
+};
+
+struct trace_index_entry {
+  uint64_t offset;         // of trace_block_header
+  uint64_t first_ns;
+  uint64_t last_ns;
+  int32_t min_pid;
+  int32_t max_pid;
+  uint32_t num_records;
+  uint32_t reserved;
+};
+
+struct trace_footer {
+  uint64_t index_offset;
+  uint32_t num_blocks;
+  uint32_t magic;
+};
+
+// strings of record, as dictionary ids
+struct trace_record_strings {
+  uint32_t facility;
+  uint32_t hostname;
+  uint32_t device;
+  uint32_t s1;
+  uint32_t s2;
+};
+
+// values record is encoded against (previous record); zeroed at start
+// of every block
+struct trace_codec_state {
+  uint64_t timestamp_ns;
+  int32_t pid;
+};
+
+static inline uint8_t* trace_put_varint(uint8_t* p, uint64_t value)
+{
+  while (value >= 0x80) {
+    *p++ = (uint8_t)value | 0x80;
+    value >>= 7;
+  }
+  *p++ = (uint8_t)value;
+  return p;
+}
+
+static inline uint8_t* trace_put_svarint(uint8_t* p, int64_t value)
+{
+  return trace_put_varint(p, ((uint64_t)value << 1) ^ (uint64_t)(value >> 63));
+}
+
+// returns NULL when value doesn't fit before end
+static inline const uint8_t* trace_get_varint(const uint8_t* p,
+                                              const uint8_t* end,
+                                              uint64_t* value)
+{
+  uint64_t v = 0;
+  int shift = 0;
+
+  for (; p < end && shift < 64; shift += 7) {
+    v |= (uint64_t)(*p & 0x7f) << shift;
+    if (!(*p++ & 0x80)) {
+      *value = v;
+      return p;
+    }
+  }
+  return NULL;
+}
+
+static inline const uint8_t* trace_get_svarint(const uint8_t* p,
+                                               const uint8_t* end,
+                                               int64_t* value)
+{
+  uint64_t v = 0;
+
+  p = trace_get_varint(p, end, &v);
+  *value = (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+  return p;
+}
+
+// writes at most TRACE_MAX_RECORD_SIZE bytes
+static inline uint8_t* trace_encode_record(uint8_t* p,
+                                           struct trace_codec_state* codec,
+                                           const struct monitor_record_t* rec,
+                                           const struct trace_record_strings* str)
+{
+  p = trace_put_svarint(p, (int64_t)(rec->timestamp_ns - codec->timestamp_ns));
+  p = trace_put_svarint(p, rec->timestamp -
+                        (int64_t)(rec->timestamp_ns / 1000000000ULL));
+  memcpy(p, &rec->elapsed_time, sizeof(float));
+  p += sizeof(float);
+  p = trace_put_svarint(p, (int64_t)rec->pid - codec->pid);
+  p = trace_put_svarint(p, (int64_t)rec->tid - rec->pid);
+  p = trace_put_varint(p, rec->seq);
+  p = trace_put_svarint(p, rec->dom_type);
+  p = trace_put_svarint(p, rec->op_type);
+  p = trace_put_svarint(p, rec->error_code);
+  p = trace_put_svarint(p, rec->fd);
+  p = trace_put_varint(p, rec->bytes_transferred);
+  p = trace_put_svarint(p, rec->offset);
+  p = trace_put_varint(p, str->facility);
+  p = trace_put_varint(p, str->hostname);
+  p = trace_put_varint(p, str->device);
+  p = trace_put_varint(p, str->s1);
+  p = trace_put_varint(p, str->s2);
+  codec->timestamp_ns = rec->timestamp_ns;
+  codec->pid = rec->pid;
+  return p;
+}
+
+// decodes numeric fields and string ids; NULL on malformed input
+static inline const uint8_t* trace_decode_record(const uint8_t* p,
+                                                 const uint8_t* end,
+                                                 struct trace_codec_state* codec,
+                                                 struct monitor_record_t* rec,
+                                                 struct trace_record_strings* str)
+{
+  uint64_t u[7];
+  int64_t s[9];
+
+  if (!(p = trace_get_svarint(p, end, &s[0])) ||
+      !(p = trace_get_svarint(p, end, &s[1])) ||
+      end - p < (long)sizeof(float)) {
+    return NULL;
+  }
+  memcpy(&rec->elapsed_time, p, sizeof(float));
+  p += sizeof(float);
+  if (!(p = trace_get_svarint(p, end, &s[2])) ||
+      !(p = trace_get_svarint(p, end, &s[3])) ||
+      !(p = trace_get_varint(p, end, &u[0])) ||
+      !(p = trace_get_svarint(p, end, &s[4])) ||
+      !(p = trace_get_svarint(p, end, &s[5])) ||
+      !(p = trace_get_svarint(p, end, &s[6])) ||
+      !(p = trace_get_svarint(p, end, &s[7])) ||
+      !(p = trace_get_varint(p, end, &u[1])) ||
+      !(p = trace_get_svarint(p, end, &s[8])) ||
+      !(p = trace_get_varint(p, end, &u[2])) ||
+      !(p = trace_get_varint(p, end, &u[3])) ||
+      !(p = trace_get_varint(p, end, &u[4])) ||
+      !(p = trace_get_varint(p, end, &u[5])) ||
+      !(p = trace_get_varint(p, end, &u[6]))) {
+    return NULL;
+  }
+  rec->timestamp_ns = codec->timestamp_ns + s[0];
+  rec->timestamp = (int)(s[1] + (int64_t)(rec->timestamp_ns / 1000000000ULL));
+  rec->pid = (int)(codec->pid + s[2]);
+  rec->tid = (int)(rec->pid + s[3]);
+  rec->seq = (unsigned int)u[0];
+  rec->dom_type = (int)s[4];
+  rec->op_type = (int)s[5];
+  rec->error_code = (int)s[6];
+  rec->fd = (int)s[7];
+  rec->bytes_transferred = (size_t)u[1];
+  rec->offset = s[8];
+  str->facility = (uint32_t)u[2];
+  str->hostname = (uint32_t)u[3];
+  str->device = (uint32_t)u[4];
+  str->s1 = (uint32_t)u[5];
+  str->s2 = (uint32_t)u[6];
+  codec->timestamp_ns = rec->timestamp_ns;
+  codec->pid = rec->pid;
+  return p;
+}
+
+#endif
@@ -55,7 +55,7 @@ cat monitored_functions.data | while read -r LINE ; do
     S1=`echo $LINE | cut -d '|' -f 4`
     S2=`echo $LINE | cut -d '|' -f 5`
     HOOK=`echo $LINE | cut -d '|' -f 6`
-    REALPATH=`echo $LINE | cut -d '|' -f 7`
+    HOOK_BEFORE=`echo $LINE | cut -d '|' -f 7`
 
     #generate content for intercept_functions.h
     (
@@ -84,7 +84,7 @@ EOF
     ISEXEC=$? # some variant of exec (so record and hook must happen BEFORE call)
 
         #if hook or prototype contains variable fd
-    echo $HOOK $PROTOTYPE | grep -F ' fd' >/dev/null
+    echo $HOOK_BEFORE $HOOK $PROTOTYPE | grep -F ' fd' >/dev/null
     if [ $? -eq 0 ] ; then
 	FD='fd'
     else
@@ -118,6 +118,11 @@ EOF
 	    echo 'int mode = va_arg(args, int);'
 	fi
     fi
+    # hook using arguments which call invalidates, like fp of fclose
+    if [ -n "$HOOK_BEFORE" ] ; then
+	echo "\n   /* invoke hook before call */"
+	echo "   $HOOK_BEFORE"
+    fi
     echo  "\n   /* call original function */"
     if [ "$RET" = 'void' ] ; then
 	echo -n "   orig_$NAME("	
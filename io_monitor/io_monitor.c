@@ -51,18 +51,26 @@
 #include <pthread.h>
 #ifndef __FreeBSD__
 #include <sys/xattr.h>
+#include <sys/syscall.h>
 #include <endian.h>
+#else
+#include <pthread_np.h>
 #endif
 #include <sys/uio.h>
 #include <sys/mount.h>
 #include <sys/stat.h>
 #include <sys/time.h>
+#include <sys/mman.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
 #include "ops.h"
 #include "domains.h"
 #include "domains_names.h"
 #include "mq.h"
+#include "monitor_control.h"
+#include "monitor_ring.h"
+#include "path_matcher.h"
+#include "path_tags.h"
 #include "io_function_types.h"
 #include "io_monitor.h"
 #include "io_function_types.h"
@@ -86,6 +94,56 @@ static int ipc_records = 0;
 static key_t message_queue_key = -1;
 static int message_queue_id = -1;
 static unsigned int domain_bit_flags = 0;
+static unsigned int op_bit_flags[CONTROL_OP_MASK_WORDS] = {
+   [0 ... CONTROL_OP_MASK_WORDS-1] = ~0U
+};
+static int strings_wanted = 1;
+
+/* message queue hints published by mq_listener */
+#define MAX_IPC_RETRIES 5
+#define DEFAULT_RETRY_WAIT_US 1024
+static unsigned int queue_capacity = 0;
+static unsigned int retry_wait_us = DEFAULT_RETRY_WAIT_US;
+
+/* per-thread sequence of sent records; lets listener see lost ones.
+ * thread_pid detects that we are first thread of a forked child */
+static __thread pid_t thread_pid = 0;
+static __thread int thread_tid = 0;
+static __thread unsigned int thread_seq = 0;
+
+/* file position of intercepted call, set by its hook (see
+ * monitored_functions.data) and consumed by next record() */
+static __thread long long record_offset = OFFSET_NONE;
+
+/* per-process ring; used instead of message queue when MONITOR_RING_DIR is set.
+ * ring_dir is cleared (under ring_mutex) when ring can't be created, while
+ * other threads may be reading it */
+static const char* ring_dir = NULL;
+static struct monitor_ring_t* ring = NULL;
+static pid_t ring_pid = 0;
+static pthread_mutex_t ring_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* paths left out by MONITOR_PATHS_INCLUDE/EXCLUDE. Descriptors opened on
+ * them are tagged, so records of their later use are skipped without
+ * matching path again. Tag is cleared by close, fclose and closedir, or
+ * when descriptor is handed out again. dup passes it on to new one */
+#define TAGGED_FDS 65536
+static struct path_matcher* path_matcher = NULL;
+static unsigned int tagged_fds[TAGGED_FDS / 32];
+
+/* runtime control block published by mq_listener */
+static struct monitor_control_t* control = NULL;
+static unsigned int control_generation = 0;
+static time_t control_attach_attempt = 0;
+static int control_paused = 0;
+
+/* settings from environment; control block may override them */
+static unsigned int env_domain_bit_flags = 0;
+static int env_count_based_sampling = 0;
+static int env_count_based_sample_frequency = 10;
+static int env_time_based_sampling = 0;
+static unsigned long env_time_based_sample_duration = 2L;
+static unsigned long env_time_based_sample_frequency = 10L;
 
 
 //***********  initialization  ***********
@@ -93,8 +151,10 @@ void initialize_monitor();
 unsigned int domain_list_to_bit_mask(const char* domain_list);
 
 //***********  IPC mechanisms  ***********
-int send_tcp_socket(struct monitor_record_t* monitor_record);
-int send_msg_queue(struct monitor_record_t* monitor_record);
+int send_tcp_socket(struct monitor_record_t* monitor_record, size_t length);
+int send_msg_queue(struct monitor_record_t* monitor_record, size_t length);
+int send_ring(struct monitor_record_t* monitor_record, size_t length, pid_t pid);
+void poll_control();
 
 //***********  monitoring mechanism  ***********
 void record(DOMAIN_TYPE dom_type,
@@ -232,6 +292,10 @@ void initialize_monitor() {
    }
 
    message_queue_path = getenv(ENV_MESSAGE_QUEUE_PATH);
+   ring_dir = getenv(ENV_MONITOR_RING_DIR);
+   if ((ring_dir != NULL) && (strlen(ring_dir) == 0)) {
+      ring_dir = NULL;
+   }
 
    const char* monitor_domain_list = getenv(ENV_MONITOR_DOMAINS);
    if (monitor_domain_list != NULL) {
@@ -272,12 +336,156 @@ void initialize_monitor() {
       }
    }
 
+   env_domain_bit_flags = domain_bit_flags;
+   env_count_based_sampling = count_based_sampling;
+   env_count_based_sample_frequency = count_based_sample_frequency;
+   env_time_based_sampling = time_based_sampling;
+   env_time_based_sample_frequency = time_based_sample_frequency;
+   env_time_based_sample_duration = time_based_sample_duration;
+
+   const char* paths_include = getenv(ENV_MONITOR_PATHS_INCLUDE);
+   const char* paths_exclude = getenv(ENV_MONITOR_PATHS_EXCLUDE);
+   if ((paths_include != NULL && *paths_include) ||
+       (paths_exclude != NULL && *paths_exclude)) {
+      path_matcher = path_matcher_compile(paths_include, paths_exclude, ':');
+   }
+
    load_library_functions();
 }
 
 //*****************************************************************************
 
-int send_msg_queue(struct monitor_record_t* monitor_record)
+static int is_tagged_fd(void* tags, int fd)
+{
+   return (fd < TAGGED_FDS) &&
+      (__atomic_load_n(&tagged_fds[fd / 32], __ATOMIC_RELAXED) &
+       (1U << (fd % 32)));
+}
+
+//*****************************************************************************
+
+static void tag_fd(void* tags, int fd, int skipped)
+{
+   if (fd < TAGGED_FDS) {
+      if (skipped) {
+         __atomic_or_fetch(&tagged_fds[fd / 32], 1U << (fd % 32),
+                           __ATOMIC_RELAXED);
+      } else {
+         __atomic_and_fetch(&tagged_fds[fd / 32], ~(1U << (fd % 32)),
+                            __ATOMIC_RELAXED);
+      }
+   }
+}
+
+//*****************************************************************************
+
+// whether record is about path left out by MONITOR_PATHS_INCLUDE/EXCLUDE,
+// or about descriptor opened on one (see path_tags.h)
+static int skip_path(DOMAIN_TYPE dom_type, OP_TYPE op_type, int fd,
+                     int old_fd, const char* s1)
+{
+   return path_tags_skip(path_matcher, NULL, is_tagged_fd, tag_fd, dom_type,
+                         op_type, fd, old_fd, s1);
+}
+
+//*****************************************************************************
+
+// copy settings published by mq_listener. block may be rewritten while we
+// read it, so retry until we get a copy with stable, even generation
+void apply_control()
+{
+   struct monitor_control_t c;
+   unsigned int generation;
+
+   do {
+      generation = __atomic_load_n(&control->generation, __ATOMIC_ACQUIRE);
+      memcpy(&c, control, sizeof(c));
+      __atomic_thread_fence(__ATOMIC_ACQUIRE);
+   } while ((generation & 1) ||
+            (generation != __atomic_load_n(&control->generation,
+                                           __ATOMIC_RELAXED)));
+   control_generation = generation;
+
+   domain_bit_flags = (c.flags & CONTROL_DOMAINS) ?
+      c.domain_mask : env_domain_bit_flags;
+   domain_bit_flags &= c.capture_domain_mask;
+   memcpy(op_bit_flags, c.capture_op_mask, sizeof(op_bit_flags));
+   strings_wanted = c.wants_strings;
+   control_paused = c.paused;
+   queue_capacity = c.queue_capacity;
+   retry_wait_us = c.retry_wait_us ? c.retry_wait_us : DEFAULT_RETRY_WAIT_US;
+
+   if (c.flags & CONTROL_SAMPLING) {
+      count_based_sampling = (c.count_sample_frequency > 0);
+      if (count_based_sampling) {
+         count_based_sample_frequency = c.count_sample_frequency;
+      }
+      time_based_sampling = (c.time_sample_frequency > 0) &&
+         (c.time_sample_duration > 0);
+      if (time_based_sampling) {
+         time_based_sample_frequency = c.time_sample_frequency;
+         time_based_sample_duration = c.time_sample_duration;
+      }
+   } else {
+      count_based_sampling = env_count_based_sampling;
+      count_based_sample_frequency = env_count_based_sample_frequency;
+      time_based_sampling = env_time_based_sampling;
+      time_based_sample_frequency = env_time_based_sample_frequency;
+      time_based_sample_duration = env_time_based_sample_duration;
+   }
+}
+
+//*****************************************************************************
+
+// called for every intercept, so it has to be cheap: one comparison once
+// the control block is attached, and at most one attach attempt per second
+// while it is not (listener may be started after monitored process)
+void poll_control()
+{
+   if (control != NULL) {
+      if (__atomic_load_n(&control->generation, __ATOMIC_RELAXED) !=
+          control_generation) {
+         apply_control();
+      }
+      return;
+   }
+
+   if (message_queue_path == NULL) {
+      return;
+   }
+
+   const time_t now = time(NULL);
+   if (now == control_attach_attempt) {
+      return;
+   }
+   control_attach_attempt = now;
+
+   const key_t control_key = ftok(message_queue_path, CONTROL_PROJECT_ID);
+   if (control_key == -1) {
+      return;
+   }
+   const int control_id = shmget(control_key,
+                                 sizeof(struct monitor_control_t), 0);
+   if (control_id == -1) {
+      return;
+   }
+   void* p = shmat(control_id, NULL, SHM_RDONLY);
+   if (p == (void*)-1) {
+      return;
+   }
+   struct monitor_control_t* c = p;
+   if ((__atomic_load_n(&c->magic, __ATOMIC_ACQUIRE) != CONTROL_MAGIC) ||
+       (c->version != CONTROL_VERSION)) {
+      shmdt(p);
+      return;
+   }
+   control = c;
+   apply_control();
+}
+
+//*****************************************************************************
+
+int send_msg_queue(struct monitor_record_t* monitor_record, size_t length)
 {
    MONITOR_MESSAGE monitor_message;
    if (message_queue_key == MQ_KEY_NONE) {
@@ -294,33 +502,128 @@ int send_msg_queue(struct monitor_record_t* monitor_record)
       return -1;
    }
 
-   memset(&monitor_message, 0, sizeof(MONITOR_MESSAGE));
    monitor_message.message_type = 1L;
-   memcpy(&monitor_message.monitor_record, monitor_record, sizeof (*monitor_record));
+   memcpy(&monitor_message.monitor_record, monitor_record, length);
 
    int r;
    int retries = 0;
-   while (retries < 5) {
+   unsigned int wait_us = retry_wait_us;
+   unsigned long waited_us = 0;
+   // listener empties a full queue in about capacity times the time it
+   // needs for one record; waiting longer only slows application down
+   const unsigned long max_wait_us = queue_capacity ?
+      (unsigned long)queue_capacity * retry_wait_us : ~0UL;
+
+   for (;;) {
      r = msgsnd(message_queue_id,
 		&monitor_message,
-		sizeof(*monitor_record),
+		length,
 		IPC_NOWAIT);
-     if (r && errno == EAGAIN) {
-       retries++;
-       PUTS("Retrying msgsend");
-       usleep(512<<retries);
-       ipc_retries++;
-       ipc_retry_wait_lost_time += (512<<retries);
-       continue;
-     } else {
+     if (!r || errno != EAGAIN ||
+         retries == MAX_IPC_RETRIES || waited_us >= max_wait_us) {
        return r;
      }
+     retries++;
+     PUTS("Retrying msgsend");
+     usleep(wait_us);
+     ipc_retries++;
+     ipc_retry_wait_lost_time += wait_us;
+     waited_us += wait_us;
+     wait_us *= 2;
    }
 }
 
 //*****************************************************************************
 
-int send_tcp_socket(struct monitor_record_t* monitor_record)
+// creates <MONITOR_RING_DIR>/<pid>.ring. called again in a forked child,
+// so that every process has its own channel. caller holds ring_mutex.
+// ring is set up under another name and renamed into place: after exec
+// the listener may still have the old ring of this pid mapped, and
+// truncating that file would fault its reads
+int open_ring(const char* dir, pid_t pid)
+{
+   char ring_path[PATH_MAX];
+   char new_path[PATH_MAX];
+   unsigned int num_slots = 1;
+   unsigned long requested_slots = RING_DEFAULT_SLOTS;
+   const char* env_ring_slots = getenv(ENV_MONITOR_RING_SLOTS);
+
+   if ((env_ring_slots != NULL) && (atol(env_ring_slots) > 0)) {
+      requested_slots = atol(env_ring_slots);
+   }
+   while ((num_slots < requested_slots) && (num_slots < (1U << 20))) {
+      num_slots <<= 1;
+   }
+
+   snprintf(ring_path, sizeof(ring_path), "%s/%d%s", dir, pid,
+            RING_SUFFIX);
+   snprintf(new_path, sizeof(new_path), "%s/%d%s.new", dir, pid,
+            RING_SUFFIX);
+   int fd = orig_open(new_path, O_RDWR | O_CREAT | O_TRUNC, 0660);
+   if (fd == -1) {
+      return -1;
+   }
+   if (orig_ftruncate(fd, RING_SIZE(num_slots)) != 0) {
+      orig_close(fd);
+      orig_unlink(new_path);
+      return -1;
+   }
+   void* p = mmap(NULL, RING_SIZE(num_slots), PROT_READ | PROT_WRITE,
+                  MAP_SHARED, fd, 0);
+   orig_close(fd);
+   if (p == MAP_FAILED) {
+      orig_unlink(new_path);
+      return -1;
+   }
+
+   // ring of parent (if any) stays mapped; parent keeps using it
+   ring_init(p, num_slots, pid);
+   if (orig_rename(new_path, ring_path) != 0) {
+      munmap(p, RING_SIZE(num_slots));
+      orig_unlink(new_path);
+      return -1;
+   }
+   ring_pid = pid;
+   __atomic_store_n(&ring, p, __ATOMIC_RELEASE);
+   return 0;
+}
+
+//*****************************************************************************
+
+int send_ring(struct monitor_record_t* monitor_record, size_t length, pid_t pid)
+{
+   struct monitor_ring_t* r = __atomic_load_n(&ring, __ATOMIC_ACQUIRE);
+
+   if ((r == NULL) || (ring_pid != pid)) {
+      // first record of process; threads racing here must not truncate
+      // ring another thread already writes to. mutex functions are
+      // intercepted themselves, so bypass our own wrappers
+      orig_pthread_mutex_lock(&ring_mutex);
+      int rc = 0;
+      if ((ring == NULL) || (ring_pid != pid)) {
+         const char* dir = __atomic_load_n(&ring_dir, __ATOMIC_ACQUIRE);
+         rc = (dir != NULL) ? open_ring(dir, pid) : -1;
+         if (rc != 0) {
+            // no usable ring directory; this and later records of all
+            // threads go to message queue
+            __atomic_store_n(&ring_dir, NULL, __ATOMIC_RELEASE);
+         }
+      }
+      r = ring;
+      orig_pthread_mutex_unlock(&ring_mutex);
+      if (rc != 0) {
+         PUTS("unable to create ring")
+         return send_msg_queue(monitor_record, length);
+      }
+   }
+
+   // never wait for listener; a full ring counts as drop in its header
+   return ring_push(r, monitor_record, length);
+}
+
+//*****************************************************************************
+
+int send_tcp_socket(struct monitor_record_t* monitor_record, size_t length)
 {
    int rc;
    int record_length;
@@ -332,7 +635,7 @@ int send_tcp_socket(struct monitor_record_t* monitor_record)
    // set up a 10 byte header that includes the size (in bytes)
    // of our payload since sockets don't include any built-in
    // message boundaries
-   record_length = sizeof(*monitor_record);
+   record_length = length;
    memset(msg_size_header, 0, 10);
    snprintf(msg_size_header, 10, "%d", record_length);
 
@@ -401,6 +704,19 @@ int send_tcp_socket(struct monitor_record_t* monitor_record)
 #define RECORD_FIELD_S(f) if (f) {strncpy(record_output.f, f, sizeof(record_output.f)); \
     record_output.f[sizeof(record_output.f)-1] = 0; }
 
+// copies string, truncated to fit; unlike strncpy, rest of buffer is left
+// alone. returns length copied
+static size_t record_string(char* to, const char* from, size_t size)
+{
+   size_t len = (from != NULL) ? strnlen(from, size - 1) : 0;
+
+   if (len) {
+      memcpy(to, from, len);
+   }
+   to[len] = 0;
+   return len;
+}
+
 void record(DOMAIN_TYPE dom_type,
             OP_TYPE op_type,
             int fd,
@@ -413,10 +729,17 @@ void record(DOMAIN_TYPE dom_type,
 {
    struct monitor_record_t record_output;
    unsigned long timestamp;
+   unsigned long long timestamp_ns;
+   struct timespec now;
+   int tid;
+   unsigned int seq;
    int rc_ipc;
-   int record_length;
+   size_t record_length;
    pid_t pid;
    double elapsed_time;
+   const long long offset = record_offset;
+
+   record_offset = OFFSET_NONE;
 
    // have we already tried to connect to our peer and failed?
    if (failed_socket_connections > 0) {
@@ -439,6 +762,21 @@ void record(DOMAIN_TYPE dom_type,
       return;
    }
 
+   // before anything else, so that descriptors are tagged and untagged
+   // even while their records wouldn't be sent anyway
+   // DUP carries descriptor it duplicated as offset
+   if ((path_matcher != NULL) &&
+       skip_path(dom_type, op_type, fd,
+                 (op_type == DUP) ? (int)offset : -1, s1)) {
+      return;
+   }
+
+   // pick up changes published by mq_listener
+   poll_control();
+   if (control_paused) {
+      return;
+   }
+
    // if we're not monitoring this domain we just ignore
    const unsigned int domain_bit_flag = 1 << dom_type;
    if (0 == (domain_bit_flags & domain_bit_flag)) {
@@ -446,6 +784,12 @@ void record(DOMAIN_TYPE dom_type,
       return;
    }
 
+   // nor if no plugin of mq_listener would ever see this operation
+   if (0 == (op_bit_flags[op_type / 32] & (1U << (op_type % 32)))) {
+      PUTS("ignoring operation")
+      return;
+   }
+
    if (op_type == OPEN) {
       if (!strcmp(s1, ".")) {
          // ignore open of current directory
@@ -486,7 +830,11 @@ void record(DOMAIN_TYPE dom_type,
       count_intercepts_since_last_report = 0;
    }
 
-   timestamp = (unsigned long)time(NULL);
+   // one clock read gives both second and nanosecond timestamps;
+   // listener orders records of all processes by the latter
+   clock_gettime(CLOCK_REALTIME, &now);
+   timestamp = (unsigned long)now.tv_sec;
+   timestamp_ns = (unsigned long long)now.tv_sec * 1000000000ULL + now.tv_nsec;
 
    if (time_based_sampling) {
       if (0L == start_time_based_sample) {
@@ -527,8 +875,23 @@ void record(DOMAIN_TYPE dom_type,
    }
 
    pid = getpid();
+   if (thread_pid != pid) {
+      thread_pid = pid;
+#ifdef __FreeBSD__
+      thread_tid = pthread_getthreadid_np();
+#else
+      thread_tid = (int)syscall(SYS_gettid);
+#endif
+      thread_seq = 0;
+   }
+   tid = thread_tid;
+   // every record that is past filters and sampling uses up a number,
+   // whether or not sending it succeeds
+   seq = thread_seq++;
 
-   bzero(&record_output, sizeof(record_output));
+   // strings are handled separately below. only as much of them as they
+   // take is sent, so uninitialized rest of record never leaves process
+   bzero(&record_output, offsetof(struct monitor_record_t, s1));
 
    RECORD_FIELD_S(facility);
    RECORD_FIELD(timestamp);
@@ -539,13 +902,36 @@ void record(DOMAIN_TYPE dom_type,
    RECORD_FIELD(error_code);
    RECORD_FIELD(fd);
    RECORD_FIELD(bytes_transferred);
-   RECORD_FIELD_S(s1);
-   RECORD_FIELD_S(s2);
+   RECORD_FIELD(timestamp_ns);
+   RECORD_FIELD(tid);
+   RECORD_FIELD(seq);
+   RECORD_FIELD(offset);
+
+   // strings make up most of the record; leave them out (and send
+   // truncated record) when nobody needs them. path of OPEN is always
+   // sent, as listener uses it to resolve devices of descriptors
+   // sent record ends with terminator of last string; listener clears
+   // strings not received
+   record_length = offsetof(struct monitor_record_t, s1);
+   if (strings_wanted || (op_type == OPEN)) {
+      size_t len = record_string(record_output.s1, s1,
+                                 sizeof(record_output.s1));
+      if ((s2 != NULL) && *s2) {
+         // gap between strings goes out too
+         memset(record_output.s1 + len, 0, sizeof(record_output.s1) - len);
+         len = record_string(record_output.s2, s2, sizeof(record_output.s2));
+         record_length = offsetof(struct monitor_record_t, s2) + len + 1;
+      } else {
+         record_length += len + 1;
+      }
+   }
    
-   if (message_queue_path != NULL) {
-      rc_ipc = send_msg_queue(&record_output);
+   if (__atomic_load_n(&ring_dir, __ATOMIC_ACQUIRE) != NULL) {
+      rc_ipc = send_ring(&record_output, record_length, pid);
+   } else if (message_queue_path != NULL) {
+      rc_ipc = send_msg_queue(&record_output, record_length);
    } else {
-      rc_ipc = send_tcp_socket(&record_output);
+      rc_ipc = send_tcp_socket(&record_output, record_length);
    }
 
    if (rc_ipc != 0) {
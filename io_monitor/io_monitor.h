@@ -17,6 +17,14 @@
 #ifndef __IO_MONITOR_H
 #define __IO_MONITOR_H
 
+// per-process ring channel (see monitor_ring.h)
+#define ENV_MONITOR_RING_DIR "MONITOR_RING_DIR"
+#define ENV_MONITOR_RING_SLOTS "MONITOR_RING_SLOTS"
+
+// path patterns (see path_matcher.h), separated by ':'
+#define ENV_MONITOR_PATHS_INCLUDE "MONITOR_PATHS_INCLUDE"
+#define ENV_MONITOR_PATHS_EXCLUDE "MONITOR_PATHS_EXCLUDE"
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -0,0 +1,928 @@
+//
+// Copyright (c) 2017 Intel Corporation
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+// implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+// io_replay re-executes file I/O captured in a binary trace (written by
+// output_trace plugin of mq_listener) against a target directory, so that
+// captured workloads can be used to benchmark storage. Every captured
+// thread is replayed by a thread of its own; descriptors are shared by
+// threads of one process, as they were originally.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "domains.h"
+#include "ops.h"
+#include "monitor_record.h"
+#include "trace_format.h"
+
+#define MAX_REMAPS 64
+#define MAX_IO_SIZE (64 * 1024 * 1024)   // larger requests are cut down
+#define PREPARE_CHUNK (1024 * 1024)
+#define MIN_PACING_SLEEP_NS 100000LL
+#define LATENCY_BUCKETS 64
+
+enum op_kind { OP_OPEN, OP_CLOSE, OP_READ, OP_WRITE, OP_SEEK, OP_SYNC, NUM_KINDS };
+static const char* kind_names[NUM_KINDS] =
+   { "open", "close", "read", "write", "seek", "sync" };
+
+// how file is opened; known from fopen mode and from use of descriptor
+#define OPEN_WRITES   1
+#define OPEN_TRUNCATE 2
+#define OPEN_APPEND   4
+
+struct replay_op {
+   unsigned long long timestamp_ns;
+   long long offset;           // OFFSET_NONE unless positioned or seek
+   unsigned long long bytes;
+   unsigned int seq;
+   int fd;                     // descriptor in captured process
+   int kind;
+   int flags;                  // OPEN_* for open
+   unsigned int path;          // for open
+};
+
+struct op_stats {
+   unsigned long long count;
+   unsigned long long bytes;
+   unsigned long long total_ns;
+   unsigned long long max_ns;
+   unsigned long long buckets[LATENCY_BUCKETS];   // log2 of ns
+};
+
+struct process {
+   int pid;
+   pthread_mutex_t mutex;
+   int* fds;                   // captured descriptor -> replay descriptor
+   int num_fds;
+   struct process* next;
+};
+
+struct stream {                // one captured thread
+   int pid;
+   int tid;
+   struct process* process;
+   struct replay_op* ops;
+   size_t num_ops;
+   size_t capacity;
+   char* buffer;
+   size_t buffer_size;
+   pthread_t thread;
+   struct op_stats stats[NUM_KINDS];
+   unsigned long long errors;
+   struct stream* next;
+};
+
+struct path {
+   char* name;                 // as captured
+   char* target;               // after remapping
+   unsigned long long extent;  // bytes which must exist to be read
+};
+
+static struct stream* streams = NULL;
+static struct process* processes = NULL;
+static struct path* paths = NULL;
+static unsigned int num_paths = 0;
+static unsigned int paths_capacity = 0;
+static unsigned int skipped_opens = 0;  // paths leading out of target
+
+static const char* target_dir = NULL;
+static char* remap_from[MAX_REMAPS];
+static char* remap_to[MAX_REMAPS];
+static int num_remaps = 0;
+static double speed = 0;
+static int only_pid = 0;
+
+static unsigned long long trace_start_ns = ~0ULL;
+static unsigned long long trace_end_ns = 0;
+static unsigned long long replay_start_ns;
+
+//*****************************************************************************
+
+static unsigned long long monotonic_ns()
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+//*****************************************************************************
+
+static void usage()
+{
+   fprintf(stderr,
+           "usage: io_replay [-s <speed>] [-m <from>=<to>]... [-p <pid>] [-n]"
+           " <trace-file> <target-dir>\n"
+           "  -s  0 replays as fast as possible (default), 1 keeps original"
+           " pacing, 2 twice as fast...\n"
+           "  -m  captured paths starting with <from> are replayed under <to>;"
+           " other paths go under <target-dir>\n"
+           "  -p  replay only given process\n"
+           "  -n  don't create files read by trace before replay\n");
+}
+
+//*****************************************************************************
+
+// joins dir and path, resolving "." and ".." of path by name (not by
+// following links); NULL if path leads out of dir
+static char* join_under(const char* dir, const char* path)
+{
+   const size_t base = strlen(dir);
+   char* joined = malloc(base + strlen(path) + 2);
+   size_t len = base;
+   const char* p = path;
+
+   memcpy(joined, dir, base + 1);
+   while (*p) {
+      const size_t n = strcspn(p, "/");
+      if ((n == 2) && (p[0] == '.') && (p[1] == '.')) {
+         if (len == base) {
+            free(joined);
+            return NULL;
+         }
+         // every component was added with its slash, at or after base
+         while (joined[--len] != '/') {
+         }
+         joined[len] = 0;
+      } else if (n && !((n == 1) && (p[0] == '.'))) {
+         joined[len++] = '/';
+         memcpy(joined + len, p, n);
+         len += n;
+         joined[len] = 0;
+      }
+      p += n;
+      while (*p == '/') {
+         p++;
+      }
+   }
+   return joined;
+}
+
+//*****************************************************************************
+
+// NULL for paths which would lead out of their target directory
+static char* map_path(const char* name)
+{
+   int i;
+
+   for (i = 0; i != num_remaps; ++i) {
+      size_t len = strlen(remap_from[i]);
+      if (!strncmp(name, remap_from[i], len)) {
+         return join_under(remap_to[i], name + len);
+      }
+   }
+   return join_under(target_dir, name);
+}
+
+//*****************************************************************************
+
+// paths are few compared to operations; linear search from the most
+// recently added one is good enough
+static unsigned int intern_path(const char* name)
+{
+   unsigned int i;
+
+   for (i = num_paths; i > 0; --i) {
+      if (!strcmp(paths[i - 1].name, name)) {
+         return i - 1;
+      }
+   }
+   if (num_paths == paths_capacity) {
+      paths_capacity = paths_capacity ? 2 * paths_capacity : 256;
+      paths = realloc(paths, paths_capacity * sizeof(struct path));
+      if (!paths) {
+         fprintf(stderr, "io_replay: out of memory\n");
+         exit(1);
+      }
+   }
+   paths[num_paths].name = strdup(name);
+   paths[num_paths].target = map_path(name);
+   paths[num_paths].extent = 0;
+   return num_paths++;
+}
+
+//*****************************************************************************
+
+static struct stream* get_stream(int pid, int tid)
+{
+   static struct stream* last = NULL;
+   struct stream* s;
+   struct process* p;
+
+   if (last && last->pid == pid && last->tid == tid) {
+      return last;
+   }
+   for (s = streams; s; s = s->next) {
+      if (s->pid == pid && s->tid == tid) {
+         return last = s;
+      }
+   }
+
+   for (p = processes; p && p->pid != pid; p = p->next) {
+   }
+   if (!p) {
+      p = calloc(1, sizeof(struct process));
+      p->pid = pid;
+      pthread_mutex_init(&p->mutex, NULL);
+      p->next = processes;
+      processes = p;
+   }
+   s = calloc(1, sizeof(struct stream));
+   s->pid = pid;
+   s->tid = tid;
+   s->process = p;
+   s->next = streams;
+   streams = s;
+   return last = s;
+}
+
+//*****************************************************************************
+
+static void add_op(const struct monitor_record_t* rec, int kind,
+                   const char* path)
+{
+   struct stream* s = get_stream(rec->pid, rec->tid ? rec->tid : rec->pid);
+   struct replay_op* op;
+
+   if (s->num_ops == s->capacity) {
+      s->capacity = s->capacity ? 2 * s->capacity : 1024;
+      s->ops = realloc(s->ops, s->capacity * sizeof(struct replay_op));
+      if (!s->ops) {
+         fprintf(stderr, "io_replay: out of memory\n");
+         exit(1);
+      }
+   }
+   op = &s->ops[s->num_ops++];
+   op->timestamp_ns = rec->timestamp_ns ? rec->timestamp_ns :
+      rec->timestamp * 1000000000ULL;
+   op->offset = rec->offset;
+   op->bytes = rec->bytes_transferred;
+   op->seq = rec->seq;
+   op->fd = rec->fd;
+   op->kind = kind;
+   op->flags = 0;
+   op->path = 0;
+   if (kind == OP_OPEN) {
+      op->path = intern_path(path);
+      if (!paths[op->path].target) {
+         // operations on its descriptor fail as it is never opened
+         s->num_ops--;
+         skipped_opens++;
+         return;
+      }
+      // fopen mode; plain open doesn't tell its flags
+      if (rec->s2[0] == 'w') {
+         op->flags = OPEN_WRITES | OPEN_TRUNCATE;
+      } else if (rec->s2[0] == 'a') {
+         op->flags = OPEN_WRITES | OPEN_APPEND;
+      }
+   }
+   if (op->timestamp_ns < trace_start_ns) {
+      trace_start_ns = op->timestamp_ns;
+   }
+   if (op->timestamp_ns > trace_end_ns) {
+      trace_end_ns = op->timestamp_ns;
+   }
+}
+
+//*****************************************************************************
+
+static int op_kind(const struct monitor_record_t* rec)
+{
+   switch (rec->dom_type) {
+   case FILE_OPEN_CLOSE:
+      return rec->op_type == OPEN ? OP_OPEN :
+         rec->op_type == CLOSE ? OP_CLOSE : -1;
+   case FILE_READ:
+      return rec->op_type == READ ? OP_READ : -1;
+   case FILE_WRITE:
+      return rec->op_type == WRITE ? OP_WRITE : -1;
+   case SEEKS:
+      return rec->op_type == SEEK ? OP_SEEK : -1;
+   case SYNCS:
+      return rec->op_type == SYNC ? OP_SYNC : -1;
+   default:
+      return -1;
+   }
+}
+
+//*****************************************************************************
+
+static int load_trace(const char* trace_path)
+{
+   const unsigned char* map;
+   struct trace_file_header header;
+   struct trace_block_header block;
+   struct trace_codec_state codec;
+   struct trace_record_strings str;
+   struct monitor_record_t rec;
+   const char** strings = NULL;
+   unsigned int strings_capacity = 0;
+   unsigned long long num_records = 0;
+   size_t size;
+   size_t offset;
+   struct stat st;
+   unsigned int i;
+   int fd;
+
+   fd = open(trace_path, O_RDONLY);
+   if (fd == -1 || fstat(fd, &st) || st.st_size < (off_t)sizeof(header)) {
+      fprintf(stderr, "io_replay: unable to read trace '%s'\n", trace_path);
+      return 1;
+   }
+   size = st.st_size;
+   map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+   close(fd);
+   if (map == MAP_FAILED) {
+      fprintf(stderr, "io_replay: unable to map trace '%s'\n", trace_path);
+      return 1;
+   }
+   madvise((void*)map, size, MADV_SEQUENTIAL);
+   memcpy(&header, map, sizeof(header));
+   if (memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)) ||
+       header.version != TRACE_VERSION) {
+      fprintf(stderr, "io_replay: '%s' is not a trace of version %d\n",
+              trace_path, TRACE_VERSION);
+      return 1;
+   }
+
+   // blocks are walked in order; index isn't needed for that
+   for (offset = header.header_size; offset + sizeof(block) <= size; ) {
+      const unsigned char* p;
+      const unsigned char* end;
+      const char* s;
+
+      memcpy(&block, map + offset, sizeof(block));
+      if (block.magic != TRACE_BLOCK_MAGIC ||
+          (unsigned long long)block.strings_size + block.records_size >
+          size - offset - sizeof(block)) {
+         break;
+      }
+      p = map + offset + sizeof(block);
+      end = p + block.strings_size + block.records_size;
+      offset = end - map;
+      if (only_pid && (only_pid < block.min_pid || only_pid > block.max_pid)) {
+         continue;
+      }
+
+      if (block.num_strings > strings_capacity) {
+         strings_capacity = block.num_strings;
+         strings = realloc(strings, strings_capacity * sizeof(char*));
+      }
+      s = (const char*)p;
+      for (i = 0; i != block.num_strings; ++i) {
+         const char* nul = memchr(s, 0, (const char*)p + block.strings_size - s);
+         if (!nul) {
+            break;
+         }
+         strings[i] = s;
+         s = nul + 1;
+      }
+      if (i != block.num_strings) {
+         break;
+      }
+
+      memset(&codec, 0, sizeof(codec));
+      p += block.strings_size;
+      for (i = 0; i != block.num_records; ++i) {
+         int kind;
+         p = trace_decode_record(p, end, &codec, &rec, &str);
+         if (!p || str.s1 >= block.num_strings || str.s2 >= block.num_strings) {
+            fprintf(stderr, "io_replay: trace '%s' is corrupt\n", trace_path);
+            return 1;
+         }
+         num_records++;
+         kind = op_kind(&rec);
+         // failed calls aren't replayed
+         if (kind < 0 || rec.error_code || (only_pid && rec.pid != only_pid) ||
+             (kind != OP_SYNC && rec.fd < 0) ||
+             (kind == OP_OPEN && !*strings[str.s1])) {
+            continue;
+         }
+         strncpy(rec.s2, strings[str.s2], sizeof(rec.s2) - 1);
+         rec.s2[sizeof(rec.s2) - 1] = 0;
+         add_op(&rec, kind, strings[str.s1]);
+      }
+   }
+   free(strings);
+   munmap((void*)map, size);
+   printf("io_replay: %llu records read from trace\n", num_records);
+   if (skipped_opens) {
+      printf("io_replay: %u opens of paths outside target directory"
+             " skipped\n", skipped_opens);
+   }
+   return 0;
+}
+
+//*****************************************************************************
+
+static int compare_ops(const void* a, const void* b)
+{
+   const struct replay_op* x = a;
+   const struct replay_op* y = b;
+   if (x->seq != y->seq) {
+      return x->seq < y->seq ? -1 : 1;
+   }
+   return x->timestamp_ns < y->timestamp_ns ? -1 :
+      x->timestamp_ns > y->timestamp_ns;
+}
+
+//*****************************************************************************
+
+struct fd_state {
+   struct replay_op* open;     // NULL when descriptor isn't open
+   unsigned long long position;
+};
+
+static void analyse_stream(struct stream* s, struct fd_state** fds,
+                           int* num_fds)
+{
+   struct fd_state* fd;
+   unsigned long long start;
+   size_t i;
+
+   for (i = 0; i != s->num_ops; ++i) {
+      struct replay_op* op = &s->ops[i];
+      unsigned long long bytes = op->bytes < MAX_IO_SIZE ? op->bytes : MAX_IO_SIZE;
+
+      if (op->fd < 0) {
+         continue;
+      }
+      if (op->fd >= *num_fds) {
+         int n = op->fd + 64;
+         *fds = realloc(*fds, n * sizeof(struct fd_state));
+         memset(*fds + *num_fds, 0, (n - *num_fds) * sizeof(struct fd_state));
+         *num_fds = n;
+      }
+      fd = &(*fds)[op->fd];
+
+      switch (op->kind) {
+      case OP_OPEN:
+         fd->open = op;
+         fd->position = 0;
+         break;
+      case OP_CLOSE:
+         fd->open = NULL;
+         break;
+      case OP_SEEK:
+         fd->position = op->offset;
+         break;
+      case OP_READ:
+      case OP_WRITE:
+         start = op->offset != OFFSET_NONE ? (unsigned long long)op->offset :
+            fd->position;
+         if (op->offset == OFFSET_NONE) {
+            fd->position += bytes;
+         }
+         if (bytes > s->buffer_size) {
+            s->buffer_size = bytes;
+         }
+         if (!fd->open) {
+            break;
+         }
+         if (op->kind == OP_WRITE) {
+            fd->open->flags |= OPEN_WRITES;
+         } else if (!(fd->open->flags & OPEN_TRUNCATE) &&
+                    start + bytes > paths[fd->open->path].extent) {
+            paths[fd->open->path].extent = start + bytes;
+         }
+         break;
+      }
+   }
+}
+
+//*****************************************************************************
+
+// follows file positions through each process to learn how much of
+// each file must exist before replay, and which opens will write
+static void analyse_streams()
+{
+   struct fd_state* fds = NULL;
+   int num_fds = 0;
+   struct process* p;
+   struct stream* s;
+
+   for (s = streams; s; s = s->next) {
+      qsort(s->ops, s->num_ops, sizeof(struct replay_op), compare_ops);
+   }
+
+   // threads of process share descriptors; its streams are analysed one
+   // after another, which is precise enough for sizing files
+   for (p = processes; p; p = p->next) {
+      if (num_fds) {
+         memset(fds, 0, num_fds * sizeof(struct fd_state));
+      }
+      for (s = streams; s; s = s->next) {
+         if (s->pid == p->pid) {
+            analyse_stream(s, &fds, &num_fds);
+         }
+      }
+   }
+   free(fds);
+}
+
+//*****************************************************************************
+
+static void make_parent_dirs(const char* path)
+{
+   char* dir = strdup(path);
+   char* p;
+
+   for (p = dir + 1; *p; ++p) {
+      if (*p == '/') {
+         *p = 0;
+         mkdir(dir, 0755);
+         *p = '/';
+      }
+   }
+   free(dir);
+}
+
+//*****************************************************************************
+
+// reads in replay should hit real data, so files are written, not just
+// extended
+static int prepare_files(int create_files)
+{
+   unsigned long long created = 0;
+   unsigned int num_files = 0;
+   char* chunk = NULL;
+   unsigned int i;
+   struct stat st;
+
+   for (i = 0; i != num_paths; ++i) {
+      struct path* path = &paths[i];
+      unsigned long long size;
+      int fd;
+
+      if (!path->target) {
+         continue;
+      }
+      make_parent_dirs(path->target);
+      if (!create_files || !path->extent) {
+         continue;
+      }
+      size = stat(path->target, &st) ? 0 : st.st_size;
+      if (size >= path->extent) {
+         continue;
+      }
+      if (!chunk) {
+         chunk = malloc(PREPARE_CHUNK);
+         memset(chunk, 0xa5, PREPARE_CHUNK);
+      }
+      fd = open(path->target, O_WRONLY | O_CREAT, 0644);
+      if (fd == -1) {
+         fprintf(stderr, "io_replay: unable to create '%s': %s\n",
+                 path->target, strerror(errno));
+         continue;
+      }
+      created += path->extent - size;
+      num_files++;
+      while (size < path->extent) {
+         size_t n = path->extent - size < PREPARE_CHUNK ?
+            path->extent - size : PREPARE_CHUNK;
+         ssize_t written = pwrite(fd, chunk, n, size);
+         if (written <= 0) {
+            fprintf(stderr, "io_replay: unable to write '%s': %s\n",
+                    path->target, strerror(errno));
+            break;
+         }
+         size += written;
+      }
+      fsync(fd);
+      close(fd);
+   }
+   free(chunk);
+   if (num_files) {
+      printf("io_replay: prepared %u files (%.1f MB)\n", num_files,
+             created / 1048576.0);
+   }
+   return 0;
+}
+
+//*****************************************************************************
+
+static int get_fd(struct process* p, int fd)
+{
+   int rfd = -1;
+
+   pthread_mutex_lock(&p->mutex);
+   if (fd < p->num_fds) {
+      rfd = p->fds[fd];
+   }
+   pthread_mutex_unlock(&p->mutex);
+   return rfd;
+}
+
+//*****************************************************************************
+
+// returns previous replay descriptor of captured one
+static int set_fd(struct process* p, int fd, int rfd)
+{
+   int old;
+
+   pthread_mutex_lock(&p->mutex);
+   if (fd >= p->num_fds) {
+      int n = fd + 64;
+      int* tmp = realloc(p->fds, n * sizeof(int));
+      if (!tmp) {
+         pthread_mutex_unlock(&p->mutex);
+         return rfd;
+      }
+      p->fds = tmp;
+      for (; p->num_fds != n; ++p->num_fds) {
+         p->fds[p->num_fds] = -1;
+      }
+   }
+   old = p->fds[fd];
+   p->fds[fd] = rfd;
+   pthread_mutex_unlock(&p->mutex);
+   return old;
+}
+
+//*****************************************************************************
+
+static int replay_op(struct stream* s, const struct replay_op* op)
+{
+   size_t bytes = op->bytes < s->buffer_size ? op->bytes : s->buffer_size;
+   int flags;
+   int rfd;
+
+   if (op->kind == OP_OPEN) {
+      flags = (op->flags & OPEN_WRITES) ? O_RDWR | O_CREAT : O_RDONLY;
+      if (op->flags & OPEN_TRUNCATE) {
+         flags |= O_TRUNC;
+      }
+      if (op->flags & OPEN_APPEND) {
+         flags |= O_APPEND;
+      }
+      rfd = open(paths[op->path].target, flags, 0644);
+      if (rfd == -1) {
+         return 1;
+      }
+      // descriptor closed by fclose wasn't recorded as closed
+      rfd = set_fd(s->process, op->fd, rfd);
+      if (rfd != -1) {
+         close(rfd);
+      }
+      return 0;
+   }
+
+   if (op->kind == OP_SYNC && op->fd < 0) {
+      sync();
+      return 0;
+   }
+   rfd = get_fd(s->process, op->fd);
+   if (rfd == -1) {
+      return 1;
+   }
+   switch (op->kind) {
+   case OP_CLOSE:
+      set_fd(s->process, op->fd, -1);
+      return close(rfd) != 0;
+   case OP_READ:
+      return (op->offset != OFFSET_NONE ?
+              pread(rfd, s->buffer, bytes, op->offset) :
+              read(rfd, s->buffer, bytes)) < 0;
+   case OP_WRITE:
+      return (op->offset != OFFSET_NONE ?
+              pwrite(rfd, s->buffer, bytes, op->offset) :
+              write(rfd, s->buffer, bytes)) < 0;
+   case OP_SEEK:
+      return lseek(rfd, op->offset, SEEK_SET) == (off_t)-1;
+   case OP_SYNC:
+      return fsync(rfd) != 0;
+   }
+   return 1;
+}
+
+//*****************************************************************************
+
+static void* replay_stream(void* arg)
+{
+   struct stream* s = arg;
+   struct timespec ts;
+   size_t i;
+
+   for (i = 0; i != s->num_ops; ++i) {
+      const struct replay_op* op = &s->ops[i];
+      struct op_stats* stats = &s->stats[op->kind];
+      unsigned long long start;
+      unsigned long long elapsed;
+      int bucket;
+
+      if (speed > 0) {
+         long long ahead = (long long)((op->timestamp_ns - trace_start_ns) / speed)
+            - (long long)(monotonic_ns() - replay_start_ns);
+         if (ahead > MIN_PACING_SLEEP_NS) {
+            ts.tv_sec = ahead / 1000000000LL;
+            ts.tv_nsec = ahead % 1000000000LL;
+            nanosleep(&ts, NULL);
+         }
+      }
+
+      start = monotonic_ns();
+      if (replay_op(s, op)) {
+         s->errors++;
+         continue;
+      }
+      elapsed = monotonic_ns() - start;
+      stats->count++;
+      if (op->kind == OP_READ || op->kind == OP_WRITE) {
+         stats->bytes += op->bytes < s->buffer_size ? op->bytes : s->buffer_size;
+      }
+      stats->total_ns += elapsed;
+      if (elapsed > stats->max_ns) {
+         stats->max_ns = elapsed;
+      }
+      bucket = elapsed ? 64 - __builtin_clzll(elapsed) : 0;
+      stats->buckets[bucket < LATENCY_BUCKETS ? bucket : LATENCY_BUCKETS - 1]++;
+   }
+   return NULL;
+}
+
+//*****************************************************************************
+
+// upper bound of bucket holding given fraction of operations
+static double percentile_us(const struct op_stats* stats, double fraction)
+{
+   unsigned long long seen = 0;
+   int i;
+
+   for (i = 0; i != LATENCY_BUCKETS; ++i) {
+      seen += stats->buckets[i];
+      if (seen >= fraction * stats->count) {
+         // bucket may reach beyond slowest operation seen
+         const double upper_ns = i ? (double)(1ULL << i) : 1.0;
+         return (upper_ns < stats->max_ns ? upper_ns : stats->max_ns) / 1000.0;
+      }
+   }
+   return stats->max_ns / 1000.0;
+}
+
+//*****************************************************************************
+
+static void report(double elapsed_s)
+{
+   struct op_stats total[NUM_KINDS];
+   unsigned long long errors = 0;
+   unsigned int num_streams = 0;
+   unsigned int num_processes = 0;
+   unsigned long long ops = 0;
+   unsigned long long bytes = 0;
+   struct stream* s;
+   struct process* p;
+   int k, i;
+
+   memset(total, 0, sizeof(total));
+   for (s = streams; s; s = s->next) {
+      num_streams++;
+      errors += s->errors;
+      for (k = 0; k != NUM_KINDS; ++k) {
+         total[k].count += s->stats[k].count;
+         total[k].bytes += s->stats[k].bytes;
+         total[k].total_ns += s->stats[k].total_ns;
+         if (s->stats[k].max_ns > total[k].max_ns) {
+            total[k].max_ns = s->stats[k].max_ns;
+         }
+         for (i = 0; i != LATENCY_BUCKETS; ++i) {
+            total[k].buckets[i] += s->stats[k].buckets[i];
+         }
+      }
+   }
+   for (p = processes; p; p = p->next) {
+      num_processes++;
+   }
+
+   printf("\n%-6s %10s %10s %10s %10s %10s %10s %10s\n", "op", "count",
+          "MB", "MB/s", "avg us", "p50 us", "p99 us", "max us");
+   for (k = 0; k != NUM_KINDS; ++k) {
+      const struct op_stats* t = &total[k];
+      if (!t->count) {
+         continue;
+      }
+      ops += t->count;
+      bytes += t->bytes;
+      printf("%-6s %10llu %10.1f %10.1f %10.1f %10.1f %10.1f %10.1f\n",
+             kind_names[k], t->count, t->bytes / 1048576.0,
+             t->bytes / 1048576.0 / elapsed_s,
+             t->total_ns / 1000.0 / t->count,
+             percentile_us(t, 0.5), percentile_us(t, 0.99),
+             t->max_ns / 1000.0);
+   }
+   printf("\n%llu operations of %u processes in %u threads took %.3f s"
+          " (%.3f s when captured): %.0f ops/s, %.1f MB/s; %llu failed\n",
+          ops, num_processes, num_streams, elapsed_s,
+          trace_end_ns > trace_start_ns ?
+          (trace_end_ns - trace_start_ns) / 1e9 : 0.0,
+          ops / elapsed_s, bytes / 1048576.0 / elapsed_s, errors);
+   printf("(percentiles are upper bounds of power of 2 buckets)\n");
+}
+
+//*****************************************************************************
+
+int main(int argc, char** argv)
+{
+   int create_files = 1;
+   struct stream* s;
+   double elapsed_s;
+   int opt;
+
+   while ((opt = getopt(argc, argv, "s:m:p:n")) != -1) {
+      switch (opt) {
+      case 's':
+         speed = atof(optarg);
+         break;
+      case 'm':
+         if (num_remaps == MAX_REMAPS || !strchr(optarg, '=')) {
+            usage();
+            return 1;
+         }
+         remap_from[num_remaps] = optarg;
+         remap_to[num_remaps] = strchr(optarg, '=') + 1;
+         remap_to[num_remaps][-1] = 0;
+         num_remaps++;
+         break;
+      case 'p':
+         only_pid = atoi(optarg);
+         break;
+      case 'n':
+         create_files = 0;
+         break;
+      default:
+         usage();
+         return 1;
+      }
+   }
+   if (argc - optind != 2 || speed < 0) {
+      usage();
+      return 1;
+   }
+   target_dir = argv[optind + 1];
+   if (mkdir(target_dir, 0755) && errno != EEXIST) {
+      fprintf(stderr, "io_replay: unable to create '%s': %s\n", target_dir,
+              strerror(errno));
+      return 1;
+   }
+
+   if (load_trace(argv[optind])) {
+      return 1;
+   }
+   if (!streams) {
+      fprintf(stderr, "io_replay: trace holds no file operations to replay\n");
+      return 1;
+   }
+   analyse_streams();
+   prepare_files(create_files);
+
+   for (s = streams; s; s = s->next) {
+      s->buffer = malloc(s->buffer_size ? s->buffer_size : 1);
+      if (!s->buffer) {
+         fprintf(stderr, "io_replay: out of memory\n");
+         return 1;
+      }
+      memset(s->buffer, 0x5a, s->buffer_size);
+   }
+
+   replay_start_ns = monotonic_ns();
+   for (s = streams; s; s = s->next) {
+      if (pthread_create(&s->thread, NULL, replay_stream, s)) {
+         fprintf(stderr, "io_replay: unable to start thread\n");
+         return 1;
+      }
+   }
+   for (s = streams; s; s = s->next) {
+      pthread_join(s->thread, NULL);
+   }
+   elapsed_s = (monotonic_ns() - replay_start_ns) / 1e9;
+   if (elapsed_s <= 0) {
+      elapsed_s = 1e-9;
+   }
+
+   report(elapsed_s);
+   return 0;
+}
+
+//*****************************************************************************
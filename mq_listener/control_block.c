@@ -0,0 +1,304 @@
+//
+// Copyright (c) 2017 Intel Corporation
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+// implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+
+#include "domains.h"
+#include "ops.h"
+#include "domains_names.h"
+#include "ops_names.h"
+#include "monitor_control.h"
+#include "plugin.h"
+#include "plugin_chain.h"
+#include "control_block.h"
+
+/* control block as mapped from shared memory, and settings requested by
+ * commands; published together by update_monitor_control() */
+static struct monitor_control_t* control = NULL;
+static struct monitor_control_t requested;
+static int pushdown_enabled = 1;
+static int listener_ready = 0;
+
+static pthread_mutex_t control_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+//*****************************************************************************
+
+int attach_monitor_control(const char* message_queue_path)
+{
+  key_t control_key;
+  int control_id;
+  void* p;
+
+  control_key = ftok(message_queue_path, CONTROL_PROJECT_ID);
+  if (control_key == -1) {
+    fprintf(stderr, "error: unable to obtain key for control block '%s'\n",
+	    message_queue_path);
+    fprintf(stderr, "errno: %d\n", errno);
+    return 1;
+  }
+
+  control_id = shmget(control_key, sizeof(struct monitor_control_t),
+		      0664 | IPC_CREAT);
+  if (control_id == -1 && errno == EINVAL) {
+    /* segment of older, smaller layout; processes still attached to it
+     * see its version and keep using their environment */
+    control_id = shmget(control_key, 0, 0);
+    if (control_id != -1)
+      shmctl(control_id, IPC_RMID, NULL);
+    control_id = shmget(control_key, sizeof(struct monitor_control_t),
+			0664 | IPC_CREAT);
+  }
+  if (control_id == -1) {
+    fprintf(stderr, "error: unable to obtain control block for '%s'\n",
+	    message_queue_path);
+    fprintf(stderr, "errno: %d\n", errno);
+    return 1;
+  }
+
+  p = shmat(control_id, NULL, 0);
+  if (p == (void*)-1) {
+    fprintf(stderr, "error: unable to attach control block for '%s'\n",
+	    message_queue_path);
+    fprintf(stderr, "errno: %d\n", errno);
+    return 1;
+  }
+
+  pthread_mutex_lock(&control_mutex);
+  control = p;
+  if (control->magic != CONTROL_MAGIC || control->version != CONTROL_VERSION) {
+    /* fresh segment (or left behind by incompatible listener) */
+    unsigned int generation = control->generation;
+    memset(control, 0, sizeof(*control));
+    control->generation = (generation + 1) & ~1U;
+    control->version = CONTROL_VERSION;
+    __atomic_store_n(&control->magic, CONTROL_MAGIC, __ATOMIC_RELEASE);
+  }
+  pthread_mutex_unlock(&control_mutex);
+
+  update_monitor_control();
+  return 0;
+}
+
+//*****************************************************************************
+
+void update_monitor_control()
+{
+  struct monitor_control_t c;
+  struct plugin_interest interest;
+  int i;
+
+  pthread_mutex_lock(&control_mutex);
+  if (!control) {
+    pthread_mutex_unlock(&control_mutex);
+    return;
+  }
+
+  c = requested;
+  if (pushdown_enabled && listener_ready) {
+    get_chain_interest(&interest);
+    c.capture_domain_mask = interest.domain_mask;
+    for (i = 0; i != CONTROL_OP_MASK_WORDS; ++i)
+      c.capture_op_mask[i] = interest.op_mask[i];
+    c.wants_strings = interest.wants_strings;
+
+    /* resolver needs opens and closes to attribute descriptors to devices,
+     * and process exits to forget descriptors of processes */
+    if (c.capture_domain_mask & ((1 << FILE_READ) | (1 << FILE_WRITE) |
+				 (1 << FILE_METADATA) | (1 << FILE_SPACE) |
+				 (1 << SYNCS))) {
+      c.capture_domain_mask |= (1 << FILE_OPEN_CLOSE) | (1 << START_STOP);
+      c.capture_op_mask[OPEN / 32] |= 1U << (OPEN % 32);
+      c.capture_op_mask[CLOSE / 32] |= 1U << (CLOSE % 32);
+      c.capture_op_mask[STOP / 32] |= 1U << (STOP % 32);
+    }
+  } else {
+    memset(&c.capture_domain_mask, 0xff, sizeof(c.capture_domain_mask));
+    memset(c.capture_op_mask, 0xff, sizeof(c.capture_op_mask));
+    c.wants_strings = 1;
+  }
+
+  /* odd generation tells readers that block is being updated */
+  __atomic_fetch_add(&control->generation, 1, __ATOMIC_SEQ_CST);
+  control->flags = c.flags;
+  control->domain_mask = c.domain_mask;
+  control->capture_domain_mask = c.capture_domain_mask;
+  memcpy(control->capture_op_mask, c.capture_op_mask,
+	 sizeof(control->capture_op_mask));
+  control->wants_strings = c.wants_strings;
+  control->paused = c.paused;
+  control->count_sample_frequency = c.count_sample_frequency;
+  control->time_sample_frequency = c.time_sample_frequency;
+  control->time_sample_duration = c.time_sample_duration;
+  control->queue_capacity = c.queue_capacity;
+  control->retry_wait_us = c.retry_wait_us;
+  __atomic_fetch_add(&control->generation, 1, __ATOMIC_SEQ_CST);
+  pthread_mutex_unlock(&control_mutex);
+}
+
+//*****************************************************************************
+
+void monitor_control_ready()
+{
+  pthread_mutex_lock(&control_mutex);
+  listener_ready = 1;
+  pthread_mutex_unlock(&control_mutex);
+  update_monitor_control();
+}
+
+//*****************************************************************************
+
+void set_monitor_domains(unsigned int domain_mask, int override)
+{
+  pthread_mutex_lock(&control_mutex);
+  if (override) {
+    requested.flags |= CONTROL_DOMAINS;
+    requested.domain_mask = domain_mask;
+  } else {
+    requested.flags &= ~CONTROL_DOMAINS;
+    requested.domain_mask = 0;
+  }
+  pthread_mutex_unlock(&control_mutex);
+  update_monitor_control();
+}
+
+//*****************************************************************************
+
+void set_monitor_paused(int paused)
+{
+  pthread_mutex_lock(&control_mutex);
+  requested.paused = paused;
+  pthread_mutex_unlock(&control_mutex);
+  update_monitor_control();
+}
+
+//*****************************************************************************
+
+void set_monitor_sampling(unsigned int count_frequency,
+                          unsigned int time_frequency,
+                          unsigned int time_duration,
+                          int override)
+{
+  pthread_mutex_lock(&control_mutex);
+  if (override) {
+    requested.flags |= CONTROL_SAMPLING;
+    requested.count_sample_frequency = count_frequency;
+    requested.time_sample_frequency = time_frequency;
+    requested.time_sample_duration = time_duration;
+  } else {
+    requested.flags &= ~CONTROL_SAMPLING;
+    requested.count_sample_frequency = 0;
+    requested.time_sample_frequency = 0;
+    requested.time_sample_duration = 0;
+  }
+  pthread_mutex_unlock(&control_mutex);
+  update_monitor_control();
+}
+
+//*****************************************************************************
+
+void set_monitor_pushdown(int enabled)
+{
+  pthread_mutex_lock(&control_mutex);
+  pushdown_enabled = enabled;
+  pthread_mutex_unlock(&control_mutex);
+  update_monitor_control();
+}
+
+//*****************************************************************************
+
+void set_monitor_queue_capacity(unsigned int capacity)
+{
+  pthread_mutex_lock(&control_mutex);
+  requested.queue_capacity = capacity;
+  pthread_mutex_unlock(&control_mutex);
+  update_monitor_control();
+}
+
+//*****************************************************************************
+
+void set_monitor_retry_wait(unsigned int retry_wait_us)
+{
+  int changed;
+
+  /* called periodically; don't make every process re-read the block
+   * when nothing changed */
+  pthread_mutex_lock(&control_mutex);
+  changed = requested.retry_wait_us != retry_wait_us;
+  requested.retry_wait_us = retry_wait_us;
+  pthread_mutex_unlock(&control_mutex);
+  if (changed)
+    update_monitor_control();
+}
+
+//*****************************************************************************
+
+static void print_domain_mask(const char* label, unsigned int m)
+{
+  int j;
+  printf("%s:", label);
+  for (j = 0; j != END_DOMAINS; j++) {
+    if (m & (1U << j)) {
+      m &= ~(1U << j);
+      printf("%s%s", domains_names[j], (m & ((1U << END_DOMAINS) - 1)) ? "," : "");
+    }
+  }
+  putchar('\n');
+}
+
+void print_monitor_control()
+{
+  struct monitor_control_t c;
+  int op;
+
+  pthread_mutex_lock(&control_mutex);
+  if (!control) {
+    pthread_mutex_unlock(&control_mutex);
+    puts("control block not attached");
+    return;
+  }
+  c = *control;
+  pthread_mutex_unlock(&control_mutex);
+
+  printf("generation: %u\n", c.generation);
+  printf("paused: %s\n", c.paused ? "yes" : "no");
+  if (c.flags & CONTROL_DOMAINS)
+    print_domain_mask("monitor_domains", c.domain_mask);
+  else
+    puts("monitor_domains:(MONITOR_DOMAINS of each process)");
+  if (c.flags & CONTROL_SAMPLING)
+    printf("sampling: count=%u time=%u/%u\n", c.count_sample_frequency,
+	   c.time_sample_frequency, c.time_sample_duration);
+  else
+    puts("sampling:(environment of each process)");
+  printf("pushdown: %s\n", pushdown_enabled ? "on" : "off");
+  print_domain_mask("capture_domains", c.capture_domain_mask);
+  printf("capture_ops:");
+  for (op = 0; op != END_OPS; ++op) {
+    if (c.capture_op_mask[op / 32] & (1U << (op % 32)))
+      printf(" %s", ops_names[op]);
+  }
+  putchar('\n');
+  printf("strings: %s\n", c.wants_strings ? "yes" : "only for OPEN");
+  printf("queue_capacity: %u records\n", c.queue_capacity);
+  printf("retry_wait: %u us\n", c.retry_wait_us);
+}
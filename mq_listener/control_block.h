@@ -0,0 +1,54 @@
+//
+// Copyright (c) 2017 Intel Corporation
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+// implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef __CONTROL_BLOCK_H
+#define __CONTROL_BLOCK_H
+
+/* create (or attach to existing) control block for message queue path */
+int attach_monitor_control(const char* message_queue_path);
+
+/* interest of plugin chain is pushed down only after startup commands
+ * (loading of plugins) are done; until then everything is captured */
+void monitor_control_ready();
+
+/* override MONITOR_DOMAINS of monitored processes; override = 0 returns
+ * control to their environment */
+void set_monitor_domains(unsigned int domain_mask, int override);
+
+void set_monitor_paused(int paused);
+
+/* override sampling env variables of monitored processes; zero
+ * frequency disables given kind of sampling */
+void set_monitor_sampling(unsigned int count_frequency,
+                          unsigned int time_frequency,
+                          unsigned int time_duration,
+                          int override);
+
+/* when enabled (default), interest of plugin chain is pushed down to
+ * monitored processes so that records nobody uses are never sent */
+void set_monitor_pushdown(int enabled);
+
+/* hints for monitored processes sending to message queue: how many
+ * records it holds and how long listener takes to make room for one */
+void set_monitor_queue_capacity(unsigned int capacity);
+void set_monitor_retry_wait(unsigned int retry_wait_us);
+
+/* recompute and publish control block; called whenever chain changes */
+void update_monitor_control();
+
+void print_monitor_control();
+
+#endif
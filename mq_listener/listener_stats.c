@@ -0,0 +1,291 @@
+//
+// Copyright (c) 2017 Intel Corporation
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+// implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "domains.h"
+#include "ops.h"
+#include "mq.h"
+#include "plugin.h"
+#include "plugin_chain.h"
+#include "record_pool.h"
+#include "control_block.h"
+#include "listener_stats.h"
+
+struct listener_stats listener_stats;
+int stats_enabled = 1;
+
+static int stats_interval = 0;
+static time_t last_emit = 0;
+static time_t last_tick = 0;
+static int reset_requested = 0;
+
+/* bounds of wait hint given to processes finding message queue full */
+#define MIN_RETRY_WAIT_US 64
+#define MAX_RETRY_WAIT_US 16384
+
+/* totals at last tick, to get processing time per record in last second */
+static unsigned long long last_records = 0;
+static unsigned long long last_busy_ns = 0;
+
+//*****************************************************************************
+
+unsigned long long histogram_percentile(const struct histogram* h,
+					double fraction)
+{
+  unsigned long long target = (unsigned long long)(fraction * h->count);
+  unsigned long long seen = 0;
+  int i;
+
+  if (!h->count)
+    return 0;
+  for (i = 0; i != HISTOGRAM_BUCKETS; ++i) {
+    seen += h->buckets[i];
+    if (seen > target) {
+      unsigned long long bound = i ? (1ULL << i) - 1 : 0;
+      return bound < h->max ? bound : h->max;
+    }
+  }
+  return h->max;
+}
+
+//*****************************************************************************
+
+void set_listener_stats_interval(int seconds)
+{
+  __atomic_store_n(&stats_interval, seconds > 0 ? seconds : 0,
+		   __ATOMIC_RELAXED);
+}
+
+//*****************************************************************************
+
+void reset_listener_stats()
+{
+  __atomic_store_n(&reset_requested, 1, __ATOMIC_RELEASE);
+}
+
+//*****************************************************************************
+
+static void reset_plugin(const char* name, struct plugin_stats* stats,
+			 void* arg)
+{
+  memset(stats, 0, sizeof(struct plugin_stats));
+}
+
+//*****************************************************************************
+
+static void format_histogram(char* buf, size_t size, const struct histogram* h,
+			     double scale)
+{
+  snprintf(buf, size, "count=%llu avg=%.3f p50=%.3f p99=%.3f max=%.3f",
+	   h->count, h->count ? h->sum / scale / h->count : 0.0,
+	   histogram_percentile(h, 0.5) / scale,
+	   histogram_percentile(h, 0.99) / scale, h->max / scale);
+}
+
+//*****************************************************************************
+
+static void print_histogram(const char* name, const struct histogram* h,
+			    double scale)
+{
+  char buf[STR_LEN];
+  format_histogram(buf, sizeof(buf), h, scale);
+  printf("%-40s %s\n", name, buf);
+}
+
+//*****************************************************************************
+
+static void print_plugin(const char* name, struct plugin_stats* stats,
+			 void* arg)
+{
+  char label[STR_LEN];
+  snprintf(label, sizeof(label), "plugin %s (us)", name);
+  print_histogram(label, &stats->process_time, 1000.0);
+  printf("%-40s refused=%llu skipped=%llu dropped=%llu\n", "",
+	 stats->refused, stats->skipped, stats->dropped);
+}
+
+//*****************************************************************************
+
+void print_listener_stats()
+{
+  if (!stats_enabled)
+    puts("timing is off; only counters are updated");
+  print_histogram("receive wait (us)", &listener_stats.receive_wait, 1000.0);
+  print_histogram("resolver (us)", &listener_stats.resolver, 1000.0);
+  print_histogram("plugin chain (us)", &listener_stats.chain, 1000.0);
+  print_histogram("queue depth (messages)", &listener_stats.queue_depth, 1.0);
+  print_histogram("ring backlog (records)", &listener_stats.ring_backlog, 1.0);
+  visit_plugin_stats(print_plugin, NULL);
+}
+
+//*****************************************************************************
+
+struct stat_records {
+  struct monitor_record_t** records;
+  int num_records;
+  int max_records;
+};
+
+//*****************************************************************************
+
+static void add_stat_record(struct stat_records* list, const char* name,
+			    const struct histogram* h, double scale,
+			    const struct plugin_stats* plugin)
+{
+  struct monitor_record_t* rec;
+  struct timespec now;
+  size_t n;
+
+  if (list->num_records == list->max_records) {
+    int new_max = list->max_records ? 2 * list->max_records : 16;
+    struct monitor_record_t** tmp =
+      realloc(list->records, new_max * sizeof(struct monitor_record_t*));
+    if (!tmp)
+      return;
+    list->records = tmp;
+    list->max_records = new_max;
+  }
+  rec = alloc_record();
+  if (!rec)
+    return;
+
+  clock_gettime(CLOCK_REALTIME, &now);
+  memset(rec, 0, offsetof(struct monitor_record_t, hostname));
+  strcpy(rec->facility, "mq_listener");
+  rec->timestamp = now.tv_sec;
+  rec->timestamp_ns = (unsigned long long)now.tv_sec * 1000000000ULL
+    + now.tv_nsec;
+  rec->pid = getpid();
+  rec->dom_type = LISTENER;
+  rec->op_type = LISTENER_STATS;
+  rec->fd = FD_NONE;
+  rec->offset = OFFSET_NONE;
+  rec->bytes_transferred = h->count;
+  rec->elapsed_time = h->count ? h->sum / scale / h->count : 0.0;
+  strncpy(rec->s1, name, sizeof(rec->s1) - 1);
+  format_histogram(rec->s2, sizeof(rec->s2), h, scale);
+  if (plugin) {
+    rec->error_code = plugin->refused;
+    n = strlen(rec->s2);
+    snprintf(rec->s2 + n, sizeof(rec->s2) - n,
+	     " refused=%llu skipped=%llu dropped=%llu",
+	     plugin->refused, plugin->skipped, plugin->dropped);
+  }
+  complete_record(rec, MONITOR_RECORD_WIRE_SIZE);
+  list->records[list->num_records++] = rec;
+}
+
+//*****************************************************************************
+
+static void add_plugin_record(const char* name, struct plugin_stats* stats,
+			      void* arg)
+{
+  char label[PATH_MAX];
+  snprintf(label, sizeof(label), "plugin:%s", name);
+  /* times of stage records are in ms, like elapsed_time of all records */
+  add_stat_record(arg, label, &stats->process_time, 1000000.0, stats);
+}
+
+//*****************************************************************************
+
+/* processes finding queue full wait about as long as listener needs to
+ * take a few records out of it; rounded to power of 2, so that block
+ * doesn't change with every small fluctuation */
+static void publish_retry_wait()
+{
+  const unsigned long long records = listener_stats.chain.count;
+  const unsigned long long busy_ns =
+    listener_stats.resolver.sum + listener_stats.chain.sum;
+  unsigned long long per_record_us;
+  unsigned int wait_us = MIN_RETRY_WAIT_US;
+
+  if (records < last_records || busy_ns < last_busy_ns) {
+    /* counters were reset */
+    last_records = records;
+    last_busy_ns = busy_ns;
+    return;
+  }
+  if (records - last_records < 100)
+    return;
+
+  per_record_us = (busy_ns - last_busy_ns) / (records - last_records) / 1000;
+  while (wait_us < 4 * per_record_us && wait_us < MAX_RETRY_WAIT_US)
+    wait_us *= 2;
+  last_records = records;
+  last_busy_ns = busy_ns;
+  set_monitor_retry_wait(wait_us);
+}
+
+//*****************************************************************************
+
+int listener_stats_tick(record_dispatch_fun sink)
+{
+  struct stat_records list = { NULL, 0, 0 };
+  unsigned long long queue_depth, ring_backlog;
+  time_t now = time(NULL);
+  int interval;
+  int i;
+
+  if (now == last_tick)
+    return 0;
+  last_tick = now;
+
+  if (__atomic_exchange_n(&reset_requested, 0, __ATOMIC_ACQUIRE)) {
+    memset(&listener_stats, 0, sizeof(listener_stats));
+    visit_plugin_stats(reset_plugin, NULL);
+  }
+
+  sample_backlog(&queue_depth, &ring_backlog);
+  histogram_add(&listener_stats.queue_depth, queue_depth);
+  histogram_add(&listener_stats.ring_backlog, ring_backlog);
+  if (stats_enabled)
+    publish_retry_wait();
+
+  interval = __atomic_load_n(&stats_interval, __ATOMIC_RELAXED);
+  if (!interval) {
+    last_emit = 0;
+    return 0;
+  }
+  /* first records come one interval after emitting is turned on */
+  if (!last_emit)
+    last_emit = now;
+  if (now - last_emit < interval)
+    return 0;
+  last_emit = now;
+
+  add_stat_record(&list, "receive_wait", &listener_stats.receive_wait,
+		  1000000.0, NULL);
+  add_stat_record(&list, "resolver", &listener_stats.resolver,
+		  1000000.0, NULL);
+  add_stat_record(&list, "chain", &listener_stats.chain, 1000000.0, NULL);
+  add_stat_record(&list, "queue_depth", &listener_stats.queue_depth,
+		  1.0, NULL);
+  add_stat_record(&list, "ring_backlog", &listener_stats.ring_backlog,
+		  1.0, NULL);
+  visit_plugin_stats(add_plugin_record, &list);
+
+  for (i = 0; i != list.num_records; ++i) {
+    sink(list.records[i]);
+    release_record(list.records[i]);
+  }
+  free(list.records);
+  return list.num_records;
+}
@@ -0,0 +1,87 @@
+//
+// Copyright (c) 2017 Intel Corporation
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+// implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef __LISTENER_STATS_H
+#define __LISTENER_STATS_H
+
+/* self-instrumentation of mq_listener: how long each stage of record
+ * processing takes, and how deep producer queues are */
+
+#include <time.h>
+#include "producers.h"
+
+/* log2 buckets; bucket i holds values in [2^(i-1), 2^i), last one also
+ * those from 2^63 */
+#define HISTOGRAM_BUCKETS 64
+
+struct histogram {
+  unsigned long long count;
+  unsigned long long sum;
+  unsigned long long max;
+  unsigned long long buckets[HISTOGRAM_BUCKETS];
+};
+
+/* stages of input loop; written only by ingest thread */
+struct listener_stats {
+  struct histogram receive_wait;   /* ns slept while all producers were empty */
+  struct histogram resolver;       /* ns spent tracking descriptors, per record */
+  struct histogram chain;          /* ns in plugin chain, per record */
+  struct histogram queue_depth;    /* messages in queue, sampled each second */
+  struct histogram ring_backlog;   /* records in all rings, sampled each second */
+};
+
+extern struct listener_stats listener_stats;
+
+/* timing costs two clock reads per measured stage; it can be turned off */
+extern int stats_enabled;
+
+static inline void histogram_add(struct histogram* h, unsigned long long value)
+{
+  h->count++;
+  h->sum += value;
+  if (value > h->max)
+    h->max = value;
+  int i = value ? 64 - __builtin_clzll(value) : 0;
+  if (i >= HISTOGRAM_BUCKETS)
+    i = HISTOGRAM_BUCKETS - 1;
+  h->buckets[i]++;
+}
+
+/* upper bound of bucket holding given fraction of values */
+unsigned long long histogram_percentile(const struct histogram* h,
+					double fraction);
+
+static inline unsigned long long stats_clock()
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (unsigned long long)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+/* emit LISTENER/LISTENER_STATS records each given number of seconds;
+ * 0 turns it off */
+void set_listener_stats_interval(int seconds);
+
+/* counters are cleared by ingest thread on its next tick */
+void reset_listener_stats();
+
+/* samples queue depths, applies pending reset, and passes stat records
+ * to sink when interval has passed; returns number of records made */
+int listener_stats_tick(record_dispatch_fun sink);
+
+void print_listener_stats();
+
+#endif
@@ -19,6 +19,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <time.h>
 #include <sys/types.h>
 #include <sys/ipc.h>
 #include <sys/msg.h>
@@ -34,17 +35,53 @@
 #include "plugin_chain.h"
 #include "command_parser.h"
 #include "resolver.h"
+#include "control_block.h"
+#include "record_pool.h"
+#include "producers.h"
+#include "reorder.h"
+#include "producer_stats.h"
+#include "listener_stats.h"
+#include "trace_replay.h"
+#include "utility_routines.h"
 
 static const int MESSAGE_QUEUE_PROJECT_ID = 'm';
 
+/* full records message queue should hold; 256 records take about 1 MB */
+#define DEFAULT_QUEUE_RECORDS 256
+static unsigned int queue_records = DEFAULT_QUEUE_RECORDS;
+
+/* polling interval bounds when no producer has records and rings are
+ * in use; with message queue only, listener blocks in msgrcv instead,
+ * at most IDLE_BLOCK_US (or MAX_IDLE_WAIT_US while ordering records) */
+#define MIN_IDLE_WAIT_US 50
+#define MAX_IDLE_WAIT_US 10000
+#define IDLE_BLOCK_US 1000000
+
 int c_mq_path(const char* name, const char** args, void* state);
 int c_load_plugin(const char* name, const char** args, void* state);
 int c_config(const char* name, const char** args, void* state);
 int c_help(const char* name, const char** args, void* state);
 int c_unload_plugin(const char* name, const char** args, void* state);
 int c_reorder_plugins(const char* name, const char** args, void* state);
+int c_branch_plugin(const char* name, const char** args, void* state);
 int c_list_plugins(const char* name, const char** args, void* state);
 int c_quit(const char* name, const char** args, void* state);
+int c_monitor_domains(const char* name, const char** args, void* state);
+int c_monitor_pause(const char* name, const char** args, void* state);
+int c_monitor_resume(const char* name, const char** args, void* state);
+int c_monitor_sampling(const char* name, const char** args, void* state);
+int c_monitor_pushdown(const char* name, const char** args, void* state);
+int c_monitor_status(const char* name, const char** args, void* state);
+int c_ring_dir(const char* name, const char** args, void* state);
+int c_producer_weight(const char* name, const char** args, void* state);
+int c_list_producers(const char* name, const char** args, void* state);
+int c_reorder_window(const char* name, const char** args, void* state);
+int c_producer_stats(const char* name, const char** args, void* state);
+int c_producer_stats_interval(const char* name, const char** args, void* state);
+int c_stats(const char* name, const char** args, void* state);
+int c_stats_interval(const char* name, const char** args, void* state);
+int c_mq_size(const char* name, const char** args, void* state);
+int c_replay(const char* name, const char** args, void* state);
 
 struct command commands[] =
   {
@@ -65,6 +102,13 @@ struct command commands[] =
      "It is required to give exhaustive list of all plugins that are loaded; otherwise "
      "command will be rejected",
      c_reorder_plugins,1},
+    {"branch-plugin", "b",
+     "<plugin> <queue-size> <block | drop | spill <file>>",
+     "Run output plugin in its own thread, fed through a queue of given size,"
+     " so that it runs at its own speed. When queue is full, ingestion waits"
+     " (block), record is dropped (drop) or records go to file until plugin"
+     " catches up (spill). Branch lasts until plugin is unloaded",
+     c_branch_plugin,0},
     {"list-plugins", "l","",
      "list currently loaded plugins",
      c_list_plugins,1},
@@ -76,10 +120,87 @@ struct command commands[] =
      "<path>",
      "Select message queue file. This parameter is mandatory unless config file is used",
     c_mq_path,0},
+    {"mq-size", "mqs",
+     "<records>",
+     "Make message queue hold given number of records (default 256), as far"
+     " as system limits allow. Give it before --mq-path",
+     c_mq_size,0},
     {"config", "c",
      "<path>",
      "Start mq_listener with particular config file",
      c_config,0},
+    {"monitor-domains", "md",
+     "<comma separated list of domains, ALL or default>",
+     "Change domains captured by monitored processes without restarting them;"
+     " 'default' returns to MONITOR_DOMAINS of each process",
+     c_monitor_domains,0},
+    {"monitor-pause", "mp",
+     "",
+     "Stop generating records in monitored processes",
+     c_monitor_pause,0},
+    {"monitor-resume", "mr",
+     "",
+     "Resume generating records in monitored processes",
+     c_monitor_resume,0},
+    {"monitor-sampling", "ms",
+     "count <frequency> | time <frequency> <duration> | off | default",
+     "Change sampling of monitored processes; 'default' returns to"
+     " COUNT_SAMPLE_FREQUENCY/TIME_SAMPLE_* of each process",
+     c_monitor_sampling,0},
+    {"monitor-pushdown", "mpd",
+     "<on|off>",
+     "Push interest of loaded plugins down to monitored processes, so that"
+     " records no plugin would see are never generated (default on)",
+     c_monitor_pushdown,0},
+    {"monitor-status", "mst",
+     "",
+     "Print settings currently published to monitored processes",
+     c_monitor_status,1},
+    {"ring-dir", "rd",
+     "<path>",
+     "Also receive records from per-process rings which processes started"
+     " with MONITOR_RING_DIR=<path> create there",
+     c_ring_dir,0},
+    {"producer-weight", "pw",
+     "<pid or 'queue'> <weight>",
+     "Give producer bigger share of each receive round (default 1)",
+     c_producer_weight,1},
+    {"list-producers", "lp",
+     "",
+     "Print backlog, drops and delivered records of each producer",
+     c_list_producers,1},
+    {"reorder-window", "rw",
+     "[<milliseconds> | off]",
+     "Pass records to plugins ordered by time across all producers, holding"
+     " each record for given time; without argument print ordering counters",
+     c_reorder_window,0},
+    {"producer-stats", "ps",
+     "",
+     "Print received, lost and reordered records and delivery latency of"
+     " each monitored process",
+     c_producer_stats,1},
+    {"producer-stats-interval", "psi",
+     "<seconds | off>",
+     "Pass LISTENER/PRODUCER_STATS record of each active process to plugins"
+     " every given number of seconds",
+     c_producer_stats_interval,0},
+    {"stats", "st",
+     "[reset | timing <on|off>]",
+     "Print time spent in each stage of mq_listener and in each plugin,"
+     " paused plugins and depth of producer queues",
+     c_stats,0},
+    {"stats-interval", "sti",
+     "<seconds | off>",
+     "Pass LISTENER/LISTENER_STATS record of each stage and plugin to"
+     " plugins every given number of seconds",
+     c_stats_interval,0},
+    {"replay", "rp",
+     "<trace-file> [fast | <speed>] [<pid>]",
+     "Pass records of trace written by output_trace plugin to plugins, as"
+     " fast as they take them (fast, default) or at original pace multiplied"
+     " by speed; optionally only records of given process. Without message"
+     " queue mq_listener quits after replay",
+     c_replay,0},
     {"help", "h",
      "",
      "Print help message",
@@ -102,13 +223,25 @@ int main(int argc, char** argv)
   if (rc) {
     return rc;
   } else {
+    char hostname[HOSTNAME_LEN];
+
+    memset(hostname, 0, HOSTNAME_LEN);
+    gethostname(hostname, HOSTNAME_LEN - 1);
+    init_record_pool(hostname);
+
     if (message_queue_id == -1) {
+      /* offline analysis of recorded trace */
+      if (run_requested_replay()) {
+        unload_all_plugins();
+        return 0;
+      }
       fprintf(stderr, "You need to provide message queue either "
 	      "via config file or via --mq-path/-m command line option\n");
       return 1;
     }
     show_runtime_commands = 1;
     capture_device_info();
+    monitor_control_ready();
     return input_loop();
   }
   
@@ -119,52 +252,99 @@ int main(int argc, char** argv)
 
 //*****************************************************************************
 
-int input_loop()
+void dispatch_record(struct monitor_record_t* rec)
 {
-   MONITOR_MESSAGE monitor_message;
-   ssize_t message_size_received;
-   char hostname[HOSTNAME_LEN];
+   const unsigned long long start = stats_enabled ? stats_clock() : 0;
+   unsigned long long resolved;
+
+   // track paths, descriptors, devices
+
+   if (rec->dom_type == FILE_OPEN_CLOSE) {
+      if (rec->op_type == OPEN) {
+         register_file(rec);
+         resolve_file(rec);
+      } else if (rec->op_type == CLOSE) {
+         resolve_file(rec);
+         deregister_file(rec);
+      }
+   } else if ((rec->dom_type == FILE_READ) ||
+              (rec->dom_type == FILE_WRITE) ||
+              (rec->dom_type == FILE_METADATA) ||
+              (rec->dom_type == FILE_SPACE) ||
+              (rec->dom_type == SYNCS)) {
+      resolve_file(rec);
+   } else if ((rec->dom_type == START_STOP) &&
+              ((rec->op_type == START) || (rec->op_type == STOP))) {
+      // descriptors of a process that reused pid are not those of the
+      // one before, whose STOP may have been lost
+      forget_process(rec);
+   }
 
-   memset(hostname, 0, HOSTNAME_LEN);
-   gethostname(hostname, HOSTNAME_LEN);
+   if (!start) {
+      execute_plugin_chain(rec);
+      return;
+   }
+   resolved = stats_clock();
+   histogram_add(&listener_stats.resolver, resolved - start);
+   execute_plugin_chain(rec);
+   histogram_add(&listener_stats.chain, stats_clock() - resolved);
+}
+
+//*****************************************************************************
+
+int input_loop()
+{
+   useconds_t idle_wait = 0;
+   unsigned long long wait_start;
+   time_t last_flush = 0;
 
    while (1) {
-      memset(&monitor_message, 0, sizeof(MONITOR_MESSAGE));
-      message_size_received =
-         msgrcv(message_queue_id,
-                &monitor_message,  // void* ptr
-                sizeof(struct monitor_record_t),  // size_t nbytes
-                0,   // long type
-                0);  // int flag
-      if (message_size_received > 0) {
-        // populate host name
-        strncpy(monitor_message.monitor_record.hostname,
-                hostname,
-                HOSTNAME_LEN);
-
-        // track paths, descriptors, devices
-	
-        if (monitor_message.monitor_record.dom_type == FILE_OPEN_CLOSE) {
-           if (monitor_message.monitor_record.op_type == OPEN) {
-              register_file(&monitor_message.monitor_record);
-              resolve_file(&monitor_message.monitor_record);
-           } else if (monitor_message.monitor_record.op_type == CLOSE) {
-              resolve_file(&monitor_message.monitor_record);
-              deregister_file(&monitor_message.monitor_record);
-           }
-        } else if ((monitor_message.monitor_record.dom_type == FILE_READ) ||
-                   (monitor_message.monitor_record.dom_type == FILE_WRITE) ||
-                   (monitor_message.monitor_record.dom_type == FILE_METADATA) ||
-                   (monitor_message.monitor_record.dom_type == FILE_SPACE) ||
-                   (monitor_message.monitor_record.dom_type == SYNCS)) {
-           resolve_file(&monitor_message.monitor_record);
-        }
-
-	execute_plugin_chain(&monitor_message.monitor_record);
+      // live records wait in their queues meanwhile
+      if (run_requested_replay()) {
+         idle_wait = 0;
+         continue;
+      }
+
+
+      // also drains held records after ordering is turned off. new
+      // records go through reorder stage until none is held, so that
+      // they can't overtake held ones
+      int received = flush_reordered(dispatch_record);
+      record_dispatch_fun sink = (get_reorder_window() || reorder_held()) ?
+         reorder_record : dispatch_record;
+      received += receive_round(sink);
+      received += emit_producer_stats(sink);
+      received += listener_stats_tick(sink);
+      if (received) {
+         idle_wait = 0;
+         continue;
+      }
+
+      // all sources are empty; wait for next record, or back off when
+      // rings have to be polled, so that idle listener doesn't spin.
+      // plugins holding data back (i.e. until window ends) are
+      // flushed again every second while idle
+      if (idle_wait == 0) {
+         flush_plugin_chain();
+         last_flush = time(NULL);
+         idle_wait = MIN_IDLE_WAIT_US;
       } else {
-	fprintf(stderr, "rc = %zu\n", message_size_received);
-	fprintf(stderr, "errno = %d\n", errno);
+         if (idle_wait < MAX_IDLE_WAIT_US) {
+            idle_wait *= 2;
+         }
+         if (time(NULL) != last_flush) {
+            flush_plugin_chain();
+            last_flush = time(NULL);
+         }
+      }
+      wait_start = stats_clock();
+      if (rings_in_use()) {
+         usleep(idle_wait);
+      } else if (wait_message_queue(sink, get_reorder_window() ?
+                                    MAX_IDLE_WAIT_US : IDLE_BLOCK_US)) {
+         idle_wait = 0;
       }
+      histogram_add(&listener_stats.receive_wait, stats_clock() - wait_start);
    }
 }
 
@@ -195,6 +375,12 @@ int c_mq_path(const char* name, const char** args, void* state)
     fprintf(stderr, "errno: %d\n", errno);
     return 1;
   }
+
+  set_message_queue_source(message_queue_id);
+
+  /* without control block monitored processes just use their environment */
+  attach_monitor_control(message_queue_path);
+  set_monitor_queue_capacity(size_message_queue(queue_records));
   return 0;
 }
 
@@ -286,7 +472,50 @@ int c_unload_plugin(const char* name, const char** args, void* state)
 
 int c_reorder_plugins(const char* name, const char** args, void* state)
 {
-  puts("Command not yet implemented");
+  const char* names[128];
+  char* list;
+  char* rest;
+  char* token;
+  int n = 0;
+  int rc;
+
+  if (!args[0]) {
+    fprintf(stderr, "Argument missing: comma separated list of plugins.\n");
+    return 1;
+  }
+  list = strdup(args[0]);
+  rest = list;
+  while ((token = strtok_r(rest, ",", &rest)) && n != 127)
+    names[n++] = token;
+  names[n] = NULL;
+  rc = reorder_plugins(names);
+  free(list);
+  return rc;
+}
+
+//*****************************************************************************
+
+int c_branch_plugin(const char* name, const char** args, void* state)
+{
+  enum branch_policy policy;
+
+  if (!args[0] || !args[1] || atoi(args[1]) <= 0 || !args[2]) {
+    fprintf(stderr, "Usage: branch-plugin <plugin> <queue-size>"
+	    " <block | drop | spill <file>>\n");
+    return 1;
+  }
+  if (!strcmp(args[2], "block")) {
+    policy = BRANCH_BLOCK;
+  } else if (!strcmp(args[2], "drop")) {
+    policy = BRANCH_DROP;
+  } else if (!strcmp(args[2], "spill") && args[3]) {
+    policy = BRANCH_SPILL;
+  } else {
+    fprintf(stderr, "error: overflow policy must be block, drop"
+	    " or spill <file>\n");
+    return 1;
+  }
+  return branch_plugin(args[0], atoi(args[1]), policy, args[3]);
 }
 //*****************************************************************************
 
@@ -310,3 +539,219 @@ int c_quit(const char* name, const char** args, void* state)
   unload_all_plugins();
   exit(1);
 }
+
+//*****************************************************************************
+
+int c_monitor_domains(const char* name, const char** args, void* state)
+{
+  if (!args[0]) {
+    fprintf(stderr, "Argument missing: list of domains.\n");
+    return 1;
+  }
+  if (!strcmp(args[0], "default")) {
+    set_monitor_domains(0, 0);
+  } else {
+    set_monitor_domains(domain_list_to_bit_mask(args[0]), 1);
+  }
+  return 0;
+}
+
+//*****************************************************************************
+
+int c_monitor_pause(const char* name, const char** args, void* state)
+{
+  set_monitor_paused(1);
+  return 0;
+}
+
+//*****************************************************************************
+
+int c_monitor_resume(const char* name, const char** args, void* state)
+{
+  set_monitor_paused(0);
+  return 0;
+}
+
+//*****************************************************************************
+
+int c_monitor_sampling(const char* name, const char** args, void* state)
+{
+  if (args[0] && !strcmp(args[0], "count") && args[1]) {
+    set_monitor_sampling(atol(args[1]), 0, 0, 1);
+  } else if (args[0] && !strcmp(args[0], "time") && args[1] && args[2]) {
+    set_monitor_sampling(0, atol(args[1]), atol(args[2]), 1);
+  } else if (args[0] && !strcmp(args[0], "off")) {
+    set_monitor_sampling(0, 0, 0, 1);
+  } else if (args[0] && !strcmp(args[0], "default")) {
+    set_monitor_sampling(0, 0, 0, 0);
+  } else {
+    fprintf(stderr, "Usage: monitor-sampling count <frequency> |"
+	    " time <frequency> <duration> | off | default\n");
+    return 1;
+  }
+  return 0;
+}
+
+//*****************************************************************************
+
+int c_monitor_pushdown(const char* name, const char** args, void* state)
+{
+  if (args[0] && !strcmp(args[0], "on")) {
+    set_monitor_pushdown(1);
+  } else if (args[0] && !strcmp(args[0], "off")) {
+    set_monitor_pushdown(0);
+  } else {
+    fprintf(stderr, "Usage: monitor-pushdown <on|off>\n");
+    return 1;
+  }
+  return 0;
+}
+
+//*****************************************************************************
+
+int c_monitor_status(const char* name, const char** args, void* state)
+{
+  print_monitor_control();
+  return 0;
+}
+
+//*****************************************************************************
+
+int c_ring_dir(const char* name, const char** args, void* state)
+{
+  if (!args[0]) {
+    fprintf(stderr, "Argument missing: ring directory.\n");
+    return 1;
+  }
+  return set_ring_dir(args[0]);
+}
+
+//*****************************************************************************
+
+int c_producer_weight(const char* name, const char** args, void* state)
+{
+  if (!args[0] || !args[1]) {
+    fprintf(stderr, "Usage: producer-weight <pid or 'queue'> <weight>\n");
+    return 1;
+  }
+  return set_producer_weight(strcmp(args[0], "queue") ? atoi(args[0]) : 0,
+			     atoi(args[1]));
+}
+
+//*****************************************************************************
+
+int c_list_producers(const char* name, const char** args, void* state)
+{
+  print_producers();
+  return 0;
+}
+
+//*****************************************************************************
+
+int c_reorder_window(const char* name, const char** args, void* state)
+{
+  if (!args[0]) {
+    print_reorder_stats();
+  } else if (!strcmp(args[0], "off")) {
+    set_reorder_window(0);
+  } else if (atof(args[0]) > 0) {
+    set_reorder_window((long long)(atof(args[0]) * 1000000.0));
+  } else {
+    fprintf(stderr, "Usage: reorder-window [<milliseconds> | off]\n");
+    return 1;
+  }
+  return 0;
+}
+
+//*****************************************************************************
+
+int c_producer_stats(const char* name, const char** args, void* state)
+{
+  print_producer_stats();
+  return 0;
+}
+
+//*****************************************************************************
+
+int c_producer_stats_interval(const char* name, const char** args, void* state)
+{
+  if (args[0] && !strcmp(args[0], "off")) {
+    set_producer_stats_interval(0);
+  } else if (args[0] && atoi(args[0]) > 0) {
+    set_producer_stats_interval(atoi(args[0]));
+  } else {
+    fprintf(stderr, "Usage: producer-stats-interval <seconds | off>\n");
+    return 1;
+  }
+  return 0;
+}
+
+//*****************************************************************************
+
+int c_stats(const char* name, const char** args, void* state)
+{
+  if (!args[0]) {
+    print_listener_stats();
+  } else if (!strcmp(args[0], "reset")) {
+    reset_listener_stats();
+  } else if (!strcmp(args[0], "timing") && args[1] && !strcmp(args[1], "on")) {
+    stats_enabled = 1;
+  } else if (!strcmp(args[0], "timing") && args[1] && !strcmp(args[1], "off")) {
+    stats_enabled = 0;
+  } else {
+    fprintf(stderr, "Usage: stats [reset | timing <on|off>]\n");
+    return 1;
+  }
+  return 0;
+}
+
+//*****************************************************************************
+
+int c_stats_interval(const char* name, const char** args, void* state)
+{
+  if (args[0] && !strcmp(args[0], "off")) {
+    set_listener_stats_interval(0);
+  } else if (args[0] && atoi(args[0]) > 0) {
+    set_listener_stats_interval(atoi(args[0]));
+  } else {
+    fprintf(stderr, "Usage: stats-interval <seconds | off>\n");
+    return 1;
+  }
+  return 0;
+}
+
+//*****************************************************************************
+
+int c_mq_size(const char* name, const char** args, void* state)
+{
+  if (!args[0] || atoi(args[0]) <= 0) {
+    fprintf(stderr, "Usage: mq-size <records>\n");
+    return 1;
+  }
+  queue_records = atoi(args[0]);
+  /* queue may already be open when command comes at runtime */
+  if (message_queue_id != -1)
+    set_monitor_queue_capacity(size_message_queue(queue_records));
+  return 0;
+}
+
+//*****************************************************************************
+
+int c_replay(const char* name, const char** args, void* state)
+{
+  double speed = 0;
+  int pid = 0;
+
+  if (!args[0] ||
+      (args[1] && strcmp(args[1], "fast") && atof(args[1]) <= 0) ||
+      (args[1] && args[2] && atoi(args[2]) <= 0)) {
+    fprintf(stderr, "Usage: replay <trace-file> [fast | <speed>] [<pid>]\n");
+    return 1;
+  }
+  if (args[1] && strcmp(args[1], "fast"))
+    speed = atof(args[1]);
+  if (args[1] && args[2])
+    pid = atoi(args[2]);
+  request_replay(args[0], speed, pid);
+  return 0;
+}
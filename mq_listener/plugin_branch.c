@@ -0,0 +1,371 @@
+//
+// Copyright (c) 2017 Intel Corporation
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+// implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "mq.h"
+#include "plugin.h"
+#include "plugin_chain.h"
+#include "record_pool.h"
+#include "plugin_branch.h"
+
+/* how long idle branch sleeps before checking queue again, in case
+ * wakeup was missed */
+#define BRANCH_IDLE_WAIT_NS 10000000
+/* how long ingest thread sleeps while blocked on full queue */
+#define BRANCH_BLOCK_WAIT_US 20
+
+struct plugin_branch {
+  struct plugin_chain* plugin;
+  enum branch_policy policy;
+  unsigned int queue_size;               /* power of 2 */
+  struct monitor_record_t** queue;
+
+  /* producer and consumer positions on separate cache lines */
+  unsigned long long head __attribute__((aligned(64)));  /* ingest thread */
+  unsigned long long tail __attribute__((aligned(64)));  /* branch thread */
+
+  int waiting __attribute__((aligned(64)));  /* branch thread is asleep */
+  int stopping;
+  pthread_mutex_t wake_mutex;
+  pthread_cond_t wake;
+  pthread_t thread;
+
+  /* with BRANCH_SPILL, once queue fills up all records go to spill file
+   * until branch has read them back; this keeps records in order */
+  char* spill_path;
+  FILE* spill_out;
+  FILE* spill_in;
+  int spilling;
+  unsigned long long spill_written;
+  unsigned long long spill_read;
+  pthread_mutex_t spill_mutex;
+
+  /* written by ingest thread */
+  unsigned long long pushed;
+  unsigned long long dropped;
+  unsigned long long spilled;
+  unsigned long long blocked;
+  unsigned long long high_water;
+};
+
+//*****************************************************************************
+
+/* same handling of paused plugin as in execute_plugin_chain() */
+static void run_plugin(struct plugin_chain* p, struct monitor_record_t* rec)
+{
+  unsigned long long start;
+  int rc_plugin;
+
+  if (p->plugin_paused) {
+    if (p->pfn_ok_to_accept_data(p->state) == PLUGIN_ACCEPT_DATA)
+      p->plugin_paused = 0;
+  }
+  if (p->plugin_paused) {
+    p->stats.skipped++;
+    return;
+  }
+
+  start = stats_enabled ? stats_clock() : 0;
+  rc_plugin = p->pfn_process_data(rec, p->state);
+  if (start)
+    histogram_add(&p->stats.process_time, stats_clock() - start);
+  if (rc_plugin == PLUGIN_REFUSE_DATA) {
+    p->plugin_paused = 1;
+    p->stats.refused++;
+  }
+  /* nothing after branch depends on it, so drop has no effect */
+  if (rc_plugin == PLUGIN_DROP_DATA)
+    p->stats.dropped++;
+}
+
+//*****************************************************************************
+
+/* returns record read back from spill file, or NULL when branch caught
+ * up with spilling (which is then ended) */
+static struct monitor_record_t* unspill(struct plugin_branch* b)
+{
+  struct monitor_record_t* rec = NULL;
+
+  pthread_mutex_lock(&b->spill_mutex);
+  if (b->spill_read < b->spill_written) {
+    fflush(b->spill_out);
+    rec = alloc_record();
+    /* whole record, as host and device were filled in by listener (or
+     * come from a replayed trace) and differ from those of pool */
+    if (rec && fread(rec, sizeof(struct monitor_record_t), 1, b->spill_in) != 1) {
+      fprintf(stderr, "error: unable to read back spilled record from %s\n",
+	      b->spill_path);
+      release_record(rec);
+      rec = NULL;
+    }
+    b->spill_read++;
+  }
+  if (b->spill_read == b->spill_written) {
+    /* queue is empty as well, since ingest only spills meanwhile */
+    if (ftruncate(fileno(b->spill_out), 0) == 0) {
+      rewind(b->spill_out);
+      rewind(b->spill_in);
+    }
+    b->spill_read = b->spill_written = 0;
+    __atomic_store_n(&b->spilling, 0, __ATOMIC_SEQ_CST);
+  }
+  pthread_mutex_unlock(&b->spill_mutex);
+  return rec;
+}
+
+//*****************************************************************************
+
+static void* branch_thread(void* arg)
+{
+  struct plugin_branch* b = arg;
+  struct monitor_record_t* rec;
+  struct timespec deadline;
+  int unflushed = 0;
+
+  for (;;) {
+    const unsigned long long tail = b->tail;
+    if (tail != __atomic_load_n(&b->head, __ATOMIC_ACQUIRE)) {
+      rec = b->queue[tail & (b->queue_size - 1)];
+      __atomic_store_n(&b->tail, tail + 1, __ATOMIC_RELEASE);
+      run_plugin(b->plugin, rec);
+      release_record(rec);
+      unflushed = 1;
+      continue;
+    }
+
+    if (__atomic_load_n(&b->spilling, __ATOMIC_ACQUIRE)) {
+      rec = unspill(b);
+      if (rec) {
+	run_plugin(b->plugin, rec);
+	release_record(rec);
+	unflushed = 1;
+      }
+      continue;
+    }
+
+    /* queue ran dry; let plugin write out what it buffered */
+    if (unflushed && b->plugin->pfn_flush_plugin) {
+      b->plugin->pfn_flush_plugin(b->plugin->state);
+      unflushed = 0;
+      continue;
+    }
+
+    if (__atomic_load_n(&b->stopping, __ATOMIC_ACQUIRE))
+      break;
+
+    /* announce sleep, then look once more, so that ingest thread either
+     * sees us waiting or we see its record */
+    pthread_mutex_lock(&b->wake_mutex);
+    __atomic_store_n(&b->waiting, 1, __ATOMIC_SEQ_CST);
+    if (b->tail == __atomic_load_n(&b->head, __ATOMIC_SEQ_CST) &&
+	!__atomic_load_n(&b->spilling, __ATOMIC_SEQ_CST) &&
+	!__atomic_load_n(&b->stopping, __ATOMIC_SEQ_CST)) {
+      clock_gettime(CLOCK_REALTIME, &deadline);
+      deadline.tv_nsec += BRANCH_IDLE_WAIT_NS;
+      if (deadline.tv_nsec >= 1000000000) {
+	deadline.tv_sec++;
+	deadline.tv_nsec -= 1000000000;
+      }
+      pthread_cond_timedwait(&b->wake, &b->wake_mutex, &deadline);
+    }
+    __atomic_store_n(&b->waiting, 0, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&b->wake_mutex);
+  }
+  return NULL;
+}
+
+//*****************************************************************************
+
+static void wake_branch(struct plugin_branch* b)
+{
+  if (__atomic_load_n(&b->waiting, __ATOMIC_SEQ_CST)) {
+    pthread_mutex_lock(&b->wake_mutex);
+    pthread_cond_signal(&b->wake);
+    pthread_mutex_unlock(&b->wake_mutex);
+  }
+}
+
+//*****************************************************************************
+
+struct plugin_branch* start_branch(struct plugin_chain* plugin,
+				   unsigned int queue_size,
+				   enum branch_policy policy,
+				   const char* spill_path)
+{
+  struct plugin_branch* b = calloc(1, sizeof(struct plugin_branch));
+  unsigned int size = 2;
+
+  if (!b)
+    return NULL;
+  while (size < queue_size && size < (1U << 24))
+    size *= 2;
+  b->plugin = plugin;
+  b->policy = policy;
+  b->queue_size = size;
+  b->queue = malloc(size * sizeof(struct monitor_record_t*));
+  if (!b->queue) {
+    free(b);
+    return NULL;
+  }
+  pthread_mutex_init(&b->wake_mutex, NULL);
+  pthread_cond_init(&b->wake, NULL);
+  pthread_mutex_init(&b->spill_mutex, NULL);
+
+  if (policy == BRANCH_SPILL) {
+    b->spill_path = strdup(spill_path);
+    b->spill_out = fopen(spill_path, "w+b");
+    b->spill_in = b->spill_out ? fopen(spill_path, "rb") : NULL;
+    if (!b->spill_in) {
+      fprintf(stderr, "error: unable to open spill file '%s'\n", spill_path);
+      fprintf(stderr, "errno: %d\n", errno);
+      if (b->spill_out)
+	fclose(b->spill_out);
+      free(b->spill_path);
+      free(b->queue);
+      free(b);
+      return NULL;
+    }
+  }
+
+  if (pthread_create(&b->thread, NULL, branch_thread, b)) {
+    fprintf(stderr, "error: unable to start thread for plugin %s\n",
+	    plugin->plugin_library);
+    if (b->spill_in) {
+      fclose(b->spill_in);
+      fclose(b->spill_out);
+      unlink(b->spill_path);
+    }
+    free(b->spill_path);
+    free(b->queue);
+    free(b);
+    return NULL;
+  }
+  return b;
+}
+
+//*****************************************************************************
+
+/* returns 1 if record went to spill file, 0 if spilling has just ended
+ * and record should go to queue after all */
+static int spill_record(struct plugin_branch* b, struct monitor_record_t* rec)
+{
+  int spilled = 0;
+
+  pthread_mutex_lock(&b->spill_mutex);
+  if (b->spilling) {
+    if (fwrite(rec, sizeof(struct monitor_record_t), 1, b->spill_out) == 1) {
+      b->spill_written++;
+      b->spilled++;
+    } else {
+      b->dropped++;
+    }
+    spilled = 1;
+  }
+  pthread_mutex_unlock(&b->spill_mutex);
+  return spilled;
+}
+
+//*****************************************************************************
+
+void push_to_branch(struct plugin_branch* b, struct monitor_record_t* rec,
+		    int copy)
+{
+  const unsigned long long head = b->head;
+  unsigned long long backlog;
+  int blocked = 0;
+
+  for (;;) {
+    if (__atomic_load_n(&b->spilling, __ATOMIC_ACQUIRE) && spill_record(b, rec)) {
+      wake_branch(b);
+      return;
+    }
+    backlog = head - __atomic_load_n(&b->tail, __ATOMIC_ACQUIRE);
+    if (backlog < b->queue_size)
+      break;
+
+    if (b->policy == BRANCH_DROP) {
+      b->dropped++;
+      return;
+    } else if (b->policy == BRANCH_SPILL) {
+      __atomic_store_n(&b->spilling, 1, __ATOMIC_RELEASE);
+    } else {
+      if (!blocked++)
+	b->blocked++;
+      wake_branch(b);
+      usleep(BRANCH_BLOCK_WAIT_US);
+    }
+  }
+
+  if (copy) {
+    rec = copy_record(rec);
+    if (!rec) {
+      b->dropped++;
+      return;
+    }
+  } else {
+    retain_record(rec);
+  }
+  b->queue[head & (b->queue_size - 1)] = rec;
+  __atomic_store_n(&b->head, head + 1, __ATOMIC_SEQ_CST);
+  b->pushed++;
+  if (backlog + 1 > b->high_water)
+    b->high_water = backlog + 1;
+  wake_branch(b);
+}
+
+//*****************************************************************************
+
+void stop_branch(struct plugin_branch* b)
+{
+  pthread_mutex_lock(&b->wake_mutex);
+  __atomic_store_n(&b->stopping, 1, __ATOMIC_SEQ_CST);
+  pthread_cond_signal(&b->wake);
+  pthread_mutex_unlock(&b->wake_mutex);
+  pthread_join(b->thread, NULL);
+
+  if (b->spill_in) {
+    fclose(b->spill_in);
+    fclose(b->spill_out);
+    unlink(b->spill_path);
+  }
+  pthread_cond_destroy(&b->wake);
+  pthread_mutex_destroy(&b->wake_mutex);
+  pthread_mutex_destroy(&b->spill_mutex);
+  free(b->spill_path);
+  free(b->queue);
+  free(b);
+}
+
+//*****************************************************************************
+
+void describe_branch(struct plugin_branch* b, char* buf, size_t size)
+{
+  static const char* policies[] = { "block", "drop", "spill" };
+
+  snprintf(buf, size, "branch %s queue=%u queued=%llu high=%llu pushed=%llu"
+	   " blocked=%llu dropped=%llu spilled=%llu",
+	   policies[b->policy], b->queue_size,
+	   __atomic_load_n(&b->head, __ATOMIC_RELAXED)
+	   - __atomic_load_n(&b->tail, __ATOMIC_RELAXED),
+	   b->high_water, b->pushed, b->blocked, b->dropped, b->spilled);
+}
@@ -0,0 +1,54 @@
+//
+// Copyright (c) 2017 Intel Corporation
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+// implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef __PLUGIN_BRANCH_H
+#define __PLUGIN_BRANCH_H
+
+/* output plugin running in its own thread. Plugin chain hands records
+ * to branch through a bounded single producer/single consumer queue
+ * instead of calling plugin, so a slow sink doesn't hold up ingestion
+ * nor plugins after it. What happens when queue is full is decided by
+ * overflow policy of branch */
+
+enum branch_policy {
+  BRANCH_BLOCK,   /* wait for room; nothing is lost */
+  BRANCH_DROP,    /* drop record and count it */
+  BRANCH_SPILL    /* append records to spill file until branch catches up */
+};
+
+struct plugin_chain;
+struct plugin_branch;
+
+/* starts thread for plugin; queue_size is rounded up to power of 2.
+ * spill_path is required for BRANCH_SPILL. NULL on failure */
+struct plugin_branch* start_branch(struct plugin_chain* plugin,
+				   unsigned int queue_size,
+				   enum branch_policy policy,
+				   const char* spill_path);
+
+/* called by ingest thread only; takes its own reference to record, or
+ * a copy of it when plugins after branch in chain may still modify it */
+void push_to_branch(struct plugin_branch* branch,
+		    struct monitor_record_t* rec, int copy);
+
+/* lets branch process everything queued and spilled, then joins its
+ * thread. Branch must no longer be reachable from published chain */
+void stop_branch(struct plugin_branch* branch);
+
+/* short description of policy and counters, for listing plugins */
+void describe_branch(struct plugin_branch* branch, char* buf, size_t size);
+
+#endif
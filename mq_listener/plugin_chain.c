@@ -32,57 +32,416 @@
 #include "plugin.h"
 #include "plugin_chain.h"
 #include "command_parser.h"
+#include "control_block.h"
+#include "record_pool.h"
 
-/* global mutex for plugin items, to prevent plugin chain alteration from happening
- * during plugin execution */
+/* global mutex for plugin items; serializes writers (load, unload and
+ * listing of plugins). execute_plugin_chain() never takes it - it reads
+ * the published snapshot below instead */
 pthread_mutex_t plugin_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 #define plugins_lock() pthread_mutex_lock(&plugin_mutex)
 #define plugins_unlock() pthread_mutex_unlock(&plugin_mutex)
 
+/* master list of plugins; only accessed with plugin_mutex held */
 struct plugin_chain* plugins = NULL;
 
+/* immutable array view of the plugin chain. A new snapshot is built
+ * every time the chain changes and swapped in atomically; the old one
+ * (and any unloaded plugins) are released once a grace period has
+ * elapsed, so readers never see freed memory or an unmapped library */
+struct plugin_slot {
+  PFN_PROCESS_DATA pfn_process_data;
+  PFN_OK_TO_ACCEPT_DATA pfn_ok_to_accept_data;
+  PFN_FLUSH_PLUGIN pfn_flush_plugin;
+  void* state;
+  unsigned int domain_mask;
+  int drop_uninteresting;
+  struct plugin_branch* branch;
+  int branch_copies;          /* plugins after branch may modify record */
+  struct plugin_chain* plugin;
+};
+
+/* per-operation dispatch lists hold indexes of slots interested in given
+ * operation, in chain order, terminated by one of the markers below.
+ * Records with out of range op_type use list number END_OPS */
+#define DISPATCH_END  0xffff
+#define DISPATCH_DROP 0xfffe
+#define DISPATCH_LISTS (END_OPS + 1)
+
+struct plugin_snapshot {
+  int num_plugins;
+  struct plugin_interest interest;  /* see get_chain_interest() */
+  const unsigned short* dispatch[DISPATCH_LISTS];
+  struct plugin_slot slots[];
+};
+
+static const unsigned short empty_dispatch_list[] = { DISPATCH_END };
+static struct plugin_snapshot empty_snapshot =
+{
+  .dispatch = { [0 ... END_OPS] = empty_dispatch_list }
+};
+static struct plugin_snapshot* current_snapshot = &empty_snapshot;
+
+/* grace period tracking: readers announce themselves in one of two
+ * counters selected by the parity of chain_epoch. Writer flips the
+ * epoch twice and waits for each old counter to drain, after which
+ * no reader can still hold a pointer to a retired snapshot */
+static unsigned long chain_epoch = 0;
+static long chain_readers[2] = { 0, 0 };
+
+static inline int chain_read_lock()
+{
+  int idx = __atomic_load_n(&chain_epoch, __ATOMIC_SEQ_CST) & 1;
+  __atomic_fetch_add(&chain_readers[idx], 1, __ATOMIC_SEQ_CST);
+  return idx;
+}
+
+static inline void chain_read_unlock(int idx)
+{
+  __atomic_fetch_sub(&chain_readers[idx], 1, __ATOMIC_RELEASE);
+}
+
+/* waits until all readers which might have seen previously published
+ * snapshot are gone. Must be called with plugin_mutex held and never
+ * from within process_data() */
+static void synchronize_plugin_chain()
+{
+  int phase;
+  for (phase = 0; phase != 2; ++phase) {
+    int idx = __atomic_fetch_add(&chain_epoch, 1, __ATOMIC_SEQ_CST) & 1;
+    while (__atomic_load_n(&chain_readers[idx], __ATOMIC_ACQUIRE))
+      usleep(50);
+  }
+}
+
+static void set_full_interest(struct plugin_interest* interest)
+{
+  memset(interest, 0xff, sizeof(*interest));
+  interest->wants_strings = 1;
+  interest->drop_uninteresting = 0;
+}
+
+static inline int interest_has_op(const struct plugin_interest* interest,
+                                  int op)
+{
+  if (op >= END_OPS) {
+    /* unknown operation is only of interest to plugins wanting all */
+    int i;
+    for (i = 0; i != OP_MASK_WORDS; ++i)
+      if (interest->op_mask[i] != ~0U)
+        return 0;
+    return interest->domain_mask == ~0U;
+  }
+  return (interest->op_mask[op / 32] >> (op % 32)) & 1;
+}
+
+/* builds snapshot from master list and publishes it; returns previously
+ * published snapshot (to be released by caller after grace period) or
+ * NULL on allocation failure. Must be called with plugin_mutex held */
+static struct plugin_snapshot* publish_plugin_chain()
+{
+  struct plugin_snapshot* snapshot;
+  struct plugin_chain* p;
+  struct plugin_interest alive;  /* records not dropped by filters so far */
+  unsigned short* dispatch_index;
+  int num_plugins = 0;
+  int later_in_chain;
+  int op, i;
+
+  for (p = plugins; p; p = p->next_plugin) {
+    set_full_interest(&p->interest);
+    if (p->pfn_get_interest)
+      p->pfn_get_interest(&p->interest, p->state);
+    num_plugins++;
+  }
+
+  snapshot = malloc(sizeof(struct plugin_snapshot)
+                    + num_plugins * sizeof(struct plugin_slot)
+                    + DISPATCH_LISTS * (num_plugins + 1)
+                    * sizeof(unsigned short));
+  if (!snapshot)
+    return NULL;
+
+  snapshot->num_plugins = num_plugins;
+  memset(&snapshot->interest, 0, sizeof(snapshot->interest));
+  set_full_interest(&alive);
+  for (num_plugins = 0, p = plugins; p; p = p->next_plugin, num_plugins++) {
+    struct plugin_slot* slot = &snapshot->slots[num_plugins];
+    slot->pfn_process_data = p->pfn_process_data;
+    slot->pfn_ok_to_accept_data = p->pfn_ok_to_accept_data;
+    slot->pfn_flush_plugin = p->pfn_flush_plugin;
+    slot->state = p->state;
+    slot->domain_mask = p->interest.domain_mask;
+    slot->drop_uninteresting = p->interest.drop_uninteresting;
+    slot->branch = p->branch;
+    slot->plugin = p;
+
+    /* whatever is still alive and of interest to plugin may reach it */
+    snapshot->interest.domain_mask |=
+      alive.domain_mask & p->interest.domain_mask;
+    for (i = 0; i != OP_MASK_WORDS; ++i)
+      snapshot->interest.op_mask[i] |=
+        alive.op_mask[i] & p->interest.op_mask[i];
+    snapshot->interest.wants_strings |= p->interest.wants_strings;
+    if (p->interest.drop_uninteresting) {
+      alive.domain_mask &= p->interest.domain_mask;
+      for (i = 0; i != OP_MASK_WORDS; ++i)
+        alive.op_mask[i] &= p->interest.op_mask[i];
+    }
+  }
+
+  /* branch thread reads record while chain goes on, so it gets its own
+   * copy unless only other branches follow */
+  for (i = num_plugins, later_in_chain = 0; i-- > 0; ) {
+    snapshot->slots[i].branch_copies = later_in_chain;
+    if (!snapshot->slots[i].branch)
+      later_in_chain = 1;
+  }
+
+  dispatch_index = (unsigned short*)(snapshot->slots + num_plugins);
+  for (op = 0; op != DISPATCH_LISTS; ++op) {
+    snapshot->dispatch[op] = dispatch_index;
+    for (i = 0; i != num_plugins; ++i) {
+      const struct plugin_interest* interest = &snapshot->slots[i].plugin->interest;
+      if (interest_has_op(interest, op)) {
+        *dispatch_index++ = i;
+      } else if (interest->drop_uninteresting) {
+        *dispatch_index++ = DISPATCH_DROP;
+        break;
+      }
+    }
+    if (i == num_plugins)
+      *dispatch_index++ = DISPATCH_END;
+  }
+
+  return __atomic_exchange_n(&current_snapshot, snapshot, __ATOMIC_SEQ_CST);
+}
+
+static void free_snapshot(struct plugin_snapshot* snapshot)
+{
+  if (snapshot && snapshot != &empty_snapshot)
+    free(snapshot);
+}
+
+static void emit_record(struct monitor_record_t* rec);
+
 struct listener listener = 
 {
-  parse_command
+  parse_command,
+  refresh_plugin_chain,
+  retain_record,
+  release_record,
+  alloc_record,
+  emit_record
 };
 
-int execute_plugin_chain(struct monitor_record_t *rec)
+/* records emitted by plugins wait here until the emitting plugin
+ * returns; only thread running the chain emits. emitting_slot is slot
+ * of plugin being called by that thread, -1 in any other thread */
+static struct monitor_record_t** emitted = NULL;
+static size_t num_emitted = 0;
+static size_t max_emitted = 0;
+static __thread int emitting_slot = -1;
+
+static void emit_record(struct monitor_record_t* rec)
 {
-  struct plugin_chain* p = plugins;
+  if (emitting_slot < 0) {
+    release_record(rec);
+    return;
+  }
+  if (num_emitted == max_emitted) {
+    size_t new_max = max_emitted ? 2 * max_emitted : 64;
+    struct monitor_record_t** tmp =
+      realloc(emitted, new_max * sizeof(struct monitor_record_t*));
+    if (!tmp) {
+      release_record(rec);
+      return;
+    }
+    emitted = tmp;
+    max_emitted = new_max;
+  }
+  emitted[num_emitted++] = rec;
+}
+
+static void run_chain_after(const struct plugin_snapshot* snapshot,
+                            struct monitor_record_t* rec, int slot);
+
+/* passes records emitted since mark to plugins after slot. Plugins
+ * there may emit too; their records are handled (and removed) by
+ * nested calls before these return */
+static void pass_emitted(const struct plugin_snapshot* snapshot,
+                         size_t mark, int slot)
+{
+  size_t i;
+
+  for (i = mark; i < num_emitted; ++i) {
+    run_chain_after(snapshot, emitted[i], slot);
+    release_record(emitted[i]);
+  }
+  num_emitted = mark;
+}
+
+/* passes record to plugin in given slot; t is end of previous plugin's
+ * call (0 when not timing). Returns non-zero if record is dropped */
+static int call_slot(const struct plugin_snapshot* snapshot, int index,
+                     struct monitor_record_t* rec, unsigned long long* t)
+{
+  const struct plugin_slot* slot = &snapshot->slots[index];
+  struct plugin_chain* p = slot->plugin;
+  const unsigned int domain_bit_flag =
+    ((unsigned int)rec->dom_type < 32) ? 1U << rec->dom_type : 0;
   int rc_plugin;
-  plugins_lock();
-  while (p) {
-    if (p->plugin_paused) {
-      rc_plugin = p->pfn_ok_to_accept_data(p->state);
-      if (rc_plugin == PLUGIN_ACCEPT_DATA) {
-	p->plugin_paused = 0;
-      }
+
+  if (!(slot->domain_mask & domain_bit_flag))
+    return slot->drop_uninteresting;
+
+  /* branch thread runs plugin; it also takes care of pausing */
+  if (slot->branch) {
+    push_to_branch(slot->branch, rec, slot->branch_copies);
+    if (*t)
+      *t = stats_clock();
+    return 0;
+  }
+
+  if (p->plugin_paused) {
+    rc_plugin = slot->pfn_ok_to_accept_data(slot->state);
+    if (rc_plugin == PLUGIN_ACCEPT_DATA) {
+      p->plugin_paused = 0;
     }
+  }
 
-    if (!p->plugin_paused) {
-      rc_plugin = p->pfn_process_data(rec,p->state);
-      if (rc_plugin == PLUGIN_REFUSE_DATA) {
-	p->plugin_paused = 1;
-      }
-      if (rc_plugin == PLUGIN_DROP_DATA) {
-	plugins_unlock();
-	return 0;
-      }
+  if (p->plugin_paused) {
+    p->stats.skipped++;
+    return 0;
+  }
+
+  const int caller_slot = emitting_slot;
+  const size_t mark = num_emitted;
+  emitting_slot = index;
+  rc_plugin = slot->pfn_process_data(rec, slot->state);
+  emitting_slot = caller_slot;
+  if (*t) {
+    unsigned long long now = stats_clock();
+    histogram_add(&p->stats.process_time, now - *t);
+    *t = now;
+  }
+  if (num_emitted != mark) {
+    pass_emitted(snapshot, mark, index);
+    if (*t)
+      *t = stats_clock();
+  }
+  if (rc_plugin == PLUGIN_REFUSE_DATA) {
+    p->plugin_paused = 1;
+    p->stats.refused++;
+  }
+  if (rc_plugin == PLUGIN_DROP_DATA) {
+    p->stats.dropped++;
+    return 1;
+  }
+  return 0;
+}
+
+/* dispatch lists describe path of records from start of chain; record
+ * emitted in the middle of it checks interest of each plugin instead */
+static void run_chain_after(const struct plugin_snapshot* snapshot,
+                            struct monitor_record_t* rec, int slot)
+{
+  unsigned long long t = stats_enabled ? stats_clock() : 0;
+  int i;
+
+  for (i = slot + 1; i < snapshot->num_plugins; ++i) {
+    const struct plugin_interest* interest =
+      &snapshot->slots[i].plugin->interest;
+    if (!interest_has_op(interest, rec->op_type)) {
+      if (interest->drop_uninteresting)
+        break;
+      continue;
     }
-    p = p->next_plugin;
+    if (call_slot(snapshot, i, rec, &t))
+      break;
   }
-  plugins_unlock();
+}
+
+int execute_plugin_chain(struct monitor_record_t *rec)
+{
+  int idx = chain_read_lock();
+  const struct plugin_snapshot* snapshot =
+    __atomic_load_n(&current_snapshot, __ATOMIC_ACQUIRE);
+  const unsigned int op = rec->op_type;
+  const unsigned short* i =
+    snapshot->dispatch[op < END_OPS ? op : END_OPS];
+  /* end of previous plugin's call is start of next one */
+  unsigned long long t = stats_enabled ? stats_clock() : 0;
+
+  for (; *i < DISPATCH_DROP; ++i) {
+    if (call_slot(snapshot, *i, rec, &t))
+      break;
+  }
+  chain_read_unlock(idx);
   return 0;
 }
 
+void flush_plugin_chain()
+{
+  int idx = chain_read_lock();
+  const struct plugin_snapshot* snapshot =
+    __atomic_load_n(&current_snapshot, __ATOMIC_ACQUIRE);
+  int i;
+
+  /* in chain order, so that records emitted on flush are flushed too */
+  for (i = 0; i != snapshot->num_plugins; ++i) {
+    const struct plugin_slot* slot = &snapshot->slots[i];
+    if (slot->pfn_flush_plugin && !slot->branch) {
+      const size_t mark = num_emitted;
+      emitting_slot = i;
+      slot->pfn_flush_plugin(slot->state);
+      emitting_slot = -1;
+      if (num_emitted != mark)
+        pass_emitted(snapshot, mark, i);
+    }
+  }
+  chain_read_unlock(idx);
+}
+
+void refresh_plugin_chain()
+{
+  struct plugin_snapshot* old_snapshot;
+
+  plugins_lock();
+  old_snapshot = publish_plugin_chain();
+  if (old_snapshot) {
+    synchronize_plugin_chain();
+    free_snapshot(old_snapshot);
+  } else {
+    fprintf(stderr, "error: unable to publish plugin chain\n");
+  }
+  plugins_unlock();
+  update_monitor_control();
+}
+
+void get_chain_interest(struct plugin_interest* interest)
+{
+  int idx = chain_read_lock();
+  const struct plugin_snapshot* snapshot =
+    __atomic_load_n(&current_snapshot, __ATOMIC_ACQUIRE);
+  *interest = snapshot->interest;
+  chain_read_unlock(idx);
+}
+
 /**
  * function unloads plugin so and all allocated resources but it 
  * does not remove plugin from the linked list. It is responsibility
- * of caller and it is requirement to do so 
+ * of caller and it is requirement to do so. Plugin must already be
+ * unpublished and grace period must have elapsed
  */
 void unload_plugin(struct plugin_chain* p)
 {
+  /* records already queued for plugin are still processed */
+  if (p->branch) {
+    stop_branch(p->branch);
+    p->branch = NULL;
+  }
   p->pfn_close_plugin(p->state);
   free_command(p->plugin_library);
   printf("Closed plugin %s\n", p->plugin_library);
@@ -95,13 +454,24 @@ void unload_plugin(struct plugin_chain* p)
 }
 
 void unload_all_plugins() {
+  struct plugin_chain* p;
+  struct plugin_snapshot* old_snapshot;
+
   plugins_lock();
-  while (plugins) {
-    unload_plugin(plugins);
-    plugins = plugins->next_plugin;
-  }
+  p = plugins;
   plugins = NULL;
+  old_snapshot = __atomic_exchange_n(&current_snapshot, &empty_snapshot,
+                                     __ATOMIC_SEQ_CST);
+  synchronize_plugin_chain();
+  free_snapshot(old_snapshot);
+  while (p) {
+    struct plugin_chain* next = p->next_plugin;
+    unload_plugin(p);
+    free(p);
+    p = next;
+  }
   plugins_unlock();
+  update_monitor_control();
 }
 
 /**
@@ -111,7 +481,6 @@ int count_plugins()
 {
   struct plugin_chain* p = plugins;
   int num_plugins = 0;
-  char** result;
   
   while (p) {
     num_plugins++;
@@ -122,18 +491,22 @@ int count_plugins()
 
 char** list_plugins()
 {
-  struct plugin_chain* p = plugins;
-  int num_plugins = count_plugins();
+  struct plugin_chain* p;
+  int num_plugins;
   char** result;
-  
+
+  plugins_lock();
+  num_plugins = count_plugins();
   result = calloc(sizeof(char*), num_plugins+1);
-  if (!result)
+  if (!result) {
+    plugins_unlock();
     return 0;
+  }
 
   p = plugins;
   num_plugins = 0;
   while (p) {
-    int s = strlen(p->plugin_library);
+    int s = strlen(p->plugin_library) + 1;
     if (p->plugin_alias) {
       s += 1 + strlen(p->plugin_alias);
     }
@@ -145,19 +518,42 @@ char** list_plugins()
       sprintf(result[num_plugins] + strlen(p->plugin_library),
 	      ":%s", p->plugin_alias);
     }
+    if (p->branch) {
+      char description[256];
+      char* tmp;
+      describe_branch(p->branch, description, sizeof(description));
+      tmp = realloc(result[num_plugins], s + 3 + strlen(description));
+      if (tmp) {
+        result[num_plugins] = tmp;
+        strcat(strcat(tmp, " ["), description);
+        strcat(tmp, "]");
+      }
+    }
     num_plugins++;
     p=p->next_plugin;
   }
+  plugins_unlock();
   return result;
 }
 
+void visit_plugin_stats(plugin_stats_fun fun, void* arg)
+{
+  struct plugin_chain* p;
+
+  plugins_lock();
+  for (p = plugins; p; p = p->next_plugin) {
+    fun(p->plugin_alias ? p->plugin_alias : p->plugin_library,
+        &p->stats, arg);
+  }
+  plugins_unlock();
+}
+
 /* Name of plugin can be either its alias or 
- * library path;
+ * library path; must be called with plugin_mutex held
  */
 struct plugin_chain* locate_plugin_by_name(const char* name)
 {
   struct plugin_chain* p = plugins;
-  char** result;
   
   while (p) {
     if (!strcmp(name, p->plugin_library)
@@ -170,35 +566,155 @@ struct plugin_chain* locate_plugin_by_name(const char* name)
   return 0;  
 }
 
+/* republishes chain after change of master list and waits until no
+ * reader uses previous snapshot; must be called with plugin_mutex held */
+static int republish_plugin_chain()
+{
+  struct plugin_snapshot* old_snapshot = publish_plugin_chain();
+  if (!old_snapshot) {
+    fprintf(stderr, "error: unable to publish plugin chain\n");
+    return 1;
+  }
+  synchronize_plugin_chain();
+  free_snapshot(old_snapshot);
+  return 0;
+}
+
+int reorder_plugins(const char** names)
+{
+  struct plugin_chain** order;
+  struct plugin_chain** previous;
+  struct plugin_chain* p;
+  int num_plugins, i, j;
+
+  plugins_lock();
+  num_plugins = count_plugins();
+  for (i = 0; names[i]; ++i)
+    ;
+  if (i != num_plugins) {
+    fprintf(stderr, "error: %d plugins given, but %d are loaded\n",
+            i, num_plugins);
+    plugins_unlock();
+    return 1;
+  }
+
+  order = calloc(2 * (num_plugins + 1), sizeof(struct plugin_chain*));
+  if (!order) {
+    plugins_unlock();
+    return 1;
+  }
+  previous = order + num_plugins + 1;
+  for (i = 0, p = plugins; p; p = p->next_plugin)
+    previous[i++] = p;
+
+  for (i = 0; i != num_plugins; ++i) {
+    order[i] = locate_plugin_by_name(names[i]);
+    for (j = 0; order[i] && j != i; ++j) {
+      if (order[j] == order[i])
+        order[i] = NULL;
+    }
+    if (!order[i]) {
+      fprintf(stderr, "error: plugin %s is not loaded or given twice\n",
+              names[i]);
+      free(order);
+      plugins_unlock();
+      return 1;
+    }
+  }
+
+  for (i = 0; i != num_plugins; ++i)
+    order[i]->next_plugin = order[i + 1];
+  plugins = order[0];
+  if (republish_plugin_chain()) {
+    /* keep previous order */
+    for (i = 0; i != num_plugins; ++i)
+      previous[i]->next_plugin = previous[i + 1];
+    plugins = previous[0];
+    plugins_unlock();
+    free(order);
+    return 1;
+  }
+  free(order);
+  plugins_unlock();
+  update_monitor_control();
+  return 0;
+}
+
+int branch_plugin(const char* name, unsigned int queue_size,
+                  enum branch_policy policy, const char* spill_path)
+{
+  struct plugin_chain* p;
+
+  plugins_lock();
+  p = locate_plugin_by_name(name);
+  if (!p) {
+    fprintf(stderr, "Plugin %s is not loaded.\n", name);
+    plugins_unlock();
+    return 1;
+  }
+  if (p->branch) {
+    fprintf(stderr, "Plugin %s already runs in its own thread.\n", name);
+    plugins_unlock();
+    return 1;
+  }
+
+  p->branch = start_branch(p, queue_size, policy, spill_path);
+  if (!p->branch) {
+    plugins_unlock();
+    return 1;
+  }
+  /* chain is run by ingest thread only, so its last direct call of
+   * plugin is over before it queues first record for branch */
+  if (republish_plugin_chain()) {
+    stop_branch(p->branch);
+    p->branch = NULL;
+    plugins_unlock();
+    return 1;
+  }
+  plugins_unlock();
+  return 0;
+}
+
 int unload_plugin_by_name(const char* name)
 {
-  struct plugin_chain* p = locate_plugin_by_name(name);
-  struct plugin_chain* i = plugins;
+  struct plugin_chain* p;
+  struct plugin_chain** i;
+  struct plugin_snapshot* old_snapshot;
+
   plugins_lock();
-  unload_plugin(p);
-  /* unlink plugin from the list */
-  if (plugins==p) {
-    /* case when it's head (replace head) */
-    plugins=p->next_plugin;
-    free(p);
+  p = locate_plugin_by_name(name);
+  if (!p) {
+    fprintf(stderr, "Plugin %s is not loaded.\n", name);
     plugins_unlock();
-    return 0;
-  } else {
-    /* case when plugin in question is not head */
-    while (i) {
-      if (i->next_plugin == p) {
-	i->next_plugin = p->next_plugin;
-	free(p);
-        plugins_unlock();
-	return 0;
-      }
-      i = i->next_plugin;
-    } /*while*/
+    return 1;
+  }
+
+  /* unlink plugin from the list */
+  for (i = &plugins; *i && *i != p; i = &(*i)->next_plugin)
+    ;
+  if (!*i) {
     fprintf(stderr, "Failed to correctly unload plugin."
 	    " This is likely a bug. mq_listener will now quit.");
     plugins_unlock();
     return 1;
   }
+  *i = p->next_plugin;
+
+  /* readers may still be inside plugin; wait for them before closing it */
+  old_snapshot = publish_plugin_chain();
+  if (!old_snapshot) {
+    /* cannot publish chain without plugin; keep it loaded */
+    *i = p;
+    plugins_unlock();
+    return 1;
+  }
+  synchronize_plugin_chain();
+  free_snapshot(old_snapshot);
+  unload_plugin(p);
+  free(p);
+  plugins_unlock();
+  update_monitor_control();
+  return 0;
 }
 
 
@@ -239,6 +755,10 @@ int load_plugin(const char* library, const char* options, const char* alias)
     (PFN_PLUGIN_COMMAND) dlsym(new_plugin->plugin_handle, "plugin_command"); 
   new_plugin->pfn_list_commands =
     (PFN_LIST_COMMANDS) dlsym(new_plugin->plugin_handle, "list_commands"); 
+  new_plugin->pfn_get_interest =
+    (PFN_GET_INTEREST) dlsym(new_plugin->plugin_handle, "get_interest"); 
+  new_plugin->pfn_flush_plugin =
+    (PFN_FLUSH_PLUGIN) dlsym(new_plugin->plugin_handle, "flush_plugin");
 
   if ((NULL == new_plugin->pfn_open_plugin) ||
       (NULL == new_plugin->pfn_close_plugin) ||
@@ -280,7 +800,22 @@ int load_plugin(const char* library, const char* options, const char* alias)
   } else {
     plugins=new_plugin;
   }
+  struct plugin_snapshot* old_snapshot = publish_plugin_chain();
+  if (!old_snapshot) {
+    struct plugin_chain** i = &plugins;
+    while (*i != new_plugin)
+      i = &(*i)->next_plugin;
+    *i = NULL;
+    plugins_unlock();
+    printf("error: unable to publish plugin chain\n");
+    unload_plugin(new_plugin);
+    free(new_plugin);
+    return 1;
+  }
+  synchronize_plugin_chain();
+  free_snapshot(old_snapshot);
   plugins_unlock();
+  update_monitor_control();
   
   return 0;
 }
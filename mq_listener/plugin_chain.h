@@ -1,6 +1,17 @@
 #ifndef __PLUGIN_CHAIN_H
 #define __PLUGIN_CHAIN_H
 
+#include "listener_stats.h"
+#include "plugin_branch.h"
+
+/* written only by thread running the plugin */
+struct plugin_stats {
+  struct histogram process_time;  /* ns per process_data call */
+  unsigned long long refused;     /* PLUGIN_REFUSE_DATA returned */
+  unsigned long long skipped;     /* records not given while paused */
+  unsigned long long dropped;     /* PLUGIN_DROP_DATA returned */
+};
+
 struct plugin_chain {
   const char* plugin_library;
   const char* plugin_options;
@@ -11,25 +22,59 @@ struct plugin_chain {
   PFN_PROCESS_DATA pfn_process_data;
   PFN_PLUGIN_COMMAND pfn_plugin_command;
   PFN_LIST_COMMANDS pfn_list_commands;
+  PFN_GET_INTEREST pfn_get_interest;
+  PFN_FLUSH_PLUGIN pfn_flush_plugin;
+  struct plugin_interest interest;  /* as last reported by plugin */
   int plugin_paused;
+  struct plugin_stats stats;
+  struct plugin_branch* branch;  /* set when plugin runs in its own thread */
   void* plugin_handle;
   void* state;
   struct plugin_chain* next_plugin;
 };
 
 /**
- * execute all the plugins within the chain. 
+ * execute all the plugins within the chain. Takes no locks: it runs
+ * over the most recently published snapshot of the chain, so plugins
+ * may be loaded and unloaded concurrently from another thread.
+ * Management functions below must not be called from process_data().
+ * Chain must be run by one thread only; plugin branches rely on it.
  */
 int execute_plugin_chain(struct monitor_record_t *rec);
 
+/* lets plugins in chain write out buffered output; called by thread
+ * running the chain once input runs dry. Branched plugins are flushed
+ * by their own threads */
+void flush_plugin_chain();
+
 void unload_all_plugins();
 
 int load_plugin(const char* library, const char* options, const char* alias);
 
 int unload_plugin_by_name(const char* name);
 
+/* names (paths or aliases) must list every loaded plugin exactly once */
 int reorder_plugins(const char** names);
 
+/* moves plugin out of chain into its own thread; records reaching its
+ * place in chain are queued for it. Branch lasts until plugin is
+ * unloaded. Meant for output plugins, as filtering there has no effect */
+int branch_plugin(const char* name, unsigned int queue_size,
+		  enum branch_policy policy, const char* spill_path);
+
+/* re-query interest of all plugins and republish the chain */
+void refresh_plugin_chain();
+
+/* aggregated interest of the whole chain: records which can reach at
+ * least one plugin without being dropped by a filter before it */
+void get_chain_interest(struct plugin_interest* interest);
+
+/* calls fun for every loaded plugin (in chain order) with plugin_mutex
+ * held; name is alias or library path */
+typedef void (*plugin_stats_fun)(const char* name, struct plugin_stats* stats,
+				 void* arg);
+void visit_plugin_stats(plugin_stats_fun fun, void* arg);
+
 /* result is malloc-allocated; it is responsibility of caller to free it.
  * It is also responsibility of caller to free all the strings */
 char** list_plugins();
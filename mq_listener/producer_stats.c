@@ -0,0 +1,373 @@
+//
+// Copyright (c) 2017 Intel Corporation
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+// implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "domains.h"
+#include "ops.h"
+#include "mq.h"
+#include "record_pool.h"
+#include "producer_stats.h"
+
+/* threads not heard from for this long are forgotten */
+#define THREAD_IDLE_SEC 60
+#define MIN_THREAD_TABLE_SIZE 64
+
+struct counters {
+  unsigned long long received;
+  unsigned long long lost;
+  unsigned long long reordered;
+  unsigned long long latency_sum_ns;
+  unsigned long long latency_max_ns;
+};
+
+struct thread_stats {
+  int pid;
+  int tid;
+  unsigned int next_seq;
+  time_t last_seen;
+  struct counters total;
+  struct counters interval;         /* since last stat record */
+};
+
+/* open addressing table keyed by (pid, tid) */
+static struct thread_stats* threads = NULL;
+static unsigned int table_size = 0;
+static unsigned int num_threads = 0;
+
+static int stats_interval = 0;
+static time_t last_emit = 0;
+static time_t last_maintenance = 0;
+
+static pthread_mutex_t stats_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+//*****************************************************************************
+
+static inline unsigned int thread_hash(int pid, int tid)
+{
+  return ((unsigned int)pid * 2654435761U) ^ (unsigned int)tid;
+}
+
+//*****************************************************************************
+
+static inline unsigned long long now_ns()
+{
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  return (unsigned long long)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+//*****************************************************************************
+
+/* rebuilds table with room for min_threads, leaving out threads idle
+ * since given time; must be called with stats_mutex held */
+static int rebuild_thread_table(unsigned int min_threads, time_t idle_since)
+{
+  unsigned int new_size = MIN_THREAD_TABLE_SIZE;
+  struct thread_stats* new_threads;
+  unsigned int i;
+
+  while (new_size < 2 * min_threads)
+    new_size *= 2;
+  new_threads = calloc(new_size, sizeof(struct thread_stats));
+  if (!new_threads)
+    return 1;
+
+  num_threads = 0;
+  for (i = 0; i != table_size; ++i) {
+    struct thread_stats* t = &threads[i];
+    unsigned int j;
+    if (!t->last_seen || t->last_seen < idle_since)
+      continue;
+    j = thread_hash(t->pid, t->tid) & (new_size - 1);
+    while (new_threads[j].last_seen)
+      j = (j + 1) & (new_size - 1);
+    new_threads[j] = *t;
+    num_threads++;
+  }
+  free(threads);
+  threads = new_threads;
+  table_size = new_size;
+  return 0;
+}
+
+//*****************************************************************************
+
+/* must be called with stats_mutex held */
+static struct thread_stats* find_thread(int pid, int tid, int* is_new)
+{
+  unsigned int i;
+
+  if (2 * (num_threads + 1) > table_size &&
+      rebuild_thread_table(num_threads + 1, 0))
+    return NULL;
+
+  i = thread_hash(pid, tid) & (table_size - 1);
+  while (threads[i].last_seen) {
+    if (threads[i].pid == pid && threads[i].tid == tid) {
+      *is_new = 0;
+      return &threads[i];
+    }
+    i = (i + 1) & (table_size - 1);
+  }
+  threads[i].pid = pid;
+  threads[i].tid = tid;
+  num_threads++;
+  *is_new = 1;
+  return &threads[i];
+}
+
+//*****************************************************************************
+
+static void count(struct counters* c, unsigned long long lost,
+		  int reordered, unsigned long long latency_ns)
+{
+  c->received++;
+  if (reordered) {
+    c->reordered++;
+    /* it was counted as lost when later records came first */
+    if (c->lost)
+      c->lost--;
+  }
+  c->lost += lost;
+  c->latency_sum_ns += latency_ns;
+  if (latency_ns > c->latency_max_ns)
+    c->latency_max_ns = latency_ns;
+}
+
+//*****************************************************************************
+
+void account_record(struct monitor_record_t* rec)
+{
+  const unsigned long long received_ns = now_ns();
+  unsigned long long latency_ns = 0;
+  unsigned long long lost = 0;
+  int reordered = 0;
+  struct thread_stats* t;
+  int is_new;
+
+  if (rec->dom_type == LISTENER)
+    return;
+  if (rec->timestamp_ns && received_ns > rec->timestamp_ns)
+    latency_ns = received_ns - rec->timestamp_ns;
+
+  pthread_mutex_lock(&stats_mutex);
+  t = find_thread(rec->pid, rec->tid, &is_new);
+  if (t) {
+    /* records made before first one we got are not accounted for;
+     * they may predate this listener */
+    if (!is_new) {
+      int gap = (int)(rec->seq - t->next_seq);
+      if (gap > 0)
+	lost = gap;
+      else if (gap < 0)
+	reordered = 1;
+    }
+    if (is_new || (int)(rec->seq - t->next_seq) >= 0)
+      t->next_seq = rec->seq + 1;
+    t->last_seen = rec->timestamp ? rec->timestamp : time(NULL);
+    count(&t->total, lost, reordered, latency_ns);
+    count(&t->interval, lost, reordered, latency_ns);
+  }
+  pthread_mutex_unlock(&stats_mutex);
+}
+
+//*****************************************************************************
+
+void set_producer_stats_interval(int seconds)
+{
+  pthread_mutex_lock(&stats_mutex);
+  stats_interval = seconds > 0 ? seconds : 0;
+  last_emit = time(NULL);
+  pthread_mutex_unlock(&stats_mutex);
+}
+
+//*****************************************************************************
+
+static int compare_pid(const void* a, const void* b)
+{
+  const struct thread_stats* ta = *(const struct thread_stats* const*)a;
+  const struct thread_stats* tb = *(const struct thread_stats* const*)b;
+  return (ta->pid > tb->pid) - (ta->pid < tb->pid);
+}
+
+//*****************************************************************************
+
+/* threads sorted by pid, so that producers can be summed up in one
+ * pass; must be called with stats_mutex held */
+static struct thread_stats** threads_by_pid()
+{
+  struct thread_stats** list =
+    malloc((num_threads + 1) * sizeof(struct thread_stats*));
+  unsigned int i, n = 0;
+
+  if (!list)
+    return NULL;
+  for (i = 0; i != table_size; ++i) {
+    if (threads[i].last_seen)
+      list[n++] = &threads[i];
+  }
+  list[n] = NULL;
+  qsort(list, n, sizeof(struct thread_stats*), compare_pid);
+  return list;
+}
+
+//*****************************************************************************
+
+static void add_counters(struct counters* sum, const struct counters* c)
+{
+  sum->received += c->received;
+  sum->lost += c->lost;
+  sum->reordered += c->reordered;
+  sum->latency_sum_ns += c->latency_sum_ns;
+  if (c->latency_max_ns > sum->latency_max_ns)
+    sum->latency_max_ns = c->latency_max_ns;
+}
+
+//*****************************************************************************
+
+static double loss_rate(const struct counters* c)
+{
+  const unsigned long long sent = c->received + c->lost;
+  return sent ? (double)c->lost / sent : 0.0;
+}
+
+//*****************************************************************************
+
+static double average_latency_ms(const struct counters* c)
+{
+  return c->received ? c->latency_sum_ns / 1000000.0 / c->received : 0.0;
+}
+
+//*****************************************************************************
+
+static struct monitor_record_t* make_stat_record(int pid,
+						 unsigned int num_threads,
+						 const struct counters* c,
+						 const struct counters* total)
+{
+  struct monitor_record_t* rec = alloc_record();
+  const unsigned long long t = now_ns();
+
+  if (!rec)
+    return NULL;
+  memset(rec, 0, offsetof(struct monitor_record_t, hostname));
+  strcpy(rec->facility, "mq_listener");
+  rec->timestamp = t / 1000000000ULL;
+  rec->timestamp_ns = t;
+  rec->elapsed_time = average_latency_ms(c);
+  rec->pid = pid;
+  rec->dom_type = LISTENER;
+  rec->op_type = PRODUCER_STATS;
+  rec->error_code = c->lost;
+  rec->fd = FD_NONE;
+  rec->offset = OFFSET_NONE;
+  rec->bytes_transferred = c->received;
+  snprintf(rec->s1, sizeof(rec->s1),
+	   "received=%llu lost=%llu reordered=%llu loss_rate=%.6f"
+	   " latency_avg_ms=%.3f latency_max_ms=%.3f threads=%u",
+	   c->received, c->lost, c->reordered, loss_rate(c),
+	   average_latency_ms(c), c->latency_max_ns / 1000000.0, num_threads);
+  snprintf(rec->s2, sizeof(rec->s2),
+	   "total_received=%llu total_lost=%llu total_reordered=%llu",
+	   total->received, total->lost, total->reordered);
+  complete_record(rec, MONITOR_RECORD_WIRE_SIZE);
+  return rec;
+}
+
+//*****************************************************************************
+
+int emit_producer_stats(record_dispatch_fun sink)
+{
+  struct monitor_record_t** records = NULL;
+  struct thread_stats** list;
+  time_t now = time(NULL);
+  int n = 0;
+  int i, j;
+
+  /* cheap check first; this is called on every pass of input loop */
+  if (now == __atomic_load_n(&last_maintenance, __ATOMIC_RELAXED))
+    return 0;
+
+  pthread_mutex_lock(&stats_mutex);
+  __atomic_store_n(&last_maintenance, now, __ATOMIC_RELAXED);
+  if (stats_interval && now - last_emit >= stats_interval && num_threads) {
+    last_emit = now;
+    list = threads_by_pid();
+    /* records go to plugins after lock is dropped */
+    records = malloc(num_threads * sizeof(struct monitor_record_t*));
+    for (i = 0; list && records && list[i]; i = j) {
+      struct counters interval = { 0 };
+      struct counters total = { 0 };
+      struct monitor_record_t* rec;
+
+      for (j = i; list[j] && list[j]->pid == list[i]->pid; ++j) {
+	add_counters(&interval, &list[j]->interval);
+	add_counters(&total, &list[j]->total);
+	memset(&list[j]->interval, 0, sizeof(struct counters));
+      }
+      if (!interval.received && !interval.lost)
+	continue;
+      rec = make_stat_record(list[i]->pid, j - i, &interval, &total);
+      if (rec)
+	records[n++] = rec;
+    }
+    free(list);
+  }
+  for (i = 0; i != (int)table_size; ++i) {
+    if (threads[i].last_seen && threads[i].last_seen < now - THREAD_IDLE_SEC) {
+      rebuild_thread_table(num_threads, now - THREAD_IDLE_SEC);
+      break;
+    }
+  }
+  pthread_mutex_unlock(&stats_mutex);
+
+  for (i = 0; i != n; ++i) {
+    sink(records[i]);
+    release_record(records[i]);
+  }
+  free(records);
+  return n;
+}
+
+//*****************************************************************************
+
+void print_producer_stats()
+{
+  struct thread_stats** list;
+  int i, j;
+
+  pthread_mutex_lock(&stats_mutex);
+  printf("%8s %7s %12s %10s %10s %10s %12s %12s\n", "PID", "THREADS",
+	 "RECEIVED", "LOST", "REORDERED", "LOSS_RATE", "LAT_AVG_MS",
+	 "LAT_MAX_MS");
+  list = threads_by_pid();
+  for (i = 0; list && list[i]; i = j) {
+    struct counters total = { 0 };
+    for (j = i; list[j] && list[j]->pid == list[i]->pid; ++j)
+      add_counters(&total, &list[j]->total);
+    printf("%8d %7d %12llu %10llu %10llu %10.6f %12.3f %12.3f\n",
+	   list[i]->pid, j - i, total.received, total.lost, total.reordered,
+	   loss_rate(&total), average_latency_ms(&total),
+	   total.latency_max_ns / 1000000.0);
+  }
+  free(list);
+  pthread_mutex_unlock(&stats_mutex);
+}
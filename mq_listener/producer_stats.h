@@ -0,0 +1,40 @@
+//
+// Copyright (c) 2017 Intel Corporation
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+// implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef __PRODUCER_STATS_H
+#define __PRODUCER_STATS_H
+
+/* end-to-end delivery accounting. Each monitored thread numbers its
+ * records; gaps in the numbers are records lost on the way, numbers
+ * coming back are reordered records. Delivery latency is time between
+ * making and receiving a record */
+
+#include "producers.h"
+
+/* called for every received record, before it is ordered or dispatched */
+void account_record(struct monitor_record_t* rec);
+
+/* make LISTENER/PRODUCER_STATS record for every active producer each
+ * given number of seconds; 0 turns it off */
+void set_producer_stats_interval(int seconds);
+
+/* passes stat records to sink when interval has passed and forgets
+ * threads which went quiet; returns number of records made */
+int emit_producer_stats(record_dispatch_fun sink);
+
+void print_producer_stats();
+
+#endif
@@ -0,0 +1,608 @@
+//
+// Copyright (c) 2017 Intel Corporation
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+// implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/ipc.h>
+#include <sys/msg.h>
+
+#include "mq.h"
+#include "monitor_ring.h"
+#include "record_pool.h"
+#include "producers.h"
+#include "producer_stats.h"
+
+/* records taken from a source per round for weight 1 */
+#define QUANTUM 16
+/* how often ring directory is checked for new and finished producers */
+#define RESCAN_INTERVAL_SEC 1
+/* slot reserved by a writer for this long is taken as abandoned */
+#define RING_STALL_NS 1000000000ULL
+/* interrupts blocking receive from message queue when wait times out */
+#define WAIT_SIGNAL (SIGRTMIN + 1)
+
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+
+struct producer {
+  int pid;                          /* 0 for message queue */
+  int weight;
+  long deficit;
+  struct monitor_ring_t* ring;      /* NULL for message queue */
+  unsigned int num_slots;           /* as mapped */
+  char* path;
+  dev_t dev;                        /* of ring file as mapped */
+  ino_t ino;
+  unsigned long long delivered;
+  unsigned long long high_water;    /* largest backlog sampled */
+  unsigned long long full_samples;  /* samples which found it full */
+  unsigned long long stalled_ns;    /* since when oldest slot is not ready */
+};
+
+static struct producer message_queue_producer = { 0, 1 };
+static int message_queue_id = -1;
+
+static struct producer** producers = NULL;
+static int num_producers = 0;
+static int max_producers = 0;
+static char* ring_dir = NULL;
+static time_t last_scan = 0;
+
+static timer_t wait_timer;
+static int wait_timer_state = 0;    /* 0 not created, 1 ready, -1 failed */
+
+/* held by ingest thread for a whole round; commands take it briefly */
+static pthread_mutex_t producers_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+//*****************************************************************************
+
+void set_message_queue_source(int queue_id)
+{
+  message_queue_id = queue_id;
+}
+
+//*****************************************************************************
+
+/* per-queue limit non-privileged user may set, or 0 if unknown */
+static unsigned long system_queue_limit()
+{
+  unsigned long limit = 0;
+  FILE* f = fopen("/proc/sys/kernel/msgmnb", "r");
+  if (f) {
+    if (fscanf(f, "%lu", &limit) != 1)
+      limit = 0;
+    fclose(f);
+  }
+  return limit;
+}
+
+//*****************************************************************************
+
+unsigned int size_message_queue(unsigned int records)
+{
+  const unsigned long wanted = (unsigned long)records * MONITOR_RECORD_WIRE_SIZE;
+  struct msqid_ds queue_ds;
+  unsigned long limit;
+  unsigned int capacity;
+
+  if (message_queue_id == -1 || msgctl(message_queue_id, IPC_STAT, &queue_ds)) {
+    fprintf(stderr, "error: unable to query message queue\n");
+    return 0;
+  }
+
+  if (queue_ds.msg_qbytes < wanted) {
+    queue_ds.msg_qbytes = wanted;
+    if (msgctl(message_queue_id, IPC_SET, &queue_ds)) {
+      /* above system limit only privileged user may go; get as close
+       * as we are allowed to */
+      limit = system_queue_limit();
+      msgctl(message_queue_id, IPC_STAT, &queue_ds);
+      if (limit > queue_ds.msg_qbytes) {
+	queue_ds.msg_qbytes = limit < wanted ? limit : wanted;
+	msgctl(message_queue_id, IPC_SET, &queue_ds);
+      }
+      msgctl(message_queue_id, IPC_STAT, &queue_ds);
+    }
+  }
+
+  capacity = queue_ds.msg_qbytes / MONITOR_RECORD_WIRE_SIZE;
+  printf("message queue holds %u records (%lu bytes)\n", capacity,
+	 (unsigned long)queue_ds.msg_qbytes);
+  if (capacity < records) {
+    fprintf(stderr, "warning: message queue holds only %u of %u requested"
+	    " records; monitored processes will wait and drop records in"
+	    " bursts. Raise the limit (sysctl -w kernel.msgmnb=%lu), run"
+	    " mq_listener as root once, or use --ring-dir\n",
+	    capacity, records, wanted);
+  }
+  return capacity;
+}
+
+//*****************************************************************************
+
+int set_ring_dir(const char* path)
+{
+  DIR* d = opendir(path);
+  if (!d) {
+    fprintf(stderr, "error: unable to open ring directory '%s'\n", path);
+    fprintf(stderr, "errno: %d\n", errno);
+    return 1;
+  }
+  closedir(d);
+
+  pthread_mutex_lock(&producers_mutex);
+  free(ring_dir);
+  ring_dir = strdup(path);
+  last_scan = 0;
+  pthread_mutex_unlock(&producers_mutex);
+  return 0;
+}
+
+//*****************************************************************************
+
+static struct producer* find_producer(int pid)
+{
+  int i;
+  for (i = 0; i != num_producers; ++i) {
+    if (producers[i]->pid == pid)
+      return producers[i];
+  }
+  return NULL;
+}
+
+//*****************************************************************************
+
+int set_producer_weight(int pid, int weight)
+{
+  struct producer* p;
+
+  if (weight < 1) {
+    fprintf(stderr, "error: weight must be positive\n");
+    return 1;
+  }
+  pthread_mutex_lock(&producers_mutex);
+  p = pid ? find_producer(pid) : &message_queue_producer;
+  if (p)
+    p->weight = weight;
+  pthread_mutex_unlock(&producers_mutex);
+  if (!p) {
+    fprintf(stderr, "error: no producer with pid %d\n", pid);
+    return 1;
+  }
+  return 0;
+}
+
+//*****************************************************************************
+
+static struct producer* attach_ring(const char* path, int pid)
+{
+  struct stat st;
+  struct producer* p;
+  struct monitor_ring_t* ring;
+  int fd = open(path, O_RDWR);
+
+  if (fd == -1)
+    return NULL;
+  if (fstat(fd, &st) || st.st_size < (off_t)sizeof(struct monitor_ring_t)) {
+    close(fd);
+    return NULL;
+  }
+  ring = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (ring == MAP_FAILED)
+    return NULL;
+
+  /* producer may still be setting ring up; try again on next scan */
+  if (__atomic_load_n(&ring->magic, __ATOMIC_ACQUIRE) != RING_MAGIC
+      || ring->version != RING_VERSION
+      || !ring->num_slots || (ring->num_slots & (ring->num_slots - 1))
+      || RING_SIZE(ring->num_slots) > (size_t)st.st_size) {
+    munmap(ring, st.st_size);
+    return NULL;
+  }
+
+  if (num_producers == max_producers) {
+    int new_max = max_producers ? 2 * max_producers : 64;
+    struct producer** tmp = realloc(producers, new_max * sizeof(*producers));
+    if (!tmp) {
+      munmap(ring, st.st_size);
+      return NULL;
+    }
+    producers = tmp;
+    max_producers = new_max;
+  }
+
+  p = calloc(1, sizeof(struct producer));
+  if (!p) {
+    munmap(ring, st.st_size);
+    return NULL;
+  }
+  p->pid = pid;
+  p->weight = 1;
+  p->ring = ring;
+  p->num_slots = ring->num_slots;
+  p->path = strdup(path);
+  p->dev = st.st_dev;
+  p->ino = st.st_ino;
+  producers[num_producers++] = p;
+  return p;
+}
+
+//*****************************************************************************
+
+static void detach_ring(int i, int remove_file)
+{
+  struct producer* p = producers[i];
+  munmap(p->ring, RING_SIZE(p->num_slots));
+  if (remove_file)
+    unlink(p->path);
+  free(p->path);
+  free(p);
+  producers[i] = producers[--num_producers];
+}
+
+//*****************************************************************************
+
+static void scan_ring_dir()
+{
+  char path[PATH_MAX];
+  struct dirent* e;
+  DIR* d;
+  int i;
+
+  d = opendir(ring_dir);
+  if (d) {
+    while ((e = readdir(d))) {
+      char* end;
+      long pid = strtol(e->d_name, &end, 10);
+      if (pid <= 0 || strcmp(end, RING_SUFFIX))
+	continue;
+      if (find_producer(pid))
+	continue;
+      snprintf(path, sizeof(path), "%s/%s", ring_dir, e->d_name);
+      attach_ring(path, pid);
+    }
+    closedir(d);
+  }
+
+  /* retire producers which exited and whose ring is drained. a process
+   * creates a new ring file after exec; the old one is drained first */
+  for (i = num_producers - 1; i >= 0; --i) {
+    struct producer* p = producers[i];
+    struct stat st;
+    if (ring_backlog(p->ring))
+      continue;
+    if (!stat(p->path, &st) && (st.st_dev != p->dev || st.st_ino != p->ino)) {
+      int pid = p->pid;
+      int weight = p->weight;
+      snprintf(path, sizeof(path), "%s", p->path);
+      detach_ring(i, 0);
+      p = attach_ring(path, pid);
+      if (p)
+	p->weight = weight;
+    } else if (kill(p->pid, 0) == -1 && errno == ESRCH) {
+      detach_ring(i, 1);
+    }
+  }
+}
+
+//*****************************************************************************
+
+static struct monitor_record_t* receive_message_queue()
+{
+  struct monitor_record_t* rec = alloc_record();
+  ssize_t message_size_received;
+
+  if (!rec)
+    return NULL;
+  message_size_received =
+    msgrcv(message_queue_id, record_message(rec), MONITOR_RECORD_WIRE_SIZE,
+	   0, IPC_NOWAIT | MSG_NOERROR);
+  if (message_size_received <= 0) {
+    if (errno != ENOMSG) {
+      fprintf(stderr, "rc = %zd\n", message_size_received);
+      fprintf(stderr, "errno = %d\n", errno);
+    }
+    release_record(rec);
+    return NULL;
+  }
+  complete_record(rec, message_size_received);
+  return rec;
+}
+
+//*****************************************************************************
+
+static unsigned long long monotonic_ns()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+//*****************************************************************************
+
+static struct monitor_record_t* receive_ring(struct producer* p)
+{
+  struct monitor_ring_t* ring = p->ring;
+  struct monitor_ring_slot_t* slot = ring_peek(ring);
+  struct monitor_record_t* rec;
+  const size_t strings = offsetof(struct monitor_record_t, s1);
+  unsigned int length;
+
+  if (!slot) {
+    /* a writer which died between reserving slot and completing it
+     * would hold back all records behind it */
+    if (!ring_backlog(ring)) {
+      p->stalled_ns = 0;
+    } else if (!p->stalled_ns) {
+      p->stalled_ns = monotonic_ns();
+    } else if (monotonic_ns() - p->stalled_ns > RING_STALL_NS) {
+      ring_skip(ring);
+      p->stalled_ns = 0;
+    }
+    return NULL;
+  }
+  p->stalled_ns = 0;
+  rec = alloc_record();
+  if (!rec)
+    return NULL;
+
+  /* copy only used part of strings, not the whole slot */
+  length = slot->length;
+  if (length > MONITOR_RECORD_WIRE_SIZE)
+    length = MONITOR_RECORD_WIRE_SIZE;
+  memcpy(rec, &slot->record, length < strings ? length : strings);
+  if (length > strings) {
+    size_t n = strnlen(slot->record.s1, PATH_MAX - 1);
+    memcpy(rec->s1, slot->record.s1, n);
+    rec->s1[n] = 0;
+    n = strnlen(slot->record.s2, STR_LEN - 1);
+    memcpy(rec->s2, slot->record.s2, n);
+    rec->s2[n] = 0;
+  }
+  ring_consume(ring, slot);
+  complete_record(rec, length);
+  return rec;
+}
+
+//*****************************************************************************
+
+/* serves one source for its share of round; returns records dispatched */
+static int serve_producer(struct producer* p, record_dispatch_fun dispatch)
+{
+  struct monitor_record_t* rec;
+  int n = 0;
+
+  p->deficit += QUANTUM * p->weight;
+  while (p->deficit > 0) {
+    rec = p->ring ? receive_ring(p) : receive_message_queue();
+    if (!rec) {
+      /* idle sources don't bank credit for later bursts */
+      p->deficit = 0;
+      break;
+    }
+    account_record(rec);
+    dispatch(rec);
+    /* plugins which kept record have their own reference */
+    release_record(rec);
+    p->deficit--;
+    p->delivered++;
+    n++;
+  }
+  return n;
+}
+
+//*****************************************************************************
+
+int receive_round(record_dispatch_fun dispatch)
+{
+  int n = 0;
+  int i;
+
+  pthread_mutex_lock(&producers_mutex);
+  if (ring_dir) {
+    time_t now = time(NULL);
+    if (now - last_scan >= RESCAN_INTERVAL_SEC) {
+      last_scan = now;
+      scan_ring_dir();
+    }
+  }
+
+  if (message_queue_id != -1)
+    n += serve_producer(&message_queue_producer, dispatch);
+  for (i = 0; i != num_producers; ++i)
+    n += serve_producer(producers[i], dispatch);
+  pthread_mutex_unlock(&producers_mutex);
+  return n;
+}
+
+//*****************************************************************************
+
+int rings_in_use()
+{
+  int in_use;
+
+  pthread_mutex_lock(&producers_mutex);
+  in_use = ring_dir || num_producers;
+  pthread_mutex_unlock(&producers_mutex);
+  return in_use;
+}
+
+//*****************************************************************************
+
+static void wake_up(int signal)
+{
+}
+
+//*****************************************************************************
+
+/* timer interrupting msgrcv of calling (ingest) thread only, so that
+ * reads of other threads, i.e. of commands, never see EINTR */
+static int create_wait_timer()
+{
+  struct sigaction action;
+  struct sigevent event;
+
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = wake_up;
+  sigemptyset(&action.sa_mask);
+  if (sigaction(WAIT_SIGNAL, &action, NULL))
+    return -1;
+
+  memset(&event, 0, sizeof(event));
+  event.sigev_notify = SIGEV_THREAD_ID;
+  event.sigev_signo = WAIT_SIGNAL;
+  event.sigev_notify_thread_id = syscall(SYS_gettid);
+  if (timer_create(CLOCK_MONOTONIC, &event, &wait_timer))
+    return -1;
+  return 1;
+}
+
+//*****************************************************************************
+
+int wait_message_queue(record_dispatch_fun dispatch, unsigned long timeout_us)
+{
+  struct itimerspec timeout;
+  struct monitor_record_t* rec;
+  ssize_t message_size_received;
+
+  if (!wait_timer_state)
+    wait_timer_state = create_wait_timer();
+  if (wait_timer_state < 0 || message_queue_id == -1) {
+    usleep(timeout_us);
+    return 0;
+  }
+  rec = alloc_record();
+  if (!rec) {
+    usleep(timeout_us);
+    return 0;
+  }
+
+  memset(&timeout, 0, sizeof(timeout));
+  timeout.it_value.tv_sec = timeout_us / 1000000;
+  timeout.it_value.tv_nsec = (timeout_us % 1000000) * 1000;
+  /* fires again should first signal come before msgrcv started */
+  timeout.it_interval = timeout.it_value;
+  timer_settime(wait_timer, 0, &timeout, NULL);
+  /* msgrcv is never restarted after a signal handler ran */
+  message_size_received =
+    msgrcv(message_queue_id, record_message(rec), MONITOR_RECORD_WIRE_SIZE,
+	   0, MSG_NOERROR);
+  memset(&timeout, 0, sizeof(timeout));
+  timer_settime(wait_timer, 0, &timeout, NULL);
+
+  if (message_size_received <= 0) {
+    if (errno != EINTR) {
+      fprintf(stderr, "rc = %zd\n", message_size_received);
+      fprintf(stderr, "errno = %d\n", errno);
+      usleep(timeout_us);
+    }
+    release_record(rec);
+    return 0;
+  }
+  complete_record(rec, message_size_received);
+
+  pthread_mutex_lock(&producers_mutex);
+  account_record(rec);
+  dispatch(rec);
+  message_queue_producer.delivered++;
+  pthread_mutex_unlock(&producers_mutex);
+  release_record(rec);
+  return 1;
+}
+
+//*****************************************************************************
+
+/* must be called with producers_mutex held */
+static void note_backlog(struct producer* p, unsigned long long backlog,
+			 int full)
+{
+  if (backlog > p->high_water)
+    p->high_water = backlog;
+  if (full)
+    p->full_samples++;
+}
+
+//*****************************************************************************
+
+void sample_backlog(unsigned long long* queue, unsigned long long* rings)
+{
+  struct msqid_ds queue_ds;
+  int i;
+
+  pthread_mutex_lock(&producers_mutex);
+  *queue = 0;
+  if (message_queue_id != -1 && !msgctl(message_queue_id, IPC_STAT, &queue_ds)) {
+    *queue = queue_ds.msg_qnum;
+    note_backlog(&message_queue_producer, *queue,
+		 queue_ds.msg_cbytes + MONITOR_RECORD_WIRE_SIZE
+		 > queue_ds.msg_qbytes);
+  }
+
+  *rings = 0;
+  for (i = 0; i != num_producers; ++i) {
+    struct producer* p = producers[i];
+    unsigned long long backlog = ring_backlog(p->ring);
+    note_backlog(p, backlog, backlog >= p->num_slots);
+    *rings += backlog;
+  }
+  pthread_mutex_unlock(&producers_mutex);
+}
+
+//*****************************************************************************
+
+void print_producers()
+{
+  struct msqid_ds queue_ds;
+  int i;
+
+  pthread_mutex_lock(&producers_mutex);
+  printf("%8s %6s %10s %10s %10s %10s %10s %12s\n", "PID", "WEIGHT",
+	 "BACKLOG", "CAPACITY", "HIGHWATER", "FULL", "DROPS", "DELIVERED");
+  if (message_queue_id != -1) {
+    if (!msgctl(message_queue_id, IPC_STAT, &queue_ds)) {
+      struct producer* p = &message_queue_producer;
+      note_backlog(p, queue_ds.msg_qnum, queue_ds.msg_cbytes +
+		   MONITOR_RECORD_WIRE_SIZE > queue_ds.msg_qbytes);
+      printf("%8s %6d %10lu %10lu %10llu %10llu %10s %12llu\n", "queue",
+	     p->weight, (unsigned long)queue_ds.msg_qnum,
+	     (unsigned long)(queue_ds.msg_qbytes / MONITOR_RECORD_WIRE_SIZE),
+	     p->high_water, p->full_samples, "n/a", p->delivered);
+    }
+  }
+  for (i = 0; i != num_producers; ++i) {
+    struct producer* p = producers[i];
+    unsigned long long backlog = ring_backlog(p->ring);
+    note_backlog(p, backlog, backlog >= p->num_slots);
+    printf("%8d %6d %10llu %10u %10llu %10llu %10llu %12llu\n", p->pid,
+	   p->weight, backlog, p->num_slots, p->high_water, p->full_samples,
+	   __atomic_load_n(&p->ring->drops, __ATOMIC_RELAXED), p->delivered);
+  }
+  pthread_mutex_unlock(&producers_mutex);
+}
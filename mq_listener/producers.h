@@ -0,0 +1,59 @@
+//
+// Copyright (c) 2017 Intel Corporation
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+// implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef __PRODUCERS_H
+#define __PRODUCERS_H
+
+/* sources of records: SysV message queue and per-process rings
+ * discovered in ring directory. Sources are served by deficit round
+ * robin, so a chatty process can't delay records of quiet ones */
+
+typedef void (*record_dispatch_fun)(struct monitor_record_t* rec);
+
+/* set message queue served as one of sources */
+void set_message_queue_source(int message_queue_id);
+
+/* tries to make message queue hold given number of full records,
+ * warning when limits don't allow it; returns records it holds */
+unsigned int size_message_queue(unsigned int records);
+
+/* start watching directory for <pid>.ring files */
+int set_ring_dir(const char* path);
+
+/* weight (records per round, in quanta) of producer given by pid,
+ * or of message queue when pid is 0 */
+int set_producer_weight(int pid, int weight);
+
+/* one scheduling round over all sources; returns number of records
+ * passed to dispatch */
+int receive_round(record_dispatch_fun dispatch);
+
+/* whether any ring may hold records; rings can't be waited on, so
+ * while they are in use an idle listener polls */
+int rings_in_use();
+
+/* blocks until a record comes through message queue, but at most
+ * timeout_us; returns number of records passed to dispatch */
+int wait_message_queue(record_dispatch_fun dispatch, unsigned long timeout_us);
+
+/* number of messages in queue and of records in all rings; also
+ * updates high-water marks of producers */
+void sample_backlog(unsigned long long* queue, unsigned long long* rings);
+
+/* print per-producer backlog, drop and delivery counters */
+void print_producers();
+
+#endif
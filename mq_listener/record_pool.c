@@ -0,0 +1,233 @@
+//
+// Copyright (c) 2017 Intel Corporation
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+// implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <assert.h>
+#include <pthread.h>
+
+#include "mq.h"
+#include "record_pool.h"
+
+/* buffers are allocated in chunks and never returned to the system;
+ * pool grows up to the peak number of records held at once. Each thread
+ * keeps a cache of free buffers and exchanges them with the shared list
+ * CACHE_BATCH at a time, so the pool mutex is not taken per record */
+#define RECORDS_PER_CHUNK 64
+#define CACHE_BATCH 32
+#define RECORD_BUFFER_MAGIC 0x52454342  /* "RECB" */
+
+struct record_buffer {
+  struct record_buffer* next_free;
+  unsigned int magic;
+  int refcount;
+  MONITOR_MESSAGE message;
+};
+
+struct record_cache {
+  struct record_buffer* head;
+  unsigned int count;
+  int registered;             /* for return of buffers on thread exit */
+};
+
+static struct record_buffer* free_buffers = NULL;
+static pthread_mutex_t pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+static char pool_hostname[HOSTNAME_LEN];
+
+static __thread struct record_cache cache;
+static pthread_key_t cache_key;
+static pthread_once_t cache_key_once = PTHREAD_ONCE_INIT;
+
+#define buffer_of(rec) ((struct record_buffer*)((char*)(rec) - \
+  offsetof(struct record_buffer, message.monitor_record)))
+
+//*****************************************************************************
+
+void init_record_pool(const char* hostname)
+{
+  strncpy(pool_hostname, hostname, HOSTNAME_LEN - 1);
+}
+
+//*****************************************************************************
+
+/* must be called with pool_mutex held */
+static int grow_pool()
+{
+  struct record_buffer* chunk =
+    calloc(RECORDS_PER_CHUNK, sizeof(struct record_buffer));
+  int i;
+
+  if (!chunk)
+    return 1;
+
+  for (i = 0; i != RECORDS_PER_CHUNK; ++i) {
+    chunk[i].magic = RECORD_BUFFER_MAGIC;
+    /* per-host constants are set once, as no message ever overwrites them */
+    memcpy(chunk[i].message.monitor_record.hostname, pool_hostname,
+	   HOSTNAME_LEN);
+    chunk[i].next_free = free_buffers;
+    free_buffers = &chunk[i];
+  }
+  return 0;
+}
+
+//*****************************************************************************
+
+/* moves up to count cached buffers to the shared list */
+static void return_buffers(struct record_cache* c, unsigned int count)
+{
+  struct record_buffer* first = c->head;
+  struct record_buffer* last = first;
+  unsigned int n;
+
+  if (!first)
+    return;
+  for (n = 1; n < count && last->next_free; ++n)
+    last = last->next_free;
+  c->head = last->next_free;
+  c->count -= n;
+
+  pthread_mutex_lock(&pool_mutex);
+  last->next_free = free_buffers;
+  free_buffers = first;
+  pthread_mutex_unlock(&pool_mutex);
+}
+
+//*****************************************************************************
+
+static void flush_cache(void* c)
+{
+  return_buffers(c, ((struct record_cache*)c)->count);
+}
+
+//*****************************************************************************
+
+static void create_cache_key()
+{
+  pthread_key_create(&cache_key, flush_cache);
+}
+
+//*****************************************************************************
+
+static void register_cache()
+{
+  pthread_once(&cache_key_once, create_cache_key);
+  pthread_setspecific(cache_key, &cache);
+  cache.registered = 1;
+}
+
+//*****************************************************************************
+
+struct monitor_record_t* alloc_record()
+{
+  struct record_buffer* buffer;
+
+  if (!cache.head) {
+    if (!cache.registered)
+      register_cache();
+
+    pthread_mutex_lock(&pool_mutex);
+    if (!free_buffers && grow_pool()) {
+      pthread_mutex_unlock(&pool_mutex);
+      return NULL;
+    }
+    while (free_buffers && cache.count != CACHE_BATCH) {
+      buffer = free_buffers;
+      free_buffers = buffer->next_free;
+      buffer->next_free = cache.head;
+      cache.head = buffer;
+      cache.count++;
+    }
+    pthread_mutex_unlock(&pool_mutex);
+  }
+
+  buffer = cache.head;
+  cache.head = buffer->next_free;
+  cache.count--;
+  buffer->refcount = 1;
+  return &buffer->message.monitor_record;
+}
+
+//*****************************************************************************
+
+MONITOR_MESSAGE* record_message(struct monitor_record_t* rec)
+{
+  return &buffer_of(rec)->message;
+}
+
+//*****************************************************************************
+
+void complete_record(struct monitor_record_t* rec, size_t received)
+{
+  rec->device[0] = 0;
+  if (received <= offsetof(struct monitor_record_t, s1)) {
+    rec->s1[0] = 0;
+    rec->s2[0] = 0;
+  } else if (received <= offsetof(struct monitor_record_t, s2)) {
+    rec->s2[0] = 0;
+  }
+}
+
+//*****************************************************************************
+
+struct monitor_record_t* copy_record(const struct monitor_record_t* rec)
+{
+  struct monitor_record_t* copy = alloc_record();
+  size_t n;
+
+  if (!copy)
+    return NULL;
+  memcpy(copy, rec, offsetof(struct monitor_record_t, s1));
+  n = strnlen(rec->s1, PATH_MAX - 1);
+  memcpy(copy->s1, rec->s1, n);
+  copy->s1[n] = 0;
+  n = strnlen(rec->s2, STR_LEN - 1);
+  memcpy(copy->s2, rec->s2, n);
+  copy->s2[n] = 0;
+  memcpy(copy->hostname, rec->hostname, HOSTNAME_LEN);
+  memcpy(copy->device, rec->device, DEVICE_LEN);
+  return copy;
+}
+
+//*****************************************************************************
+
+void retain_record(struct monitor_record_t* rec)
+{
+  struct record_buffer* buffer = buffer_of(rec);
+  assert(buffer->magic == RECORD_BUFFER_MAGIC);
+  __atomic_fetch_add(&buffer->refcount, 1, __ATOMIC_RELAXED);
+}
+
+//*****************************************************************************
+
+void release_record(struct monitor_record_t* rec)
+{
+  struct record_buffer* buffer = buffer_of(rec);
+  assert(buffer->magic == RECORD_BUFFER_MAGIC);
+  if (__atomic_sub_fetch(&buffer->refcount, 1, __ATOMIC_ACQ_REL))
+    return;
+
+  /* records retained by branch threads are released there; threads
+   * which only release hand the surplus back to the shared list */
+  if (!cache.registered)
+    register_cache();
+  buffer->next_free = cache.head;
+  cache.head = buffer;
+  if (++cache.count > 2 * CACHE_BATCH)
+    return_buffers(&cache, CACHE_BATCH);
+}
@@ -0,0 +1,45 @@
+//
+// Copyright (c) 2017 Intel Corporation
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+// implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef __RECORD_POOL_H
+#define __RECORD_POOL_H
+
+/* pool of reference counted record buffers. Records are received
+ * directly into pooled buffers; plugins may retain a record passed to
+ * process_data and release it later from any thread */
+
+/* sets per-host constants attached to every pooled record */
+void init_record_pool(const char* hostname);
+
+/* returns record with reference count 1; listener-populated fields
+ * (hostname) are already filled in. NULL if out of memory */
+struct monitor_record_t* alloc_record();
+
+/* message buffer of pooled record, suitable for msgrcv */
+MONITOR_MESSAGE* record_message(struct monitor_record_t* rec);
+
+/* clears listener-populated per-record fields and strings which were
+ * not part of a (possibly truncated) received message */
+void complete_record(struct monitor_record_t* rec, size_t received);
+
+/* new record (reference count 1) with same contents; strings are
+ * copied up to their terminators only. NULL if out of memory */
+struct monitor_record_t* copy_record(const struct monitor_record_t* rec);
+
+void retain_record(struct monitor_record_t* rec);
+void release_record(struct monitor_record_t* rec);
+
+#endif
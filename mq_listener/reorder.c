@@ -0,0 +1,348 @@
+//
+// Copyright (c) 2017 Intel Corporation
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+// implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "mq.h"
+#include "record_pool.h"
+#include "reorder.h"
+
+/* records held at once; when exceeded, oldest ones are passed on even
+ * though they are still inside window */
+#define MAX_HELD_RECORDS 8192
+#define MIN_STREAM_TABLE_SIZE 64
+
+struct stream {
+  int pid;
+  int heap_index;                      /* -1 when stream is empty */
+  unsigned int head;                   /* circular buffer of records */
+  unsigned int count;
+  unsigned int capacity;
+  struct monitor_record_t** records;
+};
+
+/* open addressing table of streams keyed by pid */
+static struct stream** streams = NULL;
+static unsigned int table_size = 0;
+static unsigned int num_streams = 0;
+
+/* min-heap of non-empty streams keyed by timestamp of their oldest
+ * record */
+static struct stream** heap = NULL;
+static unsigned int heap_size = 0;
+
+/* set by command thread, everything else belongs to ingest thread */
+static long long window_ns = 0;
+
+static unsigned long long held = 0;
+static unsigned long long passed = 0;
+static unsigned long long late = 0;
+static unsigned long long lost = 0;
+static unsigned long long last_passed_ns = 0;
+
+//*****************************************************************************
+
+static inline unsigned long long record_time(const struct monitor_record_t* rec)
+{
+  if (rec->timestamp_ns)
+    return rec->timestamp_ns;
+  return (unsigned long long)rec->timestamp * 1000000000ULL;
+}
+
+//*****************************************************************************
+
+static inline struct monitor_record_t* stream_at(const struct stream* s,
+						 unsigned int i)
+{
+  return s->records[(s->head + i) & (s->capacity - 1)];
+}
+
+//*****************************************************************************
+
+static inline unsigned long long stream_key(const struct stream* s)
+{
+  return record_time(stream_at(s, 0));
+}
+
+//*****************************************************************************
+
+void set_reorder_window(long long window)
+{
+  __atomic_store_n(&window_ns, window, __ATOMIC_RELAXED);
+}
+
+//*****************************************************************************
+
+long long get_reorder_window()
+{
+  return __atomic_load_n(&window_ns, __ATOMIC_RELAXED);
+}
+
+//*****************************************************************************
+
+static void heap_swap(unsigned int a, unsigned int b)
+{
+  struct stream* tmp = heap[a];
+  heap[a] = heap[b];
+  heap[b] = tmp;
+  heap[a]->heap_index = a;
+  heap[b]->heap_index = b;
+}
+
+//*****************************************************************************
+
+static void sift_up(unsigned int i)
+{
+  while (i) {
+    unsigned int parent = (i - 1) / 2;
+    if (stream_key(heap[parent]) <= stream_key(heap[i]))
+      break;
+    heap_swap(parent, i);
+    i = parent;
+  }
+}
+
+//*****************************************************************************
+
+static void sift_down(unsigned int i)
+{
+  for (;;) {
+    unsigned int smallest = i;
+    unsigned int child = 2 * i + 1;
+    if (child < heap_size &&
+	stream_key(heap[child]) < stream_key(heap[smallest]))
+      smallest = child;
+    child++;
+    if (child < heap_size &&
+	stream_key(heap[child]) < stream_key(heap[smallest]))
+      smallest = child;
+    if (smallest == i)
+      break;
+    heap_swap(i, smallest);
+    i = smallest;
+  }
+}
+
+//*****************************************************************************
+
+/* (re)builds stream table with room for at least min_streams, leaving
+ * out empty streams */
+static int rebuild_stream_table(unsigned int min_streams)
+{
+  unsigned int new_size = MIN_STREAM_TABLE_SIZE;
+  struct stream** new_streams;
+  unsigned int i;
+
+  while (new_size < 2 * min_streams)
+    new_size *= 2;
+  new_streams = calloc(new_size, sizeof(struct stream*));
+  if (!new_streams)
+    return 1;
+
+  num_streams = 0;
+  for (i = 0; i != table_size; ++i) {
+    struct stream* s = streams[i];
+    unsigned int j;
+    if (!s)
+      continue;
+    if (!s->count) {
+      free(s->records);
+      free(s);
+      continue;
+    }
+    j = (unsigned int)s->pid & (new_size - 1);
+    while (new_streams[j])
+      j = (j + 1) & (new_size - 1);
+    new_streams[j] = s;
+    num_streams++;
+  }
+  free(streams);
+  streams = new_streams;
+  table_size = new_size;
+  return 0;
+}
+
+//*****************************************************************************
+
+static struct stream* find_stream(int pid)
+{
+  unsigned int i;
+
+  if (2 * (num_streams + 1) > table_size) {
+    if (rebuild_stream_table(heap_size + 1))
+      return NULL;
+    /* keep heap big enough for every stream which can be in it */
+    if (table_size > 0) {
+      struct stream** new_heap =
+	realloc(heap, table_size * sizeof(struct stream*));
+      if (!new_heap)
+	return NULL;
+      heap = new_heap;
+    }
+  }
+
+  i = (unsigned int)pid & (table_size - 1);
+  while (streams[i]) {
+    if (streams[i]->pid == pid)
+      return streams[i];
+    i = (i + 1) & (table_size - 1);
+  }
+
+  streams[i] = calloc(1, sizeof(struct stream));
+  if (!streams[i])
+    return NULL;
+  streams[i]->pid = pid;
+  streams[i]->heap_index = -1;
+  num_streams++;
+  return streams[i];
+}
+
+//*****************************************************************************
+
+static int grow_stream(struct stream* s)
+{
+  unsigned int new_capacity = s->capacity ? 2 * s->capacity : 16;
+  struct monitor_record_t** records =
+    malloc(new_capacity * sizeof(struct monitor_record_t*));
+  unsigned int i;
+
+  if (!records)
+    return 1;
+  for (i = 0; i != s->count; ++i)
+    records[i] = stream_at(s, i);
+  free(s->records);
+  s->records = records;
+  s->capacity = new_capacity;
+  s->head = 0;
+  return 0;
+}
+
+//*****************************************************************************
+
+void reorder_record(struct monitor_record_t* rec)
+{
+  const unsigned long long t = record_time(rec);
+  struct stream* s = find_stream(rec->pid);
+  unsigned int i;
+
+  if (!s || (s->count == s->capacity && grow_stream(s))) {
+    lost++;
+    return;
+  }
+  retain_record(rec);
+
+  /* threads of a process may send records slightly out of order;
+   * keep stream sorted by moving newer records back */
+  i = s->count;
+  while (i && record_time(stream_at(s, i - 1)) > t) {
+    s->records[(s->head + i) & (s->capacity - 1)] = stream_at(s, i - 1);
+    i--;
+  }
+  s->records[(s->head + i) & (s->capacity - 1)] = rec;
+  s->count++;
+  held++;
+
+  if (s->heap_index == -1) {
+    s->heap_index = heap_size;
+    heap[heap_size++] = s;
+    sift_up(s->heap_index);
+  } else if (i == 0) {
+    sift_up(s->heap_index);
+  }
+}
+
+//*****************************************************************************
+
+int flush_reordered(record_dispatch_fun dispatch)
+{
+  const long long window = get_reorder_window();
+  unsigned long long watermark = ~0ULL;
+  struct timespec now;
+  int n = 0;
+
+  if (!heap_size) {
+    /* ordering was turned off; no need to keep streams around */
+    if (!window && num_streams)
+      rebuild_stream_table(0);
+    return 0;
+  }
+
+  if (window) {
+    clock_gettime(CLOCK_REALTIME, &now);
+    watermark = (unsigned long long)now.tv_sec * 1000000000ULL + now.tv_nsec;
+    watermark = watermark > (unsigned long long)window ?
+      watermark - window : 0;
+  }
+
+  while (heap_size) {
+    struct stream* s = heap[0];
+    struct monitor_record_t* rec = stream_at(s, 0);
+    const unsigned long long t = record_time(rec);
+
+    if (t > watermark && held <= MAX_HELD_RECORDS)
+      break;
+
+    s->head = (s->head + 1) & (s->capacity - 1);
+    s->count--;
+    held--;
+    if (s->count) {
+      sift_down(0);
+    } else {
+      s->heap_index = -1;
+      if (--heap_size) {
+	heap[0] = heap[heap_size];
+	heap[0]->heap_index = 0;
+	sift_down(0);
+      }
+    }
+
+    /* record came later than window allowed for */
+    if (t < last_passed_ns)
+      late++;
+    else
+      last_passed_ns = t;
+
+    dispatch(rec);
+    release_record(rec);
+    passed++;
+    n++;
+  }
+  return n;
+}
+
+//*****************************************************************************
+
+unsigned long long reorder_held()
+{
+  return held;
+}
+
+//*****************************************************************************
+
+void print_reorder_stats()
+{
+  long long window = get_reorder_window();
+
+  if (window)
+    printf("reorder window: %.3f ms\n", window / 1000000.0);
+  else
+    printf("reorder window: off\n");
+  printf("held: %llu passed: %llu late: %llu lost: %llu streams: %u\n",
+	 held, passed, late, lost, num_streams);
+}
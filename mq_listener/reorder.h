@@ -0,0 +1,46 @@
+//
+// Copyright (c) 2017 Intel Corporation
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+// implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef __REORDER_H
+#define __REORDER_H
+
+/* optional ordering stage between producers and plugin chain. Records
+ * of each process form a stream ordered by timestamp_ns; streams are
+ * merged through a heap over their oldest records. A record is passed
+ * on once it is older than the reorder window, so output is globally
+ * ordered as long as no record arrives later than that */
+
+#include "producers.h"
+
+/* 0 turns ordering off; records still held are passed on by next
+ * flush_reordered() */
+void set_reorder_window(long long window_ns);
+long long get_reorder_window();
+
+/* takes a reference and holds record until it may be passed on;
+ * has signature of record_dispatch_fun */
+void reorder_record(struct monitor_record_t* rec);
+
+/* passes on (and releases) records which left reorder window;
+ * returns number of records passed on */
+int flush_reordered(record_dispatch_fun dispatch);
+
+/* number of records held back */
+unsigned long long reorder_held();
+
+void print_reorder_stats();
+
+#endif
@@ -17,169 +17,503 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/param.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <limits.h>
+#include <signal.h>
+#include <errno.h>
 #include <string>
-#include <map>
+#include <vector>
+#include <algorithm>
 
 #include "resolver.h"
 #include "monitor_record.h"
 
 
-#define LEN_DEVICE_NAME 40
-#define LEN_MAJ_MIN 10
-#define LEN_DEVICE_SIZE 10
-#define LEN_DEVICE_TYPE 40
-#define LEN_MOUNT_POINT 256
-
-typedef struct _device_config {
-   char device_name[LEN_DEVICE_NAME];
-   char maj_min[LEN_MAJ_MIN];
-   char rm;
-   char device_size[LEN_DEVICE_SIZE];
-   char ro;
-   char device_type[LEN_DEVICE_TYPE];
-   char mount_point[LEN_MOUNT_POINT];
-} device_config;
+#define MOUNTINFO_PATH "/proc/self/mountinfo"
+#define MOUNTS_PATH "/proc/self/mounts"
+#define SYS_DEV_BLOCK_PATH "/sys/dev/block/"
+#define MOUNTS_CHECK_NS 1000000000ULL   // how often mount changes are polled
+#define CACHE_SETS 1024                  // power of 2
+#define CACHE_WAYS 4
+#define MIN_FD_SLOTS 1024                // power of 2
+#define MAX_FDS (1 << 18)                // descriptors tracked at most
+#define PROCESSES_CHECK_NS 10000000000ULL   // how often exits are looked for
 
 
 using namespace std;
 
 
-// mapping of file system mount points to devices
-static map<string,string> fs_mount_path_to_dev;
-static string root_fs_dev;  // device for root file system
+// mount points as a tree of path components. Device of a path is that
+// of the deepest mount point on its way down, found in one walk of its
+// components
+struct mount_node {
+   vector<pair<string, mount_node*> > children;   // few per node
+   int device;                                    // -1 if not a mount point
+
+   mount_node() : device(-1) {}
+   ~mount_node() {
+      for (size_t i = 0; i != children.size(); ++i) {
+         delete children[i].second;
+      }
+   }
+};
+
+// recent lookups; set associative, least recently used way is replaced
+struct cache_entry {
+   unsigned long long hash;
+   unsigned int generation;   // entry is valid if it is the current one
+   unsigned int used;         // higher is more recent
+   int device;
+   string path;
+};
+
+// names of devices, each stored once; mount tree refers to them by index
+static vector<string> devices;
+static mount_node* mount_root = NULL;
+
+static int mounts_fd = -1;
+static unsigned long long mounts_checked_ns = 0;
+
+static cache_entry path_cache[CACHE_SETS][CACHE_WAYS];
+static unsigned int cache_generation = 1;
+static unsigned int cache_clock = 0;
 
-// mapping of file descriptors to devices
-static map<int,string> fd_to_dev;
+// devices of descriptors, by (pid, fd). Open addressing with linear
+// probing; key 0 marks empty slot
+struct fd_slot {
+   unsigned long long key;
+   int device;
+};
+
+static fd_slot* fd_table = NULL;
+static unsigned int fd_table_size = 0;   // power of 2
+static unsigned int fd_count = 0;
+static unsigned long long processes_checked_ns = 0;
 
 
 //*****************************************************************************
 
-int parse_device_fields(const char* device_fields, device_config* dc)
-{
-   char* pos_equal;
-   char* token;
-   char* buf_copy;
-   char* rest;
-   char* pos_open_quote;
-   char* pos_close_quote;
-   char* pos_field_value;
-   int j = 0;
-   int num_field_chars;
+static int intern_device(const string& name) {
+   for (size_t i = 0; i != devices.size(); ++i) {
+      if (devices[i] == name) {
+         return i;
+      }
+   }
+   devices.push_back(name);
+   return devices.size() - 1;
+}
 
-   buf_copy = strdup(device_fields);
-   rest = buf_copy;
-   memset(dc, 0, sizeof(struct _device_config));
+//*****************************************************************************
 
-   //NAME="vda" MAJ:MIN="253:0" RM="0" SIZE="40G" RO="0" TYPE="disk" MOUNTPOINT="" 
-   while (token = strtok_r(rest , " ", &rest)) {
-      pos_equal = strchr(token, '=');
-      if (NULL == pos_equal) {
-         continue;
+// block device backing file system, by kernel name (as lsblk shows it);
+// otherwise file system type and device number, i.e. tmpfs:0:45, so that
+// mounts of same type are told apart. Type is shortened to fit DEVICE_LEN
+// with its terminator
+static string device_name(const char* maj_min, const char* fs_type) {
+   const size_t max_len = DEVICE_LEN - 1;
+   char link[PATH_MAX];
+   string path = string(SYS_DEV_BLOCK_PATH) + maj_min;
+   const ssize_t len = readlink(path.c_str(), link, sizeof(link) - 1);
+
+   if (len > 0) {
+      link[len] = 0;
+      const char* name = strrchr(link, '/');
+      return string(name ? name + 1 : link).substr(0, max_len);
+   }
+   const string number = string(":") + maj_min;
+   if (number.size() >= max_len) {
+      return string(maj_min).substr(0, max_len);
+   }
+   return string(fs_type).substr(0, max_len - number.size()) + number;
+}
+
+//*****************************************************************************
+
+// mountinfo escapes space, tab, newline and backslash as \ooo
+static void unescape(char* s) {
+   char* out = s;
+
+   for (; *s; ++s) {
+      if ((s[0] == '\\') && (s[1] >= '0') && (s[1] <= '3') &&
+          (s[2] >= '0') && (s[2] <= '7') && (s[3] >= '0') && (s[3] <= '7')) {
+         *out++ = ((s[1] - '0') << 6) | ((s[2] - '0') << 3) | (s[3] - '0');
+         s += 3;
+      } else {
+         *out++ = *s;
       }
-      pos_open_quote = strchr(pos_equal+1, '"');
-      if (NULL == pos_open_quote) {
-         continue;
+   }
+   *out = 0;
+}
+
+//*****************************************************************************
+
+static void add_mount(mount_node* root, const char* mount_point, int device) {
+   mount_node* node = root;
+   const char* p = mount_point;
+
+   while (*p) {
+      while (*p == '/') {
+         ++p;
+      }
+      const size_t len = strcspn(p, "/");
+      if (!len) {
+         break;
       }
-      pos_field_value = pos_open_quote + 1;
+      size_t i;
+      for (i = 0; i != node->children.size(); ++i) {
+         const string& name = node->children[i].first;
+         if ((name.size() == len) && !memcmp(name.data(), p, len)) {
+            break;
+         }
+      }
+      if (i == node->children.size()) {
+         node->children.push_back(make_pair(string(p, len), new mount_node()));
+      }
+      node = node->children[i].second;
+      p += len;
+   }
+   // mounts are listed in order; later one on same point hides earlier
+   node->device = device;
+}
+
+//*****************************************************************************
+
+static void load_mounts() {
+   FILE* f = fopen(MOUNTINFO_PATH, "r");
+   char* line = NULL;
+   size_t size = 0;
+   char maj_min[32];
+   char mount_point[PATH_MAX];
+   char fs_type[64];
+   mount_node* root;
 
-      pos_close_quote = strchr(pos_field_value, '"');
-      if (NULL == pos_close_quote) {
+   if (f == NULL) {
+      return;
+   }
+   root = new mount_node();
+
+   //36 35 98:0 /mnt1 /mnt2 rw,noatime master:1 - ext3 /dev/root rw,errors=continue
+   while (getline(&line, &size, f) > 0) {
+      const char* separator = strstr(line, " - ");
+      if ((separator == NULL) ||
+          (sscanf(line, "%*d %*d %31s %*s %4095s", maj_min, mount_point) != 2) ||
+          (sscanf(separator + 3, "%63s", fs_type) != 1)) {
          continue;
       }
+      unescape(mount_point);
+      add_mount(root, mount_point, intern_device(device_name(maj_min, fs_type)));
+   }
+   free(line);
+   fclose(f);
 
-      num_field_chars = pos_close_quote - pos_open_quote - 1;
+   delete mount_root;
+   mount_root = root;
+   ++cache_generation;
+}
 
-      switch (j) {
-         case 0:
-            memcpy(dc->device_name,
-                   pos_field_value,
-                   MIN(LEN_DEVICE_NAME, num_field_chars));
-            break;
-         case 1:
-            memcpy(dc->maj_min,
-                   pos_field_value,
-                   MIN(LEN_MAJ_MIN, num_field_chars));
-            break;
-         case 2:
-            dc->rm = pos_field_value[0];
-            break;
-         case 3:
-            memcpy(dc->device_size,
-                   pos_field_value,
-                   MIN(LEN_DEVICE_SIZE, num_field_chars));
-            break;
-         case 4:
-            dc->ro = pos_field_value[0];
-            break;
-         case 5:
-            memcpy(dc->device_type,
-                   pos_field_value,
-                   MIN(LEN_DEVICE_TYPE, num_field_chars));
-            break;
-         case 6:
-            memcpy(dc->mount_point,
-                   pos_field_value,
-                   MIN(LEN_MOUNT_POINT, num_field_chars));
-            break;
-         default:
+//*****************************************************************************
+
+static unsigned long long coarse_now() {
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+   return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+//*****************************************************************************
+
+// kernel flags /proc/self/mounts when mounts change; checked at most
+// once per MOUNTS_CHECK_NS, so that lookups rarely pay for a system call
+static void check_mounts(unsigned long long now) {
+   struct pollfd pfd;
+
+   if ((mounts_fd < 0) || (now - mounts_checked_ns < MOUNTS_CHECK_NS)) {
+      return;
+   }
+   mounts_checked_ns = now;
+
+   pfd.fd = mounts_fd;
+   pfd.events = POLLPRI;
+   pfd.revents = 0;
+   if ((poll(&pfd, 1, 0) > 0) && (pfd.revents & (POLLPRI | POLLERR))) {
+      load_mounts();
+   }
+}
+
+//*****************************************************************************
+
+void capture_device_info() {
+   if (mounts_fd < 0) {
+      mounts_fd = open(MOUNTS_PATH, O_RDONLY | O_CLOEXEC);
+   }
+   load_mounts();
+}
+
+//*****************************************************************************
+
+// relative paths are taken as being on root file system
+static int tree_lookup(const char* path) {
+   const mount_node* node = mount_root;
+   const char* p = path;
+   int device;
+
+   if (node == NULL) {
+      return -1;
+   }
+   device = node->device;
+   while (*p) {
+      while (*p == '/') {
+         ++p;
+      }
+      const size_t len = strcspn(p, "/");
+      if (!len) {
+         break;
+      }
+      size_t i;
+      for (i = 0; i != node->children.size(); ++i) {
+         const string& name = node->children[i].first;
+         if ((name.size() == len) && !memcmp(name.data(), p, len)) {
             break;
+         }
+      }
+      if (i == node->children.size()) {
+         break;
       }
-      j++;
+      node = node->children[i].second;
+      if (node->device >= 0) {
+         device = node->device;
+      }
+      p += len;
    }
+   return device;
+}
 
-   free(buf_copy);
-   return j;
+//*****************************************************************************
+
+static int path_to_dev(const char* path) {
+   const size_t len = strlen(path);
+   unsigned long long hash = 14695981039346656037ULL;
+   cache_entry* victim;
+   int i;
+
+   for (size_t j = 0; j != len; ++j) {
+      hash = (hash ^ (unsigned char)path[j]) * 1099511628211ULL;
+   }
+   cache_entry* set = path_cache[hash & (CACHE_SETS - 1)];
+   victim = &set[0];
+   for (i = 0; i != CACHE_WAYS; ++i) {
+      cache_entry* e = &set[i];
+      if (e->generation != cache_generation) {
+         victim = e;
+         continue;
+      }
+      if ((e->hash == hash) && (e->path.size() == len) &&
+          !memcmp(e->path.data(), path, len)) {
+         e->used = ++cache_clock;
+         return e->device;
+      }
+      if ((victim->generation == cache_generation) && (e->used < victim->used)) {
+         victim = e;
+      }
+   }
+
+   victim->hash = hash;
+   victim->generation = cache_generation;
+   victim->used = ++cache_clock;
+   victim->device = tree_lookup(path);
+   victim->path.assign(path, len);
+   return victim->device;
+}
+
+// fd + 1, so that no key is 0
+static unsigned long long fd_key(int pid, int fd) {
+   return ((unsigned long long)(unsigned int)pid << 32) | (unsigned int)(fd + 1);
 }
 
 //*****************************************************************************
 
-void capture_device_info() {
-   FILE* f;
-   char path[256];
-   device_config dc;
-   int fields_parsed;
+static unsigned int fd_home(unsigned long long key) {
+   return (unsigned int)((key * 0x9e3779b97f4a7c15ULL) >> 32) &
+      (fd_table_size - 1);
+}
 
-   f = popen("lsblk -P", "r");
-   if (f == NULL) {
-      return;
+//*****************************************************************************
+
+// slot holding key, or -1
+static int fd_find(unsigned long long key) {
+   unsigned int i;
+
+   if (fd_count == 0) {
+      return -1;
    }
+   for (i = fd_home(key); fd_table[i].key; i = (i + 1) & (fd_table_size - 1)) {
+      if (fd_table[i].key == key) {
+         return i;
+      }
+   }
+   return -1;
+}
+
+//*****************************************************************************
 
-   /* read output one line at a time */
-   while (fgets(path, sizeof(path)-1, f) != NULL) {
-      fields_parsed = parse_device_fields(path, &dc);
-      if (fields_parsed == 7) {
-         if (!strcmp(dc.mount_point, "/")) {
-            root_fs_dev = string(dc.device_name);
-         } else {
-            fs_mount_path_to_dev[string(dc.mount_point)] = string(dc.device_name);
+// empties slot, moving back later keys of the same probe sequence, so
+// that lookups need no tombstones
+static void fd_remove_at(unsigned int i) {
+   const unsigned int mask = fd_table_size - 1;
+   unsigned int j = i;
+
+   for (;;) {
+      fd_table[i].key = 0;
+      for (;;) {
+         j = (j + 1) & mask;
+         if (!fd_table[j].key) {
+            --fd_count;
+            return;
+         }
+         // key at j can move to i unless its home lies in (i, j]
+         if (((j - fd_home(fd_table[j].key)) & mask) >= ((j - i) & mask)) {
+            break;
          }
       }
+      fd_table[i] = fd_table[j];
+      i = j;
+   }
+}
+
+//*****************************************************************************
+
+static int fd_grow() {
+   const unsigned int size = fd_table_size ? 2 * fd_table_size : MIN_FD_SLOTS;
+   fd_slot* table = (fd_slot*)calloc(size, sizeof(fd_slot));
+   fd_slot* old_table = fd_table;
+   const unsigned int old_size = fd_table_size;
+   unsigned int i, j;
+
+   if (table == NULL) {
+      return -1;
+   }
+   fd_table = table;
+   fd_table_size = size;
+   for (j = 0; j != old_size; ++j) {
+      if (old_table[j].key) {
+         for (i = fd_home(old_table[j].key); fd_table[i].key;
+              i = (i + 1) & (size - 1))
+            ;
+         fd_table[i] = old_table[j];
+      }
+   }
+   free(old_table);
+   return 0;
+}
+
+//*****************************************************************************
+
+// forgets descriptors of processes matching; slot emptied is refilled
+// from later ones, so it is looked at again
+template <typename Predicate>
+static void fd_remove_if(Predicate matches) {
+   unsigned int i = 0;
+
+   while (fd_count && (i != fd_table_size)) {
+      if (fd_table[i].key && matches((int)(fd_table[i].key >> 32))) {
+         fd_remove_at(i);
+      } else {
+         ++i;
+      }
    }
 }
 
 //*****************************************************************************
 
-const string& path_to_dev(const string& path) {
-   const map<string,string>::const_iterator itEnd = fs_mount_path_to_dev.end();
-   map<string,string>::const_iterator it = fs_mount_path_to_dev.begin();
+// processes may end without STOP record (i.e. killed), so their
+// descriptors are forgotten once they are gone. Slots of a process are
+// scattered over the table, so each process is looked for once
+struct process_exited {
+   vector<int> exited;   // sorted
 
-   for (; it != itEnd; it++) {
-      const string& mount_point = it->first;
-      if (!path.compare(0, mount_point.size(), mount_point)) {
-         return it->second;
+   process_exited() {
+      vector<int> pids;
+      unsigned int i;
+
+      for (i = 0; i != fd_table_size; ++i) {
+         if (fd_table[i].key) {
+            pids.push_back((int)(fd_table[i].key >> 32));
+         }
       }
+      sort(pids.begin(), pids.end());
+      pids.erase(unique(pids.begin(), pids.end()), pids.end());
+      for (i = 0; i != pids.size(); ++i) {
+         if ((kill(pids[i], 0) < 0) && (errno == ESRCH)) {
+            exited.push_back(pids[i]);
+         }
+      }
+   }
+   bool operator()(int p) const {
+      return binary_search(exited.begin(), exited.end(), p);
    }
+};
+
+//*****************************************************************************
+
+struct process_is {
+   int pid;
+
+   process_is(int p) : pid(p) {}
+   bool operator()(int p) const { return p == pid; }
+};
+
+//*****************************************************************************
 
-   return root_fs_dev;
+static void check_processes(unsigned long long now) {
+   if (fd_count && (now - processes_checked_ns >= PROCESSES_CHECK_NS)) {
+      processes_checked_ns = now;
+      process_exited exited;
+      if (!exited.exited.empty()) {
+         fd_remove_if(exited);
+      }
+   }
+}
+
+//*****************************************************************************
+
+// table is bounded; when it is full, descriptor is left unresolved until
+// check_processes finds processes gone. That is not done on each insert,
+// as it signals every process in table
+static void fd_insert(unsigned long long key, int device) {
+   unsigned int i;
+   int slot = fd_find(key);
+
+   if (slot >= 0) {
+      fd_table[slot].device = device;
+      return;
+   }
+   if (fd_count >= MAX_FDS) {
+      return;
+   }
+   if ((2 * (fd_count + 1) > fd_table_size) && fd_grow()) {
+      return;
+   }
+   for (i = fd_home(key); fd_table[i].key; i = (i + 1) & (fd_table_size - 1))
+      ;
+   fd_table[i].key = key;
+   fd_table[i].device = device;
+   ++fd_count;
 }
 
 //*****************************************************************************
 
 void register_file(struct monitor_record_t* rec) {
-   if ((rec->fd != FD_NONE) && (rec->s1 != NULL) && (strlen(rec->s1) > 0)) {
-      const string& dev_id = path_to_dev(string(rec->s1));
-      fd_to_dev[rec->fd] = dev_id;
+   if ((rec->fd != FD_NONE) && (rec->s1[0] != 0)) {
+      const unsigned long long now = coarse_now();
+      check_mounts(now);
+      check_processes(now);
+      const int device = path_to_dev(rec->s1);
+      if (device >= 0) {
+         fd_insert(fd_key(rec->pid, rec->fd), device);
+      }
    }
 }
 
@@ -187,21 +521,28 @@ void register_file(struct monitor_record_t* rec) {
 
 void deregister_file(struct monitor_record_t* rec) {
    if (rec->fd != FD_NONE) {
-      map<int,string>::iterator it = fd_to_dev.find(rec->fd);
-      if (it != fd_to_dev.end()) {
-         fd_to_dev.erase(it);
+      const int slot = fd_find(fd_key(rec->pid, rec->fd));
+      if (slot >= 0) {
+         fd_remove_at(slot);
       }
    }
 }
 
 //*****************************************************************************
 
+void forget_process(struct monitor_record_t* rec) {
+   fd_remove_if(process_is(rec->pid));
+}
+
+//*****************************************************************************
+
 void resolve_file(struct monitor_record_t* rec) {
    if (rec->fd != FD_NONE) {
-      const map<int,string>::const_iterator it = fd_to_dev.find(rec->fd);
-      if (it != fd_to_dev.end()) {
-         const string& dev_id = it->second;
-         strncpy(rec->device, dev_id.c_str(), DEVICE_LEN); 
+      const int slot = fd_find(fd_key(rec->pid, rec->fd));
+      if (slot >= 0) {
+         strncpy(rec->device, devices[fd_table[slot].device].c_str(),
+                 DEVICE_LEN - 1);
+         rec->device[DEVICE_LEN - 1] = 0;
       }
    }
 }
@@ -23,6 +23,7 @@ extern "C" {
    void capture_device_info();
    void register_file(struct monitor_record_t *rec);
    void deregister_file(struct monitor_record_t *rec);
+   void forget_process(struct monitor_record_t *rec);
    void resolve_file(struct monitor_record_t *rec);
 #ifdef __cplusplus
 }
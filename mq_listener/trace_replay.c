@@ -0,0 +1,330 @@
+//
+// Copyright (c) 2017 Intel Corporation
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+// implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "mq.h"
+#include "domains.h"
+#include "ops.h"
+#include "trace_format.h"
+#include "plugin.h"
+#include "plugin_chain.h"
+#include "record_pool.h"
+#include "trace_replay.h"
+
+/* pacing sleeps only when ahead of trace by more than this */
+#define MIN_PACING_SLEEP_NS 1000000LL
+
+struct replay_request {
+  char* path;
+  double speed;
+  int pid;
+};
+
+static pthread_mutex_t request_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct replay_request* requested = NULL;
+
+struct replay {
+  const unsigned char* map;
+  size_t size;
+  double speed;
+  int pid;
+  const char** strings;        /* dictionary of current block */
+  unsigned int strings_capacity;
+  unsigned long long base_ns;  /* trace time of first record passed on */
+  unsigned long long started;  /* CLOCK_MONOTONIC at that moment */
+  unsigned long long records;
+  unsigned long long blocks;
+  unsigned long long skipped_blocks;
+};
+
+//*****************************************************************************
+
+static unsigned long long monotonic_ns()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+//*****************************************************************************
+
+static void copy_string(char* dest, size_t size, const char* src)
+{
+  size_t len = strlen(src);
+  if (len >= size)
+    len = size - 1;
+  memcpy(dest, src, len);
+  dest[len] = 0;
+}
+
+//*****************************************************************************
+
+static void pace(struct replay* r, unsigned long long timestamp_ns)
+{
+  long long ahead;
+  struct timespec ts;
+
+  if (!r->started) {
+    r->base_ns = timestamp_ns;
+    r->started = monotonic_ns();
+    return;
+  }
+  if (timestamp_ns <= r->base_ns)
+    return;
+  ahead = (long long)((timestamp_ns - r->base_ns) / r->speed)
+    - (long long)(monotonic_ns() - r->started);
+  if (ahead > MIN_PACING_SLEEP_NS) {
+    ts.tv_sec = ahead / 1000000000LL;
+    ts.tv_nsec = ahead % 1000000000LL;
+    nanosleep(&ts, NULL);
+  }
+}
+
+//*****************************************************************************
+
+/* returns offset of next block, or 0 when block is malformed */
+static size_t replay_block(struct replay* r, size_t offset)
+{
+  struct trace_block_header block;
+  struct trace_codec_state codec;
+  struct trace_record_strings str;
+  struct monitor_record_t* rec;
+  const unsigned char* p;
+  const unsigned char* end;
+  const char* s;
+  unsigned int i;
+
+  if (offset + sizeof(block) > r->size)
+    return 0;
+  memcpy(&block, r->map + offset, sizeof(block));
+  if (block.magic != TRACE_BLOCK_MAGIC ||
+      (unsigned long long)block.strings_size + block.records_size >
+      r->size - offset - sizeof(block))
+    return 0;
+
+  p = r->map + offset + sizeof(block);
+  end = p + block.strings_size + block.records_size;
+  if (r->pid && (r->pid < block.min_pid || r->pid > block.max_pid)) {
+    r->skipped_blocks++;
+    return end - r->map;
+  }
+
+  if (block.num_strings > r->strings_capacity) {
+    const char** tmp = realloc(r->strings, block.num_strings * sizeof(char*));
+    if (!tmp)
+      return 0;
+    r->strings = tmp;
+    r->strings_capacity = block.num_strings;
+  }
+  s = (const char*)p;
+  for (i = 0; i != block.num_strings; ++i) {
+    const char* nul = memchr(s, 0, (const char*)p + block.strings_size - s);
+    if (!nul)
+      return 0;
+    r->strings[i] = s;
+    s = nul + 1;
+  }
+
+  memset(&codec, 0, sizeof(codec));
+  p += block.strings_size;
+  for (i = 0; i != block.num_records; ++i) {
+    rec = alloc_record();
+    if (!rec)
+      return 0;
+    p = trace_decode_record(p, end, &codec, rec, &str);
+    /* plugins index names of domains and operations by these */
+    if (!p || (unsigned int)rec->dom_type >= END_DOMAINS ||
+        (unsigned int)rec->op_type >= END_OPS ||
+        str.facility >= block.num_strings ||
+        str.hostname >= block.num_strings || str.device >= block.num_strings ||
+        str.s1 >= block.num_strings || str.s2 >= block.num_strings) {
+      release_record(rec);
+      return 0;
+    }
+    if (!r->pid || rec->pid == r->pid) {
+      copy_string(rec->facility, sizeof(rec->facility), r->strings[str.facility]);
+      copy_string(rec->hostname, sizeof(rec->hostname), r->strings[str.hostname]);
+      copy_string(rec->device, sizeof(rec->device), r->strings[str.device]);
+      copy_string(rec->s1, sizeof(rec->s1), r->strings[str.s1]);
+      copy_string(rec->s2, sizeof(rec->s2), r->strings[str.s2]);
+      if (r->speed > 0)
+        pace(r, rec->timestamp_ns ? rec->timestamp_ns :
+             rec->timestamp * 1000000000ULL);
+      execute_plugin_chain(rec);
+      r->records++;
+    }
+    release_record(rec);
+  }
+  r->blocks++;
+  return end - r->map;
+}
+
+//*****************************************************************************
+
+/* index is used when file is complete; returns NULL otherwise */
+static const unsigned char* find_index(struct replay* r,
+                                                  unsigned int* num_blocks)
+{
+  struct trace_footer footer;
+  size_t index_size;
+
+  if (r->size < sizeof(struct trace_file_header) + sizeof(footer))
+    return NULL;
+  memcpy(&footer, r->map + r->size - sizeof(footer), sizeof(footer));
+  index_size = (size_t)footer.num_blocks * sizeof(struct trace_index_entry);
+  if (footer.magic != TRACE_FOOTER_MAGIC ||
+      footer.index_offset + index_size + sizeof(footer) != r->size)
+    return NULL;
+  *num_blocks = footer.num_blocks;
+  return r->map + footer.index_offset;
+}
+
+//*****************************************************************************
+
+int replay_trace(const char* path, double speed, int pid)
+{
+  struct replay r;
+  struct trace_file_header header;
+  const unsigned char* index;
+  struct trace_index_entry entry;
+  unsigned int num_blocks = 0;
+  unsigned int i;
+  unsigned long long start = monotonic_ns();
+  size_t offset;
+  struct stat st;
+  int fd;
+  int rc = 0;
+
+  memset(&r, 0, sizeof(r));
+  r.speed = speed;
+  r.pid = pid;
+
+  fd = open(path, O_RDONLY);
+  if (fd == -1 || fstat(fd, &st)) {
+    fprintf(stderr, "error: unable to open trace '%s': %s\n", path,
+            strerror(errno));
+    if (fd != -1)
+      close(fd);
+    return 1;
+  }
+  r.size = st.st_size;
+  r.map = r.size ? mmap(NULL, r.size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+  close(fd);
+  if (r.map == MAP_FAILED) {
+    fprintf(stderr, "error: unable to map trace '%s'\n", path);
+    return 1;
+  }
+  madvise((void*)r.map, r.size, MADV_SEQUENTIAL);
+
+  if (r.size < sizeof(header))
+    memset(&header, 0, sizeof(header));
+  else
+    memcpy(&header, r.map, sizeof(header));
+  if (memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)) ||
+      header.version != TRACE_VERSION || header.header_size > r.size) {
+    fprintf(stderr, "error: '%s' is not a trace of version %d\n", path,
+            TRACE_VERSION);
+    munmap((void*)r.map, r.size);
+    return 1;
+  }
+
+  index = find_index(&r, &num_blocks);
+  if (index) {
+    for (i = 0; i != num_blocks; ++i) {
+      // entries need not be aligned in file
+      memcpy(&entry, index + i * sizeof(entry), sizeof(entry));
+      if (pid && (pid < entry.min_pid || pid > entry.max_pid)) {
+        r.skipped_blocks++;
+        continue;
+      }
+      if (!replay_block(&r, entry.offset)) {
+        rc = 1;
+        break;
+      }
+    }
+  } else {
+    // writer didn't finish; blocks are walked up to first incomplete one
+    for (offset = header.header_size; offset < r.size; ) {
+      offset = replay_block(&r, offset);
+      if (!offset)
+        break;
+    }
+  }
+  if (rc)
+    fprintf(stderr, "error: trace '%s' is corrupt\n", path);
+
+  flush_plugin_chain();
+  printf("replayed %llu records from %llu blocks (%llu skipped) in %.3f s\n",
+         r.records, r.blocks, r.skipped_blocks,
+         (monotonic_ns() - start) / 1e9);
+  free(r.strings);
+  munmap((void*)r.map, r.size);
+  return rc;
+}
+
+//*****************************************************************************
+
+void request_replay(const char* path, double speed, int pid)
+{
+  struct replay_request* request = malloc(sizeof(struct replay_request));
+
+  if (!request)
+    return;
+  request->path = strdup(path);
+  request->speed = speed;
+  request->pid = pid;
+  pthread_mutex_lock(&request_mutex);
+  if (requested) {
+    free(requested->path);
+    free(requested);
+  }
+  requested = request;
+  pthread_mutex_unlock(&request_mutex);
+}
+
+//*****************************************************************************
+
+int run_requested_replay()
+{
+  struct replay_request* request;
+
+  if (!__atomic_load_n(&requested, __ATOMIC_RELAXED))
+    return 0;
+  pthread_mutex_lock(&request_mutex);
+  request = requested;
+  requested = NULL;
+  pthread_mutex_unlock(&request_mutex);
+  if (!request)
+    return 0;
+
+  replay_trace(request->path, request->speed, request->pid);
+  free(request->path);
+  free(request);
+  return 1;
+}
+
+//*****************************************************************************
@@ -0,0 +1,37 @@
+//
+// Copyright (c) 2017 Intel Corporation
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+// implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#ifndef __TRACE_REPLAY_H
+#define __TRACE_REPLAY_H
+
+/* feeds records of binary trace file (see trace_format.h), as written by
+ * output_trace plugin, to plugin chain, so that captured activity can be
+ * analysed again offline. speed 0 passes records as fast as plugins take
+ * them, 1 keeps original pacing and other values scale it. pid selects
+ * records of one process (0 for all); blocks without it are skipped */
+
+/* replay is run by thread running plugin chain; this queues it for
+ * input loop (or for main, when there is no message queue) */
+void request_replay(const char* path, double speed, int pid);
+
+/* runs queued replay, if any; returns 1 if it did */
+int run_requested_replay();
+
+/* returns 0 on success */
+int replay_trace(const char* path, double speed, int pid);
+
+#endif
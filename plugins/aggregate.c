@@ -0,0 +1,531 @@
+//
+// Copyright (c) 2017 Intel Corporation
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+// implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "plugin.h"
+#include "monitor_record.h"
+#include "latency_histogram.h"
+#include "plugin_helpers.h"
+
+/* plugin configuration is a comma separated list of key=value pairs:
+ *   window=10,slide=5,keys=pid+device+path,pass=on,max_keys=10000
+ * Records are aggregated per domain, operation and chosen keys over
+ * windows of <window> seconds, a new one starting every <slide> seconds
+ * (tumbling windows by default). When a window ends, one summary record
+ * per key is passed to plugins loaded after this one; raw records are
+ * passed on too only with pass=on. Once max_keys keys exist, records of
+ * new keys are counted in an overflow key of their domain and operation */
+#define DEFAULT_WINDOW_S 10
+#define DEFAULT_MAX_KEYS 10000
+#define MAX_PANES 60
+#define OVERFLOW_PATH "*"
+#define INITIAL_TABLE_SIZE 256
+#define FACILITY "aggregate"
+
+#define KEY_PID    1
+#define KEY_DEVICE 2
+#define KEY_PATH   4
+
+/* one slide worth of operations of one key */
+struct pane {
+   unsigned long long errors;
+   unsigned long long bytes;
+   double latency_sum_ms;
+   struct latency_histogram latency;
+};
+
+struct key_entry {
+   unsigned int hash;
+   int pid;
+   int dom_type;
+   int op_type;
+   char device[DEVICE_LEN];
+   char* path;
+   int overflow;              /* stands for keys beyond max_keys */
+   struct key_entry* next;
+   struct pane panes[];       /* ring, indexed by pane number */
+};
+
+struct plugin_state {
+   struct listener* listener;
+   unsigned int keys;
+   int pass;
+   unsigned long long slide_ns;
+   unsigned int num_panes;      /* per window */
+
+   struct key_entry** table;
+   unsigned int table_size;     /* power of 2 */
+   unsigned int num_keys;       /* overflow keys excluded */
+   unsigned int max_keys;
+
+   unsigned long long pane;     /* number of current pane; 0 before first */
+   struct event_clock clock;
+
+   unsigned long long windows;
+   unsigned long long summaries;
+   unsigned long long late;
+   unsigned long long overflowed;   /* records counted in overflow keys */
+};
+
+//*****************************************************************************
+
+static unsigned int key_hash(const struct plugin_state* ps,
+                             const struct monitor_record_t* rec, int overflow)
+{
+   unsigned int hash = FNV_OFFSET;
+
+   hash = fnv_hash(hash, &rec->dom_type, sizeof(rec->dom_type));
+   hash = fnv_hash(hash, &rec->op_type, sizeof(rec->op_type));
+   if (overflow) {
+      return fnv_hash(hash, &overflow, sizeof(overflow));
+   }
+   if (ps->keys & KEY_PID) {
+      hash = fnv_hash(hash, &rec->pid, sizeof(rec->pid));
+   }
+   if (ps->keys & KEY_DEVICE) {
+      hash = fnv_hash(hash, rec->device, strnlen(rec->device, DEVICE_LEN));
+   }
+   if (ps->keys & KEY_PATH) {
+      hash = fnv_hash(hash, rec->s1, strlen(rec->s1));
+   }
+   return hash;
+}
+
+//*****************************************************************************
+
+static int key_matches(const struct plugin_state* ps,
+                       const struct key_entry* e,
+                       const struct monitor_record_t* rec, int overflow)
+{
+   if (e->dom_type != rec->dom_type || e->op_type != rec->op_type ||
+       e->overflow != overflow) {
+      return 0;
+   }
+   if (overflow) {
+      return 1;
+   }
+   return (!(ps->keys & KEY_PID) || e->pid == rec->pid) &&
+      (!(ps->keys & KEY_DEVICE) ||
+       !strncmp(e->device, rec->device, DEVICE_LEN)) &&
+      (!(ps->keys & KEY_PATH) || !strcmp(e->path, rec->s1));
+}
+
+//*****************************************************************************
+
+static struct key_entry* lookup_key(struct plugin_state* ps,
+                                    const struct monitor_record_t* rec,
+                                    unsigned int hash, int overflow)
+{
+   struct key_entry* e;
+
+   for (e = ps->table[hash & (ps->table_size - 1)]; e; e = e->next) {
+      if (e->hash == hash && key_matches(ps, e, rec, overflow)) {
+         return e;
+      }
+   }
+   return NULL;
+}
+
+//*****************************************************************************
+
+// keys beyond max_keys share one overflow key per domain and operation,
+// so that memory stays bounded whatever the number of paths or processes
+static struct key_entry* find_key(struct plugin_state* ps,
+                                  const struct monitor_record_t* rec)
+{
+   unsigned int hash = key_hash(ps, rec, 0);
+   struct key_entry** head;
+   struct key_entry* e;
+   int overflow = 0;
+
+   if ((e = lookup_key(ps, rec, hash, 0))) {
+      return e;
+   }
+   if (ps->num_keys >= ps->max_keys) {
+      overflow = 1;
+      ps->overflowed++;
+      hash = key_hash(ps, rec, 1);
+      if ((e = lookup_key(ps, rec, hash, 1))) {
+         return e;
+      }
+   }
+
+   e = calloc(1, sizeof(struct key_entry) +
+              ps->num_panes * sizeof(struct pane));
+   if (!e) {
+      return NULL;
+   }
+   e->hash = hash;
+   e->dom_type = rec->dom_type;
+   e->op_type = rec->op_type;
+   e->overflow = overflow;
+   if ((ps->keys & KEY_PID) && !overflow) {
+      e->pid = rec->pid;
+   }
+   if ((ps->keys & KEY_DEVICE) && !overflow) {
+      memcpy(e->device, rec->device, DEVICE_LEN);
+   }
+   if ((ps->keys & KEY_PATH) &&
+       !(e->path = strdup(overflow ? OVERFLOW_PATH : rec->s1))) {
+      free(e);
+      return NULL;
+   }
+   head = &ps->table[hash & (ps->table_size - 1)];
+   e->next = *head;
+   *head = e;
+   if (!overflow && ++ps->num_keys > ps->table_size) {
+      GROW_CHAINED_TABLE(ps->table, ps->table_size, k, k->hash);
+   }
+   return e;
+}
+
+//*****************************************************************************
+
+static void emit_summary(struct plugin_state* ps, const struct key_entry* e,
+                         unsigned long long end_ns)
+{
+   struct latency_histogram* latency = calloc(1, sizeof(*latency));
+   struct monitor_record_t* rec;
+   unsigned long long errors = 0;
+   unsigned long long bytes = 0;
+   double latency_sum_ms = 0.0;
+   const double window_s = ps->num_panes * ps->slide_ns / 1e9;
+   unsigned int i;
+
+   if (!latency) {
+      return;
+   }
+   for (i = 0; i != ps->num_panes; ++i) {
+      const struct pane* pane = &e->panes[i];
+      latency_merge(latency, &pane->latency);
+      errors += pane->errors;
+      bytes += pane->bytes;
+      latency_sum_ms += pane->latency_sum_ms;
+   }
+   if (!latency->count || !(rec = ps->listener->alloc_record())) {
+      free(latency);
+      return;
+   }
+
+   memset(rec, 0, offsetof(struct monitor_record_t, hostname));
+   strcpy(rec->facility, FACILITY);
+   rec->timestamp = end_ns / 1000000000ULL;
+   rec->timestamp_ns = end_ns;
+   rec->elapsed_time = latency_sum_ms / latency->count;
+   rec->pid = e->pid;
+   rec->dom_type = e->dom_type;
+   rec->op_type = e->op_type;
+   rec->error_code = errors;
+   rec->fd = FD_NONE;
+   rec->bytes_transferred = bytes;
+   rec->seq = ps->windows;
+   rec->offset = OFFSET_NONE;
+   if (e->path) {
+      strncpy(rec->s1, e->path, sizeof(rec->s1) - 1);
+   }
+   snprintf(rec->s2, sizeof(rec->s2),
+            "window_s=%g ops=%llu ops_s=%.1f mb_s=%.3f p50_ms=%.3f"
+            " p90_ms=%.3f p99_ms=%.3f p999_ms=%.3f max_ms=%.3f errors=%llu",
+            window_s, (unsigned long long)latency->count,
+            latency->count / window_s, bytes / window_s / 1048576.0,
+            latency_percentile(latency, 0.5) / 1000.0,
+            latency_percentile(latency, 0.9) / 1000.0,
+            latency_percentile(latency, 0.99) / 1000.0,
+            latency_percentile(latency, 0.999) / 1000.0,
+            latency->max_us / 1000.0, errors);
+   memcpy(rec->device, e->device, DEVICE_LEN);
+   free(latency);
+
+   ps->summaries++;
+   ps->listener->emit_record(rec);
+}
+
+//*****************************************************************************
+
+// ends window of current pane, then starts next pane: its slot of ring
+// is cleared and keys with nothing left in any pane are forgotten
+static void end_pane(struct plugin_state* ps)
+{
+   const unsigned int next = (ps->pane + 1) % ps->num_panes;
+   unsigned int i;
+
+   for (i = 0; i != ps->table_size; ++i) {
+      struct key_entry** link = &ps->table[i];
+      while (*link) {
+         struct key_entry* e = *link;
+         unsigned int j;
+
+         emit_summary(ps, e, (ps->pane + 1) * ps->slide_ns);
+         if (e->panes[next].latency.count) {
+            memset(&e->panes[next], 0, sizeof(struct pane));
+         }
+         for (j = 0; j != ps->num_panes; ++j) {
+            if (e->panes[j].latency.count) {
+               break;
+            }
+         }
+         if (j == ps->num_panes) {
+            *link = e->next;
+            if (!e->overflow) {
+               ps->num_keys--;
+            }
+            free(e->path);
+            free(e);
+         } else {
+            link = &e->next;
+         }
+      }
+   }
+   ps->windows++;
+   ps->pane++;
+}
+
+//*****************************************************************************
+
+// ends panes before given one. After a gap of a whole window there is
+// nothing left to report, so skip right to it
+static void advance_to(struct plugin_state* ps, unsigned long long pane)
+{
+   unsigned int ended = 0;
+
+   while (ps->pane < pane && ended++ < ps->num_panes) {
+      end_pane(ps);
+   }
+   if (ps->pane < pane) {
+      ps->pane = pane;
+   }
+}
+
+//*****************************************************************************
+
+static int parse_config(struct plugin_state* ps, const char* plugin_config)
+{
+   char* config = strdup(plugin_config ? plugin_config : "");
+   char* rest = config;
+   char* token;
+   unsigned int window_s = DEFAULT_WINDOW_S;
+   unsigned int slide_s = 0;
+   int rc = 0;
+
+   ps->keys = KEY_PID | KEY_DEVICE;
+   ps->max_keys = DEFAULT_MAX_KEYS;
+   while ((token = strtok_r(rest, ",", &rest))) {
+      char* value = strchr(token, '=');
+      if (!value) {
+         fprintf(stderr, "error: aggregate option '%s' has no value\n", token);
+         rc = 1;
+         continue;
+      }
+      *value++ = 0;
+      if (!strcmp(token, "window") && atoi(value) > 0) {
+         window_s = atoi(value);
+      } else if (!strcmp(token, "slide") && atoi(value) > 0) {
+         slide_s = atoi(value);
+      } else if (!strcmp(token, "max_keys") && atoi(value) > 0) {
+         ps->max_keys = atoi(value);
+      } else if (!strcmp(token, "pass")) {
+         ps->pass = !strcmp(value, "on") || !strcmp(value, "1");
+      } else if (!strcmp(token, "keys")) {
+         char* key_rest = value;
+         char* key;
+         ps->keys = 0;
+         while ((key = strtok_r(key_rest, "+", &key_rest))) {
+            if (!strcmp(key, "pid")) {
+               ps->keys |= KEY_PID;
+            } else if (!strcmp(key, "device")) {
+               ps->keys |= KEY_DEVICE;
+            } else if (!strcmp(key, "path")) {
+               ps->keys |= KEY_PATH;
+            } else if (strcmp(key, "op")) {
+               fprintf(stderr, "error: aggregate key '%s' is invalid\n", key);
+               rc = 1;
+            }
+         }
+      } else {
+         fprintf(stderr, "error: aggregate option '%s' is invalid\n", token);
+         rc = 1;
+      }
+   }
+   free(config);
+
+   if (!slide_s) {
+      slide_s = window_s;
+   }
+   if (window_s % slide_s || window_s / slide_s > MAX_PANES) {
+      fprintf(stderr, "error: aggregate window must be a multiple of slide,"
+              " at most %d times\n", MAX_PANES);
+      rc = 1;
+   }
+   ps->slide_ns = slide_s * 1000000000ULL;
+   ps->num_panes = window_s / slide_s;
+   return rc;
+}
+
+//*****************************************************************************
+
+int open_plugin(const char* plugin_config, struct listener* listener,
+                void** state)
+{
+   struct plugin_state* ps = calloc(1, sizeof(struct plugin_state));
+
+   if (!ps) {
+      return PLUGIN_OPEN_FAIL;
+   }
+   if (!listener->emit_record) {
+      fprintf(stderr, "error: aggregate needs newer mq_listener\n");
+      free(ps);
+      return PLUGIN_OPEN_FAIL;
+   }
+   ps->listener = listener;
+   ps->table_size = INITIAL_TABLE_SIZE;
+   if (parse_config(ps, plugin_config) ||
+       !(ps->table = calloc(ps->table_size, sizeof(struct key_entry*)))) {
+      free(ps);
+      return PLUGIN_OPEN_FAIL;
+   }
+   *state = ps;
+   return PLUGIN_OPEN_SUCCESS;
+}
+
+//*****************************************************************************
+
+// summaries of window in progress are lost; they can't be passed on
+// from here
+void close_plugin(void* state)
+{
+   struct plugin_state* ps = state;
+   unsigned int i;
+
+   for (i = 0; i != ps->table_size; ++i) {
+      while (ps->table[i]) {
+         struct key_entry* e = ps->table[i];
+         ps->table[i] = e->next;
+         free(e->path);
+         free(e);
+      }
+   }
+   free(ps->table);
+   free(ps);
+}
+
+//*****************************************************************************
+
+int ok_to_accept_data(void* state)
+{
+   return PLUGIN_ACCEPT_DATA;
+}
+
+//*****************************************************************************
+
+// records of process life cycle and of listener itself are not timed
+// operations; they pass by
+void get_interest(struct plugin_interest* interest, void* state)
+{
+   struct plugin_state* ps = state;
+
+   interest->domain_mask &= ~((1U << START_STOP) | (1U << LISTENER));
+   interest->wants_strings = (ps->keys & KEY_PATH) != 0;
+}
+
+//*****************************************************************************
+
+int process_data(struct monitor_record_t* data, void* state)
+{
+   struct plugin_state* ps = state;
+   const unsigned long long timestamp_ns = data->timestamp_ns ?
+      data->timestamp_ns : data->timestamp * 1000000000ULL;
+   unsigned long long pane = timestamp_ns / ps->slide_ns;
+   struct key_entry* e;
+   struct pane* p;
+   double latency_us;
+
+   if (!ps->pane) {
+      ps->pane = pane;
+   } else if (pane > ps->pane) {
+      advance_to(ps, pane);
+   } else if (pane + ps->num_panes <= ps->pane) {
+      // its window has been reported already
+      ps->late++;
+      pane = ps->pane;
+   }
+   event_clock_see(&ps->clock, timestamp_ns);
+
+   if ((e = find_key(ps, data))) {
+      p = &e->panes[pane % ps->num_panes];
+      latency_us = data->elapsed_time * 1000.0;
+      latency_add(&p->latency, latency_us > 0 ? (uint64_t)latency_us : 0);
+      p->latency_sum_ms += data->elapsed_time;
+      p->bytes += data->bytes_transferred;
+      if (data->error_code) {
+         p->errors++;
+      }
+   }
+   return ps->pass ? PLUGIN_ACCEPT_DATA : PLUGIN_DROP_DATA;
+}
+
+//*****************************************************************************
+
+// windows end by time of records, not by clock of listener, so that
+// replayed traces are aggregated as they were captured. While no
+// records come, time of records is estimated from time passed since
+// the last one
+void flush_plugin(void* state)
+{
+   struct plugin_state* ps = state;
+   unsigned long long event_now;
+
+   if (!ps->pane) {
+      return;
+   }
+   event_now = event_clock_now(&ps->clock);
+   if (event_now / ps->slide_ns > ps->pane) {
+      advance_to(ps, event_now / ps->slide_ns);
+   }
+}
+
+//*****************************************************************************
+
+char** list_commands()
+{
+   static const char* command_list[] = {"aggregate-status", "help", 0};
+   return (char**)command_list;
+}
+
+//*****************************************************************************
+
+int plugin_command(const char* name, const char** args, void* state)
+{
+   struct plugin_state* ps = state;
+
+   if (args[0] && !strcmp(args[0], "aggregate-status")) {
+      printf("aggregate: window %llu s, slide %llu s, %u of %u keys,"
+             " %llu windows, %llu summaries, %llu late records,"
+             " %llu records in overflow keys\n",
+             ps->num_panes * ps->slide_ns / 1000000000ULL,
+             ps->slide_ns / 1000000000ULL, ps->num_keys, ps->max_keys,
+             ps->windows, ps->summaries, ps->late, ps->overflowed);
+   } else if (args[0] && !strcmp(args[0], "help")) {
+      printf("aggregate: passes one summary record per domain, operation"
+             " and key for each window\n"
+             "  aggregate-status  print window settings and counters\n");
+   }
+   return 0;
+}
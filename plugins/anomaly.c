@@ -0,0 +1,696 @@
+//
+// Copyright (c) 2017 Intel Corporation
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+// implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <strings.h>
+#include <math.h>
+#include <time.h>
+#include <spawn.h>
+#include <sys/wait.h>
+
+#include "plugin.h"
+#include "monitor_record.h"
+#include "ops.h"
+#include "ops_names.h"
+#include "latency_histogram.h"
+#include "plugin_helpers.h"
+
+/* plugin configuration is a comma separated list of key=value pairs:
+ *   ops=READ+SYNC,window=10,stat=p99,alpha=0.1,high=3,low=1,ratio=2,
+ *   max_keys=10000
+ * Latencies are collected per host, device and operation over windows of
+ * <window> seconds (by time of records, as in aggregate). When a window
+ * ends, its statistic is compared to baseline of the key, exponentially
+ * weighted mean and variance of statistics of earlier windows. Key goes
+ * into alert when statistic is <high> standard deviations and <ratio>
+ * times above mean, and out of it after <clear> windows within <low>
+ * standard deviations or with too few operations; alert record is
+ * passed to plugins loaded after this one on both, and exec=<command> is
+ * run. Per record there is a hash lookup and a histogram increment; all
+ * the rest is done per window. Once max_keys keys exist, records of new
+ * keys are counted in an overflow key of their domain and operation */
+#define DEFAULT_WINDOW_S 10
+#define DEFAULT_MAX_KEYS 10000
+#define OVERFLOW_NAME "*"
+#define INITIAL_TABLE_SIZE 64
+#define MAX_CHILDREN 16
+#define FACILITY "anomaly"
+
+enum statistic { STAT_MEAN, STAT_P50, STAT_P90, STAT_P99, STAT_MAX };
+
+static const struct {
+   const char* name;
+   enum statistic stat;
+   double fraction;
+} statistics[] = {
+   {"mean", STAT_MEAN, 0},
+   {"p50", STAT_P50, 0.5},
+   {"p90", STAT_P90, 0.9},
+   {"p99", STAT_P99, 0.99},
+   {"max", STAT_MAX, 0},
+};
+#define NUM_STATISTICS (sizeof(statistics) / sizeof(statistics[0]))
+
+struct key_entry {
+   unsigned int hash;
+   int dom_type;
+   int op_type;
+   char device[DEVICE_LEN];
+   char hostname[HOSTNAME_LEN];
+   int overflow;                        /* stands for keys beyond max_keys */
+
+   struct latency_histogram window;     /* of current window */
+   double window_sum_ms;
+
+   double mean_ms;                      /* baseline */
+   double variance;
+   unsigned int windows;                /* in baseline */
+   int alert;
+   unsigned int normal_windows;         /* in a row, during alert */
+   double value_ms;                     /* statistic of last window */
+   struct key_entry* next;
+};
+
+struct plugin_state {
+   struct listener* listener;
+   unsigned int op_mask[OP_MASK_WORDS];
+   unsigned int stat;                   /* index to statistics */
+   unsigned long long window_ns;
+   double alpha;
+   double high;
+   double low;
+   double ratio;
+   unsigned int warmup;                 /* windows before alerts */
+   unsigned int clear;
+   unsigned int min_ops;
+   char* command;
+
+   struct key_entry** table;
+   unsigned int table_size;             /* power of 2 */
+   unsigned int num_keys;               /* overflow keys excluded */
+   unsigned int max_keys;
+
+   unsigned long long window;           /* number of current window */
+   struct event_clock clock;
+
+   pid_t children[MAX_CHILDREN];
+   unsigned int num_children;
+
+   unsigned long long alerts;
+   unsigned long long clears;
+   unsigned long long commands_skipped;
+   unsigned long long overflowed;       /* records counted in overflow keys */
+};
+
+extern char** environ;
+
+//*****************************************************************************
+
+static unsigned int key_hash(const struct monitor_record_t* rec,
+                             int overflow)
+{
+   unsigned int hash = FNV_OFFSET;
+
+   hash = fnv_hash(hash, &rec->dom_type, sizeof(rec->dom_type));
+   hash = fnv_hash(hash, &rec->op_type, sizeof(rec->op_type));
+   if (overflow) {
+      return fnv_hash(hash, &overflow, sizeof(overflow));
+   }
+   hash = fnv_hash(hash, rec->device, strnlen(rec->device, DEVICE_LEN));
+   hash = fnv_hash(hash, rec->hostname, strnlen(rec->hostname, HOSTNAME_LEN));
+   return hash;
+}
+
+//*****************************************************************************
+
+static struct key_entry* lookup_key(struct plugin_state* ps,
+                                    const struct monitor_record_t* rec,
+                                    unsigned int hash, int overflow)
+{
+   struct key_entry* e;
+
+   for (e = ps->table[hash & (ps->table_size - 1)]; e; e = e->next) {
+      if (e->hash == hash && e->dom_type == rec->dom_type &&
+          e->op_type == rec->op_type && e->overflow == overflow &&
+          (overflow ||
+           (!strncmp(e->device, rec->device, DEVICE_LEN) &&
+            !strncmp(e->hostname, rec->hostname, HOSTNAME_LEN)))) {
+         return e;
+      }
+   }
+   return NULL;
+}
+
+//*****************************************************************************
+
+// keys beyond max_keys share one overflow key per domain and operation,
+// so that memory stays bounded however many hosts and devices there are.
+// keys are kept for their baselines, so the bound is never freed again
+static struct key_entry* find_key(struct plugin_state* ps,
+                                  const struct monitor_record_t* rec)
+{
+   unsigned int hash = key_hash(rec, 0);
+   struct key_entry** head;
+   struct key_entry* e;
+   int overflow = 0;
+
+   if ((e = lookup_key(ps, rec, hash, 0))) {
+      return e;
+   }
+   if (ps->num_keys >= ps->max_keys) {
+      overflow = 1;
+      ps->overflowed++;
+      hash = key_hash(rec, 1);
+      if ((e = lookup_key(ps, rec, hash, 1))) {
+         return e;
+      }
+   }
+
+   e = calloc(1, sizeof(struct key_entry));
+   if (!e) {
+      return NULL;
+   }
+   e->hash = hash;
+   e->dom_type = rec->dom_type;
+   e->op_type = rec->op_type;
+   e->overflow = overflow;
+   if (overflow) {
+      strcpy(e->device, OVERFLOW_NAME);
+      strcpy(e->hostname, OVERFLOW_NAME);
+   } else {
+      memcpy(e->device, rec->device, DEVICE_LEN);
+      memcpy(e->hostname, rec->hostname, HOSTNAME_LEN);
+   }
+   head = &ps->table[hash & (ps->table_size - 1)];
+   e->next = *head;
+   *head = e;
+   if (!overflow && ++ps->num_keys > ps->table_size) {
+      GROW_CHAINED_TABLE(ps->table, ps->table_size, k, k->hash);
+   }
+   return e;
+}
+
+//*****************************************************************************
+
+static void reap_children(struct plugin_state* ps)
+{
+   unsigned int i = 0;
+
+   while (i != ps->num_children) {
+      if (waitpid(ps->children[i], NULL, WNOHANG)) {
+         ps->children[i] = ps->children[--ps->num_children];
+      } else {
+         ++i;
+      }
+   }
+}
+
+//*****************************************************************************
+
+// runs command in background, telling it about alert in environment
+static void run_command(struct plugin_state* ps, const struct key_entry* e,
+                        const char* state)
+{
+   const char* argv[] = {"/bin/sh", "-c", ps->command, NULL};
+   char vars[7][128];
+   char** envp;
+   size_t n = 0, i;
+   pid_t pid;
+
+   reap_children(ps);
+   if (ps->num_children == MAX_CHILDREN) {
+      ps->commands_skipped++;
+      return;
+   }
+   while (environ[n]) {
+      n++;
+   }
+   if (!(envp = malloc((n + 8) * sizeof(char*)))) {
+      ps->commands_skipped++;
+      return;
+   }
+   memcpy(envp, environ, n * sizeof(char*));
+   snprintf(vars[0], sizeof(vars[0]), "ANOMALY_STATE=%s", state);
+   snprintf(vars[1], sizeof(vars[1]), "ANOMALY_HOST=%.*s", HOSTNAME_LEN,
+            e->hostname);
+   snprintf(vars[2], sizeof(vars[2]), "ANOMALY_DEVICE=%.*s", DEVICE_LEN,
+            e->device);
+   snprintf(vars[3], sizeof(vars[3]), "ANOMALY_OP=%s", ops_names[e->op_type]);
+   snprintf(vars[4], sizeof(vars[4]), "ANOMALY_%s_MS=%.3f",
+            statistics[ps->stat].name, e->value_ms);
+   snprintf(vars[5], sizeof(vars[5]), "ANOMALY_BASELINE_MS=%.3f", e->mean_ms);
+   snprintf(vars[6], sizeof(vars[6]), "ANOMALY_STDDEV_MS=%.3f",
+            sqrt(e->variance));
+   // variable names are upper case
+   for (i = 0; vars[4][i] != '='; ++i) {
+      if (vars[4][i] >= 'a' && vars[4][i] <= 'z') {
+         vars[4][i] -= 'a' - 'A';
+      }
+   }
+   for (i = 0; i != 7; ++i) {
+      envp[n++] = vars[i];
+   }
+   envp[n] = NULL;
+   if (!posix_spawn(&pid, "/bin/sh", NULL, NULL, (char**)argv, envp)) {
+      ps->children[ps->num_children++] = pid;
+   } else {
+      ps->commands_skipped++;
+   }
+   free(envp);
+}
+
+//*****************************************************************************
+
+static void emit_alert(struct plugin_state* ps, const struct key_entry* e,
+                       const char* state, unsigned long long end_ns)
+{
+   struct monitor_record_t* rec;
+   const double stddev_ms = sqrt(e->variance);
+
+   if (ps->command) {
+      run_command(ps, e, state);
+   }
+   if (!(rec = ps->listener->alloc_record())) {
+      return;
+   }
+   memset(rec, 0, offsetof(struct monitor_record_t, hostname));
+   strcpy(rec->facility, FACILITY);
+   rec->timestamp = end_ns / 1000000000ULL;
+   rec->timestamp_ns = end_ns;
+   rec->elapsed_time = e->value_ms;
+   rec->dom_type = e->dom_type;
+   rec->op_type = e->op_type;
+   rec->fd = FD_NONE;
+   rec->bytes_transferred = e->window.count;
+   rec->seq = ps->window;
+   rec->offset = OFFSET_NONE;
+   snprintf(rec->s2, sizeof(rec->s2),
+            "state=%s %s_ms=%.3f baseline_ms=%.3f stddev_ms=%.3f z=%.1f"
+            " ops=%llu window_s=%llu", state, statistics[ps->stat].name,
+            e->value_ms, e->mean_ms, stddev_ms,
+            stddev_ms > 0 ? (e->value_ms - e->mean_ms) / stddev_ms : 0.0,
+            (unsigned long long)e->window.count,
+            ps->window_ns / 1000000000ULL);
+   memcpy(rec->hostname, e->hostname, HOSTNAME_LEN);
+   memcpy(rec->device, e->device, DEVICE_LEN);
+   ps->listener->emit_record(rec);
+}
+
+//*****************************************************************************
+
+// compares statistic of window that ended to baseline, which then takes
+// it in, unless it is anomalous
+static void end_key_window(struct plugin_state* ps, struct key_entry* e,
+                           unsigned long long end_ns)
+{
+   const double x = e->value_ms;
+   const double deviation = x - e->mean_ms;
+   double incr;
+   int high, low;
+
+   if (!e->windows) {
+      e->mean_ms = x;
+      e->variance = 0;
+      e->windows = 1;
+      return;
+   }
+   // compared as squares, so no square root per window
+   high = deviation > 0 && deviation * deviation >=
+      ps->high * ps->high * e->variance && x >= ps->ratio * e->mean_ms;
+   low = deviation <= 0 ||
+      deviation * deviation <= ps->low * ps->low * e->variance;
+
+   if (e->windows >= ps->warmup) {
+      if (!e->alert && high) {
+         e->alert = 1;
+         e->normal_windows = 0;
+         ps->alerts++;
+         emit_alert(ps, e, "alert", end_ns);
+      } else if (e->alert) {
+         e->normal_windows = low ? e->normal_windows + 1 : 0;
+         if (e->normal_windows >= ps->clear) {
+            e->alert = 0;
+            ps->clears++;
+            emit_alert(ps, e, "clear", end_ns);
+         }
+      }
+   }
+   // once warmed up, baseline is kept out of anomalies, so that a
+   // lasting one doesn't become normal
+   if (e->windows < ps->warmup || (!e->alert && !high)) {
+      incr = ps->alpha * deviation;
+      e->mean_ms += incr;
+      e->variance = (1 - ps->alpha) * (e->variance + deviation * incr);
+      e->windows++;
+   }
+}
+
+//*****************************************************************************
+
+static double window_value(const struct plugin_state* ps,
+                           const struct key_entry* e)
+{
+   const struct latency_histogram* h = &e->window;
+
+   if (!h->count) {
+      return 0;
+   }
+   if (statistics[ps->stat].stat == STAT_MEAN) {
+      return e->window_sum_ms / h->count;
+   }
+   if (statistics[ps->stat].stat == STAT_MAX) {
+      return h->max_us / 1000.0;
+   }
+   return latency_percentile(h, statistics[ps->stat].fraction) / 1000.0;
+}
+
+//*****************************************************************************
+
+// windows with too few operations to compare count as normal ones during
+// alert, so that alert of key which went quiet clears too
+static void count_quiet_windows(struct plugin_state* ps, struct key_entry* e,
+                                unsigned long long end_ns,
+                                unsigned long long windows)
+{
+   unsigned long long needed;
+
+   if (!e->alert || !windows) {
+      return;
+   }
+   needed = ps->clear - e->normal_windows;
+   if (windows < needed) {
+      e->normal_windows += windows;
+      return;
+   }
+   e->alert = 0;
+   ps->clears++;
+   emit_alert(ps, e, "clear", end_ns + (needed - 1) * ps->window_ns);
+}
+
+//*****************************************************************************
+
+// ends given number of windows, all but first of which had no records
+static void end_windows(struct plugin_state* ps, unsigned long long windows)
+{
+   const unsigned long long end_ns = (ps->window + 1) * ps->window_ns;
+   unsigned int i;
+
+   for (i = 0; i != ps->table_size; ++i) {
+      struct key_entry* e;
+      for (e = ps->table[i]; e; e = e->next) {
+         if (e->window.count >= ps->min_ops) {
+            e->value_ms = window_value(ps, e);
+            end_key_window(ps, e, end_ns);
+            count_quiet_windows(ps, e, end_ns + ps->window_ns, windows - 1);
+         } else {
+            if (e->alert) {
+               e->value_ms = window_value(ps, e);
+            }
+            count_quiet_windows(ps, e, end_ns, windows);
+         }
+         if (e->window.count) {
+            memset(&e->window, 0, sizeof(e->window));
+            e->window_sum_ms = 0;
+         }
+      }
+   }
+   ps->window += windows;
+}
+
+//*****************************************************************************
+
+static void advance_to(struct plugin_state* ps, unsigned long long window)
+{
+   end_windows(ps, window > ps->window ? window - ps->window : 1);
+}
+
+//*****************************************************************************
+
+static int parse_ops(struct plugin_state* ps, char* value)
+{
+   char* rest = value;
+   char* name;
+   int op;
+
+   memset(ps->op_mask, 0, sizeof(ps->op_mask));
+   while ((name = strtok_r(rest, "+", &rest))) {
+      for (op = 0; op != END_OPS; ++op) {
+         if (!strcasecmp(name, ops_names[op])) {
+            ps->op_mask[op / 32] |= 1U << (op % 32);
+            break;
+         }
+      }
+      if (op == END_OPS) {
+         fprintf(stderr, "error: anomaly operation '%s' is invalid\n", name);
+         return 1;
+      }
+   }
+   return 0;
+}
+
+//*****************************************************************************
+
+static int parse_config(struct plugin_state* ps, const char* plugin_config)
+{
+   char* config = strdup(plugin_config ? plugin_config : "");
+   char* rest = config;
+   char* token;
+   unsigned int window_s = DEFAULT_WINDOW_S;
+   unsigned int i;
+   int rc = 0;
+
+   ps->op_mask[READ / 32] |= 1U << (READ % 32);
+   ps->op_mask[WRITE / 32] |= 1U << (WRITE % 32);
+   ps->op_mask[SYNC / 32] |= 1U << (SYNC % 32);
+   ps->stat = STAT_P99;
+   ps->alpha = 0.1;
+   ps->high = 3;
+   ps->low = 1;
+   ps->ratio = 2;
+   ps->warmup = 6;
+   ps->clear = 3;
+   ps->min_ops = 20;
+   ps->max_keys = DEFAULT_MAX_KEYS;
+   while ((token = strtok_r(rest, ",", &rest))) {
+      char* value = strchr(token, '=');
+      if (!value) {
+         fprintf(stderr, "error: anomaly option '%s' has no value\n", token);
+         rc = 1;
+         continue;
+      }
+      *value++ = 0;
+      if (!strcmp(token, "ops")) {
+         rc |= parse_ops(ps, value);
+      } else if (!strcmp(token, "window") && atoi(value) > 0) {
+         window_s = atoi(value);
+      } else if (!strcmp(token, "stat")) {
+         for (i = 0; i != NUM_STATISTICS; ++i) {
+            if (!strcmp(value, statistics[i].name)) {
+               ps->stat = i;
+               break;
+            }
+         }
+         if (i == NUM_STATISTICS) {
+            fprintf(stderr, "error: anomaly statistic '%s' is invalid\n",
+                    value);
+            rc = 1;
+         }
+      } else if (!strcmp(token, "alpha") && atof(value) > 0 &&
+                 atof(value) <= 1) {
+         ps->alpha = atof(value);
+      } else if (!strcmp(token, "high") && atof(value) > 0) {
+         ps->high = atof(value);
+      } else if (!strcmp(token, "low") && atof(value) >= 0) {
+         ps->low = atof(value);
+      } else if (!strcmp(token, "ratio") && atof(value) >= 1) {
+         ps->ratio = atof(value);
+      } else if (!strcmp(token, "warmup") && atoi(value) > 0) {
+         ps->warmup = atoi(value);
+      } else if (!strcmp(token, "clear") && atoi(value) > 0) {
+         ps->clear = atoi(value);
+      } else if (!strcmp(token, "min_ops") && atoi(value) > 0) {
+         ps->min_ops = atoi(value);
+      } else if (!strcmp(token, "max_keys") && atoi(value) > 0) {
+         ps->max_keys = atoi(value);
+      } else if (!strcmp(token, "exec") && *value) {
+         free(ps->command);
+         ps->command = strdup(value);
+      } else {
+         fprintf(stderr, "error: anomaly option '%s' is invalid\n", token);
+         rc = 1;
+      }
+   }
+   free(config);
+
+   if (ps->low > ps->high) {
+      fprintf(stderr, "error: anomaly low must not be above high\n");
+      rc = 1;
+   }
+   ps->window_ns = window_s * 1000000000ULL;
+   return rc;
+}
+
+//*****************************************************************************
+
+int open_plugin(const char* plugin_config, struct listener* listener,
+                void** state)
+{
+   struct plugin_state* ps = calloc(1, sizeof(struct plugin_state));
+
+   if (!ps) {
+      return PLUGIN_OPEN_FAIL;
+   }
+   if (!listener->emit_record) {
+      fprintf(stderr, "error: anomaly needs newer mq_listener\n");
+      free(ps);
+      return PLUGIN_OPEN_FAIL;
+   }
+   ps->listener = listener;
+   ps->table_size = INITIAL_TABLE_SIZE;
+   if (parse_config(ps, plugin_config) ||
+       !(ps->table = calloc(ps->table_size, sizeof(struct key_entry*)))) {
+      free(ps->command);
+      free(ps);
+      return PLUGIN_OPEN_FAIL;
+   }
+   *state = ps;
+   return PLUGIN_OPEN_SUCCESS;
+}
+
+//*****************************************************************************
+
+// commands still running are left to finish on their own
+void close_plugin(void* state)
+{
+   struct plugin_state* ps = state;
+   unsigned int i;
+
+   printf("anomaly: %u keys, %llu alerts, %llu cleared, %llu records in"
+          " overflow keys\n", ps->num_keys, ps->alerts, ps->clears,
+          ps->overflowed);
+   reap_children(ps);
+   for (i = 0; i != ps->table_size; ++i) {
+      while (ps->table[i]) {
+         struct key_entry* e = ps->table[i];
+         ps->table[i] = e->next;
+         free(e);
+      }
+   }
+   free(ps->table);
+   free(ps->command);
+   free(ps);
+}
+
+//*****************************************************************************
+
+int ok_to_accept_data(void* state)
+{
+   return PLUGIN_ACCEPT_DATA;
+}
+
+//*****************************************************************************
+
+// only watched operations reach us; all records pass on
+void get_interest(struct plugin_interest* interest, void* state)
+{
+   struct plugin_state* ps = state;
+   int i;
+
+   for (i = 0; i != OP_MASK_WORDS; ++i) {
+      interest->op_mask[i] &= ps->op_mask[i];
+   }
+   interest->domain_mask &= ~((1U << START_STOP) | (1U << LISTENER));
+   interest->wants_strings = 0;
+}
+
+//*****************************************************************************
+
+int process_data(struct monitor_record_t* data, void* state)
+{
+   struct plugin_state* ps = state;
+   const unsigned long long timestamp_ns = data->timestamp_ns ?
+      data->timestamp_ns : data->timestamp * 1000000000ULL;
+   const unsigned long long window = timestamp_ns / ps->window_ns;
+   struct key_entry* e;
+   double latency_us;
+
+   if (!ps->window) {
+      ps->window = window;
+   } else if (window > ps->window) {
+      advance_to(ps, window);
+   }
+   event_clock_see(&ps->clock, timestamp_ns);
+   // late records count in current window; failed calls don't count
+   if (!data->error_code && (e = find_key(ps, data))) {
+      latency_us = data->elapsed_time * 1000.0;
+      latency_add(&e->window, latency_us > 0 ? (uint64_t)latency_us : 0);
+      e->window_sum_ms += data->elapsed_time;
+   }
+   return PLUGIN_ACCEPT_DATA;
+}
+
+//*****************************************************************************
+
+// while no records come, time of records is estimated from time passed
+// since the last one
+void flush_plugin(void* state)
+{
+   struct plugin_state* ps = state;
+   unsigned long long event_now;
+
+   reap_children(ps);
+   if (!ps->window) {
+      return;
+   }
+   event_now = event_clock_now(&ps->clock);
+   if (event_now / ps->window_ns > ps->window) {
+      advance_to(ps, event_now / ps->window_ns);
+   }
+}
+
+//*****************************************************************************
+
+char** list_commands()
+{
+   static const char* command_list[] = {"anomaly-status", "help", 0};
+   return (char**)command_list;
+}
+
+//*****************************************************************************
+
+int plugin_command(const char* name, const char** args, void* state)
+{
+   struct plugin_state* ps = state;
+
+   if (args[0] && !strcmp(args[0], "anomaly-status")) {
+      printf("anomaly: window %llu s, %s, %u keys (max %u), %llu alerts,"
+             " %llu cleared, %llu commands skipped, %llu records in"
+             " overflow keys\n",
+             ps->window_ns / 1000000000ULL, statistics[ps->stat].name,
+             ps->num_keys, ps->max_keys, ps->alerts, ps->clears,
+             ps->commands_skipped, ps->overflowed);
+   } else if (args[0] && !strcmp(args[0], "help")) {
+      printf("anomaly: passes alert record when latency of device and"
+             " operation departs from its baseline\n"
+             "  anomaly-status  print settings and counters\n");
+   }
+   return 0;
+}
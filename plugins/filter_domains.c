@@ -30,6 +30,7 @@
 //*****************************************************************************
 struct plugin_state {
   unsigned int domain_bit_flags;
+  struct listener * listener;
 };
 
 int open_plugin(const char* plugin_config, struct listener * listener, void *param)
@@ -37,6 +38,7 @@ int open_plugin(const char* plugin_config, struct listener * listener, void *par
   struct plugin_state ** ps = param;
   *ps = malloc(sizeof (struct plugin_state));
   (*ps)->domain_bit_flags=domain_list_to_bit_mask(plugin_config);
+  (*ps)->listener = listener;
   return PLUGIN_OPEN_SUCCESS;
 }
 
@@ -68,6 +70,17 @@ int process_data(struct monitor_record_t* data, void *param)
 
 //*****************************************************************************
 
+/* let mq_listener drop records from other domains without calling us */
+void get_interest(struct plugin_interest* interest, void *param)
+{
+  struct plugin_state * ps = param;
+  interest->domain_mask = ps->domain_bit_flags;
+  interest->wants_strings = 0;
+  interest->drop_uninteresting = 1;
+}
+
+//*****************************************************************************
+
 char **list_commands()
 {
   static const char* command_list[] =
@@ -83,6 +96,8 @@ int plugin_command(const char* name, const char** args, void *param)
 
   if (args[0] && !strcmp(args[0], "update-mask") && args[1]) {
     ps->domain_bit_flags=domain_list_to_bit_mask(args[1]);
+    if (ps->listener->interest_changed)
+      ps->listener->interest_changed();
   } else if (args[0] && !strcmp(args[0], "print-mask")) {
     printf("domain_mask:");
     /* print all the enabled bit fields */
@@ -0,0 +1,1080 @@
+//
+// Copyright (c) 2017 Intel Corporation
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+// implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <fnmatch.h>
+
+#include "plugin.h"
+#include "monitor_record.h"
+#include "domains_names.h"
+#include "ops_names.h"
+
+/* plugin configuration is filter expression; records for which it is
+ * false are dropped from the chain, e.g.
+ *   op in (WRITE,SYNC) && bytes > 64k && latency > 1ms && path ~ "*.wal"
+ * Expression is parsed once and compiled into a list of tests, each
+ * with next test to run when it holds and when it doesn't. Operands of
+ * && and || are reordered so that cheap field tests run before string
+ * matching. Domains and operations the expression can accept become
+ * plugin's interest, so other records are dropped before reaching it */
+#define ACCEPT -1
+#define DROP -2
+#define MAX_EXPRESSION_LEN 4096
+#define MAX_DEPTH 64               /* of parentheses and negations */
+
+enum field_kind { KIND_NAME, KIND_NUMBER, KIND_STRING };
+
+enum field_id {
+   FIELD_DOMAIN, FIELD_OP, FIELD_PID, FIELD_TID, FIELD_FD, FIELD_ERROR,
+   FIELD_BYTES, FIELD_OFFSET, FIELD_LATENCY, FIELD_FACILITY, FIELD_DEVICE,
+   FIELD_HOST, FIELD_PATH, FIELD_PARAMS
+};
+
+static const struct {
+   const char* name;
+   enum field_id id;
+   enum field_kind kind;
+} fields[] = {
+   {"domain", FIELD_DOMAIN, KIND_NAME},
+   {"op", FIELD_OP, KIND_NAME},
+   {"pid", FIELD_PID, KIND_NUMBER},
+   {"tid", FIELD_TID, KIND_NUMBER},
+   {"fd", FIELD_FD, KIND_NUMBER},
+   {"error", FIELD_ERROR, KIND_NUMBER},
+   {"error_code", FIELD_ERROR, KIND_NUMBER},
+   {"bytes", FIELD_BYTES, KIND_NUMBER},
+   {"offset", FIELD_OFFSET, KIND_NUMBER},
+   {"latency", FIELD_LATENCY, KIND_NUMBER},     /* nanoseconds */
+   {"facility", FIELD_FACILITY, KIND_STRING},
+   {"device", FIELD_DEVICE, KIND_STRING},
+   {"host", FIELD_HOST, KIND_STRING},
+   {"path", FIELD_PATH, KIND_STRING},
+   {"s1", FIELD_PATH, KIND_STRING},
+   {"params", FIELD_PARAMS, KIND_STRING},
+   {"s2", FIELD_PARAMS, KIND_STRING},
+};
+#define NUM_FIELDS (sizeof(fields) / sizeof(fields[0]))
+
+enum test_kind {
+   TEST_MASK,       /* domain or op is in mask */
+   TEST_LESS,       /* number < value */
+   TEST_GREATER,    /* number > value */
+   TEST_EQUAL,      /* number == value */
+   TEST_NUMBERS,    /* number is one of values */
+   TEST_STRING,     /* string == text */
+   TEST_PREFIX,     /* string starts with text */
+   TEST_GLOB,       /* string matches pattern */
+   TEST_STRINGS     /* string is one of texts */
+};
+
+struct test {
+   enum test_kind kind;
+   enum field_id field;
+   int on_true;                 /* next test, ACCEPT or DROP */
+   int on_false;
+   long long value;
+   unsigned int mask[OP_MASK_WORDS];
+   long long* values;           /* TEST_NUMBERS */
+   char** texts;                /* TEST_STRING, TEST_PREFIX and TEST_GLOB
+                                 * have one, TEST_STRINGS count of them */
+   size_t* lengths;
+   unsigned int count;
+};
+
+struct program {
+   struct test* tests;
+   unsigned int num_tests;
+   int start;                   /* first test, ACCEPT or DROP */
+   unsigned int domain_mask;    /* what expression may accept */
+   unsigned int op_mask[OP_MASK_WORDS];
+   int wants_strings;
+};
+
+enum node_kind { NODE_TEST, NODE_NOT, NODE_AND, NODE_OR, NODE_TRUE };
+
+struct node {
+   enum node_kind kind;
+   struct node* left;
+   struct node* right;
+   struct test test;
+   int negate;                  /* test of != and !~ */
+   int cost;
+};
+
+enum token_kind {
+   TOKEN_END, TOKEN_WORD, TOKEN_NUMBER, TOKEN_STRING, TOKEN_PATH,
+   TOKEN_OPERATOR
+};
+
+struct parser {
+   const char* next;
+   const char* token;
+   size_t len;
+   enum token_kind kind;
+   int failed;
+   int depth;                   /* of parentheses and negations */
+};
+
+struct plugin_state {
+   struct program* program;     /* owned by thread calling process_data */
+   struct program* replacement; /* compiled by plugin_command, not yet
+                                 * taken over */
+   struct listener* listener;
+   char expression[MAX_EXPRESSION_LEN];   /* of latest program */
+   struct plugin_interest interest;
+   unsigned long long records;
+   unsigned long long dropped;
+};
+
+//*****************************************************************************
+
+static void free_test(struct test* t)
+{
+   unsigned int i;
+
+   if (t->texts) {
+      for (i = 0; i != t->count; ++i) {
+         free(t->texts[i]);
+      }
+   }
+   free(t->texts);
+   free(t->lengths);
+   free(t->values);
+}
+
+//*****************************************************************************
+
+static void free_node(struct node* n)
+{
+   if (n) {
+      free_node(n->left);
+      free_node(n->right);
+      free_test(&n->test);
+      free(n);
+   }
+}
+
+//*****************************************************************************
+
+static void free_program(struct program* p)
+{
+   unsigned int i;
+
+   if (p) {
+      for (i = 0; i != p->num_tests; ++i) {
+         free_test(&p->tests[i]);
+      }
+      free(p->tests);
+      free(p);
+   }
+}
+
+//*****************************************************************************
+
+static void syntax_error(struct parser* ps, const char* message)
+{
+   if (!ps->failed) {
+      fprintf(stderr, "error: filter_expr %s at '%.*s'\n", message,
+              ps->kind == TOKEN_END ? 3 : (int)strlen(ps->token),
+              ps->kind == TOKEN_END ? "end" : ps->token);
+      ps->failed = 1;
+   }
+}
+
+//*****************************************************************************
+
+static int is_operator(const struct parser* ps, const char* op)
+{
+   return ps->kind == TOKEN_OPERATOR && ps->len == strlen(op) &&
+      !memcmp(ps->token, op, ps->len);
+}
+
+//*****************************************************************************
+
+static int is_keyword(const struct parser* ps, const char* word)
+{
+   return ps->kind == TOKEN_WORD && ps->len == strlen(word) &&
+      !strncasecmp(ps->token, word, ps->len);
+}
+
+//*****************************************************************************
+
+static void next_token(struct parser* ps)
+{
+   static const char* const operators[] = {
+      "&&", "||", "==", "!=", "<=", ">=", "!~", "(", ")", ",", "!", "<",
+      ">", "~", "=", 0
+   };
+   const char* p = ps->next;
+   int i;
+
+   while (isspace((unsigned char)*p)) {
+      ++p;
+   }
+   ps->token = p;
+   if (!*p) {
+      ps->kind = TOKEN_END;
+   } else if (isalpha((unsigned char)*p) || *p == '_') {
+      ps->kind = TOKEN_WORD;
+      while (isalnum((unsigned char)*p) || *p == '_') {
+         ++p;
+      }
+   } else if (isdigit((unsigned char)*p) || *p == '.' ||
+              (*p == '-' && (isdigit((unsigned char)p[1]) || p[1] == '.'))) {
+      ps->kind = TOKEN_NUMBER;
+      ++p;
+      while (isalnum((unsigned char)*p) || *p == '.') {
+         ++p;
+      }
+   } else if (*p == '"' || *p == '\'') {
+      const char quote = *p++;
+      ps->kind = TOKEN_STRING;
+      while (*p && *p != quote) {
+         p += (*p == '\\' && p[1]) ? 2 : 1;
+      }
+      if (!*p) {
+         syntax_error(ps, "unterminated string");
+         ps->kind = TOKEN_END;
+         return;
+      }
+      ++p;
+   } else if (*p == '/') {
+      ps->kind = TOKEN_PATH;
+      while (*p && !isspace((unsigned char)*p) && *p != ')' && *p != ',') {
+         ++p;
+      }
+   } else {
+      ps->kind = TOKEN_OPERATOR;
+      for (i = 0; operators[i]; ++i) {
+         if (!strncmp(p, operators[i], strlen(operators[i]))) {
+            p += strlen(operators[i]);
+            break;
+         }
+      }
+      if (!operators[i]) {
+         ps->len = 1;
+         syntax_error(ps, "unexpected character");
+         ps->kind = TOKEN_END;
+         return;
+      }
+   }
+   ps->len = p - ps->token;
+   ps->next = p;
+}
+
+//*****************************************************************************
+
+// text of current literal, with quotes and escapes of strings removed
+static char* literal_text(const struct parser* ps)
+{
+   char* text = malloc(ps->len + 1);
+   const char* p = ps->token;
+   const char* end = ps->token + ps->len;
+   char* q = text;
+
+   if (!text) {
+      return NULL;
+   }
+   if (ps->kind == TOKEN_STRING) {
+      ++p;
+      --end;
+   }
+   while (p != end) {
+      if (ps->kind == TOKEN_STRING && *p == '\\' && p + 1 != end) {
+         ++p;
+      }
+      *q++ = *p++;
+   }
+   *q = 0;
+   return text;
+}
+
+//*****************************************************************************
+
+// number with unit: ns, us, ms (default) or s for latency; k, m or g
+// (powers of 1024, optionally followed by b) for bytes and offset
+static int parse_number(struct parser* ps, enum field_id field,
+                        long long* value)
+{
+   char text[64];
+   char* unit;
+   double number, scale = 1;
+
+   if (ps->kind != TOKEN_NUMBER || ps->len >= sizeof(text)) {
+      syntax_error(ps, "number expected");
+      return -1;
+   }
+   memcpy(text, ps->token, ps->len);
+   text[ps->len] = 0;
+   number = strtod(text, &unit);
+
+   if (field == FIELD_LATENCY) {
+      if (!*unit || !strcasecmp(unit, "ms")) {
+         scale = 1e6;
+      } else if (!strcasecmp(unit, "us")) {
+         scale = 1e3;
+      } else if (!strcasecmp(unit, "s")) {
+         scale = 1e9;
+      } else if (strcasecmp(unit, "ns")) {
+         syntax_error(ps, "unit of latency must be ns, us, ms or s");
+         return -1;
+      }
+   } else if (*unit && (field == FIELD_BYTES || field == FIELD_OFFSET)) {
+      const char u = tolower((unsigned char)*unit);
+      scale = u == 'k' ? 1024.0 : u == 'm' ? 1048576.0 :
+         u == 'g' ? 1073741824.0 : 0;
+      if (!scale || (unit[1] && strcasecmp(unit + 1, "b"))) {
+         syntax_error(ps, "unit of size must be k, m or g");
+         return -1;
+      }
+   } else if (*unit) {
+      syntax_error(ps, "number expected");
+      return -1;
+   }
+   number *= scale;
+   *value = (long long)(number < 0 ? number - 0.5 : number + 0.5);
+   return 0;
+}
+
+//*****************************************************************************
+
+static int parse_name(struct parser* ps, enum field_id field)
+{
+   const char* const* names = field == FIELD_DOMAIN ? domains_names : ops_names;
+   const int count = field == FIELD_DOMAIN ? END_DOMAINS : END_OPS;
+   int i;
+
+   if (ps->kind == TOKEN_NUMBER) {
+      i = atoi(ps->token);
+      if (i >= 0 && i < count) {
+         return i;
+      }
+   } else if (ps->kind == TOKEN_WORD) {
+      for (i = 0; i != count; ++i) {
+         if (strlen(names[i]) == ps->len &&
+             !strncasecmp(names[i], ps->token, ps->len)) {
+            return i;
+         }
+      }
+   }
+   syntax_error(ps, field == FIELD_DOMAIN ? "unknown domain" :
+                "unknown operation");
+   return -1;
+}
+
+//*****************************************************************************
+
+// adds value of current token to test; strings and numbers go to lists
+// even when there is just one
+static int add_value(struct parser* ps, struct test* t, enum field_kind kind)
+{
+   const unsigned int n = t->count + 1;
+   long long number;
+   int name;
+
+   if (kind == KIND_NAME) {
+      name = parse_name(ps, t->field);
+      if (name < 0) {
+         return -1;
+      }
+      t->mask[name / 32] |= 1U << (name % 32);
+      return 0;
+   }
+   if (kind == KIND_NUMBER) {
+      long long* values = realloc(t->values, n * sizeof(long long));
+      if (!values || parse_number(ps, t->field, &number)) {
+         t->values = values ? values : t->values;
+         return -1;
+      }
+      t->values = values;
+      t->values[t->count++] = number;
+      return 0;
+   }
+   if (ps->kind != TOKEN_STRING && ps->kind != TOKEN_WORD &&
+       ps->kind != TOKEN_PATH && ps->kind != TOKEN_NUMBER) {
+      syntax_error(ps, "string expected");
+      return -1;
+   } else {
+      char** texts = realloc(t->texts, n * sizeof(char*));
+      size_t* lengths;
+      if (!texts) {
+         return -1;
+      }
+      t->texts = texts;
+      lengths = realloc(t->lengths, n * sizeof(size_t));
+      if (!lengths) {
+         return -1;
+      }
+      t->lengths = lengths;
+      t->texts[t->count] = literal_text(ps);
+      if (!t->texts[t->count]) {
+         return -1;
+      }
+      t->lengths[t->count] = strlen(t->texts[t->count]);
+      ++t->count;
+   }
+   return 0;
+}
+
+//*****************************************************************************
+
+// pattern without wildcards is compared as it is, and pattern whose only
+// wildcard is trailing * as prefix
+static void classify_pattern(struct test* t)
+{
+   const char* pattern = t->texts[0];
+   const size_t special = strcspn(pattern, "*?[\\");
+
+   if (!pattern[special]) {
+      t->kind = TEST_STRING;
+   } else if (pattern[special] == '*' && !pattern[special + 1]) {
+      t->kind = TEST_PREFIX;
+      t->lengths[0] = special;
+   } else {
+      t->kind = TEST_GLOB;
+   }
+}
+
+//*****************************************************************************
+
+static int test_cost(const struct test* t)
+{
+   switch (t->kind) {
+   case TEST_NUMBERS:
+      return 1 + t->count / 4;
+   case TEST_STRING:
+   case TEST_PREFIX:
+      return 8;
+   case TEST_GLOB:
+      return 32;
+   case TEST_STRINGS:
+      return 8 * t->count;
+   default:
+      return 1;
+   }
+}
+
+//*****************************************************************************
+
+static struct node* new_node(enum node_kind kind, struct node* left,
+                             struct node* right)
+{
+   struct node* n = calloc(1, sizeof(struct node));
+
+   if (n) {
+      n->kind = kind;
+      n->left = left;
+      n->right = right;
+      n->cost = (left ? left->cost : 0) + (right ? right->cost : 0);
+   }
+   return n;
+}
+
+//*****************************************************************************
+
+static struct node* parse_test(struct parser* ps)
+{
+   struct node* n;
+   unsigned int i;
+   enum field_kind kind;
+   long long number;
+
+   if (ps->kind != TOKEN_WORD) {
+      syntax_error(ps, "field name expected");
+      return NULL;
+   }
+   if (is_keyword(ps, "true")) {
+      next_token(ps);
+      return new_node(NODE_TRUE, NULL, NULL);
+   }
+   for (i = 0; i != NUM_FIELDS; ++i) {
+      if (strlen(fields[i].name) == ps->len &&
+          !strncasecmp(fields[i].name, ps->token, ps->len)) {
+         break;
+      }
+   }
+   if (i == NUM_FIELDS) {
+      syntax_error(ps, "unknown field");
+      return NULL;
+   }
+   n = new_node(NODE_TEST, NULL, NULL);
+   if (!n) {
+      return NULL;
+   }
+   kind = fields[i].kind;
+   n->test.field = fields[i].id;
+   next_token(ps);
+
+   if (is_keyword(ps, "in")) {
+      next_token(ps);
+      if (!is_operator(ps, "(")) {
+         syntax_error(ps, "'(' expected");
+      }
+      do {
+         next_token(ps);
+         if (ps->failed || add_value(ps, &n->test, kind)) {
+            free_node(n);
+            return NULL;
+         }
+         next_token(ps);
+      } while (is_operator(ps, ","));
+      if (!is_operator(ps, ")")) {
+         syntax_error(ps, "')' expected");
+         free_node(n);
+         return NULL;
+      }
+      n->test.kind = kind == KIND_NAME ? TEST_MASK :
+         kind == KIND_NUMBER ? TEST_NUMBERS : TEST_STRINGS;
+   } else if (is_operator(ps, "==") || is_operator(ps, "=") ||
+              is_operator(ps, "!=")) {
+      n->negate = is_operator(ps, "!=");
+      next_token(ps);
+      if (add_value(ps, &n->test, kind)) {
+         free_node(n);
+         return NULL;
+      }
+      n->test.kind = kind == KIND_NAME ? TEST_MASK :
+         kind == KIND_NUMBER ? TEST_EQUAL : TEST_STRING;
+      if (kind == KIND_NUMBER) {
+         n->test.value = n->test.values[0];
+      }
+   } else if (is_operator(ps, "~") || is_operator(ps, "!~")) {
+      n->negate = is_operator(ps, "!~");
+      next_token(ps);
+      if (kind != KIND_STRING) {
+         syntax_error(ps, "only strings can be matched against pattern");
+      }
+      if (ps->failed || add_value(ps, &n->test, kind)) {
+         free_node(n);
+         return NULL;
+      }
+      classify_pattern(&n->test);
+   } else if (is_operator(ps, "<") || is_operator(ps, ">=") ||
+              is_operator(ps, ">") || is_operator(ps, "<=")) {
+      // a <= b is !(a > b), a >= b is !(a < b)
+      n->test.kind = (is_operator(ps, "<") || is_operator(ps, ">=")) ?
+         TEST_LESS : TEST_GREATER;
+      n->negate = is_operator(ps, "<=") || is_operator(ps, ">=");
+      next_token(ps);
+      if (kind != KIND_NUMBER) {
+         syntax_error(ps, "only numbers can be compared");
+      }
+      if (ps->failed || parse_number(ps, n->test.field, &number)) {
+         free_node(n);
+         return NULL;
+      }
+      n->test.value = number;
+   } else {
+      syntax_error(ps, "comparison expected");
+      free_node(n);
+      return NULL;
+   }
+   next_token(ps);
+   n->cost = test_cost(&n->test);
+   return n;
+}
+
+//*****************************************************************************
+
+static struct node* parse_or(struct parser* ps);
+
+static struct node* parse_unary(struct parser* ps)
+{
+   struct node* n;
+
+   if ((is_operator(ps, "!") || is_keyword(ps, "not") ||
+        is_operator(ps, "(")) && ps->depth == MAX_DEPTH) {
+      // parser and compiler recurse once per level
+      syntax_error(ps, "expression nested too deeply");
+      return NULL;
+   }
+   if (is_operator(ps, "!") || is_keyword(ps, "not")) {
+      next_token(ps);
+      ++ps->depth;
+      n = parse_unary(ps);
+      --ps->depth;
+      return n ? new_node(NODE_NOT, n, NULL) : NULL;
+   }
+   if (is_operator(ps, "(")) {
+      next_token(ps);
+      ++ps->depth;
+      n = parse_or(ps);
+      --ps->depth;
+      if (n && !is_operator(ps, ")")) {
+         syntax_error(ps, "')' expected");
+         free_node(n);
+         return NULL;
+      }
+      next_token(ps);
+      return n;
+   }
+   return parse_test(ps);
+}
+
+//*****************************************************************************
+
+// operands of && or || chain sorted by cost, cheapest evaluated first
+static struct node* parse_chain(struct parser* ps, enum node_kind kind)
+{
+   struct node* operands[256];
+   struct node* n;
+   int num = 0, i, j;
+
+   do {
+      if (num) {
+         next_token(ps);
+      }
+      n = kind == NODE_OR ? parse_chain(ps, NODE_AND) : parse_unary(ps);
+      if (!n || num == sizeof(operands) / sizeof(operands[0])) {
+         if (n) {
+            syntax_error(ps, "expression too long");
+            free_node(n);
+         }
+         while (num) {
+            free_node(operands[--num]);
+         }
+         return NULL;
+      }
+      for (i = num++; i && operands[i - 1]->cost > n->cost; --i) {
+         operands[i] = operands[i - 1];
+      }
+      operands[i] = n;
+   } while (kind == NODE_OR ? (is_operator(ps, "||") || is_keyword(ps, "or")) :
+            (is_operator(ps, "&&") || is_keyword(ps, "and")));
+
+   n = operands[num - 1];
+   for (j = num - 2; j >= 0; --j) {
+      struct node* chain = new_node(kind, operands[j], n);
+      if (!chain) {
+         free_node(n);
+         while (j >= 0) {
+            free_node(operands[j--]);
+         }
+         return NULL;
+      }
+      n = chain;
+   }
+   return n;
+}
+
+//*****************************************************************************
+
+static struct node* parse_or(struct parser* ps)
+{
+   return parse_chain(ps, NODE_OR);
+}
+
+//*****************************************************************************
+
+// domains and operations which node can accept, and whether it reads
+// strings of records
+static void node_interest(const struct node* n, unsigned int* domain_mask,
+                          unsigned int* op_mask, int* wants_strings)
+{
+   unsigned int left_domains, right_domains;
+   unsigned int left_ops[OP_MASK_WORDS], right_ops[OP_MASK_WORDS];
+   int i;
+
+   *domain_mask = ~0U;
+   memset(op_mask, 0xff, OP_MASK_WORDS * sizeof(unsigned int));
+   switch (n->kind) {
+   case NODE_TEST:
+      if (n->test.field == FIELD_PATH || n->test.field == FIELD_PARAMS) {
+         *wants_strings = 1;
+      }
+      if (n->test.kind == TEST_MASK && n->test.field == FIELD_DOMAIN) {
+         *domain_mask = n->negate ? ~n->test.mask[0] : n->test.mask[0];
+      } else if (n->test.kind == TEST_MASK) {
+         for (i = 0; i != OP_MASK_WORDS; ++i) {
+            op_mask[i] = n->negate ? ~n->test.mask[i] : n->test.mask[i];
+         }
+      }
+      break;
+   case NODE_NOT:
+      // whatever child accepts, negation may reject and the other way round
+      node_interest(n->left, &left_domains, left_ops, wants_strings);
+      break;
+   case NODE_AND:
+   case NODE_OR:
+      node_interest(n->left, &left_domains, left_ops, wants_strings);
+      node_interest(n->right, &right_domains, right_ops, wants_strings);
+      *domain_mask = n->kind == NODE_AND ? left_domains & right_domains :
+         left_domains | right_domains;
+      for (i = 0; i != OP_MASK_WORDS; ++i) {
+         op_mask[i] = n->kind == NODE_AND ? left_ops[i] & right_ops[i] :
+            left_ops[i] | right_ops[i];
+      }
+      break;
+   case NODE_TRUE:
+      break;
+   }
+}
+
+//*****************************************************************************
+
+// emits tests of node, last one first, so that tests they lead to are
+// already known; returns index of first test of node
+static int emit(struct program* p, struct node* n, int on_true, int on_false)
+{
+   struct test* t;
+
+   switch (n->kind) {
+   case NODE_TRUE:
+      return on_true;
+   case NODE_NOT:
+      return emit(p, n->left, on_false, on_true);
+   case NODE_AND:
+      return emit(p, n->left, emit(p, n->right, on_true, on_false), on_false);
+   case NODE_OR:
+      return emit(p, n->left, on_true, emit(p, n->right, on_true, on_false));
+   case NODE_TEST:
+      break;
+   }
+   t = &p->tests[p->num_tests];
+   *t = n->test;
+   memset(&n->test, 0, sizeof(n->test));
+   t->on_true = n->negate ? on_false : on_true;
+   t->on_false = n->negate ? on_true : on_false;
+   return p->num_tests++;
+}
+
+//*****************************************************************************
+
+static unsigned int count_tests(const struct node* n)
+{
+   return !n ? 0 : (n->kind == NODE_TEST) + count_tests(n->left) +
+      count_tests(n->right);
+}
+
+//*****************************************************************************
+
+// empty expression accepts everything
+static struct program* compile(const char* expression)
+{
+   struct program* p = calloc(1, sizeof(struct program));
+   struct parser ps = {expression, expression, 0, TOKEN_END, 0, 0};
+   struct node* root = NULL;
+
+   if (!p) {
+      return NULL;
+   }
+   next_token(&ps);
+   if (ps.kind == TOKEN_END && !ps.failed) {
+      p->start = ACCEPT;
+      p->domain_mask = ~0U;
+      memset(p->op_mask, 0xff, sizeof(p->op_mask));
+      return p;
+   }
+   root = parse_or(&ps);
+   if (root && ps.kind != TOKEN_END) {
+      syntax_error(&ps, "'&&', '||' or end of expression expected");
+   }
+   if (!root || ps.failed) {
+      free_node(root);
+      free_program(p);
+      return NULL;
+   }
+
+   node_interest(root, &p->domain_mask, p->op_mask, &p->wants_strings);
+   p->tests = calloc(count_tests(root) + 1, sizeof(struct test));
+   if (!p->tests) {
+      free_node(root);
+      free_program(p);
+      return NULL;
+   }
+   p->start = emit(p, root, ACCEPT, DROP);
+   free_node(root);
+   return p;
+}
+
+//*****************************************************************************
+
+static long long number_field(enum field_id field,
+                              const struct monitor_record_t* rec)
+{
+   switch (field) {
+   case FIELD_PID:
+      return rec->pid;
+   case FIELD_TID:
+      return rec->tid;
+   case FIELD_FD:
+      return rec->fd;
+   case FIELD_ERROR:
+      return rec->error_code;
+   case FIELD_BYTES:
+      return rec->bytes_transferred;
+   case FIELD_OFFSET:
+      return rec->offset;
+   case FIELD_LATENCY:
+      return (long long)(rec->elapsed_time * 1e6);
+   case FIELD_DOMAIN:
+      return rec->dom_type;
+   case FIELD_OP:
+      return rec->op_type;
+   default:
+      return 0;
+   }
+}
+
+//*****************************************************************************
+
+// device is not terminated when it fills its field, so it is copied
+static const char* string_field(enum field_id field,
+                                const struct monitor_record_t* rec,
+                                char* device)
+{
+   switch (field) {
+   case FIELD_FACILITY:
+      return rec->facility;
+   case FIELD_HOST:
+      return rec->hostname;
+   case FIELD_PATH:
+      return rec->s1;
+   case FIELD_PARAMS:
+      return rec->s2;
+   default:
+      memcpy(device, rec->device, DEVICE_LEN);
+      device[DEVICE_LEN] = 0;
+      return device;
+   }
+}
+
+//*****************************************************************************
+
+static int run_test(const struct test* t, const struct monitor_record_t* rec)
+{
+   char device[DEVICE_LEN + 1];
+   const char* s;
+   long long v;
+   unsigned int i;
+
+   switch (t->kind) {
+   case TEST_MASK:
+      v = number_field(t->field, rec);
+      return v >= 0 && v < OP_MASK_WORDS * 32 &&
+         (t->mask[v / 32] & (1U << (v % 32)));
+   case TEST_LESS:
+      return number_field(t->field, rec) < t->value;
+   case TEST_GREATER:
+      return number_field(t->field, rec) > t->value;
+   case TEST_EQUAL:
+      return number_field(t->field, rec) == t->value;
+   case TEST_NUMBERS:
+      v = number_field(t->field, rec);
+      for (i = 0; i != t->count; ++i) {
+         if (t->values[i] == v) {
+            return 1;
+         }
+      }
+      return 0;
+   case TEST_STRING:
+      return !strcmp(string_field(t->field, rec, device), t->texts[0]);
+   case TEST_PREFIX:
+      return !strncmp(string_field(t->field, rec, device), t->texts[0],
+                      t->lengths[0]);
+   case TEST_GLOB:
+      return !fnmatch(t->texts[0], string_field(t->field, rec, device), 0);
+   case TEST_STRINGS:
+      s = string_field(t->field, rec, device);
+      for (i = 0; i != t->count; ++i) {
+         if (!strcmp(s, t->texts[i])) {
+            return 1;
+         }
+      }
+      return 0;
+   }
+   return 0;
+}
+
+//*****************************************************************************
+
+static int run_program(const struct program* p,
+                       const struct monitor_record_t* rec)
+{
+   int next = p->start;
+
+   while (next >= 0) {
+      const struct test* t = &p->tests[next];
+      next = run_test(t, rec) ? t->on_true : t->on_false;
+   }
+   return next == ACCEPT;
+}
+
+//*****************************************************************************
+
+// replacement is taken over by thread calling process_data, which is
+// the only one running the program
+static void take_replacement(struct plugin_state* ps)
+{
+   struct program* p;
+
+   if (__atomic_load_n(&ps->replacement, __ATOMIC_ACQUIRE)) {
+      p = __atomic_exchange_n(&ps->replacement, NULL, __ATOMIC_ACQ_REL);
+      if (p) {
+         free_program(ps->program);
+         ps->program = p;
+      }
+   }
+}
+
+//*****************************************************************************
+
+static void set_interest(struct plugin_state* ps, const struct program* p)
+{
+   ps->interest.domain_mask = p->domain_mask;
+   memcpy(ps->interest.op_mask, p->op_mask, sizeof(p->op_mask));
+   ps->interest.wants_strings = p->wants_strings;
+}
+
+//*****************************************************************************
+
+int open_plugin(const char* plugin_config, struct listener* listener,
+                void** state)
+{
+   struct plugin_state* ps = calloc(1, sizeof(struct plugin_state));
+
+   if (!ps) {
+      return PLUGIN_OPEN_FAIL;
+   }
+   ps->program = compile(plugin_config ? plugin_config : "");
+   if (!ps->program) {
+      free(ps);
+      return PLUGIN_OPEN_FAIL;
+   }
+   ps->listener = listener;
+   snprintf(ps->expression, sizeof(ps->expression), "%s",
+            plugin_config ? plugin_config : "");
+   set_interest(ps, ps->program);
+   *state = ps;
+   return PLUGIN_OPEN_SUCCESS;
+}
+
+//*****************************************************************************
+
+void close_plugin(void* state)
+{
+   struct plugin_state* ps = state;
+
+   printf("filter_expr: %llu records, %llu dropped\n", ps->records,
+          ps->dropped);
+   free_program(ps->program);
+   free_program(ps->replacement);
+   free(ps);
+}
+
+//*****************************************************************************
+
+int ok_to_accept_data(void* state)
+{
+   return PLUGIN_ACCEPT_DATA;
+}
+
+//*****************************************************************************
+
+int process_data(struct monitor_record_t* data, void* state)
+{
+   struct plugin_state* ps = state;
+
+   take_replacement(ps);
+   ++ps->records;
+   if (!run_program(ps->program, data)) {
+      ++ps->dropped;
+      return PLUGIN_DROP_DATA;
+   }
+   return PLUGIN_ACCEPT_DATA;
+}
+
+//*****************************************************************************
+
+void flush_plugin(void* state)
+{
+   take_replacement(state);
+}
+
+//*****************************************************************************
+
+/* let mq_listener drop records the expression can't accept without
+ * calling us */
+void get_interest(struct plugin_interest* interest, void* state)
+{
+   struct plugin_state* ps = state;
+   int i;
+
+   interest->domain_mask &= ps->interest.domain_mask;
+   for (i = 0; i != OP_MASK_WORDS; ++i) {
+      interest->op_mask[i] &= ps->interest.op_mask[i];
+   }
+   interest->wants_strings = ps->interest.wants_strings;
+   interest->drop_uninteresting = 1;
+}
+
+//*****************************************************************************
+
+char** list_commands()
+{
+   static const char* command_list[] = {
+      "filter-set", "filter-print", "help", 0
+   };
+   return (char**)command_list;
+}
+
+//*****************************************************************************
+
+int plugin_command(const char* name, const char** args, void* state)
+{
+   struct plugin_state* ps = state;
+   char expression[MAX_EXPRESSION_LEN] = "";
+   struct program* p;
+   size_t len = 0;
+   int i;
+
+   if (args[0] && !strcmp(args[0], "filter-set")) {
+      // command line was split at spaces; join it back
+      for (i = 1; args[i]; ++i) {
+         len += snprintf(expression + len, sizeof(expression) - len, "%s%s",
+                         i > 1 ? " " : "", args[i]);
+         if (len >= sizeof(expression)) {
+            fprintf(stderr, "error: filter_expr expression too long\n");
+            return 1;
+         }
+      }
+      p = compile(expression);
+      if (!p) {
+         return 1;
+      }
+      set_interest(ps, p);
+      strcpy(ps->expression, expression);
+      free_program(__atomic_exchange_n(&ps->replacement, p, __ATOMIC_ACQ_REL));
+      if (ps->listener->interest_changed) {
+         ps->listener->interest_changed();
+      }
+   } else if (args[0] && !strcmp(args[0], "filter-print")) {
+      printf("filter: %s\n", ps->expression);
+      printf("filter_expr: %llu records, %llu dropped\n", ps->records,
+             ps->dropped);
+   } else if (args[0] && !strcmp(args[0], "help")) {
+      printf("filter_expr: drops records for which expression is false\n"
+             "  filter-set <expression>  replace expression\n"
+             "  filter-print             print expression and counters\n");
+   }
+   return 0;
+}
@@ -0,0 +1,467 @@
+//
+// Copyright (c) 2017 Intel Corporation
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+// implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "plugin.h"
+#include "monitor_record.h"
+#include "domains.h"
+#include "ops.h"
+#include "path_tags.h"
+
+/* plugin configuration is a comma separated list of key=value pairs:
+ *   include=/data:/scratch,exclude=/proc:/sys:*site-packages*,file=paths.txt
+ * include and exclude are ':' separated patterns, file has pattern per
+ * line, '+' in front of includes and '-' in front of excludes. All are
+ * compiled into one automaton (path_matcher.h). Records about excluded
+ * paths, or paths matching no include when there are some, are dropped.
+ * Descriptors opened on them are tagged by (pid, fd), so that records of
+ * their later use are dropped without matching path again (path_tags.h) */
+#define MAX_PATTERNS_LEN 65536
+#define MIN_TAGS 1024
+
+struct patterns {
+   char includes[MAX_PATTERNS_LEN];
+   char excludes[MAX_PATTERNS_LEN];
+   size_t includes_len;
+   size_t excludes_len;
+};
+
+// open addressing with linear probing; 0 is empty slot
+struct tag_table {
+   unsigned long long* keys;
+   unsigned int size;            /* power of 2 */
+   unsigned int count;
+};
+
+struct plugin_state {
+   struct path_matcher* matcher;
+   struct path_matcher* replacement;
+   struct tag_table tags;
+   struct listener* listener;
+   unsigned long long records;
+   unsigned long long dropped;
+};
+
+//*****************************************************************************
+
+static int add_pattern(struct patterns* p, const char* pattern, size_t len,
+                       int exclude)
+{
+   char* list = exclude ? p->excludes : p->includes;
+   size_t* list_len = exclude ? &p->excludes_len : &p->includes_len;
+
+   if (*list_len + len + 2 > MAX_PATTERNS_LEN) {
+      fprintf(stderr, "error: filter_paths has too many patterns\n");
+      return 1;
+   }
+   if (*list_len) {
+      list[(*list_len)++] = '\n';
+   }
+   memcpy(list + *list_len, pattern, len);
+   *list_len += len;
+   list[*list_len] = 0;
+   return 0;
+}
+
+//*****************************************************************************
+
+static int add_list(struct patterns* p, const char* list, int exclude)
+{
+   const char* end;
+
+   for (; *list; list = *end ? end + 1 : end) {
+      end = strchrnul(list, ':');
+      if (end != list && add_pattern(p, list, end - list, exclude)) {
+         return 1;
+      }
+   }
+   return 0;
+}
+
+//*****************************************************************************
+
+static int add_file(struct patterns* p, const char* file_name)
+{
+   FILE* f = fopen(file_name, "r");
+   char* line = NULL;
+   size_t size = 0;
+   ssize_t len;
+   int rc = 0;
+
+   if (!f) {
+      fprintf(stderr, "error: filter_paths unable to open '%s'\n", file_name);
+      return 1;
+   }
+   while (!rc && (len = getline(&line, &size, f)) >= 0) {
+      while (len && (line[len - 1] == '\n' || line[len - 1] == '\r')) {
+         line[--len] = 0;
+      }
+      if (!len || line[0] == '#') {
+         continue;
+      }
+      if (line[0] == '+' || line[0] == '-') {
+         rc = len > 1 && add_pattern(p, line + 1, len - 1, line[0] == '-');
+      } else {
+         fprintf(stderr, "error: filter_paths line '%s' of '%s' doesn't start"
+                 " with + or -\n", line, file_name);
+         rc = 1;
+      }
+   }
+   free(line);
+   fclose(f);
+   return rc;
+}
+
+//*****************************************************************************
+
+static struct path_matcher* compile(const char* plugin_config)
+{
+   struct patterns* p = calloc(1, sizeof(struct patterns));
+   char* config = strdup(plugin_config ? plugin_config : "");
+   char* rest = config;
+   char* token;
+   struct path_matcher* m = NULL;
+   int rc = !p || !config;
+
+   while (!rc && (token = strtok_r(rest, ",", &rest))) {
+      char* value = strchr(token, '=');
+      if (!value) {
+         fprintf(stderr, "error: filter_paths option '%s' has no value\n",
+                 token);
+         rc = 1;
+         break;
+      }
+      *value++ = 0;
+      if (!strcmp(token, "include")) {
+         rc = add_list(p, value, 0);
+      } else if (!strcmp(token, "exclude")) {
+         rc = add_list(p, value, 1);
+      } else if (!strcmp(token, "file") && *value) {
+         rc = add_file(p, value);
+      } else {
+         fprintf(stderr, "error: filter_paths option '%s' is invalid\n",
+                 token);
+         rc = 1;
+      }
+   }
+   if (!rc) {
+      m = path_matcher_compile(p->includes, p->excludes, '\n');
+      if (!m) {
+         fprintf(stderr, "error: filter_paths patterns are invalid (only"
+                 " leading and trailing * are supported)\n");
+      }
+   }
+   free(config);
+   free(p);
+   return m;
+}
+
+//*****************************************************************************
+
+static unsigned int tag_slot(const struct tag_table* t,
+                             unsigned long long key)
+{
+   unsigned long long h = key * 0x9e3779b97f4a7c15ULL;
+
+   return (unsigned int)(h >> 32) & (t->size - 1);
+}
+
+//*****************************************************************************
+
+// fd + 1, so that no key is 0
+static unsigned long long tag_key(int pid, int fd)
+{
+   return ((unsigned long long)(unsigned int)pid << 32) | (unsigned int)(fd + 1);
+}
+
+//*****************************************************************************
+
+static int is_tagged(const struct tag_table* t, unsigned long long key)
+{
+   unsigned int i;
+
+   if (!t->count) {
+      return 0;
+   }
+   for (i = tag_slot(t, key); t->keys[i]; i = (i + 1) & (t->size - 1)) {
+      if (t->keys[i] == key) {
+         return 1;
+      }
+   }
+   return 0;
+}
+
+//*****************************************************************************
+
+static void tag(struct tag_table* t, unsigned long long key)
+{
+   unsigned long long* old_keys = t->keys;
+   unsigned int old_size = t->size;
+   unsigned int i, j;
+
+   if (2 * (t->count + 1) > t->size) {
+      unsigned int size = t->size ? 2 * t->size : MIN_TAGS;
+      unsigned long long* keys = calloc(size, sizeof(unsigned long long));
+      if (!keys) {
+         return;   // record stays untagged, its path is matched again
+      }
+      t->keys = keys;
+      t->size = size;
+      for (j = 0; j != old_size; ++j) {
+         if (old_keys[j]) {
+            for (i = tag_slot(t, old_keys[j]); t->keys[i];
+                 i = (i + 1) & (t->size - 1))
+               ;
+            t->keys[i] = old_keys[j];
+         }
+      }
+      free(old_keys);
+   }
+   for (i = tag_slot(t, key); t->keys[i]; i = (i + 1) & (t->size - 1)) {
+      if (t->keys[i] == key) {
+         return;
+      }
+   }
+   t->keys[i] = key;
+   ++t->count;
+}
+
+//*****************************************************************************
+
+// removes key at slot i, moving back keys of the same probe sequence
+static void remove_slot(struct tag_table* t, unsigned int i)
+{
+   unsigned int j = i, home;
+
+   for (;;) {
+      t->keys[i] = 0;
+      for (;;) {
+         j = (j + 1) & (t->size - 1);
+         if (!t->keys[j]) {
+            --t->count;
+            return;
+         }
+         home = tag_slot(t, t->keys[j]);
+         // key at j can move to i unless its home lies in (i, j]
+         if (((j - home) & (t->size - 1)) >= ((j - i) & (t->size - 1))) {
+            break;
+         }
+      }
+      t->keys[i] = t->keys[j];
+      i = j;
+   }
+}
+
+//*****************************************************************************
+
+static void untag(struct tag_table* t, unsigned long long key)
+{
+   unsigned int i;
+
+   if (!t->count) {
+      return;
+   }
+   for (i = tag_slot(t, key); t->keys[i]; i = (i + 1) & (t->size - 1)) {
+      if (t->keys[i] == key) {
+         remove_slot(t, i);
+         return;
+      }
+   }
+}
+
+//*****************************************************************************
+
+static void untag_process(struct tag_table* t, int pid)
+{
+   unsigned int i = 0;
+
+   while (t->count && i != t->size) {
+      if (t->keys[i] && (int)(t->keys[i] >> 32) == pid) {
+         remove_slot(t, i);   // slot is refilled from later ones, see again
+      } else {
+         ++i;
+      }
+   }
+}
+
+//*****************************************************************************
+
+// tags of one process, as path_tags_skip sees them
+struct process_tags {
+   struct tag_table* table;
+   int pid;
+};
+
+//*****************************************************************************
+
+static int is_tagged_fd(void* tags, int fd)
+{
+   const struct process_tags* pt = tags;
+
+   return is_tagged(pt->table, tag_key(pt->pid, fd));
+}
+
+//*****************************************************************************
+
+static void tag_fd(void* tags, int fd, int tagged)
+{
+   const struct process_tags* pt = tags;
+
+   if (tagged) {
+      tag(pt->table, tag_key(pt->pid, fd));
+   } else {
+      untag(pt->table, tag_key(pt->pid, fd));
+   }
+}
+
+//*****************************************************************************
+
+// whether record is about path left out, or about descriptor opened on one
+static int skip(struct plugin_state* ps, const struct monitor_record_t* rec)
+{
+   struct process_tags pt = { &ps->tags, rec->pid };
+
+   // DUP carries descriptor it duplicated as offset
+   return path_tags_skip(ps->matcher, &pt, is_tagged_fd, tag_fd,
+                         rec->dom_type, rec->op_type, rec->fd,
+                         (rec->op_type == DUP) ? (int)rec->offset : -1,
+                         rec->s1);
+}
+
+//*****************************************************************************
+
+// replacement is taken over by thread calling process_data, which is
+// the only one using the matcher
+static void take_replacement(struct plugin_state* ps)
+{
+   struct path_matcher* m;
+
+   if (__atomic_load_n(&ps->replacement, __ATOMIC_ACQUIRE)) {
+      m = __atomic_exchange_n(&ps->replacement, NULL, __ATOMIC_ACQ_REL);
+      if (m) {
+         path_matcher_free(ps->matcher);
+         ps->matcher = m;
+      }
+   }
+}
+
+//*****************************************************************************
+
+int open_plugin(const char* plugin_config, struct listener* listener,
+                void** state)
+{
+   struct plugin_state* ps = calloc(1, sizeof(struct plugin_state));
+
+   if (!ps) {
+      return PLUGIN_OPEN_FAIL;
+   }
+   ps->matcher = compile(plugin_config);
+   if (!ps->matcher) {
+      free(ps);
+      return PLUGIN_OPEN_FAIL;
+   }
+   ps->listener = listener;
+   *state = ps;
+   return PLUGIN_OPEN_SUCCESS;
+}
+
+//*****************************************************************************
+
+void close_plugin(void* state)
+{
+   struct plugin_state* ps = state;
+
+   printf("filter_paths: %llu records, %llu dropped\n", ps->records,
+          ps->dropped);
+   path_matcher_free(ps->matcher);
+   path_matcher_free(ps->replacement);
+   free(ps->tags.keys);
+   free(ps);
+}
+
+//*****************************************************************************
+
+int ok_to_accept_data(void* state)
+{
+   return PLUGIN_ACCEPT_DATA;
+}
+
+//*****************************************************************************
+
+int process_data(struct monitor_record_t* data, void* state)
+{
+   struct plugin_state* ps = state;
+
+   take_replacement(ps);
+   ++ps->records;
+   if ((data->dom_type == START_STOP) && (data->op_type == STOP)) {
+      untag_process(&ps->tags, data->pid);
+      return PLUGIN_ACCEPT_DATA;
+   }
+   if (skip(ps, data)) {
+      ++ps->dropped;
+      return PLUGIN_DROP_DATA;
+   }
+   return PLUGIN_ACCEPT_DATA;
+}
+
+//*****************************************************************************
+
+void flush_plugin(void* state)
+{
+   take_replacement(state);
+}
+
+//*****************************************************************************
+
+char** list_commands()
+{
+   static const char* command_list[] = {
+      "paths-set", "paths-print", "help", 0
+   };
+   return (char**)command_list;
+}
+
+//*****************************************************************************
+
+int plugin_command(const char* name, const char** args, void* state)
+{
+   struct plugin_state* ps = state;
+   struct path_matcher* m;
+
+   if (args[0] && !strcmp(args[0], "paths-set") && args[1]) {
+      m = compile(args[1]);
+      if (!m) {
+         return 1;
+      }
+      path_matcher_free(__atomic_exchange_n(&ps->replacement, m,
+                                            __ATOMIC_ACQ_REL));
+   } else if (args[0] && !strcmp(args[0], "paths-print")) {
+      printf("filter_paths: %llu records, %llu dropped\n", ps->records,
+             ps->dropped);
+   } else if (args[0] && !strcmp(args[0], "help")) {
+      printf("filter_paths: drops records about excluded paths\n"
+             "  paths-set include=<a:b>,exclude=<c:d>,file=<file>"
+             "  replace patterns\n"
+             "  paths-print  print counters\n");
+   }
+   return 0;
+}
@@ -0,0 +1,603 @@
+//
+// Copyright (c) 2017 Intel Corporation
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+// implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <time.h>
+
+#include "plugin.h"
+#include "monitor_record.h"
+#include "plugin_helpers.h"
+
+/* plugin configuration is a comma separated list of key=value pairs:
+ *   keys=pid+op+path,rate=100,burst=500,dedup=100,summary=10,max_keys=10000
+ * Each key gets a token bucket of <burst> records, refilled at <rate>
+ * records per second (rate=0 turns it off). Record finding it empty is
+ * dropped, as is record identical to the last passed one of its key
+ * within <dedup> milliseconds. Every <summary> seconds one record per key
+ * with drops, telling how many, is passed to plugins loaded after this
+ * one. Time is taken from records, as in aggregate. Once max_keys keys
+ * exist, records of new keys share one catch-all key */
+#define DEFAULT_RATE 100
+#define DEFAULT_SUMMARY_S 10
+#define DEFAULT_MAX_KEYS 10000
+#define INITIAL_TABLE_SIZE 256
+#define FACILITY "ratelimit"
+#define OVERFLOW_PATH "*"
+
+#define KEY_HOST   1
+#define KEY_PID    2
+#define KEY_TID    4
+#define KEY_OP     8
+#define KEY_FD     16
+#define KEY_ERROR  32
+#define KEY_DEVICE 64
+#define KEY_PATH   128
+
+static const struct {
+   const char* name;
+   unsigned int key;
+} key_names[] = {
+   {"host", KEY_HOST},
+   {"pid", KEY_PID},
+   {"tid", KEY_TID},
+   {"op", KEY_OP},
+   {"fd", KEY_FD},
+   {"error", KEY_ERROR},
+   {"device", KEY_DEVICE},
+   {"path", KEY_PATH},
+};
+#define NUM_KEY_NAMES (sizeof(key_names) / sizeof(key_names[0]))
+
+struct key_entry {
+   unsigned int hash;
+   int pid;
+   int tid;
+   int dom_type;
+   int op_type;
+   int fd;
+   int error_code;
+   char device[DEVICE_LEN];
+   char hostname[HOSTNAME_LEN];
+   char* path;
+
+   double tokens;
+   unsigned long long refilled_ns;
+   unsigned long long last_ns;           /* of last record of key */
+   unsigned long long passed_hash;       /* contents of last passed record */
+   unsigned long long passed_ns;
+   unsigned long long limited;           /* dropped since last summary */
+   unsigned long long deduplicated;
+   struct key_entry* next;
+};
+
+struct plugin_state {
+   struct listener* listener;
+   unsigned int keys;
+   double rate;                 /* per second */
+   double burst;
+   unsigned long long dedup_ns;
+   unsigned long long summary_ns;
+
+   struct key_entry** table;
+   unsigned int table_size;     /* power of 2 */
+   unsigned int num_keys;       /* catch-all key excluded */
+   unsigned int max_keys;
+   struct key_entry* overflow;  /* catch-all key, kept out of table */
+
+   unsigned long long period;   /* number of current summary period */
+   struct event_clock clock;
+
+   unsigned long long records;
+   unsigned long long limited;
+   unsigned long long deduplicated;
+   unsigned long long summaries;
+   unsigned long long overflowed;   /* records counted in catch-all key */
+};
+
+//*****************************************************************************
+
+// 64 bits, as records are told apart by it alone
+static unsigned long long contents_hash(const struct monitor_record_t* rec)
+{
+   unsigned long long hash = FNV64_OFFSET;
+
+   hash = fnv_hash64(hash, &rec->dom_type, sizeof(rec->dom_type));
+   hash = fnv_hash64(hash, &rec->op_type, sizeof(rec->op_type));
+   hash = fnv_hash64(hash, &rec->pid, sizeof(rec->pid));
+   hash = fnv_hash64(hash, &rec->error_code, sizeof(rec->error_code));
+   hash = fnv_hash64(hash, &rec->fd, sizeof(rec->fd));
+   hash = fnv_hash64(hash, &rec->bytes_transferred,
+                     sizeof(rec->bytes_transferred));
+   hash = fnv_hash64(hash, rec->s1, strlen(rec->s1) + 1);
+   hash = fnv_hash64(hash, rec->s2, strlen(rec->s2));
+   return hash;
+}
+
+//*****************************************************************************
+
+static unsigned int key_hash(const struct plugin_state* ps,
+                             const struct monitor_record_t* rec)
+{
+   unsigned int hash = FNV_OFFSET;
+
+   if (ps->keys & KEY_HOST) {
+      hash = fnv_hash(hash, rec->hostname, strnlen(rec->hostname,
+                                                   HOSTNAME_LEN));
+   }
+   if (ps->keys & KEY_PID) {
+      hash = fnv_hash(hash, &rec->pid, sizeof(rec->pid));
+   }
+   if (ps->keys & KEY_TID) {
+      hash = fnv_hash(hash, &rec->tid, sizeof(rec->tid));
+   }
+   if (ps->keys & KEY_OP) {
+      hash = fnv_hash(hash, &rec->dom_type, sizeof(rec->dom_type));
+      hash = fnv_hash(hash, &rec->op_type, sizeof(rec->op_type));
+   }
+   if (ps->keys & KEY_FD) {
+      hash = fnv_hash(hash, &rec->fd, sizeof(rec->fd));
+   }
+   if (ps->keys & KEY_ERROR) {
+      hash = fnv_hash(hash, &rec->error_code, sizeof(rec->error_code));
+   }
+   if (ps->keys & KEY_DEVICE) {
+      hash = fnv_hash(hash, rec->device, strnlen(rec->device, DEVICE_LEN));
+   }
+   if (ps->keys & KEY_PATH) {
+      hash = fnv_hash(hash, rec->s1, strlen(rec->s1));
+   }
+   return hash;
+}
+
+//*****************************************************************************
+
+static int key_matches(const struct plugin_state* ps,
+                       const struct key_entry* e,
+                       const struct monitor_record_t* rec)
+{
+   return (!(ps->keys & KEY_HOST) ||
+           !strncmp(e->hostname, rec->hostname, HOSTNAME_LEN)) &&
+      (!(ps->keys & KEY_PID) || e->pid == rec->pid) &&
+      (!(ps->keys & KEY_TID) || e->tid == rec->tid) &&
+      (!(ps->keys & KEY_OP) ||
+       (e->dom_type == rec->dom_type && e->op_type == rec->op_type)) &&
+      (!(ps->keys & KEY_FD) || e->fd == rec->fd) &&
+      (!(ps->keys & KEY_ERROR) || e->error_code == rec->error_code) &&
+      (!(ps->keys & KEY_DEVICE) ||
+       !strncmp(e->device, rec->device, DEVICE_LEN)) &&
+      (!(ps->keys & KEY_PATH) || !strcmp(e->path, rec->s1));
+}
+
+//*****************************************************************************
+
+// catch-all key, which has fields of the record creating it except for
+// pid, fd and path; it goes away when idle, like other keys
+static struct key_entry* overflow_key(struct plugin_state* ps,
+                                      const struct monitor_record_t* rec,
+                                      unsigned long long timestamp_ns)
+{
+   struct key_entry* e = ps->overflow;
+
+   ps->overflowed++;
+   if (e) {
+      return e;
+   }
+   e = calloc(1, sizeof(struct key_entry));
+   if (!e) {
+      return NULL;
+   }
+   e->dom_type = rec->dom_type;
+   e->op_type = rec->op_type;
+   e->fd = FD_NONE;
+   e->error_code = rec->error_code;
+   memcpy(e->hostname, rec->hostname, HOSTNAME_LEN);
+   if ((ps->keys & KEY_PATH) && !(e->path = strdup(OVERFLOW_PATH))) {
+      free(e);
+      return NULL;
+   }
+   e->tokens = ps->burst;
+   e->refilled_ns = timestamp_ns;
+   ps->overflow = e;
+   return e;
+}
+
+//*****************************************************************************
+
+// new key starts with full bucket; keys beyond max_keys share catch-all
+// key, so that memory stays bounded whatever the number of paths
+static struct key_entry* find_key(struct plugin_state* ps,
+                                  const struct monitor_record_t* rec,
+                                  unsigned long long timestamp_ns)
+{
+   const unsigned int hash = key_hash(ps, rec);
+   struct key_entry** head = &ps->table[hash & (ps->table_size - 1)];
+   struct key_entry* e;
+
+   for (e = *head; e; e = e->next) {
+      if (e->hash == hash && key_matches(ps, e, rec)) {
+         return e;
+      }
+   }
+   if (ps->num_keys >= ps->max_keys) {
+      return overflow_key(ps, rec, timestamp_ns);
+   }
+
+   e = calloc(1, sizeof(struct key_entry));
+   if (!e) {
+      return NULL;
+   }
+   e->hash = hash;
+   e->pid = rec->pid;
+   e->tid = rec->tid;
+   e->dom_type = rec->dom_type;
+   e->op_type = rec->op_type;
+   e->fd = rec->fd;
+   e->error_code = rec->error_code;
+   memcpy(e->device, rec->device, DEVICE_LEN);
+   memcpy(e->hostname, rec->hostname, HOSTNAME_LEN);
+   if ((ps->keys & KEY_PATH) && !(e->path = strdup(rec->s1))) {
+      free(e);
+      return NULL;
+   }
+   e->tokens = ps->burst;
+   e->refilled_ns = timestamp_ns;
+   e->next = *head;
+   *head = e;
+   if (++ps->num_keys > ps->table_size) {
+      GROW_CHAINED_TABLE(ps->table, ps->table_size, k, k->hash);
+   }
+   return e;
+}
+
+//*****************************************************************************
+
+static void emit_summary(struct plugin_state* ps, const struct key_entry* e,
+                         unsigned long long end_ns)
+{
+   struct monitor_record_t* rec = ps->listener->alloc_record();
+
+   if (!rec) {
+      return;
+   }
+   memset(rec, 0, offsetof(struct monitor_record_t, hostname));
+   strcpy(rec->facility, FACILITY);
+   rec->timestamp = end_ns / 1000000000ULL;
+   rec->timestamp_ns = end_ns;
+   rec->pid = e->pid;
+   rec->tid = e->tid;
+   rec->dom_type = e->dom_type;
+   rec->op_type = e->op_type;
+   rec->error_code = e->error_code;
+   rec->fd = e->fd;
+   rec->bytes_transferred = e->limited + e->deduplicated;
+   rec->seq = ps->period;
+   rec->offset = OFFSET_NONE;
+   if (e->path) {
+      strncpy(rec->s1, e->path, sizeof(rec->s1) - 1);
+   }
+   snprintf(rec->s2, sizeof(rec->s2),
+            "suppressed=%llu limited=%llu deduplicated=%llu period_s=%g",
+            e->limited + e->deduplicated, e->limited, e->deduplicated,
+            ps->summary_ns / 1e9);
+   memcpy(rec->hostname, e->hostname, HOSTNAME_LEN);
+   memcpy(rec->device, e->device, DEVICE_LEN);
+
+   ps->summaries++;
+   ps->listener->emit_record(rec);
+}
+
+//*****************************************************************************
+
+// key with drops gets summary record; whether key would be back to full
+// bucket and out of dedup window, so that it can be forgotten
+static int end_key_period(struct plugin_state* ps, struct key_entry* e,
+                          unsigned long long end_ns,
+                          unsigned long long idle_ns)
+{
+   if (e->limited || e->deduplicated) {
+      emit_summary(ps, e, end_ns);
+      e->limited = 0;
+      e->deduplicated = 0;
+      return 0;
+   }
+   return end_ns >= e->last_ns + idle_ns;
+}
+
+//*****************************************************************************
+
+static void end_period(struct plugin_state* ps, unsigned long long end_ns)
+{
+   unsigned long long idle_ns = ps->dedup_ns;
+   unsigned int i;
+
+   if (ps->rate > 0 && ps->burst / ps->rate * 1e9 > idle_ns) {
+      idle_ns = ps->burst / ps->rate * 1e9;
+   }
+   for (i = 0; i != ps->table_size; ++i) {
+      struct key_entry** link = &ps->table[i];
+      while (*link) {
+         struct key_entry* e = *link;
+
+         if (end_key_period(ps, e, end_ns, idle_ns)) {
+            *link = e->next;
+            free(e->path);
+            free(e);
+            ps->num_keys--;
+         } else {
+            link = &e->next;
+         }
+      }
+   }
+   if (ps->overflow && end_key_period(ps, ps->overflow, end_ns, idle_ns)) {
+      free(ps->overflow->path);
+      free(ps->overflow);
+      ps->overflow = NULL;
+   }
+   ps->period++;
+}
+
+//*****************************************************************************
+
+// after a gap only one period can have anything to report
+static void advance_to(struct plugin_state* ps, unsigned long long period)
+{
+   end_period(ps, (ps->period + 1) * ps->summary_ns);
+   if (ps->period < period) {
+      ps->period = period;
+   }
+}
+
+//*****************************************************************************
+
+static int parse_config(struct plugin_state* ps, const char* plugin_config)
+{
+   char* config = strdup(plugin_config ? plugin_config : "");
+   char* rest = config;
+   char* token;
+   unsigned int summary_s = DEFAULT_SUMMARY_S;
+   unsigned int i;
+   int rc = 0;
+
+   ps->keys = KEY_PID | KEY_OP | KEY_PATH;
+   ps->rate = DEFAULT_RATE;
+   ps->burst = 0;
+   ps->max_keys = DEFAULT_MAX_KEYS;
+   while ((token = strtok_r(rest, ",", &rest))) {
+      char* value = strchr(token, '=');
+      if (!value) {
+         fprintf(stderr, "error: filter_ratelimit option '%s' has no value\n",
+                 token);
+         rc = 1;
+         continue;
+      }
+      *value++ = 0;
+      if (!strcmp(token, "rate") && atof(value) >= 0) {
+         ps->rate = atof(value);
+      } else if (!strcmp(token, "burst") && atof(value) >= 1) {
+         ps->burst = atof(value);
+      } else if (!strcmp(token, "dedup") && atoi(value) >= 0) {
+         ps->dedup_ns = atoi(value) * 1000000ULL;
+      } else if (!strcmp(token, "summary") && atoi(value) > 0) {
+         summary_s = atoi(value);
+      } else if (!strcmp(token, "max_keys") && atoi(value) > 0) {
+         ps->max_keys = atoi(value);
+      } else if (!strcmp(token, "keys")) {
+         char* key_rest = value;
+         char* key;
+         ps->keys = 0;
+         while ((key = strtok_r(key_rest, "+", &key_rest))) {
+            for (i = 0; i != NUM_KEY_NAMES; ++i) {
+               if (!strcmp(key, key_names[i].name)) {
+                  ps->keys |= key_names[i].key;
+                  break;
+               }
+            }
+            if (i == NUM_KEY_NAMES) {
+               fprintf(stderr, "error: filter_ratelimit key '%s' is invalid\n",
+                       key);
+               rc = 1;
+            }
+         }
+      } else {
+         fprintf(stderr, "error: filter_ratelimit option '%s' is invalid\n",
+                 token);
+         rc = 1;
+      }
+   }
+   free(config);
+
+   if (!ps->burst) {
+      ps->burst = ps->rate < 1 ? 1 : ps->rate;
+   }
+   ps->summary_ns = summary_s * 1000000000ULL;
+   return rc;
+}
+
+//*****************************************************************************
+
+int open_plugin(const char* plugin_config, struct listener* listener,
+                void** state)
+{
+   struct plugin_state* ps = calloc(1, sizeof(struct plugin_state));
+
+   if (!ps) {
+      return PLUGIN_OPEN_FAIL;
+   }
+   if (!listener->emit_record) {
+      fprintf(stderr, "error: filter_ratelimit needs newer mq_listener\n");
+      free(ps);
+      return PLUGIN_OPEN_FAIL;
+   }
+   ps->listener = listener;
+   ps->table_size = INITIAL_TABLE_SIZE;
+   if (parse_config(ps, plugin_config) ||
+       !(ps->table = calloc(ps->table_size, sizeof(struct key_entry*)))) {
+      free(ps);
+      return PLUGIN_OPEN_FAIL;
+   }
+   *state = ps;
+   return PLUGIN_OPEN_SUCCESS;
+}
+
+//*****************************************************************************
+
+// summaries of period in progress are lost; they can't be passed on
+// from here
+void close_plugin(void* state)
+{
+   struct plugin_state* ps = state;
+   unsigned int i;
+
+   printf("filter_ratelimit: %llu records, %llu limited, %llu deduplicated\n",
+          ps->records, ps->limited, ps->deduplicated);
+   for (i = 0; i != ps->table_size; ++i) {
+      while (ps->table[i]) {
+         struct key_entry* e = ps->table[i];
+         ps->table[i] = e->next;
+         free(e->path);
+         free(e);
+      }
+   }
+   if (ps->overflow) {
+      free(ps->overflow->path);
+      free(ps->overflow);
+   }
+   free(ps->table);
+   free(ps);
+}
+
+//*****************************************************************************
+
+int ok_to_accept_data(void* state)
+{
+   return PLUGIN_ACCEPT_DATA;
+}
+
+//*****************************************************************************
+
+// records of process life cycle and of listener itself pass by
+void get_interest(struct plugin_interest* interest, void* state)
+{
+   struct plugin_state* ps = state;
+
+   interest->domain_mask &= ~((1U << START_STOP) | (1U << LISTENER));
+   interest->wants_strings = (ps->keys & KEY_PATH) || ps->dedup_ns;
+}
+
+//*****************************************************************************
+
+int process_data(struct monitor_record_t* data, void* state)
+{
+   struct plugin_state* ps = state;
+   const unsigned long long timestamp_ns = data->timestamp_ns ?
+      data->timestamp_ns : data->timestamp * 1000000000ULL;
+   const unsigned long long period = timestamp_ns / ps->summary_ns;
+   unsigned long long hash = 0;
+   struct key_entry* e;
+
+   if (!ps->period) {
+      ps->period = period;
+   } else if (period > ps->period) {
+      advance_to(ps, period);
+   }
+   event_clock_see(&ps->clock, timestamp_ns);
+   ps->records++;
+
+   if (!(e = find_key(ps, data, timestamp_ns))) {
+      return PLUGIN_ACCEPT_DATA;
+   }
+   if (timestamp_ns > e->last_ns) {
+      e->last_ns = timestamp_ns;
+   }
+   if (ps->dedup_ns) {
+      hash = contents_hash(data);
+      if (hash == e->passed_hash && timestamp_ns < e->passed_ns + ps->dedup_ns) {
+         e->deduplicated++;
+         ps->deduplicated++;
+         return PLUGIN_DROP_DATA;
+      }
+   }
+   if (ps->rate > 0) {
+      if (timestamp_ns > e->refilled_ns) {
+         e->tokens += (timestamp_ns - e->refilled_ns) * ps->rate / 1e9;
+         if (e->tokens > ps->burst) {
+            e->tokens = ps->burst;
+         }
+         e->refilled_ns = timestamp_ns;
+      }
+      if (e->tokens < 1) {
+         e->limited++;
+         ps->limited++;
+         return PLUGIN_DROP_DATA;
+      }
+      e->tokens -= 1;
+   }
+   e->passed_hash = hash;
+   e->passed_ns = timestamp_ns;
+   return PLUGIN_ACCEPT_DATA;
+}
+
+//*****************************************************************************
+
+// while no records come, time of records is estimated from time passed
+// since the last one, so that summaries of a storm that ended come out
+void flush_plugin(void* state)
+{
+   struct plugin_state* ps = state;
+   unsigned long long event_now;
+
+   if (!ps->period) {
+      return;
+   }
+   event_now = event_clock_now(&ps->clock);
+   if (event_now / ps->summary_ns > ps->period) {
+      advance_to(ps, event_now / ps->summary_ns);
+   }
+}
+
+//*****************************************************************************
+
+char** list_commands()
+{
+   static const char* command_list[] = {"ratelimit-status", "help", 0};
+   return (char**)command_list;
+}
+
+//*****************************************************************************
+
+int plugin_command(const char* name, const char** args, void* state)
+{
+   struct plugin_state* ps = state;
+
+   if (args[0] && !strcmp(args[0], "ratelimit-status")) {
+      printf("filter_ratelimit: rate %g/s, burst %g, dedup %llu ms,"
+             " %u of %u keys, %llu records, %llu limited,"
+             " %llu deduplicated, %llu summaries, %llu overflowed\n",
+             ps->rate, ps->burst, ps->dedup_ns / 1000000ULL, ps->num_keys,
+             ps->max_keys, ps->records, ps->limited, ps->deduplicated,
+             ps->summaries, ps->overflowed);
+   } else if (args[0] && !strcmp(args[0], "help")) {
+      printf("filter_ratelimit: drops records over rate of their key, and"
+             " repeats, passing counts of them\n"
+             "  ratelimit-status  print settings and counters\n");
+   }
+   return 0;
+}
@@ -22,6 +22,7 @@
 #include <stdio.h>
 #include <pthread.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "plugin.h"
 #include "monitor_record.h"
@@ -90,3 +91,11 @@ int process_data(struct monitor_record_t* data, void *param)
 
 //*****************************************************************************
 
+/* user interface only; doesn't need any records */
+void get_interest(struct plugin_interest* interest, void *param)
+{
+   memset(interest, 0, sizeof(*interest));
+}
+
+//*****************************************************************************
+
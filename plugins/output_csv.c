@@ -14,50 +14,419 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 
+
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <zlib.h>
 
 #include "plugin.h"
 #include "monitor_record.h"
 #include "domains_names.h"
 #include "ops_names.h"
 
+/* plugin configuration is a comma separated list of key=value pairs:
+ *   file=trace.csv,format=tsv,buffer_kb=4096,rotate_mb=512,rotate_s=3600,gzip=on
+ * Without file records go to standard output, as before */
+#define DEFAULT_BUFFER_KB 1024
+#define GZIP_SYNC_INTERVAL 1   /* seconds between gzip flushes on idle */
+
+/* every string may double in size when escaped */
+#define MAX_LINE_LEN (2 * sizeof(struct monitor_record_t) + 256)
+
+struct plugin_state {
+   char* path;             /* NULL for standard output */
+   int tsv;
+   int gzip;
+   int fd;
+   gzFile gz;
+   char* buffer;
+   size_t len;
+   size_t capacity;
+   unsigned long long file_bytes;   /* uncompressed bytes in current file */
+   unsigned long long rotate_bytes;
+   unsigned int rotate_seconds;
+   time_t opened;
+   time_t synced;
+   unsigned int next_index;         /* suffix of next rotated file */
+   int write_failed;
+};
+
+//*****************************************************************************
+
+static char* put_uint(char* p, unsigned long long value)
+{
+   char digits[20];
+   int n = 0;
+
+   do {
+      digits[n++] = '0' + value % 10;
+      value /= 10;
+   } while (value);
+   while (n) {
+      *p++ = digits[--n];
+   }
+   return p;
+}
 
 //*****************************************************************************
 
-int open_plugin(const char* plugin_config)
+static char* put_int(char* p, long long value)
 {
+   if (value < 0) {
+      *p++ = '-';
+      return put_uint(p, -(unsigned long long)value);
+   }
+   return put_uint(p, value);
+}
+
+//*****************************************************************************
+
+/* same as printf("%f") for values of sane magnitude */
+static char* put_double(char* p, double value)
+{
+   unsigned long long scaled;
+   unsigned int fraction;
+   int i;
+
+   if (!(value > -1e12 && value < 1e12)) {
+      return p + sprintf(p, "%f", value);
+   }
+   if (value < 0) {
+      *p++ = '-';
+      value = -value;
+   }
+   scaled = (unsigned long long)(value * 1000000.0 + 0.5);
+   p = put_uint(p, scaled / 1000000);
+   *p++ = '.';
+   fraction = scaled % 1000000;
+   for (i = 5; i >= 0; --i) {
+      p[i] = '0' + fraction % 10;
+      fraction /= 10;
+   }
+   return p + 6;
+}
+
+//*****************************************************************************
+
+/* csv: quoted (with quotes doubled) only when value needs it.
+ * tsv: tabs, newlines and backslashes are escaped with backslash */
+static char* put_string(char* p, const char* s, int tsv)
+{
+   const char* c;
+
+   if (tsv) {
+      for (; *s; ++s) {
+         switch (*s) {
+         case '\t': *p++ = '\\'; *p++ = 't'; break;
+         case '\n': *p++ = '\\'; *p++ = 'n'; break;
+         case '\r': *p++ = '\\'; *p++ = 'r'; break;
+         case '\\': *p++ = '\\'; *p++ = '\\'; break;
+         default: *p++ = *s;
+         }
+      }
+      return p;
+   }
+
+   for (c = s; *c; ++c) {
+      if ((*c == ',') || (*c == '"') || (*c == '\n') || (*c == '\r')) {
+         break;
+      }
+   }
+   if (!*c) {
+      return stpcpy(p, s);
+   }
+   *p++ = '"';
+   for (; *s; ++s) {
+      if (*s == '"') {
+         *p++ = '"';
+      }
+      *p++ = *s;
+   }
+   *p++ = '"';
+   return p;
+}
+
+//*****************************************************************************
+
+static int open_output(struct plugin_state* ps)
+{
+   struct stat st;
+
+   if (ps->path) {
+      ps->fd = open(ps->path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+      if (ps->fd == -1) {
+         fprintf(stderr, "error: unable to open '%s': %s\n", ps->path,
+                 strerror(errno));
+         return 1;
+      }
+      ps->file_bytes = fstat(ps->fd, &st) ? 0 : st.st_size;
+   } else {
+      // gzclose closes descriptor; keep standard output open
+      ps->fd = ps->gzip ? dup(STDOUT_FILENO) : STDOUT_FILENO;
+      ps->file_bytes = 0;
+   }
+
+   if (ps->gzip) {
+      // concatenated gzip members are still one valid stream
+      ps->gz = gzdopen(ps->fd, "ab1");
+      if (!ps->gz) {
+         fprintf(stderr, "error: unable to start compression\n");
+         close(ps->fd);
+         return 1;
+      }
+   }
+   ps->opened = ps->synced = time(NULL);
+   return 0;
+}
+
+//*****************************************************************************
+
+static void close_output(struct plugin_state* ps)
+{
+   if (ps->gz) {
+      gzclose(ps->gz);
+      ps->gz = NULL;
+   } else if (ps->fd != STDOUT_FILENO) {
+      close(ps->fd);
+   }
+   ps->fd = -1;
+}
+
+//*****************************************************************************
+
+static void write_buffer(struct plugin_state* ps)
+{
+   const char* p = ps->buffer;
+   size_t left = ps->len;
+   ssize_t written;
+
+   if (ps->gz) {
+      if (left && gzwrite(ps->gz, p, left) <= 0) {
+         left = 1;
+      } else {
+         left = 0;
+      }
+   } else if (!ps->path) {
+      // listener prints to standard output too; go through stdio to keep
+      // order of its messages and records
+      if (left && (fwrite(p, left, 1, stdout) != 1 || fflush(stdout))) {
+         left = 1;
+      } else {
+         left = 0;
+      }
+   } else {
+      while (left && ps->fd != -1) {
+         written = write(ps->fd, p, left);
+         if (written < 0) {
+            if (errno == EINTR) {
+               continue;
+            }
+            break;
+         }
+         p += written;
+         left -= written;
+      }
+   }
+
+   // buffer is reused either way; failing sink must not stall listener
+   if (left && !ps->write_failed) {
+      fprintf(stderr, "error: output_csv unable to write records\n");
+      ps->write_failed = 1;
+   }
+   ps->file_bytes += ps->len;
+   ps->len = 0;
+}
+
+//*****************************************************************************
+
+/* current file gets next free name <file>.<n> and new file is started */
+static void rotate_output(struct plugin_state* ps)
+{
+   char* rotated;
+
+   write_buffer(ps);
+   if (!ps->path) {
+      return;
+   }
+   close_output(ps);
+   rotated = malloc(strlen(ps->path) + 16);
+   do {
+      sprintf(rotated, "%s.%u", ps->path, ++ps->next_index);
+   } while (access(rotated, F_OK) == 0);
+   if (rename(ps->path, rotated)) {
+      fprintf(stderr, "error: unable to rotate '%s': %s\n", ps->path,
+              strerror(errno));
+   }
+   free(rotated);
+   ps->write_failed = 0;
+   open_output(ps);
+}
+
+//*****************************************************************************
+
+static void rotate_if_old(struct plugin_state* ps, time_t now)
+{
+   if (ps->rotate_seconds && ps->file_bytes + ps->len &&
+       (now - ps->opened >= ps->rotate_seconds)) {
+      rotate_output(ps);
+   }
+}
+
+//*****************************************************************************
+
+static int parse_config(struct plugin_state* ps, const char* plugin_config)
+{
+   char* config = strdup(plugin_config ? plugin_config : "");
+   char* rest = config;
+   char* token;
+   size_t buffer_kb = DEFAULT_BUFFER_KB;
+   int rc = 0;
+
+   while ((token = strtok_r(rest, ",", &rest))) {
+      char* value = strchr(token, '=');
+      if (!value) {
+         fprintf(stderr, "error: output_csv option '%s' has no value\n", token);
+         rc = 1;
+         continue;
+      }
+      *value++ = 0;
+      if (!strcmp(token, "file")) {
+         ps->path = strdup(value);
+      } else if (!strcmp(token, "format") &&
+                 (!strcmp(value, "csv") || !strcmp(value, "tsv"))) {
+         ps->tsv = !strcmp(value, "tsv");
+      } else if (!strcmp(token, "buffer_kb") && atoi(value) > 0) {
+         buffer_kb = atoi(value);
+      } else if (!strcmp(token, "rotate_mb") && atoi(value) > 0) {
+         ps->rotate_bytes = atoll(value) * 1024 * 1024;
+      } else if (!strcmp(token, "rotate_s") && atoi(value) > 0) {
+         ps->rotate_seconds = atoi(value);
+      } else if (!strcmp(token, "gzip")) {
+         ps->gzip = !strcmp(value, "on") || !strcmp(value, "1");
+      } else {
+         fprintf(stderr, "error: output_csv option '%s' is invalid\n", token);
+         rc = 1;
+      }
+   }
+   free(config);
+
+   if ((ps->rotate_bytes || ps->rotate_seconds) && !ps->path) {
+      fprintf(stderr, "error: output_csv rotation requires file\n");
+      rc = 1;
+   }
+   ps->capacity = buffer_kb * 1024;
+   if (ps->capacity < 2 * MAX_LINE_LEN) {
+      ps->capacity = 2 * MAX_LINE_LEN;
+   }
+   return rc;
+}
+
+//*****************************************************************************
+
+int open_plugin(const char* plugin_config, struct listener* listener,
+                void** state)
+{
+   struct plugin_state* ps = calloc(1, sizeof(struct plugin_state));
+
+   if (!ps) {
+      return PLUGIN_OPEN_FAIL;
+   }
+   ps->fd = -1;
+   if (parse_config(ps, plugin_config) ||
+       !(ps->buffer = malloc(ps->capacity)) ||
+       open_output(ps)) {
+      free(ps->buffer);
+      free(ps->path);
+      free(ps);
+      return PLUGIN_OPEN_FAIL;
+   }
+   *state = ps;
    return PLUGIN_OPEN_SUCCESS;
 }
 
 //*****************************************************************************
 
-void close_plugin()
+void close_plugin(void* state)
 {
+   struct plugin_state* ps = state;
+
+   write_buffer(ps);
+   close_output(ps);
+   free(ps->buffer);
+   free(ps->path);
+   free(ps);
 }
 
 //*****************************************************************************
 
-int ok_to_accept_data()
+int ok_to_accept_data(void* state)
 {
    return PLUGIN_ACCEPT_DATA;
 }
 
 //*****************************************************************************
 
-int process_data(struct monitor_record_t* data)
+int process_data(struct monitor_record_t* data, void* state)
 {
-   printf("%s,%s,%d,%f,%d,%s,%s,%d,%d,%zu,%s,%s\n",
-          data->facility,
-          data->device,
-          data->timestamp,
-          data->elapsed_time,
-          data->pid,
-          domains_names[data->dom_type],
-          ops_names[data->op_type], data->error_code, data->fd,
-          data->bytes_transferred, data->s1, data->s2);
-   fflush(stdout);
+   struct plugin_state* ps = state;
+   char* p = ps->buffer + ps->len;
+   const char separator = ps->tsv ? '\t' : ',';
+
+   p = put_string(p, data->facility, ps->tsv);
+   *p++ = separator;
+   p = put_string(p, data->device, ps->tsv);
+   *p++ = separator;
+   p = put_int(p, data->timestamp);
+   *p++ = separator;
+   p = put_double(p, data->elapsed_time);
+   *p++ = separator;
+   p = put_int(p, data->pid);
+   *p++ = separator;
+   p = stpcpy(p, domains_names[data->dom_type]);
+   *p++ = separator;
+   p = stpcpy(p, ops_names[data->op_type]);
+   *p++ = separator;
+   p = put_int(p, data->error_code);
+   *p++ = separator;
+   p = put_int(p, data->fd);
+   *p++ = separator;
+   p = put_uint(p, data->bytes_transferred);
+   *p++ = separator;
+   p = put_string(p, data->s1, ps->tsv);
+   *p++ = separator;
+   p = put_string(p, data->s2, ps->tsv);
+   *p++ = '\n';
+   ps->len = p - ps->buffer;
+
+   if (ps->rotate_bytes && (ps->file_bytes + ps->len >= ps->rotate_bytes)) {
+      rotate_output(ps);
+   } else if (ps->capacity - ps->len < MAX_LINE_LEN) {
+      write_buffer(ps);
+      rotate_if_old(ps, time(NULL));
+   }
    return PLUGIN_ACCEPT_DATA;
 }
 
 //*****************************************************************************
 
+void flush_plugin(void* state)
+{
+   struct plugin_state* ps = state;
+   time_t now = time(NULL);
+
+   write_buffer(ps);
+   // sync flush costs compression ratio, so limit how often it's done
+   if (ps->gz && (now - ps->synced >= GZIP_SYNC_INTERVAL)) {
+      gzflush(ps->gz, Z_SYNC_FLUSH);
+      ps->synced = now;
+   }
+   rotate_if_old(ps, now);
+}
+
+//*****************************************************************************
@@ -1,14 +1,38 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
 #include <curl/curl.h>
 #include <curl/easy.h>
+#include <zlib.h>
 
 #include "plugin.h"
 #include "monitor_record.h"
 #include "domains_names.h"
 #include "ops_names.h"
 
+/* plugin configuration is a single comma separated list of key=value
+ * pairs, e.g.
+ *   url=http://localhost:8086,db=testDB,precision=ms,batch=5000,gzip=on
+ * For compatibility a bare URL (http://host:8086/write?db=x) is accepted
+ * as well. */
+#define DEFAULT_URL "http://localhost:8086"
+#define DEFAULT_DB "testDB"
+#define DEFAULT_MEASUREMENT "iometrics"
+#define DEFAULT_PRECISION "ns"
+#define DEFAULT_BATCH_LINES 5000
+#define DEFAULT_FLUSH_MS 1000
+#define DEFAULT_BUFFERS 4
+#define DEFAULT_RETRIES 3
+#define RETRY_WAIT_MS 100
+
+/* longest possible line: escaped strings may double in size */
+#define MAX_MEASUREMENT_LEN 128
+#define MAX_LINE_LEN (2 * (MAX_MEASUREMENT_LEN + PATH_MAX + STR_LEN + STR_LEN) \
+                      + 1024)
+
 static const char facility[] = "facility";//char type
 static const char hostname[] = "hostname";
 static const char device[] = "device";
@@ -22,168 +46,559 @@ static const char fd[] = "fd";//int
 static const char bytes_transferred[] = "bytes_transferred";//size_t
 static const char s1[] = "s1";//char
 static const char s2[] = "s2";//char
-static char* url = "http://localhost:8086/write?db=testDB";
-static char* measure = "iometrics";
+
+struct batch {
+   char* data;
+   size_t len;
+   size_t capacity;
+   unsigned int lines;
+   struct timespec first_line;
+   struct batch* next;
+};
+
+struct plugin_state {
+   char* url;                 /* complete write url */
+   char* measurement;
+   unsigned long long precision_divisor;  /* ns per unit of precision */
+   unsigned int batch_lines;
+   unsigned int flush_ms;
+   unsigned int retries;
+   int gzip;
+
+   /* batch being filled by process_data, batches waiting for sender
+    * and free ones; all protected by mutex. Number of batches is fixed,
+    * so memory stays bounded when server is slow or down */
+   struct batch* current;
+   struct batch* send_head;
+   struct batch* send_tail;
+   struct batch* free_batches;
+   struct batch* all_batches;
+   pthread_mutex_t mutex;
+   pthread_cond_t wake;
+   int stopping;
+   pthread_t sender;
+
+   /* used only by sender thread */
+   CURL* curl;
+   struct curl_slist* headers;
+   unsigned char* compressed;
+   size_t compressed_capacity;
+
+   /* counters */
+   unsigned long long lines_sent;
+   unsigned long long batches_sent;
+   unsigned long long batches_failed;
+   unsigned long long retries_done;
+   unsigned long long refusals;
+};
 
 //*****************************************************************************
 
-void copy_escaped_tag_value(const char* src, char* dest, int dest_len)
+/* escapes tag value (commas, spaces and equal signs) */
+static char* copy_escaped_tag_value(char* dest, const char* src)
 {
-   int src_index = 0;
-   int dest_index = 0;
-   int len_src = strlen(src);
-   char ch;
-   char last_ch;
-   memset(dest, 0, dest_len);
+   for (; *src; ++src) {
+      if (*src == '\n') {
+         break;
+      }
+      if ((*src == ' ') || (*src == ',') || (*src == '=')) {
+         *dest++ = '\\';
+      }
+      *dest++ = *src;
+   }
+   return dest;
+}
 
-   for (; src_index < len_src; src_index++) {
-      ch = src[src_index];
+//*****************************************************************************
 
-      if (ch == ' ' && last_ch == ' ') {
-         continue;
-      } else if (ch == ',' && last_ch == ',') {
-         continue;
-      } else if (ch == '=' && last_ch == '=') {
-         continue;
+/* copies string field value in double quotes, escaping quotes and
+ * backslashes */
+static char* copy_quoted_field_value(char* dest, const char* src)
+{
+   *dest++ = '"';
+   if (!*src) {
+      dest = stpcpy(dest, "NULL");
+   }
+   for (; *src; ++src) {
+      if (*src == '\n') {
+         break;
       }
+      if ((*src == '"') || (*src == '\\')) {
+         *dest++ = '\\';
+      }
+      *dest++ = *src;
+   }
+   *dest++ = '"';
+   return dest;
+}
 
-      if (ch == '\n') {
-         return;
+//*****************************************************************************
+
+static size_t format_line(struct plugin_state* ps, char* line,
+                          const struct monitor_record_t* data)
+{
+   char* p = line;
+   unsigned long long point_time = data->timestamp_ns ? data->timestamp_ns :
+      (unsigned long long)data->timestamp * 1000000000ULL;
+
+   // measurement and tags
+   p = copy_escaped_tag_value(p, ps->measurement);
+   p += sprintf(p, ",%s=", facility);
+   p = copy_escaped_tag_value(p, data->facility);
+   p += sprintf(p, ",dom_tag=%s,op_tag=%s ",
+                domains_names[data->dom_type], ops_names[data->op_type]);
+
+   // fields
+   p += sprintf(p, "%s=", device);
+   p = copy_quoted_field_value(p, data->device[0] ? data->device : "none");
+   p += sprintf(p, ",%s=\"%s\",%s=", dom_type, domains_names[data->dom_type],
+                hostname);
+   p = copy_quoted_field_value(p, data->hostname);
+   p += sprintf(p, ",%s=\"%s\",%s=", op_type, ops_names[data->op_type], s1);
+   p = copy_quoted_field_value(p, data->s1);
+   p += sprintf(p, ",%s=", s2);
+   p = copy_quoted_field_value(p, data->s2);
+   p += sprintf(p, ",%s=%d,%s=%f,%s=%d,%s=%d,%s=%d,%s=%zu %llu\n",
+                timestamp, data->timestamp,
+                elapsed_time, data->elapsed_time,
+                pid, data->pid,
+                error_code, data->error_code,
+                fd, data->fd,
+                bytes_transferred, data->bytes_transferred,
+                point_time / ps->precision_divisor);
+   return p - line;
+}
+
+//*****************************************************************************
+
+/* returns compressed size, or 0 on failure */
+static size_t gzip_batch(struct plugin_state* ps, const struct batch* b)
+{
+   z_stream stream;
+   size_t bound;
+
+   memset(&stream, 0, sizeof(stream));
+   // windowBits 15 + 16 selects gzip wrapper; level 1 keeps sender fast
+   if (deflateInit2(&stream, 1, Z_DEFLATED, 15 + 16, 8,
+                    Z_DEFAULT_STRATEGY) != Z_OK) {
+      return 0;
+   }
+   bound = deflateBound(&stream, b->len);
+   if (bound > ps->compressed_capacity) {
+      unsigned char* tmp = realloc(ps->compressed, bound);
+      if (!tmp) {
+         deflateEnd(&stream);
+         return 0;
       }
+      ps->compressed = tmp;
+      ps->compressed_capacity = bound;
+   }
+   stream.next_in = (unsigned char*)b->data;
+   stream.avail_in = b->len;
+   stream.next_out = ps->compressed;
+   stream.avail_out = ps->compressed_capacity;
+   if (deflate(&stream, Z_FINISH) != Z_STREAM_END) {
+      deflateEnd(&stream);
+      return 0;
+   }
+   deflateEnd(&stream);
+   return stream.total_out;
+}
 
-      if (ch == '\\') {
-         last_ch = ch;
-         continue;
+//*****************************************************************************
+
+static size_t discard_response(char* ptr, size_t size, size_t nmemb,
+                               void* userdata)
+{
+   return size * nmemb;
+}
+
+//*****************************************************************************
+
+/* returns 0 when batch was written, 1 when it is worth trying again,
+ * -1 when server rejected it */
+static int post_batch(struct plugin_state* ps, const struct batch* b)
+{
+   CURLcode curl_status;
+   long response_code = 0;
+   const void* body = b->data;
+   size_t body_len = b->len;
+
+   if (ps->gzip) {
+      body_len = gzip_batch(ps, b);
+      if (!body_len) {
+         return -1;
+      }
+      body = ps->compressed;
+   }
+
+   curl_easy_setopt(ps->curl, CURLOPT_POSTFIELDS, body);
+   curl_easy_setopt(ps->curl, CURLOPT_POSTFIELDSIZE_LARGE,
+                    (curl_off_t)body_len);
+   curl_status = curl_easy_perform(ps->curl);
+   if (curl_status != CURLE_OK) {
+      fprintf(stderr, "output_influxdb: %s\n",
+              curl_easy_strerror(curl_status));
+      return 1;
+   }
+   curl_easy_getinfo(ps->curl, CURLINFO_RESPONSE_CODE, &response_code);
+   if ((response_code >= 200) && (response_code < 300)) {
+      return 0;
+   }
+   fprintf(stderr, "output_influxdb: server responded %ld\n", response_code);
+   return (response_code >= 500) ? 1 : -1;
+}
+
+//*****************************************************************************
+
+static void send_batch(struct plugin_state* ps, struct batch* b)
+{
+   unsigned int attempt;
+   int rc = 1;
+
+   for (attempt = 0; (rc > 0) && (attempt <= ps->retries); ++attempt) {
+      if (attempt) {
+         ps->retries_done++;
+         usleep((RETRY_WAIT_MS << (attempt - 1)) * 1000);
       }
+      rc = post_batch(ps, b);
+   }
+   if (rc == 0) {
+      ps->lines_sent += b->lines;
+      ps->batches_sent++;
+   } else {
+      ps->batches_failed++;
+   }
+}
+
+//*****************************************************************************
+
+/* must be called with mutex held */
+static void queue_current_batch(struct plugin_state* ps)
+{
+   struct batch* b = ps->current;
+
+   b->next = NULL;
+   if (ps->send_tail) {
+      ps->send_tail->next = b;
+   } else {
+      ps->send_head = b;
+   }
+   ps->send_tail = b;
+
+   ps->current = ps->free_batches;
+   if (ps->current) {
+      ps->free_batches = ps->current->next;
+      ps->current->len = 0;
+      ps->current->lines = 0;
+   }
+   pthread_cond_signal(&ps->wake);
+}
+
+//*****************************************************************************
+
+static int flush_due(struct plugin_state* ps, const struct timespec* now)
+{
+   const struct batch* b = ps->current;
+   long long age_ms;
 
-      if ((ch == ' ') || (ch == ',') || (ch == '=')) {
-         if (dest_index < (dest_len-2)) {
-            dest[dest_index++] = '\\';
-         } else {
-            return;
+   if (!b || !b->lines) {
+      return 0;
+   }
+   age_ms = (now->tv_sec - b->first_line.tv_sec) * 1000LL +
+      (now->tv_nsec - b->first_line.tv_nsec) / 1000000;
+   return age_ms >= ps->flush_ms;
+}
+
+//*****************************************************************************
+
+static void* sender_thread(void* arg)
+{
+   struct plugin_state* ps = arg;
+   struct timespec now;
+   struct timespec deadline;
+   struct batch* b;
+
+   pthread_mutex_lock(&ps->mutex);
+   for (;;) {
+      if (!ps->send_head) {
+         clock_gettime(CLOCK_REALTIME, &now);
+         if (flush_due(ps, &now) || (ps->stopping && ps->current &&
+                                     ps->current->lines)) {
+            queue_current_batch(ps);
          }
       }
+      if (!ps->send_head) {
+         if (ps->stopping) {
+            break;
+         }
+         deadline = now;
+         deadline.tv_nsec += (ps->flush_ms % 1000) * 1000000L;
+         deadline.tv_sec += ps->flush_ms / 1000 + deadline.tv_nsec / 1000000000;
+         deadline.tv_nsec %= 1000000000;
+         pthread_cond_timedwait(&ps->wake, &ps->mutex, &deadline);
+         continue;
+      }
+
+      b = ps->send_head;
+      ps->send_head = b->next;
+      if (!ps->send_head) {
+         ps->send_tail = NULL;
+      }
+      pthread_mutex_unlock(&ps->mutex);
 
-      if (dest_index < (dest_len-1)) {
-         dest[dest_index++] = ch;
+      send_batch(ps, b);
+
+      pthread_mutex_lock(&ps->mutex);
+      b->len = 0;
+      b->lines = 0;
+      if (ps->current) {
+         b->next = ps->free_batches;
+         ps->free_batches = b;
       } else {
-         return;
+         ps->current = b;
       }
-      last_ch = ch;
    }
+   pthread_mutex_unlock(&ps->mutex);
+   return NULL;
 }
 
 //*****************************************************************************
 
-int is_all_whitespace(const char* s)
+static int parse_config(struct plugin_state* ps, const char* plugin_config,
+                        unsigned int* num_buffers)
 {
-   int i;
-   int s_len = strlen(s);
-   char ch;
-
-   for (i = 0; i < s_len; i++) {
-      ch = s[i];
-      if (ch != ' ' || ch != '\n' || ch != '\r' || ch != '\t') {
-         return 0;
+   const char* base_url = DEFAULT_URL;
+   const char* db = DEFAULT_DB;
+   const char* precision = DEFAULT_PRECISION;
+   char* config = strdup(plugin_config ? plugin_config : "");
+   char* rest = config;
+   char* token;
+   size_t url_len;
+
+   ps->measurement = strdup(DEFAULT_MEASUREMENT);
+   ps->batch_lines = DEFAULT_BATCH_LINES;
+   ps->flush_ms = DEFAULT_FLUSH_MS;
+   ps->retries = DEFAULT_RETRIES;
+   *num_buffers = DEFAULT_BUFFERS;
+
+   while ((token = strtok_r(rest, ",", &rest))) {
+      char* value = strchr(token, '=');
+      if (!strncmp(token, "http://", 7) || !strncmp(token, "https://", 8)) {
+         base_url = token;
+         continue;
+      }
+      if (!value) {
+         fprintf(stderr, "output_influxdb: ignoring option '%s'\n", token);
+         continue;
+      }
+      *value++ = 0;
+      if (!strcmp(token, "url")) {
+         base_url = value;
+      } else if (!strcmp(token, "db")) {
+         db = value;
+      } else if (!strcmp(token, "precision")) {
+         precision = value;
+      } else if (!strcmp(token, "measurement")) {
+         if (strlen(value) > MAX_MEASUREMENT_LEN) {
+            fprintf(stderr, "output_influxdb: measurement is longer than %d"
+                    " characters\n", MAX_MEASUREMENT_LEN);
+            free(config);
+            return 1;
+         }
+         free(ps->measurement);
+         ps->measurement = strdup(value);
+      } else if (!strcmp(token, "batch") && atoi(value) > 0) {
+         ps->batch_lines = atoi(value);
+      } else if (!strcmp(token, "flush_ms") && atoi(value) > 0) {
+         ps->flush_ms = atoi(value);
+      } else if (!strcmp(token, "buffers") && atoi(value) > 1) {
+         *num_buffers = atoi(value);
+      } else if (!strcmp(token, "retries") && atoi(value) >= 0) {
+         ps->retries = atoi(value);
+      } else if (!strcmp(token, "gzip")) {
+         ps->gzip = !strcmp(value, "on") || !strcmp(value, "1");
+      } else {
+         fprintf(stderr, "output_influxdb: ignoring option '%s'\n", token);
       }
    }
-   return 1;
+
+   if (!strcmp(precision, "ns")) {
+      ps->precision_divisor = 1;
+   } else if (!strcmp(precision, "u") || !strcmp(precision, "us")) {
+      ps->precision_divisor = 1000;
+      precision = "u";
+   } else if (!strcmp(precision, "ms")) {
+      ps->precision_divisor = 1000000;
+   } else if (!strcmp(precision, "s")) {
+      ps->precision_divisor = 1000000000;
+   } else {
+      fprintf(stderr, "output_influxdb: precision must be ns, us, ms or s\n");
+      free(config);
+      return 1;
+   }
+
+   // bare write url given; only precision is added to it
+   url_len = strlen(base_url) + strlen(db) + strlen(precision) + 32;
+   ps->url = malloc(url_len);
+   if (strstr(base_url, "/write")) {
+      snprintf(ps->url, url_len, "%s%sprecision=%s", base_url,
+               strchr(base_url, '?') ? "&" : "?", precision);
+   } else {
+      snprintf(ps->url, url_len, "%s/write?db=%s&precision=%s", base_url, db,
+               precision);
+   }
+   free(config);
+   return 0;
 }
 
 //*****************************************************************************
 
-int open_plugin(const char* plugin_config)
+int open_plugin(const char* plugin_config, struct listener* listener,
+                void** state)
 {
+   struct plugin_state* ps = calloc(1, sizeof(struct plugin_state));
+   unsigned int num_buffers;
+   unsigned int i;
+
+   if (!ps || parse_config(ps, plugin_config, &num_buffers)) {
+      return PLUGIN_OPEN_FAIL;
+   }
+
    curl_global_init(CURL_GLOBAL_ALL);
-   //url = strdup(plugin_config);
+   // one handle for plugin's lifetime keeps connection alive between batches
+   ps->curl = curl_easy_init();
+   if (!ps->curl) {
+      return PLUGIN_OPEN_FAIL;
+   }
+   curl_easy_setopt(ps->curl, CURLOPT_URL, ps->url);
+   curl_easy_setopt(ps->curl, CURLOPT_WRITEFUNCTION, discard_response);
+   curl_easy_setopt(ps->curl, CURLOPT_TCP_KEEPALIVE, 1L);
+   ps->headers = curl_slist_append(NULL, "Content-Type: text/plain");
+   if (ps->gzip) {
+      ps->headers = curl_slist_append(ps->headers, "Content-Encoding: gzip");
+   }
+   curl_easy_setopt(ps->curl, CURLOPT_HTTPHEADER, ps->headers);
+
+   for (i = 0; i != num_buffers; ++i) {
+      struct batch* b = calloc(1, sizeof(struct batch));
+      if (!b) {
+         return PLUGIN_OPEN_FAIL;
+      }
+      b->next = ps->free_batches;
+      ps->free_batches = b;
+   }
+   ps->current = ps->free_batches;
+   ps->free_batches = ps->current->next;
+
+   pthread_mutex_init(&ps->mutex, NULL);
+   pthread_cond_init(&ps->wake, NULL);
+   if (pthread_create(&ps->sender, NULL, sender_thread, ps)) {
+      fprintf(stderr, "output_influxdb: unable to start sender thread\n");
+      return PLUGIN_OPEN_FAIL;
+   }
+   *state = ps;
    return PLUGIN_OPEN_SUCCESS;
 }
 
 //*****************************************************************************
 
-void close_plugin()
+void close_plugin(void* state)
 {
+   struct plugin_state* ps = state;
+   struct batch* b;
+
+   // sender writes whatever is left before it quits
+   pthread_mutex_lock(&ps->mutex);
+   ps->stopping = 1;
+   pthread_cond_signal(&ps->wake);
+   pthread_mutex_unlock(&ps->mutex);
+   pthread_join(ps->sender, NULL);
+
+   fprintf(stderr, "output_influxdb: %llu lines in %llu batches written,"
+           " %llu batches failed, %llu retries, %llu refusals\n",
+           ps->lines_sent, ps->batches_sent, ps->batches_failed,
+           ps->retries_done, ps->refusals);
+
+   curl_slist_free_all(ps->headers);
+   curl_easy_cleanup(ps->curl);
    curl_global_cleanup();
-   if (url != NULL) {
-      free(url);
+
+   // batches are on free list and in current now
+   if (ps->current) {
+      ps->current->next = ps->free_batches;
+      ps->free_batches = ps->current;
+   }
+   while ((b = ps->free_batches)) {
+      ps->free_batches = b->next;
+      free(b->data);
+      free(b);
    }
+   pthread_cond_destroy(&ps->wake);
+   pthread_mutex_destroy(&ps->mutex);
+   free(ps->compressed);
+   free(ps->measurement);
+   free(ps->url);
+   free(ps);
 }
 
 //*****************************************************************************
 
-int ok_to_accept_data()
+int ok_to_accept_data(void* state)
 {
-   return PLUGIN_ACCEPT_DATA;
+   struct plugin_state* ps = state;
+   int rc;
+
+   pthread_mutex_lock(&ps->mutex);
+   rc = ps->current ? PLUGIN_ACCEPT_DATA : PLUGIN_REFUSE_DATA;
+   pthread_mutex_unlock(&ps->mutex);
+   return rc;
 }
 
 //*****************************************************************************
 
-int process_data(struct monitor_record_t* data)
+int process_data(struct monitor_record_t* data, void* state)
 {
-   int rc = PLUGIN_REFUSE_DATA;
-   CURLcode curl_status;
-   char postdata[1024];
-   char s1_data[PATH_MAX]="";
-   char s2_data[STR_LEN]="";
-   int have_s1;
-   int have_s2;
-   
-   CURL* curl_handle = curl_easy_init();
-   if (curl_handle) {
-      have_s1 = (data->s1 != NULL) && (strlen(data->s1) > 0) && !is_all_whitespace(data->s1);
-      have_s2 = (data->s2 != NULL) && (strlen(data->s2) > 0) && !is_all_whitespace(data->s2);
-
-      if (have_s1) {
-         copy_escaped_tag_value(data->s1, s1_data, PATH_MAX);
-      }
-
-      if (have_s2) {
-         copy_escaped_tag_value(data->s2, s2_data, STR_LEN);
-      }
-
-          snprintf(postdata,
-                   1024,
-                   "%s,%s=%s,%s=%s,%s=%s %s=\"%s\",%s=\"%s\",%s=\"%s\",%s=\"%s\",%s=\"%s\",%s=\"%s\",%s=%d,%s=%f,%s=%d,%s=%d,%s=%d,%s=%zu",
-                   measure,
-                   facility, data->facility,
-                   "dom_tag", domains_names[data->dom_type],
-                   "op_tag", ops_names[data->op_type],
-
-		   // tags
-                   device, data->device[0]?data->device:"none", 
-                   dom_type, domains_names[data->dom_type],
-                   hostname, data->hostname,
-                   op_type, ops_names[data->op_type],
-                   s1,s1_data[0]?s1_data:"NULL",
-                   s2, s2_data[0]?s2_data:"NULL",
-
-                   timestamp, data->timestamp,
-                   elapsed_time, data->elapsed_time,
-                   pid, data->pid,
-                   error_code, data->error_code,
-                   fd, data->fd,
-                   bytes_transferred, data->bytes_transferred);
-
-      puts(postdata);
-
-      // our url is passed in as argument of open_plugin
-      curl_easy_setopt(curl_handle, CURLOPT_URL, url);
-      curl_easy_setopt(curl_handle, CURLOPT_POSTFIELDS, postdata);
-      curl_status = curl_easy_perform(curl_handle);
-
-      if (curl_status == CURLE_OK) {
-         rc = PLUGIN_ACCEPT_DATA;
-      } else {
-         fprintf(stderr, "curl_easy_perform() FAILED: %s\n",
-                 curl_easy_strerror(curl_status));
-         rc = PLUGIN_REFUSE_DATA;
+   struct plugin_state* ps = state;
+   char line[MAX_LINE_LEN];
+   size_t len = format_line(ps, line, data);
+   struct batch* b;
+
+   pthread_mutex_lock(&ps->mutex);
+   b = ps->current;
+   if (!b) {
+      // all batches wait for sender; listener pauses us until one is free
+      ps->refusals++;
+      pthread_mutex_unlock(&ps->mutex);
+      return PLUGIN_REFUSE_DATA;
+   }
+
+   if (b->len + len > b->capacity) {
+      size_t capacity = b->capacity ? 2 * b->capacity : 64 * 1024;
+      char* tmp;
+      while (capacity < b->len + len) {
+         capacity *= 2;
       }
-      curl_easy_cleanup(curl_handle);
+      tmp = realloc(b->data, capacity);
+      if (!tmp) {
+         pthread_mutex_unlock(&ps->mutex);
+         return PLUGIN_REFUSE_DATA;
+      }
+      b->data = tmp;
+      b->capacity = capacity;
+   }
+   if (!b->lines) {
+      clock_gettime(CLOCK_REALTIME, &b->first_line);
    }
+   memcpy(b->data + b->len, line, len);
+   b->len += len;
+   b->lines++;
 
-   return rc;
+   if (b->lines >= ps->batch_lines) {
+      queue_current_batch(ps);
+   }
+   pthread_mutex_unlock(&ps->mutex);
+   return PLUGIN_ACCEPT_DATA;
 }
 
 //*****************************************************************************
-
-
@@ -0,0 +1,1106 @@
+//
+// Copyright (c) 2017 Intel Corporation
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+// implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "plugin.h"
+#include "monitor_record.h"
+#include "plugin_helpers.h"
+#include "domains_names.h"
+#include "ops_names.h"
+
+/* plugin configuration is a comma separated list of key=value pairs:
+ *   file=trace.parquet,row_group=262144,compression=gzip,flush_s=60
+ * Writes records to an Apache Parquet file, one column per record field,
+ * for querying with DuckDB, Spark, pandas and the like. Columns are
+ * buffered for a row group at a time. Strings are dictionary encoded per
+ * row group, or plain when most values are distinct, and each column
+ * chunk carries min/max statistics so that readers can skip row groups.
+ * Footer is rewritten after each row group, so the file is readable between
+ * row groups while it grows. Each row group overwrites the previous footer,
+ * so a crash while one is being written leaves no valid footer. An
+ * incomplete row group is written once idle for flush_s.
+ * Values are written in host byte order, which must be little endian */
+#define DEFAULT_FILE "trace.parquet"
+#define DEFAULT_ROW_GROUP 262144
+#define DEFAULT_FLUSH_S 60
+#define PAGE_VALUES 65536           /* values per data page */
+#define MAX_DICT_BYTES (16 << 20)   /* larger dictionaries are written plain */
+#define MAX_STAT_LEN 512            /* longer string min/max are left out */
+#define CREATED_BY "io_monitor output_parquet"
+
+/* from parquet.thrift */
+enum { TYPE_INT32 = 1, TYPE_INT64 = 2, TYPE_FLOAT = 4, TYPE_BYTE_ARRAY = 6 };
+enum { ENCODING_PLAIN = 0, ENCODING_RLE = 3, ENCODING_RLE_DICTIONARY = 8 };
+enum { PAGE_DATA = 0, PAGE_DICTIONARY = 2 };
+enum { CODEC_UNCOMPRESSED = 0, CODEC_GZIP = 2 };
+enum { REPETITION_REQUIRED = 0 };
+enum { CONVERTED_UTF8 = 0 };
+
+/* thrift compact protocol field types */
+enum { T_TRUE = 1, T_FALSE = 2, T_I32 = 5, T_I64 = 6, T_BINARY = 8,
+       T_LIST = 9, T_STRUCT = 12 };
+#define THRIFT_MAX_DEPTH 8
+
+enum column_id {
+   COL_TIMESTAMP, COL_LATENCY, COL_FACILITY, COL_HOSTNAME, COL_DEVICE,
+   COL_PID, COL_TID, COL_DOMAIN, COL_OP, COL_ERROR, COL_FD, COL_BYTES,
+   COL_OFFSET, COL_S1, COL_S2, NUM_COLUMNS
+};
+
+static const struct {
+   const char* name;
+   int type;
+} column_defs[NUM_COLUMNS] = {
+   {"timestamp", TYPE_INT64},      /* nanoseconds since epoch, UTC */
+   {"latency_ms", TYPE_FLOAT},
+   {"facility", TYPE_BYTE_ARRAY},
+   {"hostname", TYPE_BYTE_ARRAY},
+   {"device", TYPE_BYTE_ARRAY},
+   {"pid", TYPE_INT32},
+   {"tid", TYPE_INT32},
+   {"domain", TYPE_BYTE_ARRAY},
+   {"op", TYPE_BYTE_ARRAY},
+   {"error_code", TYPE_INT32},
+   {"fd", TYPE_INT32},
+   {"bytes", TYPE_INT64},
+   {"offset", TYPE_INT64},
+   {"s1", TYPE_BYTE_ARRAY},
+   {"s2", TYPE_BYTE_ARRAY},
+};
+
+struct buffer {
+   unsigned char* data;
+   size_t len;
+   size_t capacity;
+   int failed;
+};
+
+struct thrift {
+   struct buffer* out;
+   int last_field[THRIFT_MAX_DEPTH];
+   int depth;
+};
+
+// distinct strings of a column within current row group
+struct dictionary {
+   char* strings;               /* entries back to back */
+   size_t size;
+   size_t capacity;
+   size_t* offsets;             /* entry n spans offsets[n]..offsets[n + 1] */
+   unsigned int num;
+   unsigned int offsets_capacity;
+   unsigned int* slots;         /* open addressing, entry + 1; 0 is empty */
+   unsigned int slots_size;     /* power of 2 */
+};
+
+struct column {
+   void* values;                /* row_group values; dictionary ids for
+                                 * strings */
+   struct dictionary dict;
+};
+
+struct chunk_meta {
+   long long dictionary_page_offset;   /* -1 when written plain */
+   long long data_page_offset;
+   long long uncompressed_size;
+   long long compressed_size;
+   unsigned char* stats;        /* min followed by max; NULL when none */
+   unsigned int min_len;
+   unsigned int max_len;
+};
+
+struct row_group_meta {
+   long long num_rows;
+   long long file_offset;
+   struct chunk_meta chunks[NUM_COLUMNS];
+};
+
+struct plugin_state {
+   char* file_name;
+   int fd;
+   unsigned int row_group;
+   int codec;
+   int flush_s;
+   long long offset;            /* where next row group goes */
+
+   struct column columns[NUM_COLUMNS];
+   unsigned int rows;           /* buffered for current row group */
+   time_t first_row_time;
+
+   struct row_group_meta* groups;
+   unsigned int num_groups;
+   unsigned int groups_capacity;
+   long long total_rows;
+
+   struct buffer page;
+   struct buffer compressed;
+   struct buffer header;
+   struct buffer footer;
+   z_stream zs;
+   int zs_ready;
+   int failed;
+};
+
+//*****************************************************************************
+
+static int reserve(struct buffer* b, size_t n)
+{
+   size_t capacity = b->capacity ? b->capacity : 4096;
+   unsigned char* data;
+
+   if (b->len + n <= b->capacity) {
+      return 0;
+   }
+   while (capacity < b->len + n) {
+      capacity *= 2;
+   }
+   data = realloc(b->data, capacity);
+   if (!data) {
+      b->failed = 1;
+      return -1;
+   }
+   b->data = data;
+   b->capacity = capacity;
+   return 0;
+}
+
+//*****************************************************************************
+
+static void put_bytes(struct buffer* b, const void* bytes, size_t n)
+{
+   if (!reserve(b, n)) {
+      memcpy(b->data + b->len, bytes, n);
+      b->len += n;
+   }
+}
+
+//*****************************************************************************
+
+static void put_byte(struct buffer* b, unsigned char c)
+{
+   put_bytes(b, &c, 1);
+}
+
+//*****************************************************************************
+
+static void put_varint(struct buffer* b, unsigned long long v)
+{
+   unsigned char bytes[10];
+   size_t n = 0;
+
+   while (v >= 0x80) {
+      bytes[n++] = (v & 0x7f) | 0x80;
+      v >>= 7;
+   }
+   bytes[n++] = v;
+   put_bytes(b, bytes, n);
+}
+
+//*****************************************************************************
+
+static void put_zigzag(struct buffer* b, long long v)
+{
+   put_varint(b, ((unsigned long long)v << 1) ^ (unsigned long long)(v >> 63));
+}
+
+//*****************************************************************************
+
+static void t_begin(struct thrift* t, struct buffer* out)
+{
+   out->len = 0;
+   out->failed = 0;
+   t->out = out;
+   t->depth = 0;
+   t->last_field[0] = 0;
+}
+
+//*****************************************************************************
+
+static void t_field(struct thrift* t, int type, int id)
+{
+   const int delta = id - t->last_field[t->depth];
+
+   if (delta > 0 && delta <= 15) {
+      put_byte(t->out, delta << 4 | type);
+   } else {
+      put_byte(t->out, type);
+      put_zigzag(t->out, id);
+   }
+   t->last_field[t->depth] = id;
+}
+
+//*****************************************************************************
+
+static void t_i32(struct thrift* t, int id, int v)
+{
+   t_field(t, T_I32, id);
+   put_zigzag(t->out, v);
+}
+
+//*****************************************************************************
+
+static void t_i64(struct thrift* t, int id, long long v)
+{
+   t_field(t, T_I64, id);
+   put_zigzag(t->out, v);
+}
+
+//*****************************************************************************
+
+static void t_bool(struct thrift* t, int id, int v)
+{
+   t_field(t, v ? T_TRUE : T_FALSE, id);
+}
+
+//*****************************************************************************
+
+static void t_binary(struct thrift* t, int id, const void* data, size_t len)
+{
+   t_field(t, T_BINARY, id);
+   put_varint(t->out, len);
+   put_bytes(t->out, data, len);
+}
+
+//*****************************************************************************
+
+static void t_string(struct thrift* t, int id, const char* s)
+{
+   t_binary(t, id, s, strlen(s));
+}
+
+//*****************************************************************************
+
+// id 0 starts struct that is element of list
+static void t_struct(struct thrift* t, int id)
+{
+   if (id) {
+      t_field(t, T_STRUCT, id);
+   }
+   t->last_field[++t->depth] = 0;
+}
+
+//*****************************************************************************
+
+static void t_end(struct thrift* t)
+{
+   put_byte(t->out, 0);
+   --t->depth;
+}
+
+//*****************************************************************************
+
+static void t_list(struct thrift* t, int id, int type, unsigned int size)
+{
+   t_field(t, T_LIST, id);
+   if (size < 15) {
+      put_byte(t->out, size << 4 | type);
+   } else {
+      put_byte(t->out, 0xf0 | type);
+      put_varint(t->out, size);
+   }
+}
+
+//*****************************************************************************
+
+static size_t value_size(int type)
+{
+   return type == TYPE_INT64 ? 8 : 4;
+}
+
+//*****************************************************************************
+
+static unsigned int string_hash(const char* s, size_t len)
+{
+   return fnv_hash(FNV_OFFSET, s, len);
+}
+
+//*****************************************************************************
+
+static int dict_rehash(struct dictionary* d, unsigned int slots_size)
+{
+   unsigned int* slots = calloc(slots_size, sizeof(unsigned int));
+   unsigned int i, slot;
+
+   if (!slots) {
+      return -1;
+   }
+   for (i = 0; i != d->num; ++i) {
+      slot = string_hash(d->strings + d->offsets[i],
+                         d->offsets[i + 1] - d->offsets[i]) & (slots_size - 1);
+      while (slots[slot]) {
+         slot = (slot + 1) & (slots_size - 1);
+      }
+      slots[slot] = i + 1;
+   }
+   free(d->slots);
+   d->slots = slots;
+   d->slots_size = slots_size;
+   return 0;
+}
+
+//*****************************************************************************
+
+// returns id of string in dictionary, adding it when new; -1 when out
+// of memory
+static long dict_add(struct dictionary* d, const char* s, size_t len)
+{
+   unsigned int slot = string_hash(s, len) & (d->slots_size - 1);
+   unsigned int id;
+
+   while (d->slots[slot]) {
+      id = d->slots[slot] - 1;
+      if (d->offsets[id + 1] - d->offsets[id] == len &&
+          !memcmp(d->strings + d->offsets[id], s, len)) {
+         return id;
+      }
+      slot = (slot + 1) & (d->slots_size - 1);
+   }
+
+   if (d->size + len > d->capacity) {
+      size_t capacity = d->capacity * 2;
+      char* strings;
+      while (capacity < d->size + len) {
+         capacity *= 2;
+      }
+      strings = realloc(d->strings, capacity);
+      if (!strings) {
+         return -1;
+      }
+      d->strings = strings;
+      d->capacity = capacity;
+   }
+   if (d->num + 2 > d->offsets_capacity) {
+      size_t* offsets = realloc(d->offsets,
+                                2 * d->offsets_capacity * sizeof(size_t));
+      if (!offsets) {
+         return -1;
+      }
+      d->offsets = offsets;
+      d->offsets_capacity *= 2;
+   }
+   memcpy(d->strings + d->size, s, len);
+   d->size += len;
+   id = d->num++;
+   d->offsets[d->num] = d->size;
+   d->slots[slot] = id + 1;
+   if (2 * d->num >= d->slots_size &&
+       dict_rehash(d, 2 * d->slots_size)) {
+      return -1;
+   }
+   return id;
+}
+
+//*****************************************************************************
+
+static void dict_clear(struct dictionary* d)
+{
+   d->size = 0;
+   d->num = 0;
+   memset(d->slots, 0, d->slots_size * sizeof(unsigned int));
+}
+
+//*****************************************************************************
+
+static int dict_init(struct dictionary* d)
+{
+   d->capacity = 65536;
+   d->strings = malloc(d->capacity);
+   d->offsets_capacity = 1024;
+   d->offsets = malloc(d->offsets_capacity * sizeof(size_t));
+   d->slots_size = 1024;
+   d->slots = calloc(d->slots_size, sizeof(unsigned int));
+   if (!d->strings || !d->offsets || !d->slots) {
+      return -1;
+   }
+   d->offsets[0] = 0;
+   return 0;
+}
+
+//*****************************************************************************
+
+static void write_at(struct plugin_state* ps, const void* data, size_t len,
+                     long long offset)
+{
+   const char* p = data;
+   ssize_t n;
+
+   while (len && !ps->failed) {
+      n = pwrite(ps->fd, p, len, offset);
+      if (n < 0 && errno == EINTR) {
+         continue;
+      }
+      if (n <= 0) {
+         fprintf(stderr, "error: output_parquet unable to write %s: %s\n",
+                 ps->file_name, strerror(errno));
+         ps->failed = 1;
+         return;
+      }
+      p += n;
+      len -= n;
+      offset += n;
+   }
+}
+
+//*****************************************************************************
+
+// compresses ps->page when codec asks for it and writes it behind its
+// header at ps->offset
+static void write_page(struct plugin_state* ps, struct chunk_meta* chunk,
+                       int page_type, unsigned int num_values, int encoding)
+{
+   const struct buffer* body = &ps->page;
+   struct thrift t;
+
+   if (ps->page.failed || ps->failed) {
+      ps->failed = 1;
+      return;
+   }
+   if (ps->codec == CODEC_GZIP) {
+      ps->compressed.len = 0;
+      if (reserve(&ps->compressed, deflateBound(&ps->zs, ps->page.len))) {
+         ps->failed = 1;
+         return;
+      }
+      deflateReset(&ps->zs);
+      ps->zs.next_in = ps->page.data;
+      ps->zs.avail_in = ps->page.len;
+      ps->zs.next_out = ps->compressed.data;
+      ps->zs.avail_out = ps->compressed.capacity;
+      if (deflate(&ps->zs, Z_FINISH) != Z_STREAM_END) {
+         fprintf(stderr, "error: output_parquet compression failed\n");
+         ps->failed = 1;
+         return;
+      }
+      ps->compressed.len = ps->compressed.capacity - ps->zs.avail_out;
+      body = &ps->compressed;
+   }
+
+   t_begin(&t, &ps->header);
+   t_i32(&t, 1, page_type);
+   t_i32(&t, 2, ps->page.len);
+   t_i32(&t, 3, body->len);
+   if (page_type == PAGE_DICTIONARY) {
+      t_struct(&t, 7);
+      t_i32(&t, 1, num_values);
+      t_i32(&t, 2, ENCODING_PLAIN);
+   } else {
+      t_struct(&t, 5);
+      t_i32(&t, 1, num_values);
+      t_i32(&t, 2, encoding);
+      t_i32(&t, 3, ENCODING_RLE);
+      t_i32(&t, 4, ENCODING_RLE);
+   }
+   t_end(&t);
+   t_end(&t);
+   if (ps->header.failed) {
+      ps->failed = 1;
+      return;
+   }
+
+   write_at(ps, ps->header.data, ps->header.len, ps->offset);
+   write_at(ps, body->data, body->len, ps->offset + ps->header.len);
+   ps->offset += ps->header.len + body->len;
+   chunk->uncompressed_size += ps->header.len + ps->page.len;
+   chunk->compressed_size += ps->header.len + body->len;
+}
+
+//*****************************************************************************
+
+// dictionary ids as RLE/bit-packed hybrid: bit width, then one bit-packed
+// run, least significant bit first
+static void put_ids(struct buffer* b, const unsigned int* ids,
+                    unsigned int n, int bit_width)
+{
+   const unsigned int groups = (n + 7) / 8;
+   unsigned long long bits = 0;
+   int num_bits = 0;
+   unsigned int i;
+
+   put_byte(b, bit_width);
+   put_varint(b, (unsigned long long)groups << 1 | 1);
+   if (reserve(b, (size_t)groups * bit_width)) {
+      return;
+   }
+   for (i = 0; i != groups * 8; ++i) {
+      bits |= (unsigned long long)(i < n ? ids[i] : 0) << num_bits;
+      num_bits += bit_width;
+      while (num_bits >= 8) {
+         b->data[b->len++] = bits & 0xff;
+         bits >>= 8;
+         num_bits -= 8;
+      }
+   }
+}
+
+//*****************************************************************************
+
+static void set_stats(struct chunk_meta* chunk, const void* min,
+                      unsigned int min_len, const void* max,
+                      unsigned int max_len)
+{
+   if (min_len > MAX_STAT_LEN || max_len > MAX_STAT_LEN) {
+      return;
+   }
+   chunk->stats = malloc(min_len + max_len + 1);
+   if (chunk->stats) {
+      memcpy(chunk->stats, min, min_len);
+      memcpy(chunk->stats + min_len, max, max_len);
+      chunk->min_len = min_len;
+      chunk->max_len = max_len;
+   }
+}
+
+//*****************************************************************************
+
+static int compare_strings(const char* a, size_t a_len, const char* b,
+                           size_t b_len)
+{
+   int rc = memcmp(a, b, a_len < b_len ? a_len : b_len);
+   return rc ? rc : (a_len > b_len) - (a_len < b_len);
+}
+
+//*****************************************************************************
+
+static void string_stats(struct chunk_meta* chunk, const struct dictionary* d)
+{
+   unsigned int i, min = 0, max = 0;
+
+   for (i = 1; i < d->num; ++i) {
+      const char* s = d->strings + d->offsets[i];
+      const size_t len = d->offsets[i + 1] - d->offsets[i];
+      if (compare_strings(s, len, d->strings + d->offsets[min],
+                          d->offsets[min + 1] - d->offsets[min]) < 0) {
+         min = i;
+      }
+      if (compare_strings(s, len, d->strings + d->offsets[max],
+                          d->offsets[max + 1] - d->offsets[max]) > 0) {
+         max = i;
+      }
+   }
+   set_stats(chunk, d->strings + d->offsets[min],
+             d->offsets[min + 1] - d->offsets[min],
+             d->strings + d->offsets[max],
+             d->offsets[max + 1] - d->offsets[max]);
+}
+
+//*****************************************************************************
+
+static void numeric_stats(struct chunk_meta* chunk, int type,
+                          const void* values, unsigned int n)
+{
+   unsigned int i, min = 0, max = 0;
+
+   for (i = 1; i < n; ++i) {
+      if (type == TYPE_INT64) {
+         const long long* v = values;
+         min = v[i] < v[min] ? i : min;
+         max = v[i] > v[max] ? i : max;
+      } else if (type == TYPE_INT32) {
+         const int* v = values;
+         min = v[i] < v[min] ? i : min;
+         max = v[i] > v[max] ? i : max;
+      } else {
+         const float* v = values;
+         min = v[i] < v[min] ? i : min;
+         max = v[i] > v[max] ? i : max;
+      }
+   }
+   set_stats(chunk, (const char*)values + min * value_size(type),
+             value_size(type), (const char*)values + max * value_size(type),
+             value_size(type));
+}
+
+//*****************************************************************************
+
+static void write_column(struct plugin_state* ps, struct column* col,
+                         int type, struct chunk_meta* chunk)
+{
+   const struct dictionary* d = &col->dict;
+   const unsigned int* ids = col->values;
+   unsigned int start, n, i;
+   int use_dict = 0;
+   int bit_width = 1;
+
+   chunk->dictionary_page_offset = -1;
+   if (type == TYPE_BYTE_ARRAY) {
+      // dictionary pays off as long as values repeat
+      use_dict = 2 * d->num <= ps->rows && d->size <= MAX_DICT_BYTES;
+      string_stats(chunk, d);
+   } else {
+      numeric_stats(chunk, type, col->values, ps->rows);
+   }
+
+   if (use_dict) {
+      chunk->dictionary_page_offset = ps->offset;
+      ps->page.len = 0;
+      for (i = 0; i != d->num; ++i) {
+         const unsigned int len = d->offsets[i + 1] - d->offsets[i];
+         put_bytes(&ps->page, &len, 4);
+         put_bytes(&ps->page, d->strings + d->offsets[i], len);
+      }
+      write_page(ps, chunk, PAGE_DICTIONARY, d->num, ENCODING_PLAIN);
+      while (bit_width < 32 && (1U << bit_width) < d->num) {
+         ++bit_width;
+      }
+   }
+
+   chunk->data_page_offset = ps->offset;
+   for (start = 0; start < ps->rows && !ps->failed; start += n) {
+      n = ps->rows - start < PAGE_VALUES ? ps->rows - start : PAGE_VALUES;
+      ps->page.len = 0;
+      if (use_dict) {
+         put_ids(&ps->page, ids + start, n, bit_width);
+      } else if (type == TYPE_BYTE_ARRAY) {
+         for (i = start; i != start + n; ++i) {
+            const unsigned int len = d->offsets[ids[i] + 1] - d->offsets[ids[i]];
+            put_bytes(&ps->page, &len, 4);
+            put_bytes(&ps->page, d->strings + d->offsets[ids[i]], len);
+         }
+      } else {
+         put_bytes(&ps->page, (const char*)col->values +
+                   (size_t)start * value_size(type), n * value_size(type));
+      }
+      write_page(ps, chunk, PAGE_DATA, n,
+                 use_dict ? ENCODING_RLE_DICTIONARY : ENCODING_PLAIN);
+   }
+}
+
+//*****************************************************************************
+
+static void write_schema(struct thrift* t)
+{
+   int i;
+
+   t_list(t, 2, T_STRUCT, NUM_COLUMNS + 1);
+   t_struct(t, 0);
+   t_string(t, 4, "schema");
+   t_i32(t, 5, NUM_COLUMNS);
+   t_end(t);
+   for (i = 0; i != NUM_COLUMNS; ++i) {
+      t_struct(t, 0);
+      t_i32(t, 1, column_defs[i].type);
+      t_i32(t, 3, REPETITION_REQUIRED);
+      t_string(t, 4, column_defs[i].name);
+      if (column_defs[i].type == TYPE_BYTE_ARRAY) {
+         t_i32(t, 6, CONVERTED_UTF8);
+         t_struct(t, 10);       /* LogicalType */
+         t_struct(t, 1);        /* STRING */
+         t_end(t);
+         t_end(t);
+      } else if (i == COL_TIMESTAMP) {
+         t_struct(t, 10);       /* LogicalType */
+         t_struct(t, 8);        /* TIMESTAMP */
+         t_bool(t, 1, 1);       /* isAdjustedToUTC */
+         t_struct(t, 2);        /* unit */
+         t_struct(t, 3);        /* NANOS */
+         t_end(t);
+         t_end(t);
+         t_end(t);
+         t_end(t);
+      }
+      t_end(t);
+   }
+}
+
+//*****************************************************************************
+
+static void write_chunk_meta(struct plugin_state* ps, struct thrift* t,
+                             const struct row_group_meta* group, int column)
+{
+   const struct chunk_meta* chunk = &group->chunks[column];
+   const int use_dict = chunk->dictionary_page_offset >= 0;
+
+   t_struct(t, 0);
+   t_i64(t, 2, use_dict ? chunk->dictionary_page_offset :
+         chunk->data_page_offset);
+   t_struct(t, 3);
+   t_i32(t, 1, column_defs[column].type);
+   t_list(t, 2, T_I32, use_dict ? 3 : 2);
+   put_zigzag(t->out, ENCODING_PLAIN);
+   put_zigzag(t->out, ENCODING_RLE);
+   if (use_dict) {
+      put_zigzag(t->out, ENCODING_RLE_DICTIONARY);
+   }
+   t_list(t, 3, T_BINARY, 1);
+   put_varint(t->out, strlen(column_defs[column].name));
+   put_bytes(t->out, column_defs[column].name, strlen(column_defs[column].name));
+   t_i32(t, 4, ps->codec);
+   t_i64(t, 5, group->num_rows);
+   t_i64(t, 6, chunk->uncompressed_size);
+   t_i64(t, 7, chunk->compressed_size);
+   t_i64(t, 9, chunk->data_page_offset);
+   if (use_dict) {
+      t_i64(t, 11, chunk->dictionary_page_offset);
+   }
+   if (chunk->stats) {
+      t_struct(t, 12);
+      t_i64(t, 3, 0);           /* null_count */
+      t_binary(t, 5, chunk->stats + chunk->min_len, chunk->max_len);
+      t_binary(t, 6, chunk->stats, chunk->min_len);
+      t_end(t);
+   }
+   t_end(t);
+   t_end(t);
+}
+
+//*****************************************************************************
+
+// footer goes at ps->offset, where next row group will overwrite it
+static void write_footer(struct plugin_state* ps)
+{
+   struct thrift t;
+   unsigned int i, j;
+   unsigned int len;
+   long long uncompressed, compressed;
+
+   t_begin(&t, &ps->footer);
+   t_i32(&t, 1, 1);             /* version */
+   write_schema(&t);
+   t_i64(&t, 3, ps->total_rows);
+   t_list(&t, 4, T_STRUCT, ps->num_groups);
+   for (i = 0; i != ps->num_groups; ++i) {
+      const struct row_group_meta* group = &ps->groups[i];
+      uncompressed = compressed = 0;
+      t_struct(&t, 0);
+      t_list(&t, 1, T_STRUCT, NUM_COLUMNS);
+      for (j = 0; j != NUM_COLUMNS; ++j) {
+         write_chunk_meta(ps, &t, group, j);
+         uncompressed += group->chunks[j].uncompressed_size;
+         compressed += group->chunks[j].compressed_size;
+      }
+      t_i64(&t, 2, uncompressed);
+      t_i64(&t, 3, group->num_rows);
+      t_i64(&t, 5, group->file_offset);
+      t_i64(&t, 6, compressed);
+      t_end(&t);
+   }
+   t_string(&t, 6, CREATED_BY);
+   t_list(&t, 7, T_STRUCT, NUM_COLUMNS);
+   for (j = 0; j != NUM_COLUMNS; ++j) {
+      t_struct(&t, 0);
+      t_struct(&t, 1);          /* TYPE_ORDER */
+      t_end(&t);
+      t_end(&t);
+   }
+   t_end(&t);
+
+   len = ps->footer.len;
+   put_bytes(&ps->footer, &len, 4);
+   put_bytes(&ps->footer, "PAR1", 4);
+   if (ps->footer.failed) {
+      fprintf(stderr, "error: output_parquet out of memory for footer\n");
+      ps->failed = 1;
+      return;
+   }
+   write_at(ps, ps->footer.data, ps->footer.len, ps->offset);
+}
+
+//*****************************************************************************
+
+static void write_row_group(struct plugin_state* ps)
+{
+   struct row_group_meta* group;
+   int i;
+
+   if (!ps->rows || ps->failed) {
+      return;
+   }
+   if (ps->num_groups == ps->groups_capacity) {
+      unsigned int capacity = ps->groups_capacity ? 2 * ps->groups_capacity : 16;
+      group = realloc(ps->groups, capacity * sizeof(struct row_group_meta));
+      if (!group) {
+         fprintf(stderr, "error: output_parquet out of memory\n");
+         ps->failed = 1;
+         return;
+      }
+      ps->groups = group;
+      ps->groups_capacity = capacity;
+   }
+
+   group = &ps->groups[ps->num_groups];
+   memset(group, 0, sizeof(*group));
+   group->num_rows = ps->rows;
+   group->file_offset = ps->offset;
+   for (i = 0; i != NUM_COLUMNS; ++i) {
+      write_column(ps, &ps->columns[i], column_defs[i].type,
+                   &group->chunks[i]);
+      if (column_defs[i].type == TYPE_BYTE_ARRAY) {
+         dict_clear(&ps->columns[i].dict);
+      }
+   }
+   ++ps->num_groups;
+   ps->total_rows += ps->rows;
+   ps->rows = 0;
+   write_footer(ps);
+}
+
+//*****************************************************************************
+
+static int add_string(struct plugin_state* ps, int column, const char* s,
+                      size_t max_len)
+{
+   struct column* col = &ps->columns[column];
+   long id = dict_add(&col->dict, s, strnlen(s, max_len));
+
+   if (id < 0) {
+      return -1;
+   }
+   ((unsigned int*)col->values)[ps->rows] = id;
+   return 0;
+}
+
+//*****************************************************************************
+
+static int parse_config(struct plugin_state* ps, const char* plugin_config)
+{
+   char* config = strdup(plugin_config ? plugin_config : "");
+   char* rest = config;
+   char* token;
+   int rc = 0;
+
+   while ((token = strtok_r(rest, ",", &rest))) {
+      char* value = strchr(token, '=');
+      if (!value) {
+         fprintf(stderr, "error: output_parquet option '%s' has no value\n",
+                 token);
+         rc = 1;
+         continue;
+      }
+      *value++ = 0;
+      if (!strcmp(token, "file") && *value) {
+         free(ps->file_name);
+         ps->file_name = strdup(value);
+      } else if (!strcmp(token, "row_group") && atoi(value) > 0) {
+         ps->row_group = atoi(value);
+      } else if (!strcmp(token, "compression") && !strcmp(value, "gzip")) {
+         ps->codec = CODEC_GZIP;
+      } else if (!strcmp(token, "compression") && !strcmp(value, "none")) {
+         ps->codec = CODEC_UNCOMPRESSED;
+      } else if (!strcmp(token, "flush_s") && atoi(value) >= 0) {
+         ps->flush_s = atoi(value);
+      } else {
+         fprintf(stderr, "error: output_parquet option '%s' is invalid\n",
+                 token);
+         rc = 1;
+      }
+   }
+   free(config);
+   return rc;
+}
+
+//*****************************************************************************
+
+static void free_state(struct plugin_state* ps)
+{
+   unsigned int i, j;
+
+   if (ps->fd != -1) {
+      close(ps->fd);
+   }
+   if (ps->zs_ready) {
+      deflateEnd(&ps->zs);
+   }
+   for (i = 0; i != NUM_COLUMNS; ++i) {
+      free(ps->columns[i].values);
+      free(ps->columns[i].dict.strings);
+      free(ps->columns[i].dict.offsets);
+      free(ps->columns[i].dict.slots);
+   }
+   for (i = 0; i != ps->num_groups; ++i) {
+      for (j = 0; j != NUM_COLUMNS; ++j) {
+         free(ps->groups[i].chunks[j].stats);
+      }
+   }
+   free(ps->groups);
+   free(ps->page.data);
+   free(ps->compressed.data);
+   free(ps->header.data);
+   free(ps->footer.data);
+   free(ps->file_name);
+   free(ps);
+}
+
+//*****************************************************************************
+
+int open_plugin(const char* plugin_config, struct listener* listener,
+                void** state)
+{
+   struct plugin_state* ps = calloc(1, sizeof(struct plugin_state));
+   int i;
+
+   if (!ps) {
+      return PLUGIN_OPEN_FAIL;
+   }
+   ps->fd = -1;
+   ps->file_name = strdup(DEFAULT_FILE);
+   ps->row_group = DEFAULT_ROW_GROUP;
+   ps->codec = CODEC_GZIP;
+   ps->flush_s = DEFAULT_FLUSH_S;
+   if (parse_config(ps, plugin_config)) {
+      free_state(ps);
+      return PLUGIN_OPEN_FAIL;
+   }
+
+   for (i = 0; i != NUM_COLUMNS; ++i) {
+      ps->columns[i].values = malloc((size_t)ps->row_group *
+                                     value_size(column_defs[i].type));
+      if (!ps->columns[i].values ||
+          (column_defs[i].type == TYPE_BYTE_ARRAY &&
+           dict_init(&ps->columns[i].dict))) {
+         fprintf(stderr, "error: output_parquet out of memory\n");
+         free_state(ps);
+         return PLUGIN_OPEN_FAIL;
+      }
+   }
+   if (ps->codec == CODEC_GZIP) {
+      // windowBits 15 + 16 makes gzip stream, as GZIP codec expects
+      if (deflateInit2(&ps->zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8,
+                       Z_DEFAULT_STRATEGY) != Z_OK) {
+         free_state(ps);
+         return PLUGIN_OPEN_FAIL;
+      }
+      ps->zs_ready = 1;
+   }
+
+   ps->fd = open(ps->file_name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+   if (ps->fd == -1) {
+      fprintf(stderr, "error: output_parquet unable to open %s: %s\n",
+              ps->file_name, strerror(errno));
+      free_state(ps);
+      return PLUGIN_OPEN_FAIL;
+   }
+   write_at(ps, "PAR1", 4, 0);
+   ps->offset = 4;
+   write_footer(ps);
+   if (ps->failed) {
+      free_state(ps);
+      return PLUGIN_OPEN_FAIL;
+   }
+   *state = ps;
+   return PLUGIN_OPEN_SUCCESS;
+}
+
+//*****************************************************************************
+
+void close_plugin(void* state)
+{
+   struct plugin_state* ps = state;
+
+   write_row_group(ps);
+   printf("output_parquet: %lld records in %u row groups, %lld bytes to %s\n",
+          ps->total_rows, ps->num_groups, ps->offset + ps->footer.len,
+          ps->file_name);
+   free_state(ps);
+}
+
+//*****************************************************************************
+
+int ok_to_accept_data(void* state)
+{
+   return PLUGIN_ACCEPT_DATA;
+}
+
+//*****************************************************************************
+
+int process_data(struct monitor_record_t* data, void* state)
+{
+   struct plugin_state* ps = state;
+   const unsigned int row = ps->rows;
+
+   if (ps->failed) {
+      return PLUGIN_ACCEPT_DATA;
+   }
+   if (add_string(ps, COL_FACILITY, data->facility, STR_LEN) ||
+       add_string(ps, COL_HOSTNAME, data->hostname, HOSTNAME_LEN) ||
+       add_string(ps, COL_DEVICE, data->device, DEVICE_LEN) ||
+       add_string(ps, COL_DOMAIN, data->dom_type >= 0 &&
+                  data->dom_type < END_DOMAINS ?
+                  domains_names[data->dom_type] : "", STR_LEN) ||
+       add_string(ps, COL_OP, data->op_type >= 0 && data->op_type < END_OPS ?
+                  ops_names[data->op_type] : "", STR_LEN) ||
+       add_string(ps, COL_S1, data->s1, PATH_MAX) ||
+       add_string(ps, COL_S2, data->s2, STR_LEN)) {
+      fprintf(stderr, "error: output_parquet out of memory\n");
+      ps->failed = 1;
+      return PLUGIN_ACCEPT_DATA;
+   }
+   ((long long*)ps->columns[COL_TIMESTAMP].values)[row] =
+      data->timestamp_ns ? (long long)data->timestamp_ns :
+      data->timestamp * 1000000000LL;
+   ((float*)ps->columns[COL_LATENCY].values)[row] = data->elapsed_time;
+   ((int*)ps->columns[COL_PID].values)[row] = data->pid;
+   ((int*)ps->columns[COL_TID].values)[row] = data->tid;
+   ((int*)ps->columns[COL_ERROR].values)[row] = data->error_code;
+   ((int*)ps->columns[COL_FD].values)[row] = data->fd;
+   ((long long*)ps->columns[COL_BYTES].values)[row] = data->bytes_transferred;
+   ((long long*)ps->columns[COL_OFFSET].values)[row] = data->offset;
+
+   if (!ps->rows++) {
+      ps->first_row_time = time(NULL);
+   }
+   if (ps->rows == ps->row_group) {
+      write_row_group(ps);
+   }
+   return PLUGIN_ACCEPT_DATA;
+}
+
+//*****************************************************************************
+
+void flush_plugin(void* state)
+{
+   struct plugin_state* ps = state;
+
+   if (ps->rows && time(NULL) - ps->first_row_time >= ps->flush_s) {
+      write_row_group(ps);
+   }
+}
+
+//*****************************************************************************
+
+char** list_commands()
+{
+   static const char* command_list[] = {"parquet-status", "help", 0};
+   return (char**)command_list;
+}
+
+//*****************************************************************************
+
+int plugin_command(const char* name, const char** args, void* state)
+{
+   struct plugin_state* ps = state;
+
+   if (args[0] && !strcmp(args[0], "parquet-status")) {
+      printf("output_parquet: %s, %lld records in %u row groups, %u buffered,"
+             " %lld bytes%s\n", ps->file_name, ps->total_rows, ps->num_groups,
+             ps->rows, ps->offset + ps->footer.len,
+             ps->failed ? ", failed" : "");
+   } else if (args[0] && !strcmp(args[0], "help")) {
+      printf("output_parquet: writes records to Parquet file, a row group"
+             " at a time\n"
+             "  parquet-status  print file, row and row group counts\n");
+   }
+   return 0;
+}
@@ -0,0 +1,612 @@
+//
+// Copyright (c) 2017 Intel Corporation
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+// implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include "plugin.h"
+#include "monitor_record.h"
+#include "plugin_helpers.h"
+#include "domains_names.h"
+#include "ops_names.h"
+
+/* plugin configuration is a comma separated list of key=value pairs:
+ *   port=9464,bind=127.0.0.1,max_series=2000
+ * Keeps counters and latency histograms per facility, domain, operation
+ * and device, and serves them to Prometheus at http://<bind>:<port>/metrics
+ * from a thread of its own. Once max_series label sets exist, records
+ * with new ones are counted in a single series labelled "other" */
+#define DEFAULT_PORT 9464
+#define DEFAULT_BIND "127.0.0.1"
+#define DEFAULT_MAX_SERIES 2000
+#define FACILITY_LEN 64
+#define SNAPSHOT_WAIT_MS 1000    /* how long scrape waits for fresh data */
+#define MAX_REQUEST_LEN 4096
+#define METRIC_PREFIX "io_monitor_"
+
+/* upper bounds of latency buckets, in seconds */
+static const double latency_bounds[] = {
+   0.00001, 0.000025, 0.00005, 0.0001, 0.00025, 0.0005, 0.001, 0.0025,
+   0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1.0, 2.5, 5.0, 10.0
+};
+#define LATENCY_BOUNDS (sizeof(latency_bounds) / sizeof(latency_bounds[0]))
+
+struct series {
+   char facility[FACILITY_LEN];
+   char device[DEVICE_LEN + 1];
+   int dom_type;                /* -1 marks overflow series */
+   int op_type;
+   unsigned int hash;
+   unsigned long long ops;
+   unsigned long long errors;
+   unsigned long long bytes;
+   double latency_sum;          /* seconds */
+   unsigned long long buckets[LATENCY_BOUNDS + 1];   /* last is +Inf */
+};
+
+struct plugin_state {
+   unsigned int max_series;
+   int listen_fd;
+   pthread_t server;
+   int stopping;
+
+   /* owned by thread calling process_data; series are only appended,
+    * so that index of series never changes */
+   struct series* series;       /* max_series + 1 (overflow) */
+   unsigned int num_series;
+   int* index;                  /* open addressing, -1 is empty */
+   unsigned int index_size;     /* power of 2 */
+   unsigned long long records;
+
+   /* copy of series published for server. Thread calling process_data
+    * only ever tries the lock, so it never waits for a scrape */
+   pthread_mutex_t snapshot_mutex;
+   pthread_cond_t snapshot_ready;
+   struct series* snapshot;
+   unsigned int snapshot_series;
+   unsigned long long snapshot_records;
+   unsigned long long snapshot_generation;
+   int snapshot_wanted;
+
+   unsigned long long scrapes;
+};
+
+//*****************************************************************************
+
+static unsigned int series_hash(const struct monitor_record_t* rec)
+{
+   unsigned int hash = FNV_OFFSET;
+
+   hash = fnv_hash(hash, rec->facility, strnlen(rec->facility,
+                                                FACILITY_LEN - 1));
+   hash = fnv_hash(hash, rec->device, strnlen(rec->device, DEVICE_LEN));
+   hash = fnv_hash(hash, &rec->dom_type, sizeof(rec->dom_type));
+   hash = fnv_hash(hash, &rec->op_type, sizeof(rec->op_type));
+   return hash;
+}
+
+//*****************************************************************************
+
+static int series_matches(const struct series* s,
+                          const struct monitor_record_t* rec)
+{
+   return s->dom_type == rec->dom_type && s->op_type == rec->op_type &&
+      !strncmp(s->device, rec->device, DEVICE_LEN) &&
+      !strncmp(s->facility, rec->facility, FACILITY_LEN - 1);
+}
+
+//*****************************************************************************
+
+static struct series* find_series(struct plugin_state* ps,
+                                  const struct monitor_record_t* rec)
+{
+   const unsigned int hash = series_hash(rec);
+   unsigned int slot = hash & (ps->index_size - 1);
+   struct series* s;
+
+   while (ps->index[slot] >= 0) {
+      s = &ps->series[ps->index[slot]];
+      if (s->hash == hash && series_matches(s, rec)) {
+         return s;
+      }
+      slot = (slot + 1) & (ps->index_size - 1);
+   }
+   if (ps->num_series == ps->max_series) {
+      return &ps->series[ps->max_series];   // overflow series
+   }
+
+   s = &ps->series[ps->num_series];
+   memset(s, 0, sizeof(*s));
+   memcpy(s->facility, rec->facility,
+          strnlen(rec->facility, FACILITY_LEN - 1));
+   strncpy(s->device, rec->device, DEVICE_LEN);
+   s->dom_type = rec->dom_type;
+   s->op_type = rec->op_type;
+   s->hash = hash;
+   ps->index[slot] = ps->num_series++;
+   return s;
+}
+
+//*****************************************************************************
+
+// hands a copy of current values to server, if it isn't just reading
+// previous copy
+static void publish_snapshot(struct plugin_state* ps)
+{
+   if (pthread_mutex_trylock(&ps->snapshot_mutex)) {
+      return;
+   }
+   memcpy(ps->snapshot, ps->series, ps->num_series * sizeof(struct series));
+   memcpy(&ps->snapshot[ps->max_series], &ps->series[ps->max_series],
+          sizeof(struct series));
+   ps->snapshot_series = ps->num_series;
+   ps->snapshot_records = ps->records;
+   ps->snapshot_generation++;
+   __atomic_store_n(&ps->snapshot_wanted, 0, __ATOMIC_RELAXED);
+   pthread_cond_broadcast(&ps->snapshot_ready);
+   pthread_mutex_unlock(&ps->snapshot_mutex);
+}
+
+//*****************************************************************************
+
+static char* put_label_value(char* p, const char* value, size_t max_len)
+{
+   size_t i;
+
+   for (i = 0; i != max_len && value[i]; ++i) {
+      if (value[i] == '\\' || value[i] == '"') {
+         *p++ = '\\';
+         *p++ = value[i];
+      } else if (value[i] == '\n') {
+         *p++ = '\\';
+         *p++ = 'n';
+      } else {
+         *p++ = value[i];
+      }
+   }
+   return p;
+}
+
+//*****************************************************************************
+
+static char* put_labels(char* p, const struct series* s)
+{
+   if (s->dom_type < 0) {
+      return stpcpy(p, "facility=\"other\",domain=\"other\",op=\"other\","
+                    "device=\"other\"");
+   }
+   p = stpcpy(p, "facility=\"");
+   p = put_label_value(p, s->facility, FACILITY_LEN);
+   p = stpcpy(p, "\",domain=\"");
+   p = stpcpy(p, s->dom_type < END_DOMAINS ?
+              domains_names[s->dom_type] : "unknown");
+   p = stpcpy(p, "\",op=\"");
+   p = stpcpy(p, s->op_type < END_OPS ? ops_names[s->op_type] : "unknown");
+   p = stpcpy(p, "\",device=\"");
+   p = put_label_value(p, s->device, DEVICE_LEN);
+   *p++ = '"';
+   return p;
+}
+
+//*****************************************************************************
+
+// text exposition format of snapshot; caller holds snapshot_mutex
+static char* render_metrics(struct plugin_state* ps, size_t* length)
+{
+   static const char* counters[][2] = {
+      { "operations_total", "Monitored operations." },
+      { "errors_total", "Monitored operations which failed." },
+      { "bytes_total", "Bytes transferred by monitored operations." }
+   };
+   // label values may double in size when escaped
+   char labels[2 * (FACILITY_LEN + DEVICE_LEN) + 128];
+   char* buffer = NULL;
+   FILE* out = open_memstream(&buffer, length);
+   unsigned int i, j;
+
+   if (!out) {
+      return NULL;
+   }
+
+   fprintf(out, "# HELP " METRIC_PREFIX "records_total Records received"
+           " by plugin.\n# TYPE " METRIC_PREFIX "records_total counter\n"
+           METRIC_PREFIX "records_total %llu\n", ps->snapshot_records);
+   fprintf(out, "# HELP " METRIC_PREFIX "series Label sets tracked, of"
+           " at most %u.\n# TYPE " METRIC_PREFIX "series gauge\n"
+           METRIC_PREFIX "series %u\n", ps->max_series, ps->snapshot_series);
+
+   // one metric family after another, as format requires
+   for (j = 0; j != 3; ++j) {
+      fprintf(out, "# HELP " METRIC_PREFIX "%s %s\n# TYPE " METRIC_PREFIX
+              "%s counter\n", counters[j][0], counters[j][1], counters[j][0]);
+      for (i = 0; i <= ps->max_series; ++i) {
+         const struct series* s = &ps->snapshot[i];
+         if ((i >= ps->snapshot_series && i != ps->max_series) ||
+             (i == ps->max_series && !s->ops)) {
+            continue;
+         }
+         *put_labels(labels, s) = 0;
+         fprintf(out, METRIC_PREFIX "%s{%s} %llu\n", counters[j][0], labels,
+                 j == 0 ? s->ops : j == 1 ? s->errors : s->bytes);
+      }
+   }
+
+   fprintf(out, "# HELP " METRIC_PREFIX "latency_seconds Duration of"
+           " monitored operations.\n# TYPE " METRIC_PREFIX
+           "latency_seconds histogram\n");
+   for (i = 0; i <= ps->max_series; ++i) {
+      const struct series* s = &ps->snapshot[i];
+      unsigned long long cumulative = 0;
+      if ((i >= ps->snapshot_series && i != ps->max_series) ||
+          (i == ps->max_series && !s->ops)) {
+         continue;
+      }
+      *put_labels(labels, s) = 0;
+      for (j = 0; j != LATENCY_BOUNDS; ++j) {
+         cumulative += s->buckets[j];
+         fprintf(out, METRIC_PREFIX "latency_seconds_bucket{%s,le=\"%g\"}"
+                 " %llu\n", labels, latency_bounds[j], cumulative);
+      }
+      fprintf(out, METRIC_PREFIX "latency_seconds_bucket{%s,le=\"+Inf\"}"
+              " %llu\n", labels, s->ops);
+      fprintf(out, METRIC_PREFIX "latency_seconds_sum{%s} %.9g\n", labels,
+              s->latency_sum);
+      fprintf(out, METRIC_PREFIX "latency_seconds_count{%s} %llu\n", labels,
+              s->ops);
+   }
+   if (fclose(out)) {
+      free(buffer);
+      return NULL;
+   }
+   return buffer;
+}
+
+//*****************************************************************************
+
+static void write_all(int fd, const char* data, size_t length)
+{
+   while (length) {
+      ssize_t n = send(fd, data, length, MSG_NOSIGNAL);
+      if (n <= 0) {
+         return;
+      }
+      data += n;
+      length -= n;
+   }
+}
+
+//*****************************************************************************
+
+// asks thread calling process_data for fresh copy; when it is idle,
+// its next flush makes one. Stale copy is served if none comes in time
+static void wait_for_snapshot(struct plugin_state* ps)
+{
+   const unsigned long long generation = ps->snapshot_generation;
+   struct timespec deadline;
+
+   clock_gettime(CLOCK_REALTIME, &deadline);
+   deadline.tv_sec += SNAPSHOT_WAIT_MS / 1000;
+   deadline.tv_nsec += (SNAPSHOT_WAIT_MS % 1000) * 1000000L;
+   if (deadline.tv_nsec >= 1000000000L) {
+      deadline.tv_sec++;
+      deadline.tv_nsec -= 1000000000L;
+   }
+   __atomic_store_n(&ps->snapshot_wanted, 1, __ATOMIC_RELAXED);
+   while (ps->snapshot_generation == generation && !ps->stopping) {
+      if (pthread_cond_timedwait(&ps->snapshot_ready, &ps->snapshot_mutex,
+                                 &deadline) == ETIMEDOUT) {
+         break;
+      }
+   }
+}
+
+//*****************************************************************************
+
+static void serve_client(struct plugin_state* ps, int fd)
+{
+   char request[MAX_REQUEST_LEN + 1];
+   size_t length = 0;
+   char header[256];
+   char* body;
+   size_t body_length;
+   struct pollfd pfd = { fd, POLLIN, 0 };
+
+   // whole request head has to arrive within a second
+   while (length < MAX_REQUEST_LEN && poll(&pfd, 1, 1000) == 1) {
+      ssize_t n = recv(fd, request + length, MAX_REQUEST_LEN - length, 0);
+      if (n <= 0) {
+         break;
+      }
+      length += n;
+      request[length] = 0;
+      if (strstr(request, "\r\n\r\n")) {
+         break;
+      }
+   }
+   request[length] = 0;
+
+   if (strncmp(request, "GET /metrics", 12) ||
+       (request[12] != ' ' && request[12] != '?')) {
+      static const char not_found[] =
+         "HTTP/1.1 404 Not Found\r\nContent-Type: text/plain\r\n"
+         "Content-Length: 10\r\nConnection: close\r\n\r\nnot found\n";
+      write_all(fd, not_found, sizeof(not_found) - 1);
+      return;
+   }
+
+   pthread_mutex_lock(&ps->snapshot_mutex);
+   wait_for_snapshot(ps);
+   body = render_metrics(ps, &body_length);
+   ps->scrapes++;
+   pthread_mutex_unlock(&ps->snapshot_mutex);
+
+   if (!body) {
+      static const char error[] =
+         "HTTP/1.1 500 Internal Server Error\r\nContent-Length: 0\r\n"
+         "Connection: close\r\n\r\n";
+      write_all(fd, error, sizeof(error) - 1);
+      return;
+   }
+   snprintf(header, sizeof(header),
+            "HTTP/1.1 200 OK\r\n"
+            "Content-Type: text/plain; version=0.0.4; charset=utf-8\r\n"
+            "Content-Length: %zu\r\nConnection: close\r\n\r\n", body_length);
+   write_all(fd, header, strlen(header));
+   write_all(fd, body, body_length);
+   free(body);
+}
+
+//*****************************************************************************
+
+// scrapes are few and short; they are served one at a time
+static void* server_thread(void* arg)
+{
+   struct plugin_state* ps = arg;
+   struct pollfd pfd = { ps->listen_fd, POLLIN, 0 };
+
+   while (!__atomic_load_n(&ps->stopping, __ATOMIC_RELAXED)) {
+      if (poll(&pfd, 1, 200) != 1) {
+         continue;
+      }
+      int fd = accept(ps->listen_fd, NULL, NULL);
+      if (fd == -1) {
+         continue;
+      }
+      serve_client(ps, fd);
+      close(fd);
+   }
+   return NULL;
+}
+
+//*****************************************************************************
+
+static int open_server(struct plugin_state* ps, const char* bind_address,
+                       int port)
+{
+   struct sockaddr_in address;
+   int one = 1;
+
+   memset(&address, 0, sizeof(address));
+   address.sin_family = AF_INET;
+   address.sin_port = htons(port);
+   if (inet_pton(AF_INET, bind_address, &address.sin_addr) != 1) {
+      fprintf(stderr, "error: output_prometheus bind address '%s' is"
+              " invalid\n", bind_address);
+      return 1;
+   }
+   ps->listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+   if (ps->listen_fd == -1) {
+      fprintf(stderr, "error: output_prometheus socket: %s\n", strerror(errno));
+      return 1;
+   }
+   setsockopt(ps->listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+   if (bind(ps->listen_fd, (struct sockaddr*)&address, sizeof(address)) ||
+       listen(ps->listen_fd, 16)) {
+      fprintf(stderr, "error: output_prometheus unable to listen on %s:%d:"
+              " %s\n", bind_address, port, strerror(errno));
+      close(ps->listen_fd);
+      ps->listen_fd = -1;
+      return 1;
+   }
+   return 0;
+}
+
+//*****************************************************************************
+
+static int parse_config(struct plugin_state* ps, const char* plugin_config,
+                        char** bind_address, int* port)
+{
+   char* config = strdup(plugin_config ? plugin_config : "");
+   char* rest = config;
+   char* token;
+   int rc = 0;
+
+   while ((token = strtok_r(rest, ",", &rest))) {
+      char* value = strchr(token, '=');
+      if (!value) {
+         fprintf(stderr, "error: output_prometheus option '%s' has no value\n",
+                 token);
+         rc = 1;
+         continue;
+      }
+      *value++ = 0;
+      if (!strcmp(token, "port") && atoi(value) > 0 && atoi(value) < 65536) {
+         *port = atoi(value);
+      } else if (!strcmp(token, "bind")) {
+         free(*bind_address);
+         *bind_address = strdup(value);
+      } else if (!strcmp(token, "max_series") && atoi(value) > 0) {
+         ps->max_series = atoi(value);
+      } else {
+         fprintf(stderr, "error: output_prometheus option '%s' is invalid\n",
+                 token);
+         rc = 1;
+      }
+   }
+   free(config);
+   return rc;
+}
+
+//*****************************************************************************
+
+static void free_state(struct plugin_state* ps)
+{
+   if (ps->listen_fd != -1) {
+      close(ps->listen_fd);
+   }
+   pthread_mutex_destroy(&ps->snapshot_mutex);
+   pthread_cond_destroy(&ps->snapshot_ready);
+   free(ps->series);
+   free(ps->snapshot);
+   free(ps->index);
+   free(ps);
+}
+
+//*****************************************************************************
+
+int open_plugin(const char* plugin_config, struct listener* listener,
+                void** state)
+{
+   struct plugin_state* ps = calloc(1, sizeof(struct plugin_state));
+   char* bind_address = strdup(DEFAULT_BIND);
+   int port = DEFAULT_PORT;
+   unsigned int i;
+
+   if (!ps) {
+      free(bind_address);
+      return PLUGIN_OPEN_FAIL;
+   }
+   ps->listen_fd = -1;
+   ps->max_series = DEFAULT_MAX_SERIES;
+   pthread_mutex_init(&ps->snapshot_mutex, NULL);
+   pthread_cond_init(&ps->snapshot_ready, NULL);
+   if (parse_config(ps, plugin_config, &bind_address, &port)) {
+      free(bind_address);
+      free_state(ps);
+      return PLUGIN_OPEN_FAIL;
+   }
+
+   ps->index_size = 1;
+   while (ps->index_size < 2 * ps->max_series) {
+      ps->index_size <<= 1;
+   }
+   ps->series = calloc(ps->max_series + 1, sizeof(struct series));
+   ps->snapshot = calloc(ps->max_series + 1, sizeof(struct series));
+   ps->index = malloc(ps->index_size * sizeof(int));
+   if (!ps->series || !ps->snapshot || !ps->index ||
+       open_server(ps, bind_address, port)) {
+      free(bind_address);
+      free_state(ps);
+      return PLUGIN_OPEN_FAIL;
+   }
+   for (i = 0; i != ps->index_size; ++i) {
+      ps->index[i] = -1;
+   }
+   ps->series[ps->max_series].dom_type = -1;
+   ps->snapshot[ps->max_series].dom_type = -1;
+
+   if (pthread_create(&ps->server, NULL, server_thread, ps)) {
+      fprintf(stderr, "error: output_prometheus unable to start server\n");
+      free(bind_address);
+      free_state(ps);
+      return PLUGIN_OPEN_FAIL;
+   }
+   printf("output_prometheus: serving http://%s:%d/metrics\n", bind_address,
+          port);
+   free(bind_address);
+   *state = ps;
+   return PLUGIN_OPEN_SUCCESS;
+}
+
+//*****************************************************************************
+
+void close_plugin(void* state)
+{
+   struct plugin_state* ps = state;
+
+   pthread_mutex_lock(&ps->snapshot_mutex);
+   __atomic_store_n(&ps->stopping, 1, __ATOMIC_RELAXED);
+   pthread_cond_broadcast(&ps->snapshot_ready);
+   pthread_mutex_unlock(&ps->snapshot_mutex);
+   pthread_join(ps->server, NULL);
+   printf("output_prometheus: %llu records in %u series, %llu scrapes\n",
+          ps->records, ps->num_series, ps->scrapes);
+   free_state(ps);
+}
+
+//*****************************************************************************
+
+int ok_to_accept_data(void* state)
+{
+   return PLUGIN_ACCEPT_DATA;
+}
+
+//*****************************************************************************
+
+// labels don't need s1 or s2; statistics of listener itself aren't I/O
+void get_interest(struct plugin_interest* interest, void* state)
+{
+   interest->domain_mask &= ~(1U << LISTENER);
+   interest->wants_strings = 0;
+}
+
+//*****************************************************************************
+
+int process_data(struct monitor_record_t* data, void* state)
+{
+   struct plugin_state* ps = state;
+   struct series* s = find_series(ps, data);
+   const double latency = data->elapsed_time / 1000.0;
+   unsigned int bucket = 0;
+
+   // bounds are few; a linear scan stops early for fast operations
+   while (bucket != LATENCY_BOUNDS && latency > latency_bounds[bucket]) {
+      bucket++;
+   }
+   s->buckets[bucket]++;
+   s->ops++;
+   s->errors += data->error_code != 0;
+   s->bytes += data->bytes_transferred;
+   s->latency_sum += latency;
+   ps->records++;
+
+   if (__atomic_load_n(&ps->snapshot_wanted, __ATOMIC_RELAXED)) {
+      publish_snapshot(ps);
+   }
+   return PLUGIN_ACCEPT_DATA;
+}
+
+//*****************************************************************************
+
+void flush_plugin(void* state)
+{
+   struct plugin_state* ps = state;
+
+   if (__atomic_load_n(&ps->snapshot_wanted, __ATOMIC_RELAXED)) {
+      publish_snapshot(ps);
+   }
+}
@@ -0,0 +1,597 @@
+//
+// Copyright (c) 2017 Intel Corporation
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+// implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sqlite3.h>
+
+#include "plugin.h"
+#include "monitor_record.h"
+#include "plugin_helpers.h"
+#include "domains_names.h"
+#include "ops_names.h"
+
+/* plugin configuration is a comma separated list of key=value pairs:
+ *   file=trace.db,batch=100000,sync=normal
+ * Appends records to a SQLite database in WAL mode. Rows are inserted
+ * through prepared statements, batch of them per transaction; a batch
+ * in progress is committed when the listener goes idle. Processes and
+ * paths are kept in tables of their own and looked up in memory. Indexes
+ * of records are dropped while loading and built when plugin is closed */
+#define DEFAULT_FILE "trace.db"
+#define DEFAULT_BATCH 100000
+#define KEY_LEN (HOSTNAME_LEN + STR_LEN + 16)
+
+static const char* const schema_sql =
+   "PRAGMA journal_mode=WAL;"
+   "PRAGMA cache_size=-65536;"
+   "CREATE TABLE IF NOT EXISTS domains(id INTEGER PRIMARY KEY,"
+   " name TEXT NOT NULL);"
+   "CREATE TABLE IF NOT EXISTS ops(id INTEGER PRIMARY KEY,"
+   " name TEXT NOT NULL);"
+   "CREATE TABLE IF NOT EXISTS processes(id INTEGER PRIMARY KEY,"
+   " hostname TEXT NOT NULL, facility TEXT NOT NULL, pid INTEGER NOT NULL);"
+   "CREATE TABLE IF NOT EXISTS paths(id INTEGER PRIMARY KEY,"
+   " path TEXT NOT NULL);"
+   "CREATE TABLE IF NOT EXISTS records(timestamp_ns INTEGER NOT NULL,"
+   " latency_ms REAL NOT NULL, process INTEGER NOT NULL, tid INTEGER NOT NULL,"
+   " domain INTEGER NOT NULL, op INTEGER NOT NULL,"
+   " error_code INTEGER NOT NULL, fd INTEGER NOT NULL,"
+   " bytes INTEGER NOT NULL, offset INTEGER, device TEXT NOT NULL,"
+   " path INTEGER, params TEXT);"
+   "CREATE VIEW IF NOT EXISTS records_view AS SELECT r.timestamp_ns,"
+   " r.latency_ms, p.hostname, p.facility, p.pid, r.tid, d.name AS domain,"
+   " o.name AS op, r.error_code, r.fd, r.bytes, r.offset, r.device,"
+   " f.path, r.params FROM records r JOIN processes p ON p.id = r.process"
+   " JOIN domains d ON d.id = r.domain JOIN ops o ON o.id = r.op"
+   " LEFT JOIN paths f ON f.id = r.path;"
+   "DROP INDEX IF EXISTS records_time;"
+   "DROP INDEX IF EXISTS records_process;"
+   "DROP INDEX IF EXISTS records_path;";
+
+static const char* const index_sql =
+   "CREATE INDEX IF NOT EXISTS records_time ON records(timestamp_ns);"
+   "CREATE INDEX IF NOT EXISTS records_process ON records(process,"
+   " timestamp_ns);"
+   "CREATE INDEX IF NOT EXISTS records_path ON records(path);"
+   "CREATE INDEX IF NOT EXISTS processes_pid ON processes(pid);"
+   "CREATE INDEX IF NOT EXISTS paths_path ON paths(path);"
+   "PRAGMA optimize;";
+
+// rows of processes or paths table by their key
+struct dictionary {
+   struct entry {
+      char* key;                /* NULL when slot is empty */
+      size_t len;
+      unsigned int hash;
+      sqlite3_int64 id;
+   } *slots;
+   unsigned int slots_size;     /* power of 2 */
+   unsigned int num;
+};
+
+struct plugin_state {
+   char* file_name;
+   const char* sync;
+   unsigned int batch;
+
+   sqlite3* db;
+   sqlite3_stmt* insert_record;
+   sqlite3_stmt* insert_process;
+   sqlite3_stmt* insert_path;
+   struct dictionary processes;
+   struct dictionary paths;
+
+   unsigned int pending;        /* rows in open transaction */
+   unsigned long long records;
+   unsigned long long commits;
+   int failed;
+};
+
+//*****************************************************************************
+
+static int report(struct plugin_state* ps, const char* what)
+{
+   fprintf(stderr, "error: output_sqlite %s %s: %s\n", what, ps->file_name,
+           sqlite3_errmsg(ps->db));
+   ps->failed = 1;
+   return -1;
+}
+
+//*****************************************************************************
+
+static int exec(struct plugin_state* ps, const char* sql, const char* what)
+{
+   if (sqlite3_exec(ps->db, sql, NULL, NULL, NULL) != SQLITE_OK) {
+      return report(ps, what);
+   }
+   return 0;
+}
+
+//*****************************************************************************
+
+static unsigned int key_hash(const char* key, size_t len)
+{
+   return fnv_hash(FNV_OFFSET, key, len);
+}
+
+//*****************************************************************************
+
+static struct entry* dict_find(struct dictionary* d, const char* key,
+                               size_t len, unsigned int hash)
+{
+   unsigned int slot = hash & (d->slots_size - 1);
+   struct entry* e;
+
+   for (;; slot = (slot + 1) & (d->slots_size - 1)) {
+      e = &d->slots[slot];
+      if (!e->key || (e->hash == hash && e->len == len &&
+                      !memcmp(e->key, key, len))) {
+         return e;
+      }
+   }
+}
+
+//*****************************************************************************
+
+static int dict_grow(struct dictionary* d)
+{
+   struct entry* old = d->slots;
+   const unsigned int old_size = d->slots_size;
+   unsigned int i, slot;
+
+   d->slots_size = old_size ? 2 * old_size : 4096;
+   d->slots = calloc(d->slots_size, sizeof(struct entry));
+   if (!d->slots) {
+      d->slots = old;
+      d->slots_size = old_size;
+      return -1;
+   }
+   for (i = 0; i != old_size; ++i) {
+      if (old[i].key) {
+         slot = old[i].hash & (d->slots_size - 1);
+         while (d->slots[slot].key) {
+            slot = (slot + 1) & (d->slots_size - 1);
+         }
+         d->slots[slot] = old[i];
+      }
+   }
+   free(old);
+   return 0;
+}
+
+//*****************************************************************************
+
+static int dict_add(struct dictionary* d, const char* key, size_t len,
+                    sqlite3_int64 id)
+{
+   const unsigned int hash = key_hash(key, len);
+   struct entry* e;
+
+   if (2 * (d->num + 1) > d->slots_size && dict_grow(d)) {
+      return -1;
+   }
+   e = dict_find(d, key, len, hash);
+   e->key = malloc(len ? len : 1);
+   if (!e->key) {
+      return -1;
+   }
+   memcpy(e->key, key, len);
+   e->len = len;
+   e->hash = hash;
+   e->id = id;
+   ++d->num;
+   return 0;
+}
+
+//*****************************************************************************
+
+static void dict_free(struct dictionary* d)
+{
+   unsigned int i;
+
+   for (i = 0; i != d->slots_size; ++i) {
+      free(d->slots[i].key);
+   }
+   free(d->slots);
+}
+
+//*****************************************************************************
+
+// key of processes row is hostname, facility and pid, each ending with 0
+static size_t process_key(char* key, const char* hostname,
+                          const char* facility, int pid)
+{
+   char* p = key;
+
+   p += strnlen(hostname, HOSTNAME_LEN - 1);
+   memcpy(key, hostname, p - key);
+   *p++ = 0;
+   memcpy(p, facility, strnlen(facility, STR_LEN - 1));
+   p += strnlen(facility, STR_LEN - 1);
+   *p++ = 0;
+   p += sprintf(p, "%d", pid) + 1;
+   return p - key;
+}
+
+//*****************************************************************************
+
+static int load_dictionaries(struct plugin_state* ps)
+{
+   sqlite3_stmt* stmt;
+   char key[KEY_LEN];
+   int rc = 0;
+
+   if (dict_grow(&ps->processes) || dict_grow(&ps->paths)) {
+      return -1;
+   }
+   if (sqlite3_prepare_v2(ps->db, "SELECT id, hostname, facility, pid"
+                          " FROM processes", -1, &stmt, NULL) != SQLITE_OK) {
+      return report(ps, "unable to read processes of");
+   }
+   while (!rc && sqlite3_step(stmt) == SQLITE_ROW) {
+      rc = dict_add(&ps->processes, key,
+                    process_key(key,
+                                (const char*)sqlite3_column_text(stmt, 1),
+                                (const char*)sqlite3_column_text(stmt, 2),
+                                sqlite3_column_int(stmt, 3)),
+                    sqlite3_column_int64(stmt, 0));
+   }
+   sqlite3_finalize(stmt);
+
+   if (sqlite3_prepare_v2(ps->db, "SELECT id, path FROM paths", -1, &stmt,
+                          NULL) != SQLITE_OK) {
+      return report(ps, "unable to read paths of");
+   }
+   while (!rc && sqlite3_step(stmt) == SQLITE_ROW) {
+      rc = dict_add(&ps->paths, (const char*)sqlite3_column_text(stmt, 1),
+                    sqlite3_column_bytes(stmt, 1),
+                    sqlite3_column_int64(stmt, 0));
+   }
+   sqlite3_finalize(stmt);
+   return rc;
+}
+
+//*****************************************************************************
+
+static int fill_names(struct plugin_state* ps)
+{
+   sqlite3_stmt* stmt;
+   int i;
+
+   if (sqlite3_prepare_v2(ps->db, "INSERT OR REPLACE INTO domains VALUES"
+                          " (?, ?)", -1, &stmt, NULL) != SQLITE_OK) {
+      return report(ps, "unable to prepare statement for");
+   }
+   for (i = 0; i != END_DOMAINS; ++i) {
+      sqlite3_bind_int(stmt, 1, i);
+      sqlite3_bind_text(stmt, 2, domains_names[i], -1, SQLITE_STATIC);
+      sqlite3_step(stmt);
+      sqlite3_reset(stmt);
+   }
+   sqlite3_finalize(stmt);
+
+   if (sqlite3_prepare_v2(ps->db, "INSERT OR REPLACE INTO ops VALUES (?, ?)",
+                          -1, &stmt, NULL) != SQLITE_OK) {
+      return report(ps, "unable to prepare statement for");
+   }
+   for (i = 0; i != END_OPS; ++i) {
+      sqlite3_bind_int(stmt, 1, i);
+      sqlite3_bind_text(stmt, 2, ops_names[i], -1, SQLITE_STATIC);
+      sqlite3_step(stmt);
+      sqlite3_reset(stmt);
+   }
+   sqlite3_finalize(stmt);
+   return 0;
+}
+
+//*****************************************************************************
+
+static int begin_batch(struct plugin_state* ps)
+{
+   return ps->pending ? 0 : exec(ps, "BEGIN", "unable to begin batch in");
+}
+
+//*****************************************************************************
+
+static void commit_batch(struct plugin_state* ps)
+{
+   if (ps->pending && !ps->failed) {
+      exec(ps, "COMMIT", "unable to commit batch to");
+      ps->pending = 0;
+      ++ps->commits;
+   }
+}
+
+//*****************************************************************************
+
+// inserts row with statement, whose parameters are bound, and remembers
+// its id under key
+static sqlite3_int64 insert_row(struct plugin_state* ps, sqlite3_stmt* stmt,
+                                struct dictionary* d, const char* key,
+                                size_t len)
+{
+   sqlite3_int64 id;
+
+   if (sqlite3_step(stmt) != SQLITE_DONE) {
+      sqlite3_reset(stmt);
+      return report(ps, "unable to insert into");
+   }
+   sqlite3_reset(stmt);
+   id = sqlite3_last_insert_rowid(ps->db);
+   if (dict_add(d, key, len, id)) {
+      fprintf(stderr, "error: output_sqlite out of memory\n");
+      ps->failed = 1;
+      return -1;
+   }
+   return id;
+}
+
+//*****************************************************************************
+
+static sqlite3_int64 process_id(struct plugin_state* ps,
+                                const struct monitor_record_t* rec)
+{
+   char key[KEY_LEN];
+   const size_t len = process_key(key, rec->hostname, rec->facility, rec->pid);
+   const char* facility = key + strlen(key) + 1;
+   struct entry* e = dict_find(&ps->processes, key, len, key_hash(key, len));
+
+   if (e->key) {
+      return e->id;
+   }
+   sqlite3_bind_text(ps->insert_process, 1, key, -1, SQLITE_STATIC);
+   sqlite3_bind_text(ps->insert_process, 2, facility, -1, SQLITE_STATIC);
+   sqlite3_bind_int(ps->insert_process, 3, rec->pid);
+   return insert_row(ps, ps->insert_process, &ps->processes, key, len);
+}
+
+//*****************************************************************************
+
+static sqlite3_int64 path_id(struct plugin_state* ps, const char* path)
+{
+   const size_t len = strnlen(path, PATH_MAX - 1);
+   struct entry* e = dict_find(&ps->paths, path, len, key_hash(path, len));
+
+   if (e->key) {
+      return e->id;
+   }
+   sqlite3_bind_text(ps->insert_path, 1, path, len, SQLITE_STATIC);
+   return insert_row(ps, ps->insert_path, &ps->paths, path, len);
+}
+
+//*****************************************************************************
+
+static int parse_config(struct plugin_state* ps, const char* plugin_config)
+{
+   char* config = strdup(plugin_config ? plugin_config : "");
+   char* rest = config;
+   char* token;
+   int rc = 0;
+
+   while ((token = strtok_r(rest, ",", &rest))) {
+      char* value = strchr(token, '=');
+      if (!value) {
+         fprintf(stderr, "error: output_sqlite option '%s' has no value\n",
+                 token);
+         rc = 1;
+         continue;
+      }
+      *value++ = 0;
+      if (!strcmp(token, "file") && *value) {
+         free(ps->file_name);
+         ps->file_name = strdup(value);
+      } else if (!strcmp(token, "batch") && atoi(value) > 0) {
+         ps->batch = atoi(value);
+      } else if (!strcmp(token, "sync") && !strcmp(value, "off")) {
+         ps->sync = "PRAGMA synchronous=OFF";
+      } else if (!strcmp(token, "sync") && !strcmp(value, "normal")) {
+         ps->sync = "PRAGMA synchronous=NORMAL";
+      } else if (!strcmp(token, "sync") && !strcmp(value, "full")) {
+         ps->sync = "PRAGMA synchronous=FULL";
+      } else {
+         fprintf(stderr, "error: output_sqlite option '%s' is invalid\n",
+                 token);
+         rc = 1;
+      }
+   }
+   free(config);
+   return rc;
+}
+
+//*****************************************************************************
+
+static void free_state(struct plugin_state* ps)
+{
+   sqlite3_finalize(ps->insert_record);
+   sqlite3_finalize(ps->insert_process);
+   sqlite3_finalize(ps->insert_path);
+   sqlite3_close(ps->db);
+   dict_free(&ps->processes);
+   dict_free(&ps->paths);
+   free(ps->file_name);
+   free(ps);
+}
+
+//*****************************************************************************
+
+int open_plugin(const char* plugin_config, struct listener* listener,
+                void** state)
+{
+   struct plugin_state* ps = calloc(1, sizeof(struct plugin_state));
+
+   if (!ps) {
+      return PLUGIN_OPEN_FAIL;
+   }
+   ps->file_name = strdup(DEFAULT_FILE);
+   ps->batch = DEFAULT_BATCH;
+   ps->sync = "PRAGMA synchronous=NORMAL";
+   if (parse_config(ps, plugin_config)) {
+      free_state(ps);
+      return PLUGIN_OPEN_FAIL;
+   }
+
+   if (sqlite3_open(ps->file_name, &ps->db) != SQLITE_OK) {
+      report(ps, "unable to open");
+      free_state(ps);
+      return PLUGIN_OPEN_FAIL;
+   }
+   if (exec(ps, schema_sql, "unable to create tables in") ||
+       exec(ps, ps->sync, "unable to set synchronous mode of") ||
+       fill_names(ps) || load_dictionaries(ps)) {
+      free_state(ps);
+      return PLUGIN_OPEN_FAIL;
+   }
+   if (sqlite3_prepare_v3(ps->db, "INSERT INTO records VALUES (?, ?, ?, ?, ?,"
+                          " ?, ?, ?, ?, ?, ?, ?, ?)", -1,
+                          SQLITE_PREPARE_PERSISTENT, &ps->insert_record,
+                          NULL) != SQLITE_OK ||
+       sqlite3_prepare_v3(ps->db, "INSERT INTO processes(hostname, facility,"
+                          " pid) VALUES (?, ?, ?)", -1,
+                          SQLITE_PREPARE_PERSISTENT, &ps->insert_process,
+                          NULL) != SQLITE_OK ||
+       sqlite3_prepare_v3(ps->db, "INSERT INTO paths(path) VALUES (?)", -1,
+                          SQLITE_PREPARE_PERSISTENT, &ps->insert_path,
+                          NULL) != SQLITE_OK) {
+      report(ps, "unable to prepare statements for");
+      free_state(ps);
+      return PLUGIN_OPEN_FAIL;
+   }
+   *state = ps;
+   return PLUGIN_OPEN_SUCCESS;
+}
+
+//*****************************************************************************
+
+void close_plugin(void* state)
+{
+   struct plugin_state* ps = state;
+
+   commit_batch(ps);
+   if (!ps->failed) {
+      printf("output_sqlite: building indexes of %s\n", ps->file_name);
+      exec(ps, index_sql, "unable to build indexes of");
+   }
+   printf("output_sqlite: %llu records in %llu transactions to %s\n",
+          ps->records, ps->commits, ps->file_name);
+   free_state(ps);
+}
+
+//*****************************************************************************
+
+int ok_to_accept_data(void* state)
+{
+   return PLUGIN_ACCEPT_DATA;
+}
+
+//*****************************************************************************
+
+int process_data(struct monitor_record_t* data, void* state)
+{
+   struct plugin_state* ps = state;
+   sqlite3_stmt* stmt = ps->insert_record;
+   sqlite3_int64 process, path = 0;
+   const size_t params_len = strnlen(data->s2, STR_LEN - 1);
+
+   if (ps->failed || begin_batch(ps)) {
+      return PLUGIN_ACCEPT_DATA;
+   }
+   ++ps->pending;
+   process = process_id(ps, data);
+   if (data->s1[0]) {
+      path = path_id(ps, data->s1);
+   }
+   if (process < 0 || path < 0) {
+      return PLUGIN_ACCEPT_DATA;
+   }
+
+   sqlite3_bind_int64(stmt, 1, data->timestamp_ns ?
+                      (sqlite3_int64)data->timestamp_ns :
+                      data->timestamp * 1000000000LL);
+   sqlite3_bind_double(stmt, 2, data->elapsed_time);
+   sqlite3_bind_int64(stmt, 3, process);
+   sqlite3_bind_int(stmt, 4, data->tid);
+   sqlite3_bind_int(stmt, 5, data->dom_type);
+   sqlite3_bind_int(stmt, 6, data->op_type);
+   sqlite3_bind_int(stmt, 7, data->error_code);
+   sqlite3_bind_int(stmt, 8, data->fd);
+   sqlite3_bind_int64(stmt, 9, data->bytes_transferred);
+   if (data->offset == OFFSET_NONE) {
+      sqlite3_bind_null(stmt, 10);
+   } else {
+      sqlite3_bind_int64(stmt, 10, data->offset);
+   }
+   sqlite3_bind_text(stmt, 11, data->device, strnlen(data->device, DEVICE_LEN),
+                     SQLITE_STATIC);
+   if (path) {
+      sqlite3_bind_int64(stmt, 12, path);
+   } else {
+      sqlite3_bind_null(stmt, 12);
+   }
+   if (params_len) {
+      sqlite3_bind_text(stmt, 13, data->s2, params_len, SQLITE_STATIC);
+   } else {
+      sqlite3_bind_null(stmt, 13);
+   }
+   if (sqlite3_step(stmt) != SQLITE_DONE) {
+      report(ps, "unable to insert record into");
+   }
+   sqlite3_reset(stmt);
+   ++ps->records;
+
+   if (ps->pending >= ps->batch) {
+      commit_batch(ps);
+   }
+   return PLUGIN_ACCEPT_DATA;
+}
+
+//*****************************************************************************
+
+void flush_plugin(void* state)
+{
+   commit_batch(state);
+}
+
+//*****************************************************************************
+
+char** list_commands()
+{
+   static const char* command_list[] = {"sqlite-status", "help", 0};
+   return (char**)command_list;
+}
+
+//*****************************************************************************
+
+int plugin_command(const char* name, const char** args, void* state)
+{
+   struct plugin_state* ps = state;
+
+   if (args[0] && !strcmp(args[0], "sqlite-status")) {
+      printf("output_sqlite: %s, %llu records in %llu transactions,"
+             " %u pending, %u processes, %u paths%s\n", ps->file_name,
+             ps->records, ps->commits, ps->pending, ps->processes.num,
+             ps->paths.num, ps->failed ? ", failed" : "");
+   } else if (args[0] && !strcmp(args[0], "help")) {
+      printf("output_sqlite: inserts records into SQLite database in"
+             " batched transactions\n"
+             "  sqlite-status  print record, transaction and dictionary"
+             " counts\n");
+   }
+   return 0;
+}
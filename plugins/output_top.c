@@ -0,0 +1,688 @@
+//
+// Copyright (c) 2017 Intel Corporation
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+// implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "plugin.h"
+#include "monitor_record.h"
+#include "latency_histogram.h"
+#include "plugin_helpers.h"
+
+/* plugin configuration is a comma separated list of key=value pairs:
+ *   by=file,sort=bytes,window=5,interval=1,rows=20
+ * Keeps per second statistics of each file, process or device and
+ * periodically redraws the ones ranked highest over the last <window>
+ * seconds, like top does. Redraw rate doesn't depend on rate of
+ * records */
+#define DEFAULT_WINDOW_S 5
+#define MAX_WINDOW_S 60
+#define DEFAULT_INTERVAL_S 1
+#define DEFAULT_ROWS 20
+#define INITIAL_TABLE_SIZE 256
+#define NAME_LEN 48              /* displayed part of name */
+
+enum group_by { BY_FILE, BY_PID, BY_DEVICE };
+enum sort_key { SORT_BYTES, SORT_OPS, SORT_MEAN, SORT_P99, SORT_ERRORS };
+
+static const char* group_names[] = { "file", "pid", "device" };
+static const char* sort_names[] = { "bytes", "ops", "mean", "p99", "errors" };
+
+/* operations of one entry within one second of record time */
+struct second {
+   unsigned long long stamp;      /* second these counters belong to */
+   unsigned long long ops;
+   unsigned long long bytes;
+   unsigned long long errors;
+   double latency_sum_ms;
+   struct latency_histogram* latency;   /* allocated on first use */
+};
+
+struct entry {
+   unsigned int hash;
+   char* name;
+   struct entry* next;
+   struct second seconds[MAX_WINDOW_S];   /* ring, by second */
+};
+
+/* path of open descriptor, learned from OPEN records */
+struct open_file {
+   int pid;
+   int fd;
+   char* path;
+   struct open_file* next;
+};
+
+/* statistics of entry over window, computed for each redraw */
+struct row {
+   const struct entry* entry;
+   double ops;
+   double bytes;
+   double error_rate;
+   double mean_ms;
+   double p99_ms;
+   double key;         /* value of sort column */
+};
+
+struct plugin_state {
+   struct listener* listener;
+   enum group_by by;
+   enum group_by pending_by;      /* set by command, applied by chain */
+   enum sort_key sort;
+   unsigned int window;
+   unsigned int interval;
+   unsigned int rows;
+   int clear;
+
+   struct entry** table;
+   unsigned int table_size;       /* power of 2 */
+   unsigned int num_entries;
+   struct open_file** files;
+   unsigned int files_size;       /* power of 2 */
+   unsigned int num_files;
+
+   unsigned long long first_second;
+   unsigned long long last_second;    /* latest record time */
+   time_t last_second_seen;           /* clock when it came */
+   time_t next_draw;
+   unsigned long long records;
+};
+
+//*****************************************************************************
+
+static unsigned int hash_string(const char* s)
+{
+   return fnv_hash(FNV_OFFSET, s, strlen(s));
+}
+
+//*****************************************************************************
+
+static unsigned int hash_fd(int pid, int fd)
+{
+   return (unsigned int)pid * 31U + (unsigned int)fd;
+}
+
+//*****************************************************************************
+
+static struct open_file** find_open_file(struct plugin_state* ps, int pid,
+                                         int fd)
+{
+   struct open_file** link =
+      &ps->files[hash_fd(pid, fd) & (ps->files_size - 1)];
+
+   while (*link && ((*link)->pid != pid || (*link)->fd != fd)) {
+      link = &(*link)->next;
+   }
+   return link;
+}
+
+//*****************************************************************************
+
+static void track_open_files(struct plugin_state* ps,
+                             const struct monitor_record_t* rec)
+{
+   struct open_file** link;
+   struct open_file* f;
+   unsigned int i;
+
+   if (rec->dom_type == START_STOP && rec->op_type == STOP) {
+      // descriptors of process are gone with it
+      for (i = 0; i != ps->files_size; ++i) {
+         link = &ps->files[i];
+         while ((f = *link)) {
+            if (f->pid == rec->pid) {
+               *link = f->next;
+               free(f->path);
+               free(f);
+               --ps->num_files;
+            } else {
+               link = &f->next;
+            }
+         }
+      }
+      return;
+   }
+   if (rec->fd < 0 || rec->error_code) {
+      return;
+   }
+   link = find_open_file(ps, rec->pid, rec->fd);
+   if (rec->op_type == OPEN && rec->s1[0]) {
+      if (!*link && (*link = calloc(1, sizeof(struct open_file)))) {
+         (*link)->pid = rec->pid;
+         (*link)->fd = rec->fd;
+         ++ps->num_files;
+      }
+      if (*link) {
+         free((*link)->path);
+         (*link)->path = strdup(rec->s1);
+      }
+      if (ps->num_files > ps->files_size) {
+         GROW_CHAINED_TABLE(ps->files, ps->files_size, f,
+                            hash_fd(f->pid, f->fd));
+      }
+   } else if (rec->op_type == CLOSE && *link) {
+      f = *link;
+      *link = f->next;
+      free(f->path);
+      free(f);
+      --ps->num_files;
+   }
+}
+
+//*****************************************************************************
+
+// name of what record is accounted to; NULL if it has none
+static const char* entry_name(struct plugin_state* ps,
+                              const struct monitor_record_t* rec,
+                              char* buffer, size_t size)
+{
+   struct open_file* f;
+
+   switch (ps->by) {
+   case BY_PID:
+      snprintf(buffer, size, "%d", rec->pid);
+      return buffer;
+   case BY_DEVICE:
+      if (!rec->device[0]) {
+         return NULL;
+      }
+      snprintf(buffer, size, "%.*s", DEVICE_LEN, rec->device);
+      return buffer;
+   case BY_FILE:
+      if (rec->fd >= 0 && (f = *find_open_file(ps, rec->pid, rec->fd))) {
+         return f->path;
+      }
+      if (rec->s1[0] == '/') {
+         return rec->s1;   // i.e. stat or unlink of a path
+      }
+      if (rec->fd >= 0) {
+         // opened before monitoring started
+         snprintf(buffer, size, "<pid %d fd %d>", rec->pid, rec->fd);
+         return buffer;
+      }
+      return NULL;
+   }
+   return NULL;
+}
+
+//*****************************************************************************
+
+static struct entry* find_entry(struct plugin_state* ps, const char* name)
+{
+   const unsigned int hash = hash_string(name);
+   struct entry** head = &ps->table[hash & (ps->table_size - 1)];
+   struct entry* e;
+
+   for (e = *head; e; e = e->next) {
+      if (e->hash == hash && !strcmp(e->name, name)) {
+         return e;
+      }
+   }
+   if (!(e = calloc(1, sizeof(struct entry)))) {
+      return NULL;
+   }
+   if (!(e->name = strdup(name))) {
+      free(e);
+      return NULL;
+   }
+   e->hash = hash;
+   e->next = *head;
+   *head = e;
+   if (++ps->num_entries > ps->table_size) {
+      GROW_CHAINED_TABLE(ps->table, ps->table_size, k, k->hash);
+   }
+   return e;
+}
+
+//*****************************************************************************
+
+static void free_entry(struct entry* e)
+{
+   unsigned int i;
+
+   for (i = 0; i != MAX_WINDOW_S; ++i) {
+      free(e->seconds[i].latency);
+   }
+   free(e->name);
+   free(e);
+}
+
+//*****************************************************************************
+
+static void clear_entries(struct plugin_state* ps)
+{
+   unsigned int i;
+
+   for (i = 0; i != ps->table_size; ++i) {
+      while (ps->table[i]) {
+         struct entry* e = ps->table[i];
+         ps->table[i] = e->next;
+         free_entry(e);
+      }
+   }
+   ps->num_entries = 0;
+}
+
+//*****************************************************************************
+
+// latest second of record time; while no records come, it is estimated
+// from time passed since the last one
+static unsigned long long current_second(const struct plugin_state* ps,
+                                         time_t now)
+{
+   return ps->last_second + (now - ps->last_second_seen);
+}
+
+//*****************************************************************************
+
+static int compare_rows(const void* a, const void* b)
+{
+   const struct row* ra = a;
+   const struct row* rb = b;
+
+   if (ra->key != rb->key) {
+      return ra->key < rb->key ? 1 : -1;
+   }
+   return strcmp(ra->entry->name, rb->entry->name);
+}
+
+//*****************************************************************************
+
+static void process_name(const char* pid, char* name, size_t size)
+{
+   char path[64];
+   FILE* f;
+
+   name[0] = 0;
+   snprintf(path, sizeof(path), "/proc/%s/comm", pid);
+   if ((f = fopen(path, "r"))) {
+      if (fgets(name, size, f)) {
+         name[strcspn(name, "\n")] = 0;
+      }
+      fclose(f);
+   }
+}
+
+//*****************************************************************************
+
+// sums up seconds of window for every entry, forgets entries idle for
+// whole window and prints highest ranked ones
+static void draw(struct plugin_state* ps, time_t now)
+{
+   const unsigned long long second = current_second(ps, now);
+   const unsigned long long oldest = second >= ps->window ?
+      second - ps->window + 1 : 0;
+   // window isn't full until that much time has passed
+   const double seconds = second - ps->first_second + 1 < ps->window ?
+      second - ps->first_second + 1 : ps->window;
+   struct latency_histogram* latency = malloc(sizeof(*latency));
+   struct row* rows = malloc((ps->num_entries + 1) * sizeof(struct row));
+   unsigned int num_rows = 0;
+   double total_ops = 0.0, total_bytes = 0.0;
+   char process[32];
+   struct tm tm;
+   unsigned int i, j;
+
+   if (!latency || !rows) {
+      free(latency);
+      free(rows);
+      return;
+   }
+
+   for (i = 0; i != ps->table_size; ++i) {
+      struct entry** link = &ps->table[i];
+      while (*link) {
+         struct entry* e = *link;
+         struct row* r = &rows[num_rows];
+         double latency_sum_ms = 0.0;
+         unsigned long long errors = 0;
+
+         memset(r, 0, sizeof(*r));
+         memset(latency, 0, sizeof(*latency));
+         for (j = 0; j != ps->window; ++j) {
+            const struct second* s = &e->seconds[j];
+            if (s->stamp < oldest || s->stamp > second || !s->ops) {
+               continue;
+            }
+            r->ops += s->ops;
+            r->bytes += s->bytes;
+            errors += s->errors;
+            latency_sum_ms += s->latency_sum_ms;
+            if (s->latency) {
+               latency_merge(latency, s->latency);
+            }
+         }
+         if (!r->ops) {
+            *link = e->next;
+            free_entry(e);
+            ps->num_entries--;
+            continue;
+         }
+         r->entry = e;
+         r->error_rate = errors / r->ops;
+         r->mean_ms = latency_sum_ms / r->ops;
+         r->p99_ms = latency_percentile(latency, 0.99) / 1000.0;
+         r->ops /= seconds;
+         r->bytes /= seconds;
+         switch (ps->sort) {
+         case SORT_BYTES:  r->key = r->bytes;      break;
+         case SORT_OPS:    r->key = r->ops;        break;
+         case SORT_MEAN:   r->key = r->mean_ms;    break;
+         case SORT_P99:    r->key = r->p99_ms;     break;
+         case SORT_ERRORS: r->key = r->error_rate; break;
+         }
+         total_ops += r->ops;
+         total_bytes += r->bytes;
+         num_rows++;
+         link = &e->next;
+      }
+   }
+   qsort(rows, num_rows, sizeof(struct row), compare_rows);
+
+   localtime_r(&now, &tm);
+   if (ps->clear) {
+      fputs("\033[H\033[J", stdout);
+   } else {
+      putchar('\n');
+   }
+   printf("io top %02d:%02d:%02d  by %s, sorted by %s, last %u s  %u %ss"
+          "  %.1f ops/s  %.2f MB/s\n\n",
+          tm.tm_hour, tm.tm_min, tm.tm_sec, group_names[ps->by],
+          sort_names[ps->sort], ps->window, num_rows, group_names[ps->by],
+          total_ops, total_bytes / 1048576.0);
+   printf("%10s %10s %10s %10s %7s  %s\n",
+          "OPS/S", "MB/S", "MEAN MS", "P99 MS", "ERR %", "NAME");
+   for (i = 0; i != num_rows && i != ps->rows; ++i) {
+      const struct row* r = &rows[i];
+      const char* name = r->entry->name;
+      const size_t len = strlen(name);
+
+      printf("%10.1f %10.3f %10.3f %10.3f %7.2f  ", r->ops,
+             r->bytes / 1048576.0, r->mean_ms, r->p99_ms,
+             100.0 * r->error_rate);
+      if (ps->by == BY_PID) {
+         process_name(name, process, sizeof(process));
+         printf("%s %s\n", name, process);
+      } else if (len > NAME_LEN) {
+         // end of path tells more than its start
+         printf("...%s\n", name + len - NAME_LEN + 3);
+      } else {
+         printf("%s\n", name);
+      }
+   }
+   fflush(stdout);
+   free(latency);
+   free(rows);
+}
+
+//*****************************************************************************
+
+static void draw_if_due(struct plugin_state* ps)
+{
+   const time_t now = time(NULL);
+
+   if (ps->pending_by != ps->by) {
+      clear_entries(ps);
+      ps->by = ps->pending_by;
+   }
+   if (ps->records && now >= ps->next_draw) {
+      draw(ps, now);
+      ps->next_draw = now + ps->interval;
+   }
+}
+
+//*****************************************************************************
+
+static int parse_sort(const char* value)
+{
+   unsigned int i;
+
+   for (i = 0; i != sizeof(sort_names) / sizeof(sort_names[0]); ++i) {
+      if (!strcmp(value, sort_names[i])) {
+         return i;
+      }
+   }
+   return -1;
+}
+
+//*****************************************************************************
+
+static int parse_group(const char* value)
+{
+   unsigned int i;
+
+   for (i = 0; i != sizeof(group_names) / sizeof(group_names[0]); ++i) {
+      if (!strcmp(value, group_names[i])) {
+         return i;
+      }
+   }
+   return -1;
+}
+
+//*****************************************************************************
+
+static int parse_config(struct plugin_state* ps, const char* plugin_config)
+{
+   char* config = strdup(plugin_config ? plugin_config : "");
+   char* rest = config;
+   char* token;
+   int rc = 0;
+
+   while ((token = strtok_r(rest, ",", &rest))) {
+      char* value = strchr(token, '=');
+      if (!value) {
+         fprintf(stderr, "error: output_top option '%s' has no value\n", token);
+         rc = 1;
+         continue;
+      }
+      *value++ = 0;
+      if (!strcmp(token, "by") && parse_group(value) >= 0) {
+         ps->by = parse_group(value);
+      } else if (!strcmp(token, "sort") && parse_sort(value) >= 0) {
+         ps->sort = parse_sort(value);
+      } else if (!strcmp(token, "window") && atoi(value) > 0 &&
+                 atoi(value) <= MAX_WINDOW_S) {
+         ps->window = atoi(value);
+      } else if (!strcmp(token, "interval") && atoi(value) > 0) {
+         ps->interval = atoi(value);
+      } else if (!strcmp(token, "rows") && atoi(value) > 0) {
+         ps->rows = atoi(value);
+      } else if (!strcmp(token, "clear")) {
+         ps->clear = !strcmp(value, "on") || !strcmp(value, "1");
+      } else {
+         fprintf(stderr, "error: output_top option '%s' is invalid\n", token);
+         rc = 1;
+      }
+   }
+   free(config);
+   ps->pending_by = ps->by;
+   return rc;
+}
+
+//*****************************************************************************
+
+int open_plugin(const char* plugin_config, struct listener* listener,
+                void** state)
+{
+   struct plugin_state* ps = calloc(1, sizeof(struct plugin_state));
+
+   if (!ps) {
+      return PLUGIN_OPEN_FAIL;
+   }
+   ps->listener = listener;
+   ps->window = DEFAULT_WINDOW_S;
+   ps->interval = DEFAULT_INTERVAL_S;
+   ps->rows = DEFAULT_ROWS;
+   ps->clear = isatty(STDOUT_FILENO);
+   ps->table_size = INITIAL_TABLE_SIZE;
+   ps->files_size = INITIAL_TABLE_SIZE;
+   if (parse_config(ps, plugin_config) ||
+       !(ps->table = calloc(ps->table_size, sizeof(struct entry*))) ||
+       !(ps->files = calloc(ps->files_size, sizeof(struct open_file*)))) {
+      free(ps->table);
+      free(ps);
+      return PLUGIN_OPEN_FAIL;
+   }
+   *state = ps;
+   return PLUGIN_OPEN_SUCCESS;
+}
+
+//*****************************************************************************
+
+void close_plugin(void* state)
+{
+   struct plugin_state* ps = state;
+   unsigned int i;
+
+   clear_entries(ps);
+   for (i = 0; i != ps->files_size; ++i) {
+      while (ps->files[i]) {
+         struct open_file* f = ps->files[i];
+         ps->files[i] = f->next;
+         free(f->path);
+         free(f);
+      }
+   }
+   free(ps->files);
+   free(ps->table);
+   free(ps);
+}
+
+//*****************************************************************************
+
+int ok_to_accept_data(void* state)
+{
+   return PLUGIN_ACCEPT_DATA;
+}
+
+//*****************************************************************************
+
+// paths are needed only to rank files
+void get_interest(struct plugin_interest* interest, void* state)
+{
+   struct plugin_state* ps = state;
+
+   interest->domain_mask &= ~(1U << LISTENER);
+   interest->wants_strings = ps->pending_by == BY_FILE;
+}
+
+//*****************************************************************************
+
+int process_data(struct monitor_record_t* data, void* state)
+{
+   struct plugin_state* ps = state;
+   const unsigned long long second = data->timestamp;
+   char buffer[64];
+   const char* name;
+   struct entry* e;
+   struct second* s;
+   double latency_us;
+
+   // path of descriptor is known from its OPEN up to its CLOSE
+   if (data->op_type == OPEN) {
+      track_open_files(ps, data);
+   }
+   if (data->dom_type != START_STOP &&
+       (name = entry_name(ps, data, buffer, sizeof(buffer))) &&
+       (e = find_entry(ps, name))) {
+      if (!ps->records++) {
+         ps->first_second = second;
+         ps->next_draw = time(NULL) + ps->interval;
+      }
+      if (second > ps->last_second) {
+         ps->last_second = second;
+         ps->last_second_seen = time(NULL);
+      }
+      s = &e->seconds[second % ps->window];
+      if (s->stamp != second) {
+         s->stamp = second;
+         s->ops = s->bytes = s->errors = 0;
+         s->latency_sum_ms = 0.0;
+         if (s->latency) {
+            memset(s->latency, 0, sizeof(*s->latency));
+         }
+      }
+      if (!s->latency) {
+         s->latency = calloc(1, sizeof(*s->latency));
+      }
+      s->ops++;
+      s->bytes += data->bytes_transferred;
+      s->errors += data->error_code != 0;
+      s->latency_sum_ms += data->elapsed_time;
+      if (s->latency) {
+         latency_us = data->elapsed_time * 1000.0;
+         latency_add(s->latency, latency_us > 0 ? (uint64_t)latency_us : 0);
+      }
+   }
+
+   if (data->op_type == CLOSE || data->dom_type == START_STOP) {
+      track_open_files(ps, data);
+   }
+
+   if (!(ps->records & 255)) {
+      draw_if_due(ps);
+   }
+   return PLUGIN_ACCEPT_DATA;
+}
+
+//*****************************************************************************
+
+void flush_plugin(void* state)
+{
+   draw_if_due(state);
+}
+
+//*****************************************************************************
+
+char** list_commands()
+{
+   static const char* command_list[] =
+      {"top-sort", "top-by", "top-rows", "help", 0};
+   return (char**)command_list;
+}
+
+//*****************************************************************************
+
+int plugin_command(const char* name, const char** args, void* state)
+{
+   struct plugin_state* ps = state;
+
+   if (args[0] && !strcmp(args[0], "top-sort") && args[1] &&
+       parse_sort(args[1]) >= 0) {
+      ps->sort = parse_sort(args[1]);
+   } else if (args[0] && !strcmp(args[0], "top-by") && args[1] &&
+              parse_group(args[1]) >= 0) {
+      // statistics are rebuilt by thread calling process_data
+      ps->pending_by = parse_group(args[1]);
+      ps->listener->interest_changed();
+   } else if (args[0] && !strcmp(args[0], "top-rows") && args[1] &&
+              atoi(args[1]) > 0) {
+      ps->rows = atoi(args[1]);
+   } else if (args[0] && !strcmp(args[0], "help")) {
+      printf("output_top: periodically ranks files, processes or devices\n"
+             "  top-sort bytes|ops|mean|p99|errors  change sort order\n"
+             "  top-by file|pid|device               change what is ranked\n"
+             "  top-rows <n>                         change number of rows\n");
+   } else {
+      fprintf(stderr, "error: output_top command is invalid\n");
+      return 1;
+   }
+   return 0;
+}
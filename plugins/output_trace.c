@@ -0,0 +1,407 @@
+//
+// Copyright (c) 2017 Intel Corporation
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+// implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "plugin.h"
+#include "monitor_record.h"
+#include "plugin_helpers.h"
+#include "trace_format.h"
+
+/* plugin configuration: <file>[,block_records=<n>]
+ * writes records to binary trace file, to be replayed with
+ * mq_listener --replay <file> */
+#define DEFAULT_BLOCK_RECORDS 16384
+#define MAX_STRINGS_SIZE (4 * 1024 * 1024)
+#define BLOCK_AGE_NS 1000000000ULL   /* idle flush writes older blocks */
+#define STRING_ID_NONE 0xffffffffU   /* string couldn't be stored */
+
+/* block dictionary; open addressing, sized to never be more than
+ * half full */
+struct dict_entry {
+   unsigned int hash;
+   unsigned int offset;     /* in strings; 0 marks empty entry */
+   unsigned int id;
+};
+
+struct plugin_state {
+   int fd;
+   unsigned long long file_offset;
+   unsigned int block_records;
+
+   /* current block */
+   struct trace_block_header block;
+   struct trace_codec_state codec;
+   unsigned char* records;
+   char* strings;              /* offset 0 is unused, see dict_entry */
+   unsigned int strings_size;
+   unsigned int strings_capacity;
+   struct dict_entry* dict;
+   unsigned int dict_size;     /* power of 2 */
+   unsigned long long block_started;
+
+   /* index of written blocks */
+   struct trace_index_entry* index;
+   unsigned int num_blocks;
+   unsigned int index_capacity;
+
+   unsigned long long records_written;
+   unsigned long long records_lost;   /* out of memory */
+   int write_failed;
+};
+
+//*****************************************************************************
+
+static int write_all(struct plugin_state* ps, const void* data, size_t size)
+{
+   const char* p = data;
+   ssize_t written;
+
+   while (size) {
+      written = write(ps->fd, p, size);
+      if (written < 0) {
+         if (errno == EINTR) {
+            continue;
+         }
+         if (!ps->write_failed) {
+            fprintf(stderr, "error: output_trace unable to write: %s\n",
+                    strerror(errno));
+            ps->write_failed = 1;
+         }
+         return 1;
+      }
+      p += written;
+      size -= written;
+      ps->file_offset += written;
+   }
+   return 0;
+}
+
+//*****************************************************************************
+
+static void reset_block(struct plugin_state* ps)
+{
+   memset(&ps->block, 0, sizeof(ps->block));
+   ps->block.magic = TRACE_BLOCK_MAGIC;
+   memset(ps->dict, 0, ps->dict_size * sizeof(struct dict_entry));
+   ps->strings_size = 1;
+}
+
+//*****************************************************************************
+
+static void write_block(struct plugin_state* ps)
+{
+   struct trace_index_entry* entry;
+   unsigned long long offset = ps->file_offset;
+   unsigned int i;
+   char* dictionary;
+   unsigned int* offsets;
+
+   if (!ps->block.num_records) {
+      return;
+   }
+
+   // strings are stored in order of their ids; block can't be written
+   // without its dictionary
+   dictionary = malloc(ps->strings_size);
+   offsets = malloc(ps->block.num_strings * sizeof(unsigned int));
+   if (!dictionary || !offsets) {
+      fprintf(stderr, "error: output_trace out of memory, %u records lost\n",
+              ps->block.num_records);
+      ps->records_lost += ps->block.num_records;
+      free(dictionary);
+      free(offsets);
+      reset_block(ps);
+      return;
+   }
+   for (i = 0; i != ps->dict_size; ++i) {
+      if (ps->dict[i].offset) {
+         offsets[ps->dict[i].id] = ps->dict[i].offset;
+      }
+   }
+   ps->block.strings_size = 0;
+   for (i = 0; i != ps->block.num_strings; ++i) {
+      char* end = stpcpy(dictionary + ps->block.strings_size,
+                         ps->strings + offsets[i]);
+      ps->block.strings_size = end + 1 - dictionary;
+   }
+   free(offsets);
+
+   if (!write_all(ps, &ps->block, sizeof(ps->block)) &&
+       !write_all(ps, dictionary, ps->block.strings_size) &&
+       !write_all(ps, ps->records, ps->block.records_size)) {
+      if (ps->num_blocks == ps->index_capacity) {
+         unsigned int capacity = ps->index_capacity ? 2 * ps->index_capacity : 256;
+         entry = realloc(ps->index, capacity * sizeof(struct trace_index_entry));
+         if (entry) {
+            ps->index = entry;
+            ps->index_capacity = capacity;
+         }
+      }
+      if (ps->num_blocks < ps->index_capacity) {
+         entry = &ps->index[ps->num_blocks++];
+         entry->offset = offset;
+         entry->first_ns = ps->block.first_ns;
+         entry->last_ns = ps->block.last_ns;
+         entry->min_pid = ps->block.min_pid;
+         entry->max_pid = ps->block.max_pid;
+         entry->num_records = ps->block.num_records;
+         entry->reserved = 0;
+      }
+      ps->records_written += ps->block.num_records;
+   }
+   free(dictionary);
+   reset_block(ps);
+}
+
+//*****************************************************************************
+
+/* STRING_ID_NONE when string is new and there is no memory for it */
+static unsigned int string_id(struct plugin_state* ps, const char* s)
+{
+   const size_t len = strlen(s);
+   const unsigned int hash = fnv_hash(FNV_OFFSET, s, len);
+   unsigned int mask = ps->dict_size - 1;
+   unsigned int i;
+
+   for (i = hash & mask; ps->dict[i].offset; i = (i + 1) & mask) {
+      if (ps->dict[i].hash == hash &&
+          !strcmp(ps->strings + ps->dict[i].offset, s)) {
+         return ps->dict[i].id;
+      }
+   }
+
+   if (ps->strings_size + len + 1 > ps->strings_capacity) {
+      unsigned int capacity = 2 * ps->strings_capacity;
+      char* tmp;
+      while (capacity < ps->strings_size + len + 1) {
+         capacity *= 2;
+      }
+      tmp = realloc(ps->strings, capacity);
+      if (!tmp) {
+         return STRING_ID_NONE;
+      }
+      ps->strings = tmp;
+      ps->strings_capacity = capacity;
+   }
+   memcpy(ps->strings + ps->strings_size, s, len + 1);
+   ps->dict[i].hash = hash;
+   ps->dict[i].offset = ps->strings_size;
+   ps->dict[i].id = ps->block.num_strings++;
+   ps->strings_size += len + 1;
+   return ps->dict[i].id;
+}
+
+//*****************************************************************************
+
+static int parse_config(struct plugin_state* ps, const char* plugin_config,
+                        char** path)
+{
+   char* config = strdup(plugin_config ? plugin_config : "");
+   char* rest = config;
+   char* token;
+   int rc = 0;
+
+   *path = NULL;
+   ps->block_records = DEFAULT_BLOCK_RECORDS;
+   while ((token = strtok_r(rest, ",", &rest))) {
+      char* value = strchr(token, '=');
+      if (!value) {
+         free(*path);
+         *path = strdup(token);
+      } else if (!strncmp(token, "file=", 5)) {
+         free(*path);
+         *path = strdup(value + 1);
+      } else if (!strncmp(token, "block_records=", 14) && atoi(value + 1) > 0) {
+         ps->block_records = atoi(value + 1);
+      } else {
+         fprintf(stderr, "error: output_trace option '%s' is invalid\n", token);
+         rc = 1;
+      }
+   }
+   free(config);
+   if (!*path) {
+      fprintf(stderr, "error: output_trace requires trace file path\n");
+      rc = 1;
+   }
+   return rc;
+}
+
+//*****************************************************************************
+
+int open_plugin(const char* plugin_config, struct listener* listener,
+                void** state)
+{
+   struct plugin_state* ps = calloc(1, sizeof(struct plugin_state));
+   struct trace_file_header header;
+   char* path = NULL;
+
+   if (!ps || parse_config(ps, plugin_config, &path)) {
+      free(path);
+      free(ps);
+      return PLUGIN_OPEN_FAIL;
+   }
+
+   // each record brings at most five strings
+   ps->dict_size = 16;
+   while (ps->dict_size < 10 * ps->block_records) {
+      ps->dict_size *= 2;
+   }
+   ps->dict = malloc(ps->dict_size * sizeof(struct dict_entry));
+   ps->records = malloc((size_t)ps->block_records * TRACE_MAX_RECORD_SIZE);
+   ps->strings_capacity = 64 * 1024;
+   ps->strings = malloc(ps->strings_capacity);
+   ps->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+   if (!ps->dict || !ps->records || !ps->strings || ps->fd == -1) {
+      fprintf(stderr, "error: output_trace unable to open '%s': %s\n", path,
+              strerror(errno));
+      if (ps->fd != -1) {
+         close(ps->fd);
+      }
+      free(ps->dict);
+      free(ps->records);
+      free(ps->strings);
+      free(ps);
+      free(path);
+      return PLUGIN_OPEN_FAIL;
+   }
+   free(path);
+
+   memset(&header, 0, sizeof(header));
+   memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+   header.version = TRACE_VERSION;
+   header.header_size = sizeof(header);
+   header.created_ns = now_ns();
+   write_all(ps, &header, sizeof(header));
+
+   reset_block(ps);
+   *state = ps;
+   return PLUGIN_OPEN_SUCCESS;
+}
+
+//*****************************************************************************
+
+void close_plugin(void* state)
+{
+   struct plugin_state* ps = state;
+   struct trace_footer footer;
+
+   write_block(ps);
+   footer.index_offset = ps->file_offset;
+   footer.num_blocks = ps->num_blocks;
+   footer.magic = TRACE_FOOTER_MAGIC;
+   if (!write_all(ps, ps->index, ps->num_blocks * sizeof(struct trace_index_entry))) {
+      write_all(ps, &footer, sizeof(footer));
+   }
+   close(ps->fd);
+   fprintf(stderr, "output_trace: %llu records in %u blocks, %llu bytes\n",
+           ps->records_written, ps->num_blocks, ps->file_offset);
+   if (ps->records_lost) {
+      fprintf(stderr, "output_trace: %llu records lost for lack of memory\n",
+              ps->records_lost);
+   }
+
+   free(ps->index);
+   free(ps->dict);
+   free(ps->strings);
+   free(ps->records);
+   free(ps);
+}
+
+//*****************************************************************************
+
+int ok_to_accept_data(void* state)
+{
+   return PLUGIN_ACCEPT_DATA;
+}
+
+//*****************************************************************************
+
+int process_data(struct monitor_record_t* data, void* state)
+{
+   struct plugin_state* ps = state;
+   struct trace_block_header* block = &ps->block;
+   struct trace_record_strings str;
+   unsigned char* end;
+
+   // a record whose string can't be stored is dropped, not recorded
+   // with wrong string
+   str.facility = string_id(ps, data->facility);
+   str.hostname = string_id(ps, data->hostname);
+   str.device = string_id(ps, data->device);
+   str.s1 = string_id(ps, data->s1);
+   str.s2 = string_id(ps, data->s2);
+   if ((str.facility == STRING_ID_NONE) || (str.hostname == STRING_ID_NONE) ||
+       (str.device == STRING_ID_NONE) || (str.s1 == STRING_ID_NONE) ||
+       (str.s2 == STRING_ID_NONE)) {
+      if (!ps->records_lost++) {
+         fprintf(stderr, "error: output_trace out of memory for strings\n");
+      }
+      return PLUGIN_ACCEPT_DATA;
+   }
+
+   if (!block->num_records) {
+      block->first_ns = block->last_ns = data->timestamp_ns;
+      block->min_pid = block->max_pid = data->pid;
+      memset(&ps->codec, 0, sizeof(ps->codec));
+      ps->block_started = now_ns();
+   }
+
+   end = trace_encode_record(ps->records + block->records_size, &ps->codec,
+                             data, &str);
+   block->records_size = end - ps->records;
+   block->num_records++;
+
+   if (data->timestamp_ns < block->first_ns) {
+      block->first_ns = data->timestamp_ns;
+   }
+   if (data->timestamp_ns > block->last_ns) {
+      block->last_ns = data->timestamp_ns;
+   }
+   if (data->pid < block->min_pid) {
+      block->min_pid = data->pid;
+   }
+   if (data->pid > block->max_pid) {
+      block->max_pid = data->pid;
+   }
+
+   if (block->num_records == ps->block_records ||
+       ps->strings_size > MAX_STRINGS_SIZE) {
+      write_block(ps);
+   }
+   return PLUGIN_ACCEPT_DATA;
+}
+
+//*****************************************************************************
+
+void flush_plugin(void* state)
+{
+   struct plugin_state* ps = state;
+
+   // keeps trace readable up to last second even if listener is killed
+   if (ps->block.num_records && now_ns() - ps->block_started >= BLOCK_AGE_NS) {
+      write_block(ps);
+   }
+}
+
+//*****************************************************************************
@@ -0,0 +1,33 @@
+#!/usr/bin/env python3
+# stand-in for InfluxDB: answers every write with 204 and logs, for each
+# request, its client port, path, encoding and number of lines to
+# requests.log; body lines go to
+# lines.txt. Port it listens on is written to port.txt
+import gzip
+import http.server
+
+class Handler(http.server.BaseHTTPRequestHandler):
+    protocol_version = "HTTP/1.1"
+
+    def do_POST(self):
+        body = self.rfile.read(int(self.headers["Content-Length"]))
+        encoding = self.headers.get("Content-Encoding", "identity")
+        if encoding == "gzip":
+            body = gzip.decompress(body)
+        lines = body.decode().splitlines()
+        with open("requests.log", "a") as log:
+            log.write("%d %s %s %d\n" % (self.client_address[1], self.path,
+                                          encoding, len(lines)))
+        with open("lines.txt", "a") as out:
+            out.write("\n".join(lines) + "\n")
+        self.send_response(204)
+        self.send_header("Content-Length", "0")
+        self.end_headers()
+
+    def log_message(self, format, *args):
+        pass
+
+server = http.server.HTTPServer(("127.0.0.1", 0), Handler)
+with open("port.txt", "w") as f:
+    f.write(str(server.server_address[1]))
+server.serve_forever()
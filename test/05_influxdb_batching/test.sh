@@ -0,0 +1,67 @@
+#!/bin/bash
+
+echo Running test event 1
+
+#prepare test
+rm -f mq1 port.txt requests.log lines.txt records.txt listener_output.txt
+touch mq1
+gcc -I../../include ../send_records.c -o send_records || exit 1
+
+./server.py &
+SERVER=$!
+for i in `seq 50` ; do
+    [ -s port.txt ] && break
+    sleep 0.1
+done
+PORT=`cat port.txt`
+
+LONG_PATH=/data/`head -c 1500 /dev/zero | tr '\0' 'x'`
+for i in `seq 250` ; do
+    echo "FILE_WRITE WRITE 100 3 10 0.5 /data/file_$i"
+done > records.txt
+echo "FILE_WRITE WRITE 100 3 10 0.5 $LONG_PATH" >> records.txt
+
+#run listener for test
+(../../mq_listener/mq_listener -m mq1 -p ../../plugins/output_influxdb.so \
+    url=http://127.0.0.1:$PORT,db=testDB,precision=ms,batch=100,flush_ms=200,gzip=on \
+    > listener_output.txt ) &
+LISTENER=$!
+sleep 1
+
+./send_records mq1 < records.txt
+
+#let partial batch age out
+sleep 2
+kill -9 `pgrep -P $LISTENER` $LISTENER
+wait $LISTENER 2>/dev/null
+kill $SERVER
+
+#verify what server received
+if [ 251 -ne `cat lines.txt | wc -l` ] ; then
+    echo Test failed: expected 251 lines, server got `cat lines.txt | wc -l`
+    exit 1
+fi
+if grep -v ' /write?db=testDB&precision=ms gzip ' requests.log ; then
+    echo Test failed: request with wrong url or encoding
+    exit 1
+fi
+if [ `cut -d ' ' -f 4 requests.log | sort -n | tail -1` -gt 100 ] ; then
+    echo Test failed: batch larger than 100 lines
+    exit 1
+fi
+if [ `cat requests.log | wc -l` -lt 3 ] ; then
+    echo Test failed: records were not sent in batches
+    exit 1
+fi
+if [ 1 -ne `cut -d ' ' -f 1 requests.log | sort -u | wc -l` ] ; then
+    echo Test failed: connection was not kept alive
+    exit 1
+fi
+if ! grep -q "s1=\"$LONG_PATH\"" lines.txt ; then
+    echo Test failed: long path was truncated
+    exit 1
+fi
+
+echo "Test event passed"
+
+exit 0
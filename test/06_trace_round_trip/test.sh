@@ -0,0 +1,58 @@
+#!/bin/bash
+
+echo Running test event 1
+
+#prepare test
+rm -f mq1 trace.bin cut.bin records.txt live.csv replayed.csv cut.csv
+touch mq1
+gcc -I../../include ../send_records.c -o send_records || exit 1
+
+for i in `seq 100` ; do
+    echo "FILE_OPEN_CLOSE OPEN $((1000 + i % 3)) $((3 + i % 5)) 0 0.25 /tmp/trace_$((i % 7)) -"
+    echo "FILE_WRITE WRITE $((1000 + i % 3)) $((3 + i % 5)) $((i * 512)) 1.5"
+    echo "FILE_READ READ $((1000 + i % 3)) $((3 + i % 5)) $i 0.75 - tag_$i"
+done > records.txt
+
+#record trace; quit unloads plugins, which writes index
+((sleep 3; echo quit) | ../../mq_listener/mq_listener -m mq1 \
+    -p ../../plugins/input_cli.so \
+    -p ../../plugins/output_trace.so trace.bin,block_records=16 \
+    -p ../../plugins/output_csv.so 2>/dev/null | \
+    sed "s/^mq_listener> //" > live.csv) &
+LISTENER=$!
+sleep 1
+./send_records mq1 < records.txt
+wait $LISTENER
+
+#replay it to csv
+../../mq_listener/mq_listener --replay trace.bin -p ../../plugins/output_csv.so \
+    > replayed.csv 2>/dev/null
+
+if [ 300 -ne `grep -c '^u,' live.csv` ] ; then
+    echo Test failed: not all records reached listener
+    exit 1
+fi
+diff <(grep '^u,' live.csv) <(grep '^u,' replayed.csv)
+if [ 0 -ne $? ] ; then
+    echo Test failed: replayed records differ from recorded ones
+    exit 1
+fi
+
+#trace cut short is read up to its last complete block
+head -c $((`stat -c %s trace.bin` / 2)) trace.bin > cut.bin
+../../mq_listener/mq_listener --replay cut.bin -p ../../plugins/output_csv.so \
+    > cut.csv 2>/dev/null
+CUT=`grep -c '^u,' cut.csv`
+if [ $CUT -eq 0 ] || [ $CUT -ge 300 ] || [ $((CUT % 16)) -ne 0 ] ; then
+    echo Test failed: $CUT records replayed from truncated trace
+    exit 1
+fi
+diff <(grep '^u,' cut.csv) <(grep '^u,' live.csv | head -$CUT)
+if [ 0 -ne $? ] ; then
+    echo Test failed: records replayed from truncated trace differ
+    exit 1
+fi
+
+echo "Test event passed"
+
+exit 0
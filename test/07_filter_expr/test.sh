@@ -0,0 +1,53 @@
+#!/bin/bash
+
+echo Running test event 1
+
+#prepare test
+rm -f mq1 records.txt output.csv deep.txt
+touch mq1
+gcc -I../../include ../send_records.c -o send_records || exit 1
+
+#only the large, slow writes and syncs of files under /srv ending in .wal
+#pass; every other record misses one of the tests
+cat > records.txt <<RECORDS
+FILE_WRITE WRITE 100 3 131072 2 /srv/db/pass_1.wal
+FILE_WRITE WRITE 100 3 131072 2 /srv/db/small.txt
+FILE_WRITE WRITE 100 3 1024 2 /srv/db/small.wal
+FILE_WRITE WRITE 100 3 131072 0.5 /srv/db/fast.wal
+FILE_WRITE WRITE 100 3 131072 2 /tmp/other.wal
+FILE_READ READ 100 3 131072 2 /srv/db/read.wal
+SYNCS SYNC 100 3 131072 2 /srv/db/pass_2.wal
+RECORDS
+
+#run listener for test
+((sleep 3; echo quit) | ../../mq_listener/mq_listener -m mq1 \
+    -p ../../plugins/input_cli.so \
+    -p ../../plugins/filter_expr.so \
+    'op in (WRITE,SYNC) && bytes > 64k && latency > 1ms && path ~ "/srv/*" && !(path !~ "*.wal")' \
+    -p ../../plugins/output_csv.so > output.csv 2>/dev/null) &
+LISTENER=$!
+sleep 1
+./send_records mq1 < records.txt
+wait $LISTENER
+
+if [ "pass_1.wal pass_2.wal" != "`grep -o 'pass_[0-9].wal' output.csv | xargs`" ] ; then
+    echo Test failed: wrong records passed filter
+    cat output.csv
+    exit 1
+fi
+
+#expression nested beyond limit is rejected, not parsed recursively
+for i in `seq 1000` ; do printf '(' ; done > deep.txt
+printf 'pid == 1' >> deep.txt
+for i in `seq 1000` ; do printf ')' ; done >> deep.txt
+../../mq_listener/mq_listener --replay /dev/null \
+    -p ../../plugins/filter_expr.so "`cat deep.txt`" 2>&1 | \
+    grep -q "nested too deeply"
+if [ 0 -ne $? ] ; then
+    echo Test failed: deeply nested expression was not rejected
+    exit 1
+fi
+
+echo "Test event passed"
+
+exit 0
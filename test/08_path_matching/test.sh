@@ -0,0 +1,59 @@
+#!/bin/bash
+
+echo Running test event 1
+
+#prepare test
+rm -f mq1 records.txt output.csv
+touch mq1
+gcc -I../../include ../send_records.c -o send_records || exit 1
+
+#s2 says whether record should pass filter; records on descriptors opened
+#on left out paths, or duplicated from those, are dropped until descriptor
+#is closed or another one is duplicated over it
+cat > records.txt <<RECORDS
+FILE_OPEN_CLOSE OPEN 100 5 0 0.1 /data/kept.db pass_open
+FILE_WRITE WRITE 100 5 10 0.1 - pass_write
+FILE_OPEN_CLOSE OPEN 100 6 0 0.1 /data/scratch.tmp drop_open
+FILE_WRITE WRITE 100 6 10 0.1 - drop_write
+FILE_OPEN_CLOSE CLOSE 100 6 0 0.1 - drop_close
+FILE_WRITE WRITE 100 6 10 0.1 - pass_after_close
+DIR_METADATA OPENDIR 100 7 0 0.1 /etc drop_opendir
+DIR_METADATA CLOSEDIR 100 7 0 0.1 - drop_closedir
+FILE_READ READ 100 7 10 0.1 - pass_after_closedir
+FILE_OPEN_CLOSE OPEN 100 8 0 0.1 /etc drop_open_for_fdopendir
+DIR_METADATA OPENDIR 100 8 0 0.1 - drop_fdopendir
+FILE_READ READ 100 8 10 0.1 - drop_after_fdopendir
+FILE_OPEN_CLOSE OPEN 100 9 0 0.1 /var/log/x drop_open_for_dup
+FILE_DESCRIPTORS DUP 100 10:9 0 0.1 - drop_dup
+FILE_WRITE WRITE 100 10 10 0.1 - drop_after_dup
+FILE_DESCRIPTORS DUP 100 9:5 0 0.1 - pass_dup_over
+FILE_WRITE WRITE 100 9 10 0.1 - pass_after_dup_over
+FILE_DESCRIPTORS DUP 100 11 0 0.1 - pass_dup_unknown
+FILE_WRITE WRITE 100 11 10 0.1 - pass_after_dup_unknown
+FILE_WRITE WRITE 100 10 10 0.1 - drop_other_dup
+FILE_WRITE WRITE 101 6 10 0.1 - pass_other_process
+FILE_METADATA STAT 100 -1 0 0.1 /opt/file drop_stat
+FILE_METADATA STAT 100 -1 0 0.1 /data/file pass_stat
+RECORDS
+
+#run listener for test
+((sleep 3; echo quit) | ../../mq_listener/mq_listener -m mq1 \
+    -p ../../plugins/input_cli.so \
+    -p ../../plugins/filter_paths.so include=/data,exclude=*.tmp \
+    -p ../../plugins/output_csv.so > output.csv 2>/dev/null) &
+LISTENER=$!
+sleep 1
+./send_records mq1 < records.txt
+wait $LISTENER
+
+PASSED=`grep -o '\(pass\|drop\)_[a-z_]*' output.csv | xargs`
+EXPECTED=`grep -o 'pass_[a-z_]*' records.txt | xargs`
+if [ "$EXPECTED" != "$PASSED" ] ; then
+    echo Test failed: expected $EXPECTED
+    echo passed $PASSED
+    exit 1
+fi
+
+echo "Test event passed"
+
+exit 0
@@ -0,0 +1,58 @@
+#!/bin/bash
+
+echo Running test event 1
+
+#prepare test
+rm -f mq1 records.txt late.txt output.csv
+touch mq1
+gcc -I../../include ../send_records.c -o send_records || exit 1
+
+#burst of 20 on one path: 5 pass. With 3 keys at most, 7 more paths share
+#catch-all key: 5 of them pass too
+for i in `seq 20` ; do
+    echo "FILE_METADATA STAT 100 -1 0 0.1 /data/busy"
+done > records.txt
+for i in `seq 9` ; do
+    echo "FILE_METADATA STAT 100 -1 0 0.1 /data/file_$i"
+done >> records.txt
+#record of next period brings summaries
+echo "FILE_METADATA STAT 100 -1 0 0.1 /data/busy" > late.txt
+
+#run listener for test
+((sleep 5; echo quit) | ../../mq_listener/mq_listener -m mq1 \
+    -p ../../plugins/input_cli.so \
+    -p ../../plugins/filter_ratelimit.so keys=path,rate=1,burst=5,summary=1,max_keys=3 \
+    -p ../../plugins/output_csv.so 2>/dev/null | \
+    sed "s/^mq_listener> //" > output.csv) &
+LISTENER=$!
+sleep 1
+./send_records mq1 < records.txt
+sleep 2
+./send_records mq1 < late.txt
+wait $LISTENER
+
+if [ 6 -ne `grep '^u,' output.csv | grep -c '/data/busy'` ] ; then
+    echo Test failed: rate of key was not limited
+    exit 1
+fi
+if [ 7 -ne `grep '^u,' output.csv | grep -c '/data/file_'` ] ; then
+    echo Test failed: keys beyond max_keys were not limited together
+    exit 1
+fi
+#burst may be split over two summary periods
+suppressed() {
+    grep '^ratelimit,' output.csv | grep ",$1," | \
+        sed 's/.*suppressed=\([0-9]*\).*/\1/' | awk '{n += $1} END {print n}'
+}
+if [ "`suppressed /data/busy`" != 15 ] ; then
+    echo Test failed: no summary of limited key
+    exit 1
+fi
+if [ "`suppressed '\*'`" != 2 ] ; then
+    echo Test failed: no summary of catch-all key
+    exit 1
+fi
+
+echo "Test event passed"
+
+exit 0
@@ -0,0 +1,89 @@
+#!/bin/bash
+
+echo Running test event 1
+
+#prepare test
+rm -f mq1 records.txt output.csv
+touch mq1
+gcc -I../../include ../send_records.c -o send_records || exit 1
+
+#device listener should name file system mounted on given point: block
+#device by kernel name, others by type and device number
+expected_device() {
+    local line=`awk -v point=$1 '$5 == point' /proc/self/mountinfo | tail -1`
+    local maj_min=`echo "$line" | cut -d ' ' -f 3`
+    local type=`echo "$line" | sed 's/.* - //' | cut -d ' ' -f 1`
+    if [ -e /sys/dev/block/$maj_min ] ; then
+        basename `readlink /sys/dev/block/$maj_min` | cut -c 1-9
+    else
+        type=`echo $type | cut -c 1-$((8 - ${#maj_min}))`
+        echo $type:$maj_min
+    fi
+}
+
+#read on each descriptor gets device of deepest mount point holding path
+cat > records.txt <<RECORDS
+FILE_OPEN_CLOSE OPEN 100 3 0 0.1 /proc/self/status
+FILE_READ READ 100 3 10 0.1 - read_proc
+FILE_OPEN_CLOSE OPEN 100 4 0 0.1 /procfs/file
+FILE_READ READ 100 4 10 0.1 - read_root
+FILE_OPEN_CLOSE OPEN 100 5 0 0.1 /dev/null
+FILE_READ READ 100 5 10 0.1 - read_dev
+FILE_OPEN_CLOSE OPEN 100 6 0 0.1 /dev/pts/ptmx
+FILE_READ READ 100 6 10 0.1 - read_dev_pts
+FILE_OPEN_CLOSE OPEN 100 7 0 0.1 /
+FILE_READ READ 100 7 10 0.1 - read_slash
+FILE_OPEN_CLOSE OPEN 200 3 0 0.1 /proc/self/status
+FILE_OPEN_CLOSE OPEN 201 3 0 0.1 /dev/null
+FILE_READ READ 200 3 10 0.1 - read_pid_200
+FILE_READ READ 201 3 10 0.1 - read_pid_201
+START_STOP STOP 200 -1 0 0.1 - -
+FILE_READ READ 200 3 10 0.1 - read_after_stop
+START_STOP START 201 -1 0 0.1 - -
+FILE_READ READ 201 3 10 0.1 - read_after_start
+RECORDS
+
+#run listener for test
+((sleep 3; echo quit) | ../../mq_listener/mq_listener -m mq1 \
+    -p ../../plugins/input_cli.so \
+    -p ../../plugins/output_csv.so > output.csv 2>/dev/null) &
+LISTENER=$!
+sleep 1
+./send_records mq1 < records.txt
+wait $LISTENER
+
+#device is second field of csv
+check() {
+    local device=`grep ",$1\$" output.csv | cut -d ',' -f 2`
+    if [ "$device" != "`expected_device $2`" ] ; then
+        echo Test failed: $1 got device \"$device\", \
+            expected \"`expected_device $2`\"
+        exit 1
+    fi
+}
+check read_proc /proc
+check read_root /
+check read_slash /
+check read_dev /dev
+if awk '$5 == "/dev/pts"' /proc/self/mountinfo | grep -q . ; then
+    check read_dev_pts /dev/pts
+fi
+#same descriptor number in two processes; forgotten when process stops,
+#or when another one starts with its pid
+check read_pid_200 /proc
+check read_pid_201 /dev
+for event in read_after_stop read_after_start ; do
+    device=`grep ",$event\$" output.csv | cut -d ',' -f 2`
+    if [ -n "$device" ] ; then
+        echo Test failed: $event got device \"$device\" of forgotten descriptor
+        exit 1
+    fi
+done
+case `grep ',read_proc$' output.csv | cut -d ',' -f 2` in
+    proc:*) ;;
+    *) echo Test failed: proc is not named by type and number ; exit 1 ;;
+esac
+
+echo "Test event passed"
+
+exit 0
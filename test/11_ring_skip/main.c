@@ -0,0 +1,76 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include "monitor_ring.h"
+
+// writer stalled while copying is skipped by listener; its slot must not
+// be handed to another writer before it is done, or record read from
+// there would mix both
+static struct monitor_record_t record(int fd, char fill)
+{
+  struct monitor_record_t rec;
+  memset(&rec, 0, sizeof(rec));
+  rec.fd = fd;
+  memset(rec.s1, fill, sizeof(rec.s1) - 1);
+  return rec;
+}
+
+static void expect(struct monitor_ring_t* ring, int fd, char fill)
+{
+  struct monitor_ring_slot_t* slot = ring_peek(ring);
+  struct monitor_record_t rec = record(fd, fill);
+  assert(slot);
+  assert(!memcmp(&slot->record, &rec, sizeof(rec)));
+  ring_consume(ring, slot);
+}
+
+int main()
+{
+  struct monitor_ring_t* ring = calloc(1, RING_SIZE(2));
+  struct monitor_record_t slow = record(1, 'a');
+  struct monitor_record_t rec;
+  unsigned long long reserved;
+  assert(ring);
+  ring_init(ring, 2, 1);
+
+  // slow writer claims slot 0 and copies half of its record
+  struct monitor_ring_slot_t* slot = ring_reserve(ring, &reserved);
+  assert(slot);
+  memcpy(&slot->record, &slow, sizeof(slow) / 2);
+
+  // listener gives up on it
+  assert(!ring_peek(ring));
+  ring_skip(ring);
+  assert(ring->tail == 1 && ring->drops == 1);
+
+  // next writer gets slot 1; one after that would need slot 0, which is
+  // still being written
+  rec = record(2, 'b');
+  assert(!ring_push(ring, &rec, sizeof(rec)));
+  rec = record(3, 'c');
+  assert(ring_push(ring, &rec, sizeof(rec)) == -1);
+  assert(ring->drops == 2);
+  expect(ring, 2, 'b');
+  assert(!ring_peek(ring));
+
+  // slow writer finishes; its record is lost and slot is free again
+  memcpy((char*)&slot->record + sizeof(slow) / 2,
+         (char*)&slow + sizeof(slow) / 2, sizeof(slow) - sizeof(slow) / 2);
+  slot->length = sizeof(slow);
+  assert(ring_commit(ring, slot, reserved) == -1);
+  assert(!ring_peek(ring));
+
+  rec = record(4, 'd');
+  assert(!ring_push(ring, &rec, sizeof(rec)));
+  expect(ring, 4, 'd');
+
+  // writer which died after reserving slot, before claiming it
+  ring->head++;
+  ring_skip(ring);
+  assert(ring->tail == 4 && ring->drops == 3);
+  rec = record(5, 'e');
+  assert(!ring_push(ring, &rec, sizeof(rec)));
+  expect(ring, 5, 'e');
+  free(ring);
+  return 0;
+}
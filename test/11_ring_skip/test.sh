@@ -0,0 +1,16 @@
+#!/bin/bash
+
+echo Running test event 1
+
+#prepare test
+rm -f a.out
+gcc -I../../include main.c || exit 1
+
+if ! ./a.out ; then
+    echo Test failed: stalled writer shares slot with next one
+    exit 1
+fi
+
+echo "Test event passed"
+
+exit 0
@@ -0,0 +1,115 @@
+// Sends records described on stdin to mq_listener through the message
+// queue, as io_monitor would. Used by tests which check listener and
+// plugins without a monitored program. One record per line:
+//
+//   DOMAIN OP pid fd bytes elapsed_ms [s1 [s2]]
+//
+// "-" stands for an empty string; fd may be given as fd:offset (offset
+// of DUP is descriptor duplicated). Empty lines and lines starting with #
+// are skipped. Usage: send_records <message queue path>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/ipc.h>
+#include <sys/msg.h>
+#include "mq.h"
+#include "ops_names.h"
+#include "domains_names.h"
+
+
+static int lookup(const char** names, int count, const char* name)
+{
+  int i;
+  for (i = 0; i < count; ++i) {
+    if (names[i] && !strcmp(names[i], name))
+      return i;
+  }
+  fprintf(stderr, "unknown name %s\n", name);
+  exit(1);
+}
+
+
+/* sequence numbers are per thread, and each pid stands for one thread */
+static unsigned int next_seq(int pid)
+{
+  static int pids[256];
+  static unsigned int seqs[256];
+  static int count = 0;
+  int i;
+
+  for (i = 0; i < count; ++i) {
+    if (pids[i] == pid)
+      return seqs[i]++;
+  }
+  if (count == 256)
+    return 0;
+  pids[count] = pid;
+  seqs[count] = 1;
+  count++;
+  return 0;
+}
+
+
+int main(int argc, char** argv)
+{
+  MONITOR_MESSAGE message;
+  struct monitor_record_t* rec = &message.monitor_record;
+  char line[PATH_MAX + STR_LEN + 256];
+  char dom[64], op[64], fd[64], s1[PATH_MAX], s2[STR_LEN];
+  char* offset;
+  double elapsed_ms;
+  struct timespec now;
+  int queue_id;
+  int n;
+
+  if (argc != 2) {
+    fprintf(stderr, "usage: %s <message queue path>\n", argv[0]);
+    return 1;
+  }
+  queue_id = msgget(ftok(argv[1], 'm'), 0600 | IPC_CREAT);
+  if (queue_id == -1) {
+    perror("msgget");
+    return 1;
+  }
+
+  while (fgets(line, sizeof(line), stdin)) {
+    if (line[0] == '#' || line[0] == '\n')
+      continue;
+    memset(&message, 0, sizeof(message));
+    message.message_type = 1;
+    s1[0] = s2[0] = 0;
+    n = sscanf(line, "%63s %63s %d %63s %zu %lf %4095s %255s", dom, op,
+	       &rec->pid, fd, &rec->bytes_transferred, &elapsed_ms,
+	       s1, s2);
+    if (n < 6) {
+      fprintf(stderr, "malformed record: %s", line);
+      return 1;
+    }
+    rec->dom_type = lookup(domains_names,
+			   sizeof(domains_names) / sizeof(domains_names[0]), dom);
+    rec->op_type = lookup(ops_names,
+			  sizeof(ops_names) / sizeof(ops_names[0]), op);
+    rec->elapsed_time = elapsed_ms;
+    strcpy(rec->facility, "u");
+    if (strcmp(s1, "-"))
+      strcpy(rec->s1, s1);
+    if (strcmp(s2, "-"))
+      strcpy(rec->s2, s2);
+    clock_gettime(CLOCK_REALTIME, &now);
+    rec->timestamp = now.tv_sec;
+    rec->timestamp_ns = now.tv_sec * 1000000000ULL + now.tv_nsec;
+    rec->tid = rec->pid;
+    rec->seq = next_seq(rec->pid);
+    rec->fd = atoi(fd);
+    offset = strchr(fd, ':');
+    rec->offset = offset ? atoll(offset + 1) : OFFSET_NONE;
+
+    if (msgsnd(queue_id, &message, MONITOR_RECORD_WIRE_SIZE, 0)) {
+      perror("msgsnd");
+      return 1;
+    }
+  }
+  return 0;
+}